@@ -127,6 +127,9 @@ public:
     bool enable_hymem = false;
 
     double admission_set_size = 0.1;
+
+    // Pin backends to cores, see Numa::PinWorker
+    bool pin_threads = false;
 };
 
 extern configuration state;
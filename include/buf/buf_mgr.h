@@ -6,6 +6,7 @@
 #define SPITFIRE
 
 #include <cstdio>
+#include <cstddef>
 #include <cstdint>
 #include <unordered_map>
 #include <unordered_set>
@@ -14,6 +15,7 @@
 #include <functional>
 #include <atomic>
 #include <list>
+#include <deque>
 #include <thread>
 #include <condition_variable>
 #include <shared_mutex>
@@ -26,9 +28,18 @@
 #include "config.h"
 #include "util/status.h"
 #include "util/env.h"
+#include "util/crc32c.h"
 #include "util/sync.h"
 #include "util/bitmaps.h"
 #include "util/concurrent_bytell_hash_map.h"
+#include "util/optimistic_hash_map.h"
+#include "util/io_engine.h"
+#include "util/frame_arena.h"
+#include "util/numa.h"
+#include "util/nvm_emulator.h"
+#include "util/access_trace.h"
+#include "util/object_pool.h"
+#include "util/parking_lot.h"
 
 namespace spitfire {
 
@@ -136,6 +147,20 @@ struct OptLock {
     void writeUnlockObsolete() { typeVersionLockObsolete.fetch_add(0b11); }
 };
 
+struct PageDesc;
+
+// Child pointers cached for the slots of an index node, see ConcurrentBufferManager::Swizzle.
+// Lives only in DRAM next to the descriptor, so page images never contain pointers.
+struct SwizzleTable {
+    explicit SwizzleTable(size_t num_slots) : num_slots(num_slots), slots(new std::atomic<PageDesc *>[num_slots]) {
+        for (size_t i = 0; i < num_slots; ++i)
+            slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    const size_t num_slots;
+    std::unique_ptr<std::atomic<PageDesc *>[]> slots;
+};
+
 struct PageDesc : OptLock {
     pid_t pid;
     std::atomic<PageType> type;
@@ -144,6 +169,13 @@ struct PageDesc : OptLock {
     std::atomic<bool> used;
     std::atomic<int> pin;
 
+    // Replacement state of ConcurrentTwoQReplacer and ConcurrentLRU2Replacer
+    std::atomic<bool> hot{false};
+    std::atomic<uint64_t> last_access{0};
+    std::atomic<uint64_t> penultimate_access{0};
+    // Replacer partition whose slot the page occupies.
+    uint32_t partition = 0;
+
     // For replacement policy
     PageDesc *prev;
     PageDesc *next;
@@ -166,6 +198,12 @@ struct PageDesc : OptLock {
     Page *page;
     SharedPageDesc *const sph_back_pointer;
 
+    // Pointers to the resident children of this page, allocated on the first swizzle.
+    std::atomic<SwizzleTable *> swizzle_table{nullptr};
+    // The slot in the parent's swizzle table that points to this page.
+    // Protected by the swizzle latch of this descriptor.
+    std::atomic<PageDesc *> *swizzled_in = nullptr;
+
     PageDesc(pid_t pid, PageType type, SharedPageDesc *const back_pointer = nullptr) : pid(pid), used(false),
                                                                                        dirty(false), pin(1),
                                                                                        prev(nullptr), next(nullptr),
@@ -263,7 +301,9 @@ struct PageDesc : OptLock {
     }
 
     void Unpin() {
-        pin.fetch_add(-1);
+        // Wake up the threads waiting for the page to become unpinned, see ConcurrentBufferManager::FillDRAMPage.
+        if (pin.fetch_add(-1) == 1)
+            ParkingLot::UnparkAll(pin);
     }
 
     bool Evicted() {
@@ -341,6 +381,8 @@ private:
 };
 
 static std::string kHeapFilePrefix = "heapfile.";
+// Holds SSDPageManager::Incarnation.
+static std::string kIncarnationFileName = "incarnation";
 
 
 struct PidHasher {
@@ -358,8 +400,14 @@ struct PidComparator {
 class SSDPageManager {
 public:
 
-    SSDPageManager(const std::string &db_path, bool direct_io) : db_path(db_path), max_file_no(0),
-                                                                 direct_io(direct_io), last_allocated_from(0) {}
+    // `io_engine_type` selects how page I/O is issued. Init falls back to
+    // IOEngineType::POSIX if the engine is not available on this system.
+    SSDPageManager(const std::string &db_path, bool direct_io, IOEngineType io_engine_type = IOEngineType::POSIX,
+                   size_t io_queue_depth = 128) : db_path(db_path), max_file_no(0), direct_io(direct_io),
+                                                  io_engine_type(io_engine_type), io_queue_depth(io_queue_depth),
+                                                  io_engine(nullptr), last_allocated_from(0), incarnation(0) {}
+
+    ~SSDPageManager();
 
     // Destroy all related db files under `db_path` but not deleting the directory.
     static Status DestroyDB(const std::string &db_path);
@@ -370,6 +418,22 @@ public:
 
     Status WritePage(pid_t pid, const Page *p);
 
+    // Queue a page read/write and return its completion handle. Queued requests are
+    // submitted together by SubmitIO() or by the first Wait() on one of the handles.
+    // `p` must stay valid until the request completes.
+    IOHandle ReadPageAsync(pid_t pid, Page *p);
+
+    IOHandle WritePageAsync(pid_t pid, const Page *p);
+
+    Status SubmitIO();
+
+    // Register a page arena (e.g. the NVM buffer pool) that is read into and written from.
+    Status RegisterIOBuffer(void *base, size_t size);
+
+    void UnregisterIOBuffer(void *base);
+
+    IOEngine *GetIOEngine() { return io_engine; }
+
     static inline pid_t MakePID(const uint32_t file_no, const uint32_t off_in_file) {
         return (((uint64_t) file_no) << 32) | off_in_file;
     }
@@ -391,11 +455,20 @@ public:
 
     bool Allocated(const pid_t pid);
 
+    // The page `delta` bytes away from `pid` in the same heap file, or kInvalidPID if there is none.
+    static pid_t AdjacentPID(pid_t pid, int64_t delta);
+
     size_t CountPages();
 
     std::vector<pid_t> GetAllocatedPids();
 
+    // A random id given to the database when it is created, so that state kept outside of
+    // `db_path`, like the NVM heap files, is not mistaken for that of an older database.
+    uint64_t Incarnation() const { return incarnation; }
+
 private:
+    Status InitIncarnation();
+
     static constexpr size_t kFileBitMaskSizeInBytes = kPageSize;
     //static constexpr size_t kPagesPerFile = kFileBitMaskSizeInBytes * 8 - 1;
     static constexpr size_t kPagesPerFile = 4095;
@@ -456,9 +529,13 @@ private:
     int max_file_no;
     std::vector<HeapFile *> files;
     bool direct_io;
+    IOEngineType io_engine_type;
+    size_t io_queue_depth;
+    IOEngine *io_engine;
     std::mutex mtx;
     std::atomic<int> num_files{0};
     int last_allocated_from;
+    uint64_t incarnation;
 };
 
 
@@ -543,22 +620,60 @@ static void *block_aligned_alloc(std::size_t sz) {
 void* nvm_page_alloc(size_t sz);
 void nvm_page_free(void * p);
 
+// Persistent header of a page of NVMPageAllocator. The headers follow the pages in the heap file.
+// Each field is a single 8B store, so a crash never leaves one torn.
+struct NVMFrameHeader {
+    static constexpr uint64_t kValid = 1;
+    // The page is newer than its SSD copy.
+    static constexpr uint64_t kDirty = 2;
+
+    std::atomic<uint64_t> flags;
+    std::atomic<uint64_t> pid;
+    // The updates logged at or below this lsn are in the page, 0 if not known.
+    std::atomic<uint64_t> lsn;
+    uint64_t padding;
+};
+
+static_assert(sizeof(NVMFrameHeader) == 32, "NVMFrameHeader is padded");
+
 class NVMPageAllocator {
 public:
-    NVMPageAllocator(const std::string &heapfile_path, size_t n_pages) : heapfile_path(heapfile_path),
-                                                                         num_pages(((n_pages + 63) / 64) * 64),
-                                                                         mmap_start_addr(nullptr), bitmap(num_pages),
-                                                                         last_pos(0) {}
+    // With a `node`, the heap file is mapped with the pages of that NUMA node preferred.
+    // `n_pages` pages are allocated from, up to `max_pages` with SetLimit.
+    NVMPageAllocator(const std::string &heapfile_path, size_t n_pages, int node = -1, size_t max_pages = 0)
+            : heapfile_path(heapfile_path),
+              num_pages(((std::max(n_pages, max_pages) + 63) / 64) * 64),
+              mmap_start_addr(nullptr), bitmap(num_pages),
+              last_pos(0), node(node), limit(((n_pages + 63) / 64) * 64), file_header(nullptr),
+              headers(nullptr) {}
 
-    Status Init();
+    // With `recover`, the frame headers are kept up to date and the pages the last run on database
+    // `db_id` left valid stay allocated until RecoverFrames. Otherwise the heap file starts empty.
+    Status Init(uint64_t db_id = 0, bool recover = false);
+
+    void *Base() { return mmap_start_addr; }
+
+    size_t Size() const { return num_pages * kPageSize; }
+
+    bool Owns(const void *p) const {
+        return (const char *) p >= (const char *) mmap_start_addr && (const char *) p < (const char *) mmap_start_addr + Size();
+    }
+
+    int Node() const { return node; }
 
     void *AllocatePage() {
-        restart:
-        int p = bitmap.TakeFirstNotSet(last_pos);
-        if (p == -1) {
+        void *p;
+        while ((p = TryAllocatePage()) == nullptr) {
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            goto restart;
         }
+        return p;
+    }
+
+    // nullptr if every page is allocated.
+    void *TryAllocatePage() {
+        int p = bitmap.TakeFirstNotSet(last_pos, limit.load());
+        if (p == -1)
+            return nullptr;
         last_pos.store(p);
         return static_cast<void *>(static_cast<char *>(mmap_start_addr) + p * kPageSize);
     }
@@ -567,15 +682,91 @@ public:
         size_t pointer_diff = static_cast<size_t>(static_cast<char *>(p) - static_cast<char *>(mmap_start_addr));
         assert(pointer_diff % kPageSize == 0);
         int pos = pointer_diff / kPageSize;
+        // Pages freed with their header kept are left to the next run.
+        if (pos >= limit.load() && (headers == nullptr || (headers[pos].flags.load() & NVMFrameHeader::kValid) == 0))
+            ReleasePages(pos, 1);
         bitmap.Clear(pos);
     }
 
+    // Allocate from the first `n_pages` pages only, at most the `max_pages` of the constructor.
+    // The storage of the pages beyond them goes back to the file system once they are free.
+    void SetLimit(size_t n_pages);
+
+    size_t Limit() const { return limit.load(); }
+
+    // Offer every page left valid by the last run to `adopt`. Pages it turns down are freed.
+    void RecoverFrames(const std::function<bool(void *, const NVMFrameHeader &)> &adopt);
+
+    // Null unless Init was asked to recover.
+    NVMFrameHeader *HeaderOf(const void *p) {
+        return headers == nullptr ? nullptr : &headers[((const char *) p - (const char *) mmap_start_addr) / kPageSize];
+    }
+
+    // Record that `p`, already persisted, holds page `pid`.
+    void PublishFrame(void *p, pid_t pid, bool dirty);
+
+    void SetFrameDirty(void *p, bool dirty);
+
+    // Raise the lsn of the header of `p` to `lsn`.
+    void AdvanceFrameLSN(void *p, uint64_t lsn);
+
+    void ClearFrame(void *p);
+
 private:
+    // Punch the pages out of the heap file.
+    void ReleasePages(size_t first, size_t count);
+
+    static void PersistHeader(NVMFrameHeader *header) {
+        NVMUtilities::persist((char *) header, sizeof(NVMFrameHeader));
+    }
+
+    // The part of the heap file before the frame headers.
+    struct HeapFileHeader {
+        uint64_t magic;
+        uint64_t db_id;
+        uint64_t num_pages;
+    };
+
     std::string heapfile_path;
     size_t num_pages;
     void *mmap_start_addr;
     AtomicBitmap bitmap;
     std::atomic<int> last_pos;
+    int node;
+    // A multiple of 64, so that the bitmap is searched by whole words.
+    std::atomic<int> limit;
+    HeapFileHeader *file_header;
+    NVMFrameHeader *headers;
+};
+
+enum class BufferPoolTier {
+    DRAM,
+    NVM
+};
+
+enum class ReplacerType {
+    CLOCK,
+    // Scan resistant, see ConcurrentTwoQReplacer.
+    TWO_Q,
+    // Scan resistant, see ConcurrentLRU2Replacer.
+    LRU_2
+};
+
+// How a transaction waits for its commit record, see LogManager::WaitForCommit.
+enum class WALCommitMode {
+    // Until the record is durable.
+    SYNC,
+    // Not at all, the page cleaner makes the record durable within its period.
+    ASYNC,
+    // Until the record is durable or BufferPoolConfig::wal_commit_timeout_us passed.
+    TIMED
+};
+
+enum LogFileBackendType {
+    // A file on SSD, see BlockLogFileBackend.
+    kBlockStorage,
+    // A file on NVM, see NVMLogFileBackend.
+    kByteAddressableStorage
 };
 
 struct BufferPoolConfig {
@@ -586,7 +777,89 @@ struct BufferPoolConfig {
     bool enable_mini_page = false;
     bool enable_hymem = false;
     bool enable_direct_io = false;
+    // Number of pages the HyMem NVM admission filter tracks frequencies for, see AdmissionFilter.
     size_t nvm_admission_set_size_limit = 10;
+    // Hand evicted pages to background writer threads instead of flushing them
+    // on the critical path of the thread that evicted them.
+    bool enable_async_eviction_writeback = false;
+    size_t num_eviction_writers = 2;
+    size_t eviction_queue_capacity = 4096;
+    // Foreground threads stall once this many evicted pages are waiting to be written back.
+    size_t eviction_queue_high_watermark = 3072;
+    // Use the lock-free-read OptimisticHashMap as the page mapping table instead of
+    // the sharded concurrent_bytell_hash_map.
+    bool enable_optimistic_mapping_table = false;
+    // Let B-tree and heap table scans prefetch the pages ahead of them, see ReadAheadCursor.
+    bool enable_read_ahead = false;
+    // Take DRAM frames and mini pages, and NVM frames when the NVM buffer pool is not backed
+    // by nvm_heap_file_path, from a preallocated hugepage FrameArena instead of dram_malloc/nvm_malloc.
+    bool enable_frame_arena = false;
+    // Tune the page migration policy while running, see MigrationPolicyTuner.
+    bool enable_migration_policy_tuner = false;
+    size_t migration_tuner_period_ms = 5000;
+    // The tuner keeps every probability within [min_prob, max_prob] and moves one of them
+    // by at most max_step per round.
+    double migration_tuner_min_prob = 0.01;
+    double migration_tuner_max_prob = 1;
+    double migration_tuner_max_step = 0.3;
+    // Cost in cycles charged per KB written to NVM, to trade throughput for NVM endurance.
+    double migration_tuner_nvm_write_cost = 0;
+    // Start with the tuner frozen, see ConcurrentBufferManager::FreezeMigrationPolicyTuner.
+    bool migration_tuner_frozen = false;
+    // Replacement policy of each tier.
+    ReplacerType dram_replacer = ReplacerType::CLOCK;
+    ReplacerType nvm_replacer = ReplacerType::CLOCK;
+    // Partitions of each replacer, 0 for one per hardware thread, see ConcurrentReplacer.
+    size_t replacer_partitions = 0;
+    // Evict pages ahead of demand in a background thread per tier, see FreeFrameProducer, so that
+    // threads missing in a tier take a free frame instead of sweeping for a victim.
+    bool enable_free_frame_producer = false;
+    // A producer wakes up once less than the low watermark fraction of its tier is free
+    // and evicts until the high watermark fraction is free.
+    double free_frame_low_watermark = 0.01;
+    double free_frame_high_watermark = 0.02;
+    // Capacities ConcurrentBufferManager::ResizeTier can grow the tiers to, 0 for the initial
+    // capacity. The replacer slot arrays, 8 bytes per page, the frame arenas and the NVM heap file
+    // mappings are sized for them up front. Only the NVM heap file gives storage back on a shrink.
+    size_t dram_buf_pool_max_cap_in_bytes = 0;
+    size_t nvm_buf_pool_max_cap_in_bytes = 0;
+    // Split the frame arenas, the NVM heap file and the replacer partitions by NUMA node, and take
+    // the frame of a page from the node of the thread that brings the page in. The heap file of
+    // node i is nvm_heap_file_path + ".node<i>", which may link to the NVM of that node.
+    bool enable_numa = false;
+    // Nodes to split by, 0 for the nodes of the machine.
+    size_t numa_nodes = 0;
+    // The pids resident in each tier are saved to this file at shutdown, and every
+    // warm_restart_snapshot_period_ms if that is not 0. Init reads them back into their tiers
+    // with warm_restart_threads threads before returning. Empty to start cold.
+    std::string warm_restart_snapshot_path;
+    size_t warm_restart_snapshot_period_ms = 0;
+    size_t warm_restart_threads = 4;
+    // Keep a persistent header per page of the NVM heap files, so that Init maps the pages the last run
+    // on the same database left there back into the NVM buffer pool instead of reading them from SSD.
+    // Needs nvm_heap_file_path.
+    bool enable_nvm_frame_recovery = false;
+    // Emulate NVM with DRAM: hold up the copies in and out of NVM pages, the accesses to NVM_FULL
+    // pages and every persist for as long as nvm_emulation says the device would take.
+    bool enable_nvm_emulation = false;
+    NVMEmulatorConfig nvm_emulation;
+    // Record the pages looked up by Get and the ranges prepared by PageAccessor to this file, for
+    // tier_sim to replay. Swizzled hits skip both and are not recorded. Up to access_trace_buffer_mb
+    // of records may wait for the writer before records are dropped. Empty to record nothing.
+    std::string access_trace_path;
+    size_t access_trace_buffer_mb = 64;
+    // Threads replaying the log on startup, see LogRecovery. 0 for one per hardware thread.
+    size_t wal_recovery_threads = 0;
+    // Log into PersistentLogBuffers, whose records are found by their slots, instead of appending them.
+    bool enable_slotted_log_buffer = false;
+    // Where the log files are, kBlockStorage to run with logging on a machine without NVM. The log
+    // of a block device is written through wal_io_engine.
+    LogFileBackendType wal_file_backend = kByteAddressableStorage;
+    IOEngineType wal_io_engine = IOEngineType::IO_URING;
+    // How CommitTransaction waits for its commit record to be durable. Committers are flushed by group,
+    // one of them persists the log of all, see LogManager::WaitForFlushedLSN.
+    WALCommitMode wal_commit_mode = WALCommitMode::SYNC;
+    size_t wal_commit_timeout_us = 1000;
     std::function<void *(std::size_t)> nvm_malloc = block_aligned_alloc;
     std::function<void(void *)> nvm_free = free;
     std::function<void *(std::size_t)> dram_malloc = block_aligned_alloc;
@@ -634,94 +907,55 @@ private:
 
 
 
-class AdmissionSet {
-private:
-    struct DLinkNode {
-        pid_t key;
-        DLinkNode *prev, *next;
-        DLinkNode(pid_t key, DLinkNode*prev = nullptr, DLinkNode *next = nullptr): key(key), prev(prev), next(next) {}
-        void remove_self() {
-            prev->next = next;
-            next->prev = prev;
-            prev = next = nullptr;
-        }
-    };
+// TinyLFU admission filter of the NVM buffer pool in HyMem mode.
+// Keeps approximate access frequencies of recently missed pages in a count-min sketch of
+// kDepth rows of 4-bit counters, packed 16 to a word. A doorkeeper bloom filter absorbs the
+// first access of a page, so pages seen once do not take up counters. After sample_size
+// recorded accesses the counters are halved and the doorkeeper is cleared, so frequencies
+// follow shifts in the working set. Everything is updated with relaxed atomics, increments
+// racing with an aging pass may be lost, which only makes the estimates more approximate.
+class AdmissionFilter {
 public:
-    AdmissionSet(const int capacity) : capacity(capacity) {
-        head = new DLinkNode(kInvalidPID);
-        tail = new DLinkNode(kInvalidPID);
-        head->prev = nullptr;
-        tail->next = nullptr;
-        head->next = tail;
-        tail->prev = head;
-    }
-
-    bool Exist(pid_t key) {
-        std::lock_guard<std::mutex> g(latch);
-        auto it = m.find(key);
-        if (it == m.end()) {
-            return false;
-        }
-        return true;
-    }
+    // `num_entries` is the number of distinct pages whose frequencies are tracked.
+    explicit AdmissionFilter(size_t num_entries);
 
-    void Remove(pid_t key) {
-        std::lock_guard<std::mutex> g(latch);
-        auto it = m.find(key);
-        if (it == m.end())
-            return;
-        auto n = it->second;
-        n->remove_self();
-        m.erase(key);
-        delete n;
-    }
-
-    void Put(pid_t key) {
-        std::lock_guard<std::mutex> g(latch);
-        auto it = m.find(key);
-        if (it == m.end()) {
-            if (m.size() == capacity) {
-                pop_least_recently_used();
-            }
-            auto n = new DLinkNode(key);
-            append_after_head(n);
-            m.insert(std::make_pair(key, n));
-        } else {
-            auto n = it->second;
-            touch_node(n);
-        }
-    }
+    void Record(pid_t pid);
+
+    // Frequency of `pid`, counting the access kept in the doorkeeper.
+    int Estimate(pid_t pid) const;
+
+    // Whether `candidate` should take the place of `victim`, the page NVM would evict for it.
+    // Without a victim the candidate is admitted once it has been seen before.
+    bool Admit(pid_t candidate, pid_t victim) const;
+
+    size_t Agings() const { return agings.load(std::memory_order_relaxed); }
+
+    static constexpr int kDepth = 4;
+    static constexpr int kMaxCount = 15;
+    // Slots searched for the victim of a candidate, see ConcurrentReplacer::PeekVictim.
+    static constexpr int kVictimSearchSteps = 16;
 
 private:
-    void touch_node(DLinkNode *n) {
-        n->remove_self();
-        append_after_head(n);
-    }
+    static uint64_t Hash(pid_t pid);
 
-    void append_after_head(DLinkNode* n) {
-        n->prev = head;
-        n->next = head->next;
-        head->next = n;
-        n->next->prev = n;
-    }
+    // Index of the counter of hash `h` in `row`, counters are numbered across the words of the row.
+    size_t CounterIndex(uint64_t h, int row) const;
 
-    void pop_least_recently_used() {
-        if (list_empty())
-            return;
-        auto last_node = tail->prev;
-        last_node->remove_self();
-        m.erase(last_node->key);
-        delete last_node;
-    }
+    bool DoorkeeperContains(uint64_t h) const;
 
-    bool list_empty() const {
-        return head->next == tail;
-    }
+    // Returns true if the bits were all set already.
+    bool DoorkeeperInsert(uint64_t h);
 
-    std::unordered_map<pid_t, DLinkNode*> m;
-    DLinkNode* head, *tail;
-    const int capacity;
-    std::mutex latch;
+    void Age();
+
+    // Counters per row, a power of two.
+    size_t width;
+    size_t doorkeeper_bits;
+    size_t sample_size;
+    std::vector<std::atomic<uint64_t>> sketch;
+    std::vector<std::atomic<uint64_t>> doorkeeper;
+    std::atomic<size_t> additions;
+    std::atomic<size_t> agings;
 };
 
 
@@ -804,6 +1038,15 @@ static constexpr lsn_t kInvalidLSN = std::numeric_limits<lsn_t>::max();
 lsn_t GetLastLogRecordLSN();
 void SetLastLogRecordLSN(lsn_t lsn);
 
+// The undo images of the pending writes of a thread, see PageAccessor::PrepareForWrite, come from a
+// thread-local BumpArena. It is rewound once the thread has no write pending.
+char *AllocateLogImage(size_t size);
+
+void ReleaseLogImage();
+
+// Called at the end of a transaction, gives back what a large one took beyond the first chunk.
+void TrimLogImages();
+
 enum LogRecordType {
     BEGIN_TXN = 1,
     COMMIT_TXN,
@@ -814,19 +1057,42 @@ enum LogRecordType {
     CHECKPOINT,
 };
 
-enum LogFileBackendType {
-    kBlockStorage,
-    kByteAddressableStorage
-};
-
-// This record is placed at the front of the log file
+// This record is placed at the front of both log files.
 struct MainRecord {
-    // The position of the latest begin checkpoint record.
+    // SSDPageManager::Incarnation of the database the log is for.
+    uint64_t db_id;
+    // Redo starts here, the updates logged before are in the database.
     lsn_t latest_checkpoint;
-    /**
-     * lsn - MainRecord.start_lsn + sizeof(MainRecord) gives the offset into the current physical log file.
-     */
+    // The first lsn of the older log file, the updates of the losers are undone back to here.
+    lsn_t log_begin_lsn;
+    // The lsn of the first log buffer of the current log file.
+    lsn_t start_lsn;
+    // crc32c of the fields above, masked.
+    uint32_t crc;
+    uint32_t padding;
+
+    uint32_t ComputeCRC() const { return crc32c::Mask(crc32c::Value((const char *) this, offsetof(MainRecord, crc))); }
+};
+
+enum LogBufferFormat : uint32_t {
+    // Records are appended one after another, see ConcurrentLogBufferManager.
+    kSequentialLogBuffer = 1,
+    // Records are chained through the slots of a PersistentLogBuffer.
+    kSlottedLogBuffer = 2
+};
+
+// Placed in front of every log buffer in the log file. It is persisted after the buffer is zeroed,
+// so the buffers of a log file are the run of headers whose lsns follow on from each other.
+struct LogBufferHeader {
+    static constexpr uint64_t kMagic = 0x31465542474f4c53ULL; // "SLOGBUF1"
+    uint64_t magic;
     lsn_t start_lsn;
+    // Bytes of the buffer, not counting the header.
+    uint64_t capacity;
+    uint32_t format;
+    uint32_t padding;
+    // The records of a sequential buffer below this lsn are whole, see LogManager::FlushLog.
+    lsn_t durable_lsn;
 };
 
 class WritableSlice {
@@ -883,23 +1149,79 @@ private:
 };
 
 
-class NVMLogFileBackend {
+// A log file. The log buffers in it are handed out by AllocatePersistentBufferAtTheEnd and written
+// in place, a range of one is durable once Persist returns. Append persists what it writes.
+class LogFileBackend {
 public:
-    Status Seek(uint64_t off);
+    virtual ~LogFileBackend() {}
 
-    Status Read(char *buf, uint64_t size);
+    virtual Status Init() = 0;
 
-    Status Append(const char *buf, uint64_t size);
+    virtual Status Seek(uint64_t off) = 0;
 
-    char * AllocatePersistentBufferAtTheEnd(uint64_t size);
+    virtual Status Read(char *buf, uint64_t size) = 0;
 
-    size_t FreeSpace();
+    virtual Status Append(const char *buf, uint64_t size) = 0;
 
-    Status Init();
+    // A zeroed buffer for the next `size` bytes of the file, `size` is a multiple of Alignment().
+    virtual char *AllocatePersistentBufferAtTheEnd(uint64_t size) = 0;
+
+    virtual Status Persist(char *p, size_t size) = 0;
+
+    // Whether `p` is in a buffer of AllocatePersistentBufferAtTheEnd that can still be persisted.
+    virtual bool Owns(const char *p) const = 0;
+
+    virtual size_t FreeSpace() = 0;
+
+    virtual size_t NextWritingPosition() = 0;
 
-    size_t NextWritingPosition();
+    virtual size_t CurrentCapacity() = 0;
 
-    size_t CurrentCapacity();
+    // The log file as Init found it, parsed in place by LogRecovery.
+    virtual const char *Data() const = 0;
+
+    // The buffers start and end at multiples of it in the file.
+    virtual size_t Alignment() const = 0;
+
+    virtual LogFileBackendType Type() const = 0;
+
+    // Where the first log buffer starts, past the MainRecord.
+    size_t FirstBufferOffset() const {
+        return (sizeof(MainRecord) + Alignment() - 1) / Alignment() * Alignment();
+    }
+};
+
+class NVMLogFileBackend : public LogFileBackend {
+public:
+    Status Seek(uint64_t off) override;
+
+    Status Read(char *buf, uint64_t size) override;
+
+    Status Append(const char *buf, uint64_t size) override;
+
+    char * AllocatePersistentBufferAtTheEnd(uint64_t size) override;
+
+    Status Persist(char *p, size_t size) override {
+        NVMUtilities::persist(p, size);
+        return Status::OK();
+    }
+
+    bool Owns(const char *p) const override { return p >= mmap_addr && p < mmap_addr + file_capacity; }
+
+    size_t FreeSpace() override;
+
+    Status Init() override;
+
+    size_t NextWritingPosition() override;
+
+    size_t CurrentCapacity() override;
+
+    // The mapped log file, parsed in place by LogRecovery.
+    const char *Data() const override { return mmap_addr; }
+
+    size_t Alignment() const override { return 1; }
+
+    LogFileBackendType Type() const override { return kByteAddressableStorage; }
 
     NVMLogFileBackend(const std::string &file_path, size_t initial_file_capacity);
 private:
@@ -912,6 +1234,93 @@ private:
     char *ptr;
 };
 
+// A log file on a block device, for machines without NVM. The log buffers are in DRAM and Persist
+// writes the blocks of a range with O_DIRECT through an IOEngine, then syncs the file. Syncs that
+// overlap are done once for all of them. The buffers of the last `num_buffers` allocations stay in
+// DRAM, a LogBufferManager writes to the current and the previous one at most. The file is
+// preallocated, and grown by doubling, with fallocate.
+class BlockLogFileBackend : public LogFileBackend {
+public:
+    static constexpr size_t kBlockSize = 4096;
+
+    // Init falls back to IOEngineType::POSIX if `io_engine_type` is not available, and to buffered
+    // I/O if the file system does not take O_DIRECT.
+    BlockLogFileBackend(const std::string &file_path, size_t initial_file_capacity,
+                        IOEngineType io_engine_type = IOEngineType::IO_URING, size_t num_buffers = 2);
+
+    ~BlockLogFileBackend();
+
+    Status Init() override;
+
+    Status Seek(uint64_t off) override;
+
+    Status Read(char *buf, uint64_t size) override;
+
+    Status Append(const char *buf, uint64_t size) override;
+
+    char *AllocatePersistentBufferAtTheEnd(uint64_t size) override;
+
+    Status Persist(char *p, size_t size) override;
+
+    bool Owns(const char *p) const override;
+
+    size_t FreeSpace() override { return file_capacity - pos; }
+
+    size_t NextWritingPosition() override { return pos; }
+
+    size_t CurrentCapacity() override { return file_capacity; }
+
+    const char *Data() const override { return image; }
+
+    size_t Alignment() const override { return kBlockSize; }
+
+    LogFileBackendType Type() const override { return kBlockStorage; }
+
+    // Bytes written, writes and syncs of the file.
+    std::string ToString() const;
+
+private:
+    struct Buffer {
+        char *data;
+        size_t size;
+        uint64_t file_off;
+    };
+
+    // Grow the file to at least `capacity`.
+    Status Extend(uint64_t capacity);
+
+    // Write the blocks at `off` in the file from `p` and sync the file.
+    Status WriteBlocks(uint64_t off, const char *p, size_t size);
+
+    Status Sync();
+
+    const std::string file_path;
+    size_t file_capacity;
+    const IOEngineType io_engine_type;
+    const size_t num_buffers;
+    IOEngine *io_engine = nullptr;
+    int fd = -1;
+    bool direct_io = true;
+    uint64_t pos = 0;
+    // The file mapped read-only by Init.
+    char *image = nullptr;
+    size_t image_size = 0;
+    mutable std::mutex buffers_mtx;
+    std::deque<Buffer> buffers;
+    // Block writes are issued one at a time.
+    std::mutex write_mtx;
+    // Syncs are numbered, a sync covers the writes done before it is started.
+    std::mutex sync_mtx;
+    std::condition_variable sync_cv;
+    uint64_t syncs_requested = 0;
+    uint64_t syncs_done = 0;
+    bool syncing = false;
+    Status sync_status;
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> syncs{0};
+};
+
 
 /**
  * For log record type except COMPENSATION and CHECKPOINT,
@@ -934,6 +1343,8 @@ public:
 
     virtual lsn_t GetPrevLSN() const = 0;
 
+    virtual txn_id_t GetTID() const = 0;
+
     virtual size_t GetIdHash() const = 0;
 
     virtual void Redo(ConcurrentBufferManager *buf_mgr) = 0;
@@ -947,6 +1358,8 @@ public:
     virtual size_t Size() = 0;
 
     LogRecord() {}
+
+    virtual ~LogRecord() {}
 };
 
 class LogRecordBeginTxn : public LogRecord {
@@ -1072,9 +1485,11 @@ public:
 
     size_t GetIdHash() const { return PidHasher()(page_id); }
 
-    void Redo(ConcurrentBufferManager *buf_mgr) {}
+    // Write the redo, or the undo, image over the range of the page. The updates are not logged,
+    // the log manager is not set up while LogRecovery runs.
+    void Redo(ConcurrentBufferManager *buf_mgr);
 
-    void Undo(ConcurrentBufferManager *buf_mgr) {}
+    void Undo(ConcurrentBufferManager *buf_mgr);
 
     void Flush(WritableSlice & slice);
 
@@ -1082,17 +1497,24 @@ public:
 
     size_t Size();
 
+    // The images are not copied, they have to outlive the record. A record is flushed before
+    // LogManager::LogUpdate returns, so they can be the page itself and an arena of undo images.
     LogRecordUpdate(lsn_t prev_lsn, txn_id_t tid, pid_t page_id, uint64_t offset, uint64_t len, const char *redo,
                     const char *undo);
     LogRecordUpdate() {}
 
-    pid_t GetPageId() { return page_id; }
+    pid_t GetPageId() const { return page_id; }
 private:
+    void WriteImage(ConcurrentBufferManager *buf_mgr, const char *image);
+
     lsn_t prev_lsn;
     txn_id_t tid;
     pid_t page_id;
     uint64_t offset_in_page;
     uint64_t len;
+    const char *redo_image = nullptr;
+    const char *undo_image = nullptr;
+    // The images of a parsed record.
     std::shared_ptr<char> redo_info;
     std::shared_ptr<char> undo_info;
 };
@@ -1187,8 +1609,10 @@ private:
 
 class LogRecordParser {
 public:
-    LogRecordParser(char * buf, size_t size): slice(buf, size){}
+    LogRecordParser(const char * buf, size_t size): slice(buf, size){}
 
+    // The record at `offset`, which is set to the offset of the record in the buffer. nullptr at the
+    // end of the records: zeroes, where no record was written yet, or bytes that do not parse.
     LogRecord * ParseNext(size_t & offset);
 private:
     ReadableSlice slice;
@@ -1196,7 +1620,10 @@ private:
 
 class LogManager {
 public:
-    LogManager(ConcurrentBufferManager *buf_mgr, NVMLogFileBackend *backend1, NVMLogFileBackend *backend2, size_t log_buffer_size = 32 * 1024 * 1024);
+    // With `slotted_log_buffer`, the records go to PersistentLogBuffers instead of being appended.
+    // The LogManager owns the backends.
+    LogManager(ConcurrentBufferManager *buf_mgr, LogFileBackend *backend1, LogFileBackend *backend2,
+               size_t log_buffer_size = 32 * 1024 * 1024, bool slotted_log_buffer = false);
 
     ~LogManager();
 
@@ -1213,21 +1640,24 @@ public:
 
     size_t FlushDirtyPages(lsn_t upto_lsn);
 
+    // Record in the main records that the updates logged before `checkpoint_lsn` are in the database.
     void Checkpoint(lsn_t checkpoint_lsn);
 
+    // Called at shutdown once every page is written back, the next run has nothing to redo or undo.
+    void CloseLog();
+
     void DirtyPage(pid_t page_id, lsn_t lsn);
 
     void WakeUpPageCleaner();
 
-    void PersistMainRecord(NVMLogFileBackend * backend);
-
-    lsn_t GetLastLSN(txn_id_t);
+    void PersistMainRecord(LogFileBackend * backend);
 
     void StartPageCleanerProcess();
 
     void EndPageCleanerProcess();
 
-    Status Init();
+    // Start a new log on database `db_id` at `start_lsn`, past the log LogRecovery replayed.
+    Status Init(uint64_t db_id = 0, lsn_t start_lsn = 0);
 
 //    void RemoveFromDirtyPageTable(pid_t page_id);
 //
@@ -1236,11 +1666,42 @@ public:
     // Return the next lsn and a new persistent log buffer for writing after incorporating the log buffer into the log.
     std::pair<lsn_t, char*> PersistLogBufferAsync(char *log_buffer, size_t log_buffer_size, size_t new_log_buffer_cap);
 
+    // The lsn past every record logged so far.
     lsn_t NextLSN();
+
+    // Persist the records written so far, up to the first one still being written, and return the new
+    // flushed lsn. The records of a slotted log buffer are persisted as they are written instead.
+    lsn_t FlushLog();
+
+    // Wait per `mode` until the log below `upto` is durable, and return whether it is. The first
+    // waiter flushes the log for itself and for the waiters that come while it does.
+    bool WaitForFlushedLSN(lsn_t upto, WALCommitMode mode = WALCommitMode::SYNC);
+
+    // Wait for the commit record at `commit_lsn` per BufferPoolConfig::wal_commit_mode.
+    bool WaitForCommit(lsn_t commit_lsn);
+
+    // The log below it is durable. Not kept for a slotted log buffer, whose records are durable once written.
+    lsn_t FlushedLSN() { return flushed_lsn.load(); }
+
+    // The end of the record written last, records below it may still be being written.
+    lsn_t WrittenLSN() { return written_lsn.load(); }
+
+    lsn_t CurrentBufferLSN() { return current_buffer_lsn.load(); }
+
+    // Make [p, p + size) of a log buffer from PersistLogBufferAsync durable.
+    void Persist(char *p, size_t size);
+
+    // Called by ConcurrentLogBufferManager once the record ending at `end_lsn` is in the buffer.
+    void RecordWritten(lsn_t end_lsn);
 private:
+    // Persist the current log buffer from flushed_lsn up to `upto`, whose records are whole.
+    void PersistLog(lsn_t upto);
+
+    void AdvanceFlushedLSN(lsn_t lsn);
+
     static void PageCleaningProcess(LogManager * mgr);
 
-    NVMLogFileBackend * GetCurrentLogFileBackend();
+    LogFileBackend * GetCurrentLogFileBackend();
 
     void SwitchLogFileIfTooBig();
     std::atomic_bool stopped{false};
@@ -1265,10 +1726,11 @@ private:
     std::recursive_mutex lock;
 
     ConcurrentBufferManager *buf_mgr;
-    NVMLogFileBackend *logfile_backends[2];
+    LogFileBackend *logfile_backends[2];
     LogBufferManager * log_buffer_mgr;
     int current_backend_idx;
     size_t log_buffer_size;
+    LogBufferFormat log_buffer_format;
     MainRecord current_main_rec;
 
     concurrent_bytell_hash_map<pid_t, lsn_t, PidHasher> dirty_page_table;
@@ -1279,10 +1741,23 @@ private:
 //    std::list<pid_t> flush_list;
     std::unique_ptr<std::thread> checkpoint_process;
 
+    // The lsn the next log buffer starts at.
     std::atomic<lsn_t> next_lsn{0};
+    // The lsn of the log buffer records are written to. No record written afterwards has a lower lsn.
+    std::atomic<lsn_t> current_buffer_lsn{0};
     std::atomic<lsn_t> checkpoint_safe_lsn{0};
     // Log records whose lsn <= persisted_lsn are persisted
     std::atomic<lsn_t> persisted_lsn{0};
+    // Whether FlushLog persists the records, false when the log buffer manager persists each one.
+    bool group_flush = false;
+    // The data of the log buffer records are written to, past its header.
+    char *current_buffer = nullptr;
+    std::atomic<lsn_t> written_lsn{0};
+    std::atomic<lsn_t> flushed_lsn{0};
+    // Waiters of WaitForFlushedLSN, one of which is the flush leader at a time.
+    std::mutex flush_mtx;
+    std::condition_variable flush_cv;
+    bool flush_leader = false;
 
     std::mutex cv_mtx;
     std::condition_variable page_cleaner_cv;
@@ -1293,23 +1768,29 @@ private:
 template<size_t kLogSlotSize = 512>
 class PersistentLogBuffer {
 public:
-    PersistentLogBuffer(char * nvm_buf_start, size_t buf_capacity, lsn_t start_lsn):
+    typedef std::function<void(char *, size_t)> PersistFunc;
+
+    // The ranges of the buffer are made durable by `persist`, the LogFileBackend the buffer is in.
+    PersistentLogBuffer(char * nvm_buf_start, size_t buf_capacity, lsn_t start_lsn,
+                        PersistFunc persist = NVMUtilities::persist):
         nvm_buf_start(nvm_buf_start),
         buf_capacity(buf_capacity),
         num_slots(buf_capacity / kLogSlotSize),
         num_reserved_uint64s(buf_capacity / 64),
         reserved(num_reserved_uint64s),
         buf_start_lsn(start_lsn),
-        filled_bytes(0)
+        filled_bytes(0),
+        persist(persist)
     {
         assert(buf_capacity % kLogSlotSize == 0);
         assert(buf_capacity % 64 == 0);
-        next_slot_hints.resize(num_slots);
-        for (int i = 0; i < num_slots; ++i) {
+        // The last hint stops the probing at the end of the buffer.
+        next_slot_hints.resize(num_slots + 1);
+        for (int i = 0; i <= num_slots; ++i) {
             next_slot_hints[i] = i;
         }
         memset(nvm_buf_start, 0, buf_capacity);
-        NVMUtilities::persist(nvm_buf_start, buf_capacity);
+        persist(nvm_buf_start, buf_capacity);
     }
 
     Status Init() { return Status::OK(); }
@@ -1365,7 +1846,7 @@ public:
         }
 
         uint32_t Next() const {
-            return head_slot_desc.slot_chain & (!kLogSlotTypeBitMask);
+            return head_slot_desc.slot_chain & (~kLogSlotTypeBitMask);
         }
 
         LogSlotType Type() const {
@@ -1388,13 +1869,13 @@ public:
                                                   expected, kReservedLogSlotChain);
         }
 
-        void SetSlotChainAndPersist(LogSlotType type, uint32_t next) {
+        void SetSlotChainAndPersist(LogSlotType type, uint32_t next, const PersistFunc &persist) {
             head_slot_desc.slot_chain = FormSlotChain(type, next);
-            PersistSlotChain();
+            PersistSlotChain(persist);
         }
 
-        void ClearSlotChain() {
-            SetSlotChainAndPersist(LogSlotType::kEmptyLogSlot, 0);
+        void ClearSlotChain(const PersistFunc &persist) {
+            SetSlotChainAndPersist(LogSlotType::kEmptyLogSlot, 0, persist);
         }
 
         void SetIdHash(pid_t pid) {
@@ -1409,16 +1890,16 @@ public:
             return kLogSlotSize - DescriptorSize();
         }
 
-        void PersistPayload() {
-            NVMUtilities::persist(PayloadBuffer(), PayloadBufferSize());
+        void PersistPayload(const PersistFunc &persist) {
+            persist(PayloadBuffer(), PayloadBufferSize());
         }
 
-        void PersistDescriptor() {
-            NVMUtilities::persist(buf, DescriptorSize());
+        void PersistDescriptor(const PersistFunc &persist) {
+            persist(buf, DescriptorSize());
         }
 
-        void PersistSlotChain() {
-            NVMUtilities::persist((char*)&head_slot_desc.slot_chain, sizeof(uint32_t));
+        void PersistSlotChain(const PersistFunc &persist) {
+            persist((char*)&head_slot_desc.slot_chain, sizeof(uint32_t));
         }
 
         bool EndOfChain() const {
@@ -1478,9 +1959,14 @@ public:
             }
             size_t copy_size = std::min(buf_size_left, slot_buf_size);
             memcpy(slot_buf_start, record_buf_p, copy_size);
+            persist(slot_buf_start, copy_size);
+            record_buf_p += copy_size;
             buf_size_left -= copy_size;
         }
 
+        // The descriptors go from the tail to the head, a head slot is only there once the payload
+        // and the rest of the chain are.
+
         for (int i = (int)slot_indices.size() - 1; i >= 0; --i) {
             if (i == 0) {
                 At(slot_indices[i])->SetIdHash(id_hash);
@@ -1488,12 +1974,12 @@ public:
                 if (slot_indices.size() > 1) {
                     next = slot_indices[i + 1];
                 }
-                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kHeadLogSlot, next);
+                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kHeadLogSlot, next, persist);
             } else if (i == slot_indices.size() - 1) {
-                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kTailLogSlot, 0);
+                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kTailLogSlot, 0, persist);
             } else {
                 uint32_t next = slot_indices[i + 1];
-                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kMiddleLogSlot, 0);
+                At(slot_indices[i])->SetSlotChainAndPersist(LogSlotType::kMiddleLogSlot, next, persist);
             }
         }
         return (int32_t) ((char*)At(slot_indices[0]) - nvm_buf_start);
@@ -1503,6 +1989,45 @@ public:
 
     lsn_t GetStartLSN() const { return buf_start_lsn; }
 
+    /**
+     * Call `f` with the offset of the head slot and the payload of every record of the buffer at `buf`
+     * whose chain of slots is complete. The payload may go on past the end of the record.
+     */
+    static void ForEachRecord(const char *buf, size_t buf_capacity,
+                              const std::function<void(uint32_t, const char *, size_t)> &f) {
+        const LogSlot *slots = (const LogSlot *) buf;
+        const size_t n = buf_capacity / kLogSlotSize;
+        std::vector<char> record;
+        for (size_t i = 0; i < n; ++i) {
+            if (slots[i].Type() != LogSlotType::kHeadLogSlot)
+                continue;
+            record.assign(slots[i].buf + sizeof(HeadLogSlotDescriptor), slots[i].buf + kLogSlotSize);
+            bool complete = true;
+            if (!slots[i].EndOfChain()) {
+                uint32_t next = slots[i].Next();
+                // A chain never takes more than every slot, whatever a damaged buffer says.
+                for (size_t hops = 0; ; ++hops) {
+                    if (next >= n || hops == n) {
+                        complete = false;
+                        break;
+                    }
+                    LogSlotType type = slots[next].Type();
+                    if (type != LogSlotType::kMiddleLogSlot && type != LogSlotType::kTailLogSlot) {
+                        complete = false;
+                        break;
+                    }
+                    record.insert(record.end(), slots[next].buf + sizeof(LogSlotDescriptor),
+                                  slots[next].buf + kLogSlotSize);
+                    if (type == LogSlotType::kTailLogSlot)
+                        break;
+                    next = slots[next].Next();
+                }
+            }
+            if (complete)
+                f((uint32_t) (i * kLogSlotSize), record.data(), record.size());
+        }
+    }
+
     ~PersistentLogBuffer() {
         //fprintf(stderr, "Avg probe length %d\n", probes / (allocs + 1));
     }
@@ -1517,13 +2042,16 @@ private:
         const int kProbeLimit = this->num_slots / 5;
         //allocs++;
         {
-            // Fast path utilizing the hints
+            // Fast path utilizing the hints. The probing stops at the end of the buffer instead of
+            // wrapping around, so the records of a page follow each other in lsn order.
             int i = start_idx;
             do {
                 while (i != next_slot_hints[i] && steps < kProbeLimit) {
                     i = next_slot_hints[i];
                     ++steps;
                 }
+                if (i == num_slots)
+                    break;
                 ++steps;
                 //++probes;
                 if (ReserveSlot(i)) {
@@ -1534,11 +2062,11 @@ private:
                         left -= kLogSlotSize - sizeof(LogSlotDescriptor);
                     }
                 }
-                i = (i + 1)  == num_slots ? 0 : i + 1;
+                ++i;
                 if (steps > kProbeLimit) {
                     break;
                 }
-            } while (i != start_idx && left > 0);
+            } while (i != num_slots && left > 0);
             if (left <= 0) {
                 next_slot_hints[start_idx] = i;
             }
@@ -1596,6 +2124,7 @@ private:
     std::vector<int> next_slot_hints;
     lsn_t buf_start_lsn;
     DistributedCounter<128> filled_bytes;
+    PersistFunc persist;
 };
 
 
@@ -1619,6 +2148,80 @@ private:
     std::atomic<int> buffer_switch_status;
 };
 
+/**
+ * ARIES style recovery from the log the last run left in the two log files, before LogManager starts
+ * a new log over it.
+ *  Analysis: the log buffers from MainRecord::log_begin_lsn on are parsed in parallel, a buffer per task.
+ *      The transactions with updates and neither a commit nor an abort record are the losers.
+ *      Updates outside of transactions, INVALID_TXN_ID, are never undone.
+ *  Redo: the updates from MainRecord::latest_checkpoint on are partitioned by page over the threads,
+ *      which replay those of their pages in lsn order. An update below the lsn of an NVM page
+ *      recovered in place is in the page already and skipped.
+ *  Undo: the updates of the losers are rolled back the same way, in reverse lsn order.
+ * The images are physical, undo assumes no other transaction overwrote the bytes of a loser before
+ * it ended. Updates of a loser older than the previous log file are not in the log anymore.
+ */
+class LogRecovery {
+public:
+    LogRecovery(ConcurrentBufferManager *buf_mgr, LogFileBackend *backend1, LogFileBackend *backend2,
+                uint64_t db_id, size_t num_threads);
+
+    ~LogRecovery();
+
+    Status Run();
+
+    // The lsn past every log buffer in the files, where the next log starts.
+    lsn_t EndLSN() const { return end_lsn; }
+
+    std::string ToString() const;
+
+private:
+    struct Buffer {
+        lsn_t start_lsn;
+        uint64_t capacity;
+        LogBufferFormat format;
+        const char *data;
+        // Bytes of whole records at the start of a sequential buffer.
+        uint64_t durable_size;
+    };
+
+    struct Entry {
+        lsn_t lsn;
+        LogRecord *rec;
+    };
+
+    // The intact main record of `db_id` with the newest log, false if there is none.
+    bool ReadMainRecord(MainRecord &main_rec);
+
+    // Append the chain of buffers written from the front of `backend` in the last log on it.
+    void FindBuffers(LogFileBackend *backend, std::vector<Buffer> &buffers);
+
+    void ParseBuffer(const Buffer &buffer, std::vector<Entry> &entries);
+
+    // Run `f(i)` on a thread of its own for every i below num_threads.
+    void RunInParallel(const std::function<void(size_t)> &f);
+
+    ConcurrentBufferManager *buf_mgr;
+    LogFileBackend *backends[2];
+    uint64_t db_id;
+    size_t num_threads;
+    lsn_t end_lsn = 0;
+    // The parsed records, a vector per log buffer.
+    std::vector<std::vector<Entry>> records;
+    // The updates to redo and to undo, partitioned by page.
+    std::vector<std::vector<Entry>> redo_partitions;
+    std::vector<std::vector<Entry>> undo_partitions;
+    size_t buffers_parsed = 0;
+    size_t records_parsed = 0;
+    size_t losers = 0;
+    std::atomic<size_t> updates_redone{0};
+    std::atomic<size_t> updates_skipped{0};
+    std::atomic<size_t> updates_undone{0};
+    double analysis_secs = 0;
+    double redo_secs = 0;
+    double undo_secs = 0;
+};
+
 struct SharedPageDesc {
     // Protects accesses to the following fields
     std::mutex m;
@@ -1633,49 +2236,289 @@ struct SharedPageDesc {
     SharedPageDesc(PageDesc *dram_ph = nullptr, PageDesc *nvm_ph = nullptr) : dram_ph(dram_ph), nvm_ph(dram_ph) {}
 };
 
-class ConcurrentClockReplacer {
-private:
-    const int64_t cap_in_bytes;
+// Replacement policy of one concurrent buffer pool tier.
+// Resident pages occupy the slots of a circular array swept by clock hands.
+// Subclasses decide which unpinned page under a hand gives up its slot.
+//
+// The slots are split into partitions, each with its own clock hand, byte budget and
+// cleaner, so threads placing and evicting pages in different partitions do not contend.
+// A page is placed in the partition its pid hashes to. When that partition is full and
+// another one has room, or has nothing to evict, e.g. all its pages are pinned, Add steals
+// a slot of another partition. EnsureSpace evicts a page of another partition and takes
+// over its bytes of budget when its own partition has nothing to evict.
+// With more than one NUMA node, partition k belongs to node k % n_nodes and pages are placed
+// in the partitions of the node of the thread that adds them. Slots and budget are then taken
+// from the partitions of the same node first.
+//
+// Slots left empty by evictions that did not place a page go to a lock-free list of free
+// frames, which Add takes from before it sweeps. See FreeFrameProducer.
+class ConcurrentReplacer {
+protected:
+    struct alignas(64) Partition {
+        // Slots [begin, end) of pool.
+        size_t begin;
+        size_t end;
+        std::atomic<size_t> clock_hand;
+        // Bytes of the pages in the slots of the partition, kept at or below budget by EnsureSpace.
+        std::atomic<int64_t> bytes;
+        std::atomic<int64_t> budget;
+        // A futex word for ParkingLot, 1 while a thread evicts to bring bytes within budget.
+        std::atomic<int> cleaning;
+
+        size_t Slots() const { return end - begin; }
+    };
+
+    // Changed online by Grow and Shrink, up to the capacity the slots are sized for.
+    std::atomic<int64_t> cap_in_bytes;
+    const int64_t max_cap_in_bytes;
     const size_t n_pages;
     std::vector<std::atomic<PageDesc *>> pool;
     std::atomic<int> free;
-    std::atomic<int> clock_hand;
-    // current_bytes_in_buffer <= cap_in_bytes
-    DistributedCounter<32> current_bytes_in_buffer;
+    const size_t n_nodes;
+    const size_t n_partitions;
+    std::unique_ptr<Partition[]> partitions;
+    DistributedCounter<32> steals;
+    // Slots that were empty when pushed, they may have been taken by a sweep since.
+    BoundedMPMCQueue<size_t> free_frames;
+    // In pages of kPageSize, 0 when no FreeFrameProducer runs for the tier.
+    std::atomic<size_t> free_frames_low{0};
+    std::atomic<size_t> free_frames_high{0};
+    // A futex word for ParkingLot, bumped to wake the FreeFrameProducer.
+    std::atomic<int> free_frames_wanted{0};
+    std::atomic<size_t> producer_cursor{0};
+    DistributedCounter<32> free_frame_hits;
+    DistributedCounter<32> frames_produced;
     RefManager *epoch_manager;
     static thread_local ThreadRefHolder *pd_reader_ref;
     bool evict_dirty = true;
     ConcurrentBufferManager * buf_mgr;
 public:
-    ConcurrentClockReplacer(const int64_t capacity_in_bytes, const size_t page_size, RefManager *epoch_manager, ConcurrentBufferManager * buf_mgr);
+    // With `num_partitions` 0 there is a partition per hardware thread. The partitions are
+    // rounded up to a multiple of `num_nodes` and have at least kMinPartitionSlots slots.
+    // There are slots for `max_capacity_in_bytes`, or for `capacity_in_bytes` if it is smaller.
+    ConcurrentReplacer(const int64_t capacity_in_bytes, const size_t page_size, RefManager *epoch_manager,
+                       ConcurrentBufferManager * buf_mgr, size_t num_partitions = 1, size_t num_nodes = 1,
+                       int64_t max_capacity_in_bytes = 0);
 
+    virtual ~ConcurrentReplacer() {}
+
+    static ConcurrentReplacer *Create(ReplacerType type, const int64_t capacity_in_bytes, const size_t page_size,
+                                      RefManager *epoch_manager, ConcurrentBufferManager *buf_mgr,
+                                      size_t num_partitions = 1, size_t num_nodes = 1,
+                                      int64_t max_capacity_in_bytes = 0);
 
     void EvictPurgablePages(const std::unordered_set<pid_t> &evict_set);
 
     void SetEvictDirty(bool evict_dirty) { this->evict_dirty = evict_dirty; }
-    void Clear();
+
+    virtual void Clear();
 
     void AssertNotInBuffer(PageDesc *entry);
 
-    ConcurrentClockReplacer(const ConcurrentClockReplacer &) = delete;
+    ConcurrentReplacer(const ConcurrentReplacer &) = delete;
 
-    ConcurrentClockReplacer(ConcurrentClockReplacer &&) = delete;
+    ConcurrentReplacer(ConcurrentReplacer &&) = delete;
 
+    // Place `entry` in a slot, evicting an unpinned page if needed. Returns the evicted page, if any.
     PageDesc *Add(PageDesc *entry, int64_t page_size);
 
-    PageDesc *Swap(PageDesc *entry, int64_t page_size);
+    // Record a hit on the resident page `entry`.
+    virtual void Touch(PageDesc *entry) { entry->Reference(); }
+
+    // Account for the resident page `entry` changing size by `size` bytes.
+    void AddCurrentBytesInBuf(PageDesc *entry, int size) { partitions[entry->partition].bytes += size; }
 
-    void AddCurrentBytesInBuf(int size) { current_bytes_in_buffer += size; }
+    // Whether a page of `page_size` bytes placed for `pid` fits in the budget of its partition.
+    bool HasFreeSpace(pid_t pid, int64_t page_size) const {
+        const Partition &p = partitions[HomePartition(pid)];
+        return p.bytes.load() + page_size <= p.budget.load();
+    }
+
+    // The pid of the first unpinned page among the next `max_steps` slots under the hand of the
+    // partition of `pid`, a guess at the page Add evicts for it. kInvalidPID if there is none.
+    pid_t PeekVictim(pid_t pid, int max_steps);
 
-    void EnsureSpace(std::vector<pid_t> &evicted_pids);
+    // Evict pages until the partition of the resident page `entry` is within its budget.
+    void EnsureSpace(const PageDesc *entry, std::vector<pid_t> &evicted_pids) {
+        EnsurePartitionSpace(entry->partition, evicted_pids);
+    }
 
-    void MoveClockHand(int curr, int start);
+    int64_t Capacity() const { return cap_in_bytes.load(); }
+
+    int64_t MaxCapacity() const { return max_cap_in_bytes; }
+
+    size_t NumPartitions() const { return n_partitions; }
+
+    // Raise the capacity by `bytes`, spread over the partitions like the initial capacity.
+    void Grow(int64_t bytes);
+
+    // Lower the capacity by `bytes`, taken from the budget of the partition with the largest one,
+    // and evict that partition down to its new budget. Callers shrink by a page at a time, so that
+    // threads adding pages to the partition meanwhile wait for at most one eviction.
+    void Shrink(int64_t bytes, std::vector<pid_t> &evicted_pids);
+
+    // Free bytes of the tier in pages of kPageSize.
+    size_t FreeFrames() const {
+        int64_t free_bytes = cap_in_bytes - BytesInBuffer();
+        return free_bytes > 0 ? free_bytes / kPageSize : 0;
+    }
+
+    void SetFreeFrameWatermarks(size_t low, size_t high) {
+        free_frames_low = low;
+        free_frames_high = high;
+    }
+
+    // Evict a page to free a frame, sweeping the partitions in turn.
+    // Returns the evicted page, or nullptr if no page could be evicted.
+    PageDesc *ProduceFreeFrame();
 
     std::string GetStats() const;
 
     std::unordered_set<pid_t> GetManagedPids() const;
+
+    // The resident pages with their reference bits.
+    void GetResidentPages(std::vector<std::pair<pid_t, bool>> &pages) const;
+
+    int64_t BytesInBuffer() const;
+
+    virtual std::string Name() const = 0;
+
+    static constexpr size_t kMinPartitionSlots = 64;
+    // Stale free frames Add skips before it sweeps instead.
+    static constexpr int kMaxFreeFramePops = 4;
+
+protected:
+    // A partition of the node of the calling thread.
+    size_t HomePartition(pid_t pid) const {
+        if (n_nodes == 1)
+            return PidHasher()(pid) % n_partitions;
+        return PidHasher()(pid) % (n_partitions / n_nodes) * n_nodes + Numa::CurrentNode() % n_nodes;
+    }
+
+    // The `k`th partition to try after `home`, the partitions of the node of `home` come first.
+    size_t NthPartition(size_t home, size_t k) const {
+        size_t per_node = n_partitions / n_nodes;
+        return (home + k % per_node * n_nodes + k / per_node) % n_partitions;
+    }
+
+    size_t PartitionOfSlot(size_t slot) const;
+
+    // Sweep at most `max_steps` slots of `p` for a slot for `entry`, evicting an unpinned page if needed.
+    // With a nullptr `entry` this only evicts. Returns false if the sweep found no slot, otherwise
+    // returns true and sets `evicted` to the evicted page, if any.
+    virtual bool Sweep(Partition &p, PageDesc *entry, int64_t page_size, size_t max_steps, PageDesc *&evicted);
+
+    // Bookkeeping once `entry` has taken `slot` of `p` from `e`, either may be nullptr.
+    void Replaced(Partition &p, size_t slot, PageDesc *e, PageDesc *entry, int64_t page_size);
+
+    // Wake up the FreeFrameProducer if the free frames dropped below the low watermark.
+    void WantFreeFrames();
+
+    friend class FreeFrameProducer;
+
+    // Evict a page of another partition and move its bytes of budget to partition `idx`.
+    PageDesc *StealBudget(size_t idx);
+
+    void EnsurePartitionSpace(size_t idx, std::vector<pid_t> &evicted_pids);
+
+    // Share of partition `p` in `bytes` of capacity.
+    int64_t ShareOf(const Partition &p, int64_t bytes) const;
+
+    // Called once `entry` occupies a slot.
+    virtual void OnAdmit(PageDesc *entry) { entry->Reference(); }
+
+    // Whether the unpinned page `e` under the hand should be evicted. Ages the state of `e` otherwise.
+    virtual bool ShouldEvict(PageDesc *e) = 0;
+
+    // Called once `e` has lost its slot.
+    virtual void OnEvict(PageDesc *e) {}
+
+    virtual std::string PolicyStats() const { return ""; }
+
+    // Give the page cleaner a chance to produce clean pages when a sweep of `p` finds none for a long distance.
+    void WaitForCleanPages(const Partition &p, size_t steps);
+};
+
+// Second-chance CLOCK over the reference bit.
+class ConcurrentClockReplacer : public ConcurrentReplacer {
+public:
+    using ConcurrentReplacer::ConcurrentReplacer;
+
+    std::string Name() const override { return "clock"; }
+
+protected:
+    bool ShouldEvict(PageDesc *e) override;
 };
 
+// Clock-based 2Q. Admitted pages are cold and are evicted when the hand reaches
+// them unreferenced, so a one-pass scan only cycles through the cold pages.
+// A cold page referenced before the hand comes back is promoted to hot. Hot pages
+// get second chances and are demoted once they outnumber kHotRatio of the slots.
+// The pids of evicted cold pages are kept in a ghost filter, and a page missed
+// again while still in the filter is admitted hot.
+class ConcurrentTwoQReplacer : public ConcurrentReplacer {
+public:
+    ConcurrentTwoQReplacer(const int64_t capacity_in_bytes, const size_t page_size, RefManager *epoch_manager,
+                           ConcurrentBufferManager *buf_mgr, size_t num_partitions = 1, size_t num_nodes = 1,
+                           int64_t max_capacity_in_bytes = 0);
+
+    void Clear() override;
+
+    std::string Name() const override { return "2q"; }
+
+protected:
+    void OnAdmit(PageDesc *entry) override;
+
+    bool ShouldEvict(PageDesc *e) override;
+
+    void OnEvict(PageDesc *e) override;
+
+    std::string PolicyStats() const override;
+
+private:
+    static constexpr double kHotRatio = 0.75;
+
+    std::atomic<pid_t> &GhostSlotOf(pid_t pid) { return ghosts[PidHasher()(pid) % n_ghosts]; }
+
+    // Follows the capacity, the slots are sized for the maximum capacity.
+    int64_t HotTarget() const { return (int64_t) (kHotRatio * n_pages * Capacity() / MaxCapacity()); }
+
+    std::atomic<int64_t> hot_pages{0};
+    const size_t n_ghosts;
+    std::unique_ptr<std::atomic<pid_t>[]> ghosts;
+    DistributedCounter<32> ghost_hits;
+    DistributedCounter<32> promotions;
+};
+
+// Sampled LRU-2. Time advances by one on every admission, and a hit records the
+// current time as the last access of the page, shifting the previous one into
+// penultimate_access. To make room, the sweep samples kSampleSize unpinned pages
+// ahead of the hand and evicts the one with the oldest penultimate access. Pages
+// accessed once have none and go first, the least recently accessed among them.
+class ConcurrentLRU2Replacer : public ConcurrentReplacer {
+public:
+    using ConcurrentReplacer::ConcurrentReplacer;
+
+    void Touch(PageDesc *entry) override;
+
+    std::string Name() const override { return "lru2"; }
+
+protected:
+    void OnAdmit(PageDesc *entry) override;
+
+    bool ShouldEvict(PageDesc *e) override { return true; }
+
+    bool Sweep(Partition &p, PageDesc *entry, int64_t page_size, size_t max_steps, PageDesc *&evicted) override;
+
+private:
+    static constexpr int kSampleSize = 8;
+
+    std::atomic<uint64_t> virtual_time{0};
+};
+
+// One flush lock per slot. A counter is even while its slot is unlocked and odd while it is
+// locked, so every flush moves it by two and it doubles as the sequence number of the flushes
+// in its slot. Waiters park on the counter until it reaches the value they wait for.
 class ConcurrentHashCounterArray {
 public:
     ConcurrentHashCounterArray(size_t sz) : counters(sz), capacity(sz) {}
@@ -1683,16 +2526,34 @@ public:
     size_t GetHashPos(size_t h) const { return h % capacity; }
 
     bool TryLock(size_t pos) {
-        int zero = 0;
-        return counters[pos].compare_exchange_strong(zero, 1);
+        int seq = counters[pos].load();
+        return (seq & 1) == 0 && counters[pos].compare_exchange_strong(seq, seq + 1);
+    }
+
+    void Lock(size_t pos) {
+        while (TryLock(pos) == false)
+            WaitUnlocked(pos);
     }
 
     void Unlock(size_t pos) {
-        auto s = counters[pos].fetch_sub(1);
-        assert(s == 1);
+        auto s = counters[pos].fetch_add(1);
+        assert(s & 1);
+        ParkingLot::UnparkAll(counters[pos]);
+    }
+
+    bool Check(size_t pos) { return counters[pos].load() & 1; }
+
+    int Sequence(size_t pos) const { return counters[pos].load(); }
+
+    void WaitUnlocked(size_t pos) {
+        ParkingLot::WaitUntil(counters[pos], [](int seq) { return (seq & 1) == 0; });
     }
 
-    bool Check(size_t pos) { return counters[pos].load(); }
+    // Waits until a flush that locked the slot at or after sequence number `seq` has unlocked it.
+    void WaitForFlush(size_t pos, int seq) {
+        unsigned target = ((unsigned) seq | 1) + 1;
+        ParkingLot::WaitUntil(counters[pos], [target](int cur) { return (int) ((unsigned) cur - target) >= 0; });
+    }
 
     std::vector<std::atomic<int>> counters;
     size_t capacity;
@@ -1716,6 +2577,163 @@ private:
 };
 
 
+// Writes evicted pages back to lower tiers in the background.
+// Foreground threads push the pids of evicted pages into a bounded lock-free
+// queue and a pool of writer threads drains it by calling Flush on each pid.
+// A foreground thread only blocks when the queue reaches the high-water mark.
+class EvictionWriteBackPool {
+public:
+    EvictionWriteBackPool(ConcurrentBufferManager *buf_mgr, size_t num_writers, size_t queue_capacity,
+                          size_t high_watermark);
+
+    ~EvictionWriteBackPool() { Stop(); }
+
+    void Start();
+
+    // Waits until the queue is drained and joins the writer threads.
+    void Stop();
+
+    void Enqueue(const std::vector<pid_t> &pids);
+
+    size_t QueueDepth() const { return queue.Size(); }
+
+private:
+    static void WriterProcess(EvictionWriteBackPool *pool);
+
+    ConcurrentBufferManager *buf_mgr;
+    const size_t num_writers;
+    const size_t high_watermark;
+    BoundedMPMCQueue<pid_t> queue;
+    std::vector<std::thread> writers;
+    std::atomic<bool> stopped{true};
+    std::atomic<int> num_idle_writers{0};
+    std::atomic<int> num_stalled_producers{0};
+    std::mutex writer_mtx;
+    std::condition_variable writer_cv;
+    std::mutex producer_mtx;
+    std::condition_variable producer_cv;
+};
+
+// Evicts the pages of one tier in the background, so that the free frames of the tier stay
+// between the low and high watermarks of its replacer. The slots of the evicted pages end up
+// on the free frame list of the replacer and the pages are written back through
+// ConcurrentBufferManager::FlushEvictedPages by the producer itself. Threads taking free
+// frames in ConcurrentReplacer::Add wake it up once the free frames drop below the low
+// watermark. A foreground thread only sweeps when the producer falls behind.
+class FreeFrameProducer {
+public:
+    FreeFrameProducer(ConcurrentBufferManager *buf_mgr, ConcurrentReplacer *replacer, size_t low_watermark,
+                      size_t high_watermark);
+
+    ~FreeFrameProducer() { Stop(); }
+
+    void Start();
+
+    void Stop();
+
+    // Evicted pages written back in one FlushEvictedPages call.
+    static constexpr size_t kFlushBatch = 32;
+    // The producer also checks the watermarks this often without being woken up.
+    static constexpr uint64_t kIdleCheckUs = 10000;
+
+private:
+    static void ProducerProcess(FreeFrameProducer *producer);
+
+    ConcurrentBufferManager *buf_mgr;
+    ConcurrentReplacer *replacer;
+    std::thread producer;
+    std::atomic<bool> stopped{true};
+};
+
+// Saves the resident set of a buffer manager every period, see
+// BufferPoolConfig::warm_restart_snapshot_path.
+class ResidentSetSnapshotter {
+public:
+    ResidentSetSnapshotter(ConcurrentBufferManager *buf_mgr, size_t period_ms)
+            : buf_mgr(buf_mgr), period(std::max(period_ms, (size_t) 1)) {}
+
+    ~ResidentSetSnapshotter() { Stop(); }
+
+    void Start();
+
+    void Stop();
+
+private:
+    static void SnapshotProcess(ResidentSetSnapshotter *snapshotter);
+
+    ConcurrentBufferManager *buf_mgr;
+    const std::chrono::milliseconds period;
+    std::thread snapshotter;
+    std::atomic<bool> stopped{true};
+    std::mutex stop_mtx;
+    std::condition_variable stop_cv;
+};
+
+// Tunes the page migration policy of a buffer manager while it runs, by simulated annealing
+// over Dr/Dw/Nr/Nw as in benchmark::SimulatedAnnealing. The cost of a policy is measured over
+// one period from the buffer manager's own Stats: the cycles spent moving pages between tiers
+// and stalled on eviction per buffer access, plus migration_tuner_nvm_write_cost per KB written
+// to NVM. Every round tries a neighbor of the accepted policy. A cheaper neighbor is accepted,
+// a costlier one with a probability that shrinks as the temperature cools, otherwise the
+// accepted policy is restored. A frozen tuner keeps the accepted policy and only measures it.
+class MigrationPolicyTuner {
+public:
+    MigrationPolicyTuner(ConcurrentBufferManager *buf_mgr, const BufferPoolConfig &config);
+
+    ~MigrationPolicyTuner() { Stop(); }
+
+    void Start();
+
+    void Stop();
+
+    void SetFrozen(bool frozen);
+
+    std::string ToString() const;
+
+    // Rounds with fewer buffer accesses are extended, too few samples to tell policies apart.
+    static constexpr int64_t kMinAccessesPerRound = 1000;
+
+private:
+    static void TunerProcess(MigrationPolicyTuner *tuner);
+
+    void Round();
+
+    // Cost of the policy in effect since the last sample, or a negative value if there
+    // was too little traffic to tell.
+    double SampleCost();
+
+    PageMigrationPolicy Neighbor(const PageMigrationPolicy &p);
+
+    ConcurrentBufferManager *buf_mgr;
+    const std::chrono::milliseconds period;
+    const double min_prob;
+    const double max_prob;
+    const double max_step;
+    const double nvm_write_cost;
+    std::mt19937 generator;
+
+    // Protects the tuning state below
+    mutable std::mutex mtx;
+    bool frozen;
+    bool exploring = false;
+    PageMigrationPolicy accepted;
+    PageMigrationPolicy candidate;
+    // Negative until the first sample
+    double accepted_cost = -1;
+    double temperature = 0.1;
+    int64_t rounds = 0;
+    int64_t accepted_moves = 0;
+    // Totals at the last sample
+    int64_t last_accesses = 0;
+    double last_cycles = 0;
+    double last_nvm_bytes = 0;
+
+    std::thread tuner;
+    std::atomic<bool> stopped{true};
+    std::mutex stop_mtx;
+    std::condition_variable stop_cv;
+};
+
 class ConcurrentBufferManager {
 public:
     ConcurrentBufferManager(SSDPageManager *ssd_page_manager, PageMigrationPolicy policy, BufferPoolConfig config);
@@ -1768,7 +2786,6 @@ public:
         PageType cur_type;
         ConcurrentBufferManager *mgr;
         bool accessed = false;
-        char * redo_buf = nullptr;
         char * undo_buf = nullptr;
         char * undo_origin = nullptr;
         size_t redo_undo_size = 0;
@@ -1815,6 +2832,29 @@ public:
         DistributedCounter<kBuckets> buf_gets;
         DistributedCounter<kBuckets> ssd_reads;
         DistributedCounter<kBuckets> ssd_writes;
+        DistributedCounter<kBuckets> async_evictions;
+        DistributedCounter<kBuckets> eviction_queue_stalls;
+        DistributedCounter<kBuckets> cycles_stalled_on_eviction_queue;
+        DistributedCounter<kBuckets> swizzled_hits;
+        DistributedCounter<kBuckets> overlapped_ssd_reads;
+        DistributedCounter<kBuckets> prefetched_pages;
+        // Pages of the saved resident set brought back by Init.
+        DistributedCounter<kBuckets> warm_restart_pages;
+        // NVM pages mapped back in place by Init, see BufferPoolConfig::enable_nvm_frame_recovery.
+        DistributedCounter<kBuckets> nvm_recovered_pages;
+        // Updates replayed and rolled back by LogRecovery in Init.
+        DistributedCounter<kBuckets> wal_redone_updates;
+        DistributedCounter<kBuckets> wal_undone_updates;
+        // Commits waited for, log flushes by FlushLog and commits that timed out, see WALCommitMode.
+        DistributedCounter<kBuckets> wal_commits;
+        DistributedCounter<kBuckets> wal_log_flushes;
+        DistributedCounter<kBuckets> wal_commit_timeouts;
+        // HyMem admission decisions on evicted DRAM pages that are not in NVM.
+        DistributedCounter<kBuckets> nvm_admissions;
+        DistributedCounter<kBuckets> nvm_admission_rejects;
+        // Hits on frames of another NUMA node than the one of the accessing thread.
+        DistributedCounter<kBuckets> dram_remote_accesses;
+        DistributedCounter<kBuckets> nvm_remote_accesses;
         ConcurrentBufferManager *buf_mgr;
 
         Stats(ConcurrentBufferManager *buf_mgr);
@@ -1830,8 +2870,27 @@ public:
 
     Status Get(const pid_t pid, PageAccessor &page_accessor, PageOPIntent intent = INTENT_READ);
 
+    // Pin `n` pages at once. The SSD reads of pages that are not resident in any tier are
+    // issued together before the pages are brought in one by one, so their latencies overlap.
+    // On failure, no page is left pinned and the contents of `out` are unspecified.
+    Status GetBatch(const pid_t *pids, size_t n, PageAccessor *out, PageOPIntent intent = INTENT_READ);
+
+    // Start reading the pages in `pids` that are not resident in any tier from SSD, without
+    // pinning them. The reads are kept per thread and picked up by the next Gets of the
+    // calling thread on those pages. Used by ReadAheadCursor.
+    void Prefetch(const pid_t *pids, size_t n);
+
     PageAccessor GetPageAccessorFromDesc(PageDesc *ph);
 
+    // Pointer swizzling for index structures.
+    // Pin the page swizzled into slot `pos` of the pinned page `parent` without consulting the mapping table.
+    // Fails if the slot is empty, holds a page other than `pid`, or the page is being evicted.
+    bool GetSwizzled(PageDesc *parent, size_t pos, pid_t pid, PageAccessor &page_accessor);
+
+    // Remember the pinned DRAM page `child` in slot `pos` of the pinned page `parent`,
+    // which has `num_slots` slots. The slot is cleared when `child` leaves DRAM.
+    void Swizzle(PageDesc *parent, size_t pos, size_t num_slots, PageDesc *child);
+
     Status Flush(const pid_t pid, bool forced = false, bool keep_in_buffer = false);
 
     Status Put(PageDesc *ph, bool dirtied);
@@ -1842,8 +2901,23 @@ public:
 
     void CleanPageReady();
 
+    // While the migration policy tuner runs, the policy set here is replaced in its next round.
     void SetPageMigrationPolicy(PageMigrationPolicy policy);
 
+    PageMigrationPolicy GetPageMigrationPolicy() const { return migration_policy; }
+
+    // Stop or resume the exploration of the migration policy tuner, if it is enabled.
+    void FreezeMigrationPolicyTuner(bool frozen);
+
+    // Change the capacity of `tier` while the buffer pool is in use, up to the maximum capacity
+    // in BufferPoolConfig. Shrinking evicts pages a page worth of bytes at a time and gives the
+    // storage of the freed NVM heap file pages back.
+    Status ResizeTier(BufferPoolTier tier, size_t new_cap_in_bytes);
+
+    // Write the pids resident in each tier, with their reference bits, to
+    // config.warm_restart_snapshot_path. The file is replaced atomically.
+    Status SaveResidentSet();
+
     std::string GetStatsString() const;
 
     Stats GetStats() const { return *stat; }
@@ -1854,6 +2928,15 @@ public:
 
     LogManager* GetLogManager() { return log_manager; }
 
+    // Write the pages back from the tiers the database does not survive a crash with: DRAM with
+    // `include_dram` or in NVM_SSD mode, NVM unless its frames are recovered in place. The pages stay
+    // where they are. Returns the number of NVM pages written.
+    size_t WriteBackVolatilePages(bool include_dram);
+
+    // The lsn up to which the updates of `pid` are in the page, from the frame header of an NVM page
+    // recovered in place, 0 if not known. kInvalidLSN if the page is no longer allocated.
+    lsn_t RecoveredPageLSN(const pid_t pid);
+
     void SetNVMSSDMode() { this->NVM_SSD_MODE = true; }
     bool IsNVMSSDMode() { return this->NVM_SSD_MODE; }
 
@@ -1871,12 +2954,134 @@ private:
 
     Status PromoteMiniPage(PageDesc *dram_ph, std::vector<pid_t> &evicted_pids);
 
+    // Write back the evicted pages, either inline or through the eviction write-back pool.
+    void FlushEvictedPages(std::vector<pid_t> &evicted_pids);
+
+    // Issue asynchronous SSD reads for the pages in `pids` that are not resident in any tier.
+    // The results are kept per thread and consumed by ReadSSDPage. When the thread has too
+    // many of them, the oldest ones are dropped. Returns the number of reads issued.
+    size_t StageSSDReads(const pid_t *pids, size_t n);
+
+    Status InitFrameArenas();
+
+    // Map the pages left in the NVM heap files by the last run back into the NVM buffer pool.
+    Status RecoverNVMFrames();
+
+    // Upkeep of the frame header of an NVM page, no-ops unless config.enable_nvm_frame_recovery.
+    // A page is published once its payload is in place.
+    void PublishNVMFrame(PageDesc *nvm_ph, bool dirty);
+
+    void SetNVMFrameDirty(PageDesc *nvm_ph, bool dirty);
+
+    void AdvanceNVMFrameLSN(PageDesc *nvm_ph, lsn_t lsn);
+
+    void ClearNVMFrame(Page *nvm_page);
+
+    // Charge the NVM emulator, if any, for reading or writing `bytes` of NVM pages.
+    void EmulateNVMRead(size_t bytes) {
+        if (nvm_emulator)
+            nvm_emulator->Read(bytes);
+    }
+
+    void EmulateNVMWrite(size_t bytes) {
+        if (nvm_emulator)
+            nvm_emulator->Write(bytes);
+    }
+
+    void TraceAccess(AccessTraceOp op, pid_t pid, PageOPIntent intent, uint32_t off, size_t size,
+                     AccessTraceTier tier) {
+        if (access_trace_recorder)
+            access_trace_recorder->Record(op, pid, intent, off, size, tier);
+    }
+
+    // The heap file allocator of NVM frame `p`, nullptr if it has no frame headers.
+    NVMPageAllocator *NVMFrameAllocatorOf(const void *p) const;
+
+    // Bring the pages saved by SaveResidentSet back into their tiers, NVM first, then DRAM,
+    // referenced pages first and no more than fit. A missing or damaged file is a cold start.
+    Status LoadResidentSet();
+
+    // Read `pids` in under `policy` with config.warm_restart_threads threads,
+    // each prefetching batches of kWarmUpBatch pages.
+    void WarmUp(const std::vector<pid_t> &pids, const PageMigrationPolicy &policy, PageOPIntent intent);
+
+    static constexpr size_t kWarmUpBatch = 32;
+
+    // One arena per NUMA node, each with its share of the frames of `classes`.
+    Status InitNodeFrameArenas(std::vector<FrameArena *> &arenas, const std::vector<FrameArena::SizeClass> &classes);
+
+    static void *AllocateFrame(const std::vector<FrameArena *> &arenas, size_t size);
+
+    static void FreeFrame(const std::vector<FrameArena *> &arenas, void *p);
+
+    // NUMA node of a frame of the arenas or the NVM heap files, -1 for frames from the heap.
+    int FrameNode(const void *frame) const;
+
+    // Count a hit on `ph` as remote if its frame is on another node than the calling thread.
+    void CountRemoteAccess(const PageDesc *ph, DistributedCounter<Stats::kBuckets> &remote_accesses) {
+        if (numa_nodes > 1) {
+            int node = FrameNode(ph->page);
+            if (node >= 0 && node != Numa::CurrentNode() % (int) numa_nodes)
+                remote_accesses++;
+        }
+    }
+
+    // Read a page from SSD, using the staged read of this thread if it is still up to date.
+    Status ReadSSDPage(pid_t pid, Page *p);
+
+    Status WriteSSDPage(pid_t pid, const Page *p);
+
+    // Make the log records written so far durable before a page goes where it outlives a crash,
+    // LogRecovery has to find the updates in it to undo them.
+    void FlushLogForWriteBack();
+
+    std::atomic<uint64_t> &SSDWriteSeqOf(pid_t pid) {
+        return ssd_write_seqs[PidHasher()(pid) & (kNumSSDWriteSeqs - 1)];
+    }
+
+    friend class EvictionWriteBackPool;
+    friend class MigrationPolicyTuner;
+    friend class LogRecovery;
+    friend class LogManager;
+    friend class FreeFrameProducer;
+
+    // Clear the slot pointing to `ph` and the slots of its own children. Called before `ph` is freed.
+    void Unswizzle(PageDesc *ph);
+
+    // Clear `slot` if it still points to `child`.
+    void UnswizzleSlot(std::atomic<PageDesc *> &slot, PageDesc *child);
+
+    std::mutex &SwizzleLatchOf(PageDesc *ph) {
+        return swizzle_latches[(((uintptr_t) ph) / sizeof(PageDesc)) & (kNumSwizzleLatches - 1)].mtx;
+    }
+
+    bool MappingTableFind(const pid_t pid, SharedPageDesc *&sph) {
+        return optimistic_mapping_table ? optimistic_mapping_table->Find(pid, sph) : mapping_table.Find(pid, sph);
+    }
+
+    bool MappingTableInsert(const pid_t pid, SharedPageDesc *sph) {
+        return optimistic_mapping_table ? optimistic_mapping_table->Insert(pid, sph) : mapping_table.Insert(pid, sph);
+    }
+
+    bool MappingTableErase(const pid_t pid) {
+        return optimistic_mapping_table ? optimistic_mapping_table->Erase(pid) : mapping_table.Erase(pid);
+    }
+
+    void MappingTableIterate(std::function<void(const pid_t &pid, SharedPageDesc *const &sph)> processor) {
+        if (optimistic_mapping_table)
+            optimistic_mapping_table->Iterate(processor);
+        else
+            mapping_table.Iterate(processor);
+    }
+
     SSDPageManager *ssd_page_manager;
     PageMigrationPolicy migration_policy;
     BufferPoolConfig config;
+    // 1 unless config.enable_numa is set.
+    const size_t numa_nodes;
     bool NVM_SSD_MODE = false;
-    ConcurrentClockReplacer dram_buf_pool_replacer;
-    ConcurrentClockReplacer nvm_buf_pool_replacer;
+    std::unique_ptr<ConcurrentReplacer> dram_buf_pool_replacer;
+    std::unique_ptr<ConcurrentReplacer> nvm_buf_pool_replacer;
 
     // To reduce allocation cost, we designed concurrent leaky buffers to cache the allocated pages.
     LeakyBuffer<Page> dram_page_leaky_buffer;
@@ -1895,10 +3100,41 @@ private:
     //tbb::concurrent_hash_map<pid_t, SharedPageDesc *, PidHashCompare<pid_t>> mapping_table;
     //CuckooMap<pid_t, SharedPageDesc*, PidHasher, PidComparator> mapping_table;
     concurrent_bytell_hash_map<pid_t, SharedPageDesc *, PidHasher> mapping_table;
-    AdmissionSet admission_set;
-    NVMPageAllocator * nvm_page_allocator;
+    // Replaces mapping_table when config.enable_optimistic_mapping_table is set.
+    OptimisticHashMap<pid_t, SharedPageDesc *, PidHasher> *optimistic_mapping_table;
+    // Decides which evicted DRAM pages enter NVM when config.enable_hymem is set.
+    AdmissionFilter admission_filter;
+    // One per NUMA node, see BufferPoolConfig::enable_numa.
+    std::vector<NVMPageAllocator *> nvm_page_allocators;
+    // Set when config.enable_frame_arena is, one per NUMA node.
+    std::vector<FrameArena *> dram_frame_arenas;
+    std::vector<FrameArena *> nvm_frame_arenas;
     LogManager * log_manager;
     MVCCPurger * mvcc_purger;
+    EvictionWriteBackPool * eviction_write_back_pool;
+    MigrationPolicyTuner * migration_policy_tuner;
+    FreeFrameProducer * dram_frame_producer;
+    FreeFrameProducer * nvm_frame_producer;
+    // Serializes ResizeTier.
+    std::mutex resize_mtx;
+    ResidentSetSnapshotter * resident_set_snapshotter;
+    // Serializes SaveResidentSet.
+    std::mutex snapshot_mtx;
+    // Set while shutting down with config.enable_nvm_frame_recovery. The NVM pages freed then keep
+    // their headers, for the next run to find them.
+    bool retain_nvm_frames = false;
+    // Set when config.enable_nvm_emulation is.
+    NVMEmulator * nvm_emulator;
+    // Set when config.access_trace_path is.
+    AccessTraceRecorder * access_trace_recorder;
+    // How long FillDRAMPage waits for the direct references to an NVM page to drop before giving up.
+    constexpr static uint64_t kMaxNVMUnpinWaitUs = 5000;
+    // Seqlock-style counters bumped around every SSD page write.
+    // A staged read is discarded if the counter of its page moved since the read was issued.
+    constexpr static int kNumSSDWriteSeqs = 4096;
+    std::atomic<uint64_t> ssd_write_seqs[kNumSSDWriteSeqs];
+    constexpr static int kNumSwizzleLatches = 256;
+    PaddedMutex swizzle_latches[kNumSwizzleLatches];
     static RefManager page_ref_manager;
     static RefManager shared_pd_ref_manager;
     static thread_local ThreadRefHolder page_payload_ref;
@@ -1907,6 +3143,47 @@ private:
     std::mutex page_cleaner_signal_cv_mtx;
     Stats *stat;
 };
+
+// Read-ahead state of one scan. The scan reports every page it moves to through OnAccess.
+// Pages announced with Hint, such as the next leaves under the parent of the current one,
+// are prefetched in order as the scan reaches them. Without hints, prefetching starts
+// once the scan has moved twice by one page in the same direction, and covers the pages
+// that follow in that direction. Each time the scan has used up half of the prefetched
+// pages, the next window is issued and the window doubles, from kMinWindow up to
+// kMaxWindow, so faster consumers get deeper read-ahead. Any other access resets it.
+// A cursor does nothing unless BufferPoolConfig::enable_read_ahead is set.
+class ReadAheadCursor {
+public:
+    explicit ReadAheadCursor(ConcurrentBufferManager *mgr) :
+            mgr(mgr), enabled(mgr->GetConfig().enable_read_ahead) {}
+
+    bool Enabled() const { return enabled; }
+
+    // Replace the hints with `pids`, the pages the scan is expected to access next, in order.
+    void Hint(const pid_t *pids, size_t n);
+
+    void OnAccess(pid_t pid);
+
+    static constexpr size_t kMinWindow = 4;
+    static constexpr size_t kMaxWindow = 32;
+
+private:
+    void Reset();
+
+    ConcurrentBufferManager *const mgr;
+    const bool enabled;
+    std::vector<pid_t> hints;
+    // hints[0, next_hint) have been accessed and hints[0, hints_issued) have been prefetched.
+    size_t next_hint = 0;
+    size_t hints_issued = 0;
+    pid_t last_pid = kInvalidPID;
+    int64_t stride = 0;
+    // The next page to prefetch in the current sequential run, kInvalidPID when the run
+    // has not started or reached the end of its heap file.
+    pid_t next_pid = kInvalidPID;
+    bool run_started = false;
+    size_t window = kMinWindow;
+};
 }
 
 #endif //DPTREE_BUF_MGR_H
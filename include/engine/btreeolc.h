@@ -454,7 +454,10 @@ public:
     static_assert(sizeof(BTreeLeafNode) == sizeof(Page), "sizeof(BTreeLeafNode) != sizeof(Page)");
     //static_assert(sizeof(BTreeInnerNode) == sizeof(Page), "sizeof(BTreeInnerNode) != sizeof(Page)");
 
-    BTree(ConcurrentBufferManager *mgr) : mgr(mgr), root_node_desc(nullptr) {}
+    // With `enable_swizzling`, traversals reach resident children through pointers cached
+    // next to the inner nodes instead of looking up their pids in the buffer manager.
+    BTree(ConcurrentBufferManager *mgr, bool enable_swizzling = false) : mgr(mgr), root_node_desc(nullptr),
+                                                                         enable_swizzling(enable_swizzling) {}
 
     Status Init(pid_t &root_pid) {
         if (root_pid == kInvalidPID) {
@@ -483,6 +486,11 @@ public:
     }
 
 
+    // The root moves up on splits, reopen the tree with this pid rather than the one Init returned.
+    pid_t GetRootPid() const {
+        return root_node_desc.load()->pid;
+    }
+
     ~BTree() {
         mgr->Put(root_node_desc.load());
         root_node_desc.store(nullptr);
@@ -635,7 +643,7 @@ public:
                     exit(1);
                 }
                 node_accessor.FinishAccess();
-                Status s = mgr->Get(current_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, current_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -808,7 +816,7 @@ public:
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
                 node_accessor.FinishAccess();
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1085,7 +1093,7 @@ public:
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
                 node_accessor.FinishAccess();
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 stack.push_back(BTreeStackElement{node_desc, (int)pos, versionNode});
@@ -1200,7 +1208,7 @@ public:
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
                 node_accessor.FinishAccess();
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
 
@@ -1243,6 +1251,18 @@ public:
     }
 
 
+    // Collect the pids of the leaves holding `keys` without reading the leaves themselves,
+    // so that the caller can bring them in with one ConcurrentBufferManager::GetBatch.
+    // The result is only a hint: keys whose traversal races with a structural change are skipped.
+    void CollectLeafPids(const Key *keys, size_t n, std::vector<pid_t> &leaf_pids) {
+        int inner_levels = -1;
+        for (size_t i = 0; i < n; ++i) {
+            pid_t leaf_pid = kInvalidPID;
+            if (FindLeafPid(keys[i], inner_levels, leaf_pid))
+                leaf_pids.push_back(leaf_pid);
+        }
+    }
+
     bool Lookup(Key k, std::function<BTreeOPResult(const Value &)> processor) {
         int restartCount = 0;
         restart:
@@ -1292,7 +1312,7 @@ public:
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
                 node_accessor.FinishAccess();
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1348,6 +1368,7 @@ public:
             Yield(restartCount);
         bool needRestart = false;
 
+        ReadAheadCursor read_ahead(mgr);
         {
             std::vector<PageDesc *> descs;
             DeferCode c([&descs, this]() {
@@ -1390,7 +1411,8 @@ public:
                 auto pos = inner->lowerBound(start_key, node_accessor, node_base);
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                HintRightSiblings(read_ahead, inner, pos, node_base, node_accessor);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1440,6 +1462,7 @@ public:
                 descs.clear();
                 leaf_desc = nullptr;
                 while (res == BTreeOPResult::CONTINUE_SCAN && next_leaf_pid != kInvalidPID) {
+                    read_ahead.OnAccess(next_leaf_pid);
                     Status s = mgr->Get(next_leaf_pid, node_accessor,
                                         ConcurrentBufferManager::PageOPIntent::INTENT_READ);
                     assert(s.ok());
@@ -1522,7 +1545,7 @@ public:
                 auto pos = inner->lowerBound(search_key, node_accessor, node_base);
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1580,6 +1603,7 @@ public:
             Yield(restartCount);
         bool needRestart = false;
 
+        ReadAheadCursor read_ahead(mgr);
         {
             std::vector<PageDesc *> descs;
             DeferCode c([&descs, this]() {
@@ -1622,7 +1646,8 @@ public:
                 auto pos = inner->lowerBound(start_key, node_accessor, node_base);
                 pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
                 assert(child_pid != kInvalidPID);
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                HintRightSiblings(read_ahead, inner, pos, node_base, node_accessor);
+                Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1688,6 +1713,7 @@ public:
                 descs.clear();
                 leaf_desc = nullptr;
                 while (exit == false && next_leaf_pid != kInvalidPID) {
+                    read_ahead.OnAccess(next_leaf_pid);
                     Status s = mgr->Get(next_leaf_pid, node_accessor,
                                         ConcurrentBufferManager::PageOPIntent::INTENT_READ);
                     assert(s.ok());
@@ -1811,7 +1837,7 @@ public:
 
                 pid_t child_pid = inner->GetKeyValue(0, node_accessor).second;
                 assert(child_pid != kInvalidPID);
-                Status s = mgr->Get(child_pid, node_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+                Status s = GetChild(inner_node_desc, 0, child_pid, node_accessor);
                 assert(s.ok());
                 node_desc = node_accessor.GetPageDesc();
                 descs.push_back(node_desc);
@@ -1874,8 +1900,89 @@ public:
 
 
 private:
+    // Descend `inner_levels` inner nodes towards `k` and return the child pid found in the last one.
+    // If `inner_levels` is negative, descend all the way to the leaf and record the number of inner levels.
+    bool FindLeafPid(const Key &k, int &inner_levels, pid_t &leaf_pid) {
+        std::vector<PageDesc *> descs;
+        DeferCode c([&descs, this]() {
+            for (int i = 0; i < descs.size(); ++i) {
+                mgr->Put(descs[i]);
+            }
+        });
+        bool needRestart = false;
+        auto root_pd = root_node_desc.load();
+        PageDesc *node_desc = root_pd;
+        uint64_t versionNode = node_desc->readLockOrRestart(needRestart);
+        if (needRestart || (node_desc != root_node_desc))
+            return false;
+
+        PageAccessor node_accessor = mgr->GetPageAccessorFromDesc(root_pd);
+        NodeBase node_base = GetNodeBase(node_accessor);
+        int level = 0;
+        while (node_base.type == InnerNode) {
+            auto inner_node_desc = node_desc;
+            auto inner = reinterpret_cast<BTreeInnerNode *>(node_desc->page);
+            auto pos = inner->lowerBound(k, node_accessor, node_base);
+            pid_t child_pid = inner->GetKeyValue(pos, node_accessor).second;
+            node_accessor.FinishAccess();
+            inner_node_desc->checkOrRestart(versionNode, needRestart);
+            if (needRestart)
+                return false;
+            if (++level == inner_levels) {
+                leaf_pid = child_pid;
+                return true;
+            }
+            Status s = GetChild(inner_node_desc, pos, child_pid, node_accessor);
+            if (!s.ok())
+                return false;
+            node_desc = node_accessor.GetPageDesc();
+            descs.push_back(node_desc);
+            versionNode = node_desc->readLockOrRestart(needRestart);
+            if (needRestart)
+                return false;
+            node_base = GetNodeBase(node_accessor);
+            node_accessor.FinishAccess();
+        }
+        node_desc->checkOrRestart(versionNode, needRestart);
+        if (needRestart || (inner_levels >= 0 && level != inner_levels))
+            return false;
+        inner_levels = level;
+        leaf_pid = node_desc->pid;
+        return true;
+    }
+
+    // Pin the child `child_pid` found at slot `pos` of the pinned inner node `inner_node_desc`.
+    Status GetChild(PageDesc *inner_node_desc, unsigned pos, pid_t child_pid, PageAccessor &child_accessor) {
+        if (enable_swizzling == false)
+            return mgr->Get(child_pid, child_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+        if (mgr->GetSwizzled(inner_node_desc, pos, child_pid, child_accessor))
+            return Status::OK();
+        Status s = mgr->Get(child_pid, child_accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+        if (s.ok())
+            mgr->Swizzle(inner_node_desc, pos, BTreeInnerNode::kMaxEntries, child_accessor.GetPageDesc());
+        return s;
+    }
+
+    // Hint the children of `inner` to the right of slot `pos`, the pages a scan descending
+    // through `pos` visits next if they are leaves. The node is read optimistically, the
+    // hints can be stale but are only used for prefetching.
+    void HintRightSiblings(ReadAheadCursor &read_ahead, BTreeInnerNode *inner, unsigned pos,
+                           const NodeBase &node_base, PageAccessor &accessor) {
+        if (read_ahead.Enabled() == false)
+            return;
+        unsigned end = std::min<unsigned>(node_base.count + 1, BTreeInnerNode::kMaxEntries);
+        if (pos + 1 >= end)
+            return;
+        auto kvs = inner->GetKeyValues(pos + 1, end - pos - 1, accessor);
+        pid_t pids[BTreeInnerNode::kMaxEntries];
+        for (unsigned i = 0; i < end - pos - 1; ++i)
+            pids[i] = kvs[i].second;
+        read_ahead.Hint(pids, end - pos - 1);
+    }
+
     ConcurrentBufferManager *mgr;
     std::atomic<PageDesc *> root_node_desc;
+    const bool enable_swizzling;
 };
 
 }
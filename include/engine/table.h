@@ -6,6 +6,7 @@
 #define SPITFIRE_TABLE_H
 
 #include "buf/buf_mgr.h"
+#include <algorithm>
 #include "engine/btreeolc.h"
 
 namespace spitfire {
@@ -53,6 +54,23 @@ public:
         return btree.GetRootPageId();
     }
 
+    // Bring the leaves holding `keys` into the buffer pool with one batched request,
+    // overlapping their SSD reads. The pages are unpinned before returning: holding
+    // direct NVM references would stall later accesses to the same pages through DRAM.
+    void PrefetchLeaves(const std::vector<Key> &keys) {
+        std::vector<pid_t> pids;
+        btree.CollectLeafPids(keys.data(), keys.size(), pids);
+        std::sort(pids.begin(), pids.end());
+        pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+        std::vector<ConcurrentBufferManager::PageAccessor> accessors(pids.size(),
+                                                                     ConcurrentBufferManager::PageAccessor(mgr));
+        Status s = mgr->GetBatch(pids.data(), pids.size(), accessors.data());
+        if (!s.ok())
+            return;
+        for (auto &accessor : accessors)
+            mgr->Put(accessor.GetPageDesc());
+    }
+
     BTreeOPResult
     Insert(const T &tuple, std::function<bool(const void *)> predicate = [](const void *) { return false; },
            bool upsert = true) {
@@ -371,8 +389,10 @@ public:
         }
 
         bool early_exit = false;
+        ReadAheadCursor read_ahead(mgr);
 
         while (cur_page_pid != kInvalidPID) {
+            read_ahead.OnAccess(cur_page_pid);
             s = mgr->Get(cur_page_pid, cur_page_desc, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
             assert(s.ok());
             cur_page_desc->LatchShared();
@@ -430,8 +450,10 @@ public:
         }
 
         bool early_exit = false;
+        ReadAheadCursor read_ahead(mgr);
 
         while (cur_page_pid != kInvalidPID) {
+            read_ahead.OnAccess(cur_page_pid);
             s = mgr->Get(cur_page_pid, cur_page_desc, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
             assert(s.ok());
             cur_page_desc->LatchShared();
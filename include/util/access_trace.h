@@ -0,0 +1,160 @@
+//
+// Created by zxjcarrot on 2020-06-21.
+//
+
+#ifndef SPITFIRE_ACCESS_TRACE_H
+#define SPITFIRE_ACCESS_TRACE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "util/status.h"
+
+namespace spitfire {
+
+enum class AccessTraceOp : uint8_t {
+    // A page looked up by ConcurrentBufferManager::Get.
+    GET = 0,
+    // A range of a page prepared by PageAccessor::PrepareForAccess.
+    ACCESS = 1
+};
+
+// Where the bytes of an access came from.
+enum class AccessTraceTier : uint8_t {
+    DRAM = 0,
+    NVM = 1,
+    SSD = 2,
+    // A DRAM frame mapped by Get, its bytes are filled by the accesses that follow.
+    UNFILLED = 3
+};
+
+struct AccessTraceRecord {
+    // Since the start of the recorder.
+    uint64_t time_ns;
+    uint64_t pid;
+    uint16_t offset;
+    uint16_t size;
+    uint8_t op;
+    uint8_t intent;
+    uint8_t tier;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(AccessTraceRecord) == 24, "AccessTraceRecord is written as is");
+
+// Records page accesses to a file for offline analysis, see tier_sim.
+// Every thread appends to a buffer of its own, with no shared state on the way. Full buffers
+// are handed to a writer thread, which appends them to the file and recycles them. When the
+// writer falls more than max_pending_buffers behind, the records of the full buffer are dropped
+// and counted instead of holding up the thread. The records of a file are in time order per thread,
+// Read merges them.
+class AccessTraceRecorder {
+public:
+    static constexpr size_t kBufferRecords = 4096;
+
+    // Accesses are at most `page_size` bytes, which AccessTraceRecord::size has to hold.
+    AccessTraceRecorder(const std::string &path, size_t page_size, size_t max_pending_buffers);
+
+    ~AccessTraceRecorder();
+
+    AccessTraceRecorder(const AccessTraceRecorder &) = delete;
+
+    AccessTraceRecorder &operator=(const AccessTraceRecorder &) = delete;
+
+    // Create the file and start the writer.
+    Status Start();
+
+    // Write out what is buffered and close the file. Nothing is recorded afterwards.
+    void Stop();
+
+    void Record(AccessTraceOp op, uint64_t pid, uint8_t intent, uint32_t offset, size_t size, AccessTraceTier tier) {
+        if (stopped.load(std::memory_order_relaxed))
+            return;
+        Channel *channel = ThreadChannel();
+        AccessTraceRecord &r = channel->buffer->records[channel->buffer->n++];
+        r.time_ns = NowNs() - start_ns;
+        r.pid = pid;
+        r.offset = (uint16_t) offset;
+        r.size = (uint16_t) size;
+        r.op = (uint8_t) op;
+        r.intent = intent;
+        r.tier = (uint8_t) tier;
+        r.reserved = 0;
+        if (channel->buffer->n == kBufferRecords)
+            Submit(channel);
+    }
+
+    uint64_t RecordsWritten() const { return records_written.load(); }
+
+    uint64_t RecordsDropped() const { return records_dropped.load(); }
+
+    std::string ToString() const;
+
+    // All the records of the trace at `path`, in time order, and the page size it was recorded with.
+    static Status Read(const std::string &path, std::vector<AccessTraceRecord> &records, size_t *page_size = nullptr);
+
+private:
+    struct Buffer {
+        AccessTraceRecord records[kBufferRecords];
+        size_t n = 0;
+    };
+
+    // The buffer a thread appends to, owned by the recorder so that it outlives the thread.
+    struct Channel {
+        Buffer *buffer;
+    };
+
+    struct FileHeader {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t page_size;
+        // Wall clock time of time_ns 0.
+        uint64_t start_unix_ns;
+    };
+
+    static constexpr uint64_t kMagic = 0x3145434152545053ULL; // "SPTRACE1"
+
+    static uint64_t NowNs();
+
+    Channel *ThreadChannel();
+
+    // Queue the full buffer of `channel` for the writer and give the channel an empty one.
+    void Submit(Channel *channel);
+
+    Buffer *NewBuffer();
+
+    void WriteBuffer(Buffer *buffer);
+
+    static void WriterProcess(AccessTraceRecorder *recorder);
+
+    const std::string path;
+    const size_t page_size;
+    const size_t max_pending_buffers;
+    // Tells the channels of this recorder from those of the recorders a thread used before.
+    const uint64_t id;
+    uint64_t start_ns = 0;
+    int fd = -1;
+    uint64_t file_offset = 0;
+    std::atomic<bool> stopped{true};
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::deque<Buffer *> pending;
+    std::vector<Buffer *> free_buffers;
+    std::atomic<uint64_t> records_written{0};
+    std::atomic<uint64_t> records_dropped{0};
+
+    static std::atomic<uint64_t> next_id;
+};
+
+}
+#endif //SPITFIRE_ACCESS_TRACE_H
@@ -125,22 +125,16 @@ struct AtomicBitmap {
         ClearAll();
     }
 
-    int TakeFirstNotSet(int start_bit) {
-        int num = data.size();
+    // Sets the first clear bit at or after `start_bit`, wrapping around, and returns its position.
+    // Only the first `end_bit` bits are searched, a multiple of 64 or -1 for all of them.
+    // Returns -1 if they are all set.
+    int TakeFirstNotSet(int start_bit, int end_bit = -1) {
+        int num = end_bit < 0 ? data.size() : end_bit / 64;
         int start_di = start_bit / 64;
-        for (int i = start_di; i < num; ++i) {
-            do {
-                auto d = data[i].load();
-                if (~d == 0)
-                    break; // Try next uint64_t
-                int pos = __builtin_ctzll(~d);
-                auto new_d = d | (1ULL << pos);
-                if (data[i].compare_exchange_strong(d, new_d) == true) {
-                    return i * 64 + pos;
-                }
-            } while (true);
-        }
-        for (int i = 0; i < start_di; ++i) {
+        if (start_di >= num)
+            start_di = 0;
+        for (int j = 0; j < num; ++j) {
+            int i = start_di + j < num ? start_di + j : start_di + j - num;
             do {
                 auto d = data[i].load();
                 if (~d == 0)
@@ -155,6 +149,12 @@ struct AtomicBitmap {
         return -1;
     }
 
+    // Returns false if the bit was set already.
+    bool TrySet(size_t p) {
+        uint64_t bit = 1ULL << (p % 64);
+        return (data[p / 64].fetch_or(bit) & bit) == 0;
+    }
+
     uint32_t BitOffToByteOff(uint32_t bit_off) {
         return bit_off / 8;
     }
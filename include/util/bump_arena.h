@@ -0,0 +1,97 @@
+//
+// Created by zxjcarrot on 2020-06-23.
+//
+
+#ifndef SPITFIRE_BUMP_ARENA_H
+#define SPITFIRE_BUMP_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace spitfire {
+
+// Memory for short-lived objects of one thread, such as the undo images of the writes
+// to a page. Allocations are carved out of chunks one after the other and are not freed
+// one by one: Rewind makes all the memory reusable at once and keeps the chunks, Trim also
+// returns all but the first chunk to the system. An allocation larger than a chunk gets
+// a chunk of its own. Not thread-safe.
+class BumpArena {
+public:
+    // That of operator new[], which the chunks come from.
+    static constexpr size_t kAlignment = alignof(std::max_align_t);
+
+    explicit BumpArena(size_t chunk_size = 64 * 1024) : chunk_size(chunk_size) {}
+
+    ~BumpArena() {
+        for (auto &chunk : chunks)
+            delete[] chunk.data;
+    }
+
+    BumpArena(const BumpArena &) = delete;
+
+    BumpArena &operator=(const BumpArena &) = delete;
+
+    char *Allocate(size_t size) {
+        size = (size + kAlignment - 1) / kAlignment * kAlignment;
+        while (cur < chunks.size()) {
+            Chunk &chunk = chunks[cur];
+            if (chunk.size - pos >= size) {
+                char *p = chunk.data + pos;
+                pos += size;
+                bytes_allocated += size;
+                return p;
+            }
+            ++cur;
+            pos = 0;
+        }
+        size_t new_chunk_size = std::max(size, chunk_size);
+        chunks.push_back({new char[new_chunk_size], new_chunk_size});
+        pos = size;
+        bytes_allocated += size;
+        return chunks.back().data;
+    }
+
+    // Everything allocated so far is free for reuse.
+    void Rewind() {
+        cur = 0;
+        pos = 0;
+        bytes_allocated = 0;
+    }
+
+    // Rewind, and keep at most the first chunk.
+    void Trim() {
+        Rewind();
+        for (size_t i = 1; i < chunks.size(); ++i)
+            delete[] chunks[i].data;
+        if (chunks.size() > 1)
+            chunks.resize(1);
+    }
+
+    // Bytes handed out since the last Rewind.
+    size_t BytesAllocated() const { return bytes_allocated; }
+
+    size_t BytesReserved() const {
+        size_t bytes = 0;
+        for (auto &chunk : chunks)
+            bytes += chunk.size;
+        return bytes;
+    }
+
+private:
+    struct Chunk {
+        char *data;
+        size_t size;
+    };
+
+    const size_t chunk_size;
+    std::vector<Chunk> chunks;
+    // The chunk allocations come from and the offset of the free bytes in it.
+    size_t cur = 0;
+    size_t pos = 0;
+    size_t bytes_allocated = 0;
+};
+
+}
+#endif //SPITFIRE_BUMP_ARENA_H
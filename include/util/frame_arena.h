@@ -0,0 +1,98 @@
+//
+// Created by zxjcarrot on 2020-06-14.
+//
+
+#ifndef SPITFIRE_FRAME_ARENA_H
+#define SPITFIRE_FRAME_ARENA_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "util/status.h"
+
+namespace spitfire {
+
+// Preallocated memory for buffer pool frames.
+// The arena is a single mapping, backed by 1GB or 2MB hugepages when the system has
+// them reserved, and by regular pages with transparent hugepages advised otherwise.
+// It is split into size classes of fixed-size frames, e.g. full pages and mini pages.
+// Each class has a global free list and kNumCaches small free-frame caches that
+// threads pick by their thread id, so most allocations and deallocations touch no
+// shared state. Allocate returns nullptr when a class runs out of frames, callers
+// fall back to the heap and use Owns to route the frame back on deallocation.
+// An arena created for a NUMA node prefers the memory of that node for its mapping.
+class FrameArena {
+public:
+    struct SizeClass {
+        size_t frame_size;
+        size_t num_frames;
+    };
+
+    explicit FrameArena(const std::vector<SizeClass> &classes, int node = -1);
+
+    ~FrameArena();
+
+    FrameArena(const FrameArena &) = delete;
+
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    Status Init();
+
+    // A frame of the smallest class that fits `size` bytes, nullptr if there is none left.
+    void *Allocate(size_t size);
+
+    void Deallocate(void *p);
+
+    bool Owns(const void *p) const {
+        return (const char *) p >= base && (const char *) p < base + mapped_size;
+    }
+
+    void *Base() { return base; }
+
+    size_t Size() const { return mapped_size; }
+
+    // -1 if the arena is not bound to a node.
+    int Node() const { return node; }
+
+    // Bytes of frames handed out and not yet returned.
+    size_t BytesInUse() const { return bytes_in_use.load(std::memory_order_relaxed); }
+
+    std::string ToString() const;
+
+    static constexpr size_t kNumCaches = 32;
+    static constexpr size_t kCacheCapacity = 64;
+
+private:
+    struct alignas(64) FrameCache {
+        std::mutex mtx;
+        size_t count = 0;
+        void *frames[kCacheCapacity];
+    };
+
+    struct Class {
+        size_t frame_size;
+        size_t num_frames;
+        size_t cache_capacity;
+        // Offset of the first frame from the base of the arena.
+        size_t offset;
+        std::mutex mtx;
+        std::vector<void *> free_frames;
+        FrameCache caches[kNumCaches];
+    };
+
+    Class &ClassOf(const void *p);
+
+    FrameCache &CacheOf(Class &c);
+
+    std::vector<std::unique_ptr<Class>> classes;
+    char *base = nullptr;
+    size_t mapped_size = 0;
+    std::string backing;
+    int node;
+    std::atomic<size_t> bytes_in_use{0};
+};
+
+}
+#endif //SPITFIRE_FRAME_ARENA_H
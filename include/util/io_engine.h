@@ -0,0 +1,114 @@
+//
+// Created by zxjcarrot on 2020-06-10.
+//
+
+#ifndef SPITFIRE_IO_ENGINE_H
+#define SPITFIRE_IO_ENGINE_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "status.h"
+
+namespace spitfire {
+
+enum class IOEngineType {
+    // Synchronous pread/pwrite, one system call per request.
+    POSIX,
+    // Linux io_uring. Requests are batched into the submission queue and reaped by a completion thread.
+    IO_URING
+};
+
+class IOEngine;
+
+// Completion handle of an asynchronous request.
+class IOCompletion {
+public:
+    IOCompletion(IOEngine *engine, int fd, void *buf, size_t size, off_t off, bool write) :
+            engine(engine), fd(fd), buf(buf), size(size), off(off), write(write) {}
+
+    bool Done() const { return done.load(std::memory_order_acquire); }
+
+    // Block until the request completes. Submits the request first if it is still queued.
+    Status Wait();
+
+private:
+    friend class PosixIOEngine;
+    friend class IOUringEngine;
+
+    void Complete(const Status &s);
+
+    IOEngine *const engine;
+    const int fd;
+    void *const buf;
+    const size_t size;
+    const off_t off;
+    const bool write;
+    // Bytes transferred so far. Short transfers are resubmitted for the rest.
+    size_t transferred = 0;
+    Status status;
+    std::atomic<bool> done{false};
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+typedef std::shared_ptr<IOCompletion> IOHandle;
+
+// Executes page-sized reads and writes against file descriptors.
+// Prepared requests are queued and handed to the device by Submit() or by the
+// first Wait() on any of them, so callers can batch a group of requests.
+class IOEngine {
+public:
+    virtual ~IOEngine() {}
+
+    virtual Status Init() = 0;
+
+    virtual IOHandle PrepareRead(int fd, void *buf, size_t size, off_t off) = 0;
+
+    virtual IOHandle PrepareWrite(int fd, const void *buf, size_t size, off_t off) = 0;
+
+    virtual Status Submit() = 0;
+
+    // Synchronous helpers.
+    virtual Status Read(int fd, void *buf, size_t size, off_t off);
+
+    virtual Status Write(int fd, const void *buf, size_t size, off_t off);
+
+    // Register a memory arena whose pages are used as I/O buffers.
+    // Engines that support it pin the arena once instead of on every request.
+    virtual Status RegisterBuffer(void *base, size_t size) { return Status::OK(); }
+
+    // Drop the registration of the arena at `base`. Must be called before the arena is unmapped,
+    // with no request on the arena in flight.
+    virtual void UnregisterBuffer(void *base) {}
+
+    virtual std::string Name() const = 0;
+
+    // Create an engine of the given type. `queue_depth` bounds the number of in-flight requests.
+    static Status Create(IOEngineType type, size_t queue_depth, IOEngine *&engine);
+};
+
+class PosixIOEngine : public IOEngine {
+public:
+    Status Init() override { return Status::OK(); }
+
+    // Executed inline, the returned handle is already complete.
+    IOHandle PrepareRead(int fd, void *buf, size_t size, off_t off) override;
+
+    IOHandle PrepareWrite(int fd, const void *buf, size_t size, off_t off) override;
+
+    Status Submit() override { return Status::OK(); }
+
+    Status Read(int fd, void *buf, size_t size, off_t off) override;
+
+    Status Write(int fd, const void *buf, size_t size, off_t off) override;
+
+    std::string Name() const override { return "posix"; }
+};
+
+}
+#endif //SPITFIRE_IO_ENGINE_H
@@ -0,0 +1,38 @@
+//
+// Created by zxjcarrot on 2020-06-19.
+//
+
+#ifndef SPITFIRE_NUMA_H
+#define SPITFIRE_NUMA_H
+
+#include <cstddef>
+#include <vector>
+#include "util/status.h"
+
+namespace spitfire {
+
+// NUMA topology of the machine, read once from /sys/devices/system/node, and placement helpers
+// on top of the raw system calls, so that no libnuma is needed. On machines without NUMA
+// support everything falls back to a single node 0.
+class Numa {
+public:
+    static int NumNodes();
+
+    // Node of the cpu the calling thread runs on.
+    static int CurrentNode();
+
+    static int NodeOfCore(int core);
+
+    static const std::vector<int> &CoresOfNode(int node);
+
+    // Prefer `node` for the physical memory of [addr, addr + len) that is not touched yet.
+    static Status BindToNode(void *addr, size_t len, int node);
+
+    static Status PinToCore(int core);
+
+    // Pin worker `worker` to a core, spreading consecutive workers round-robin over the nodes.
+    static Status PinWorker(size_t worker);
+};
+
+}
+#endif //SPITFIRE_NUMA_H
@@ -0,0 +1,89 @@
+//
+// Created by zxjcarrot on 2020-06-20.
+//
+
+#ifndef SPITFIRE_NVM_EMULATOR_H
+#define SPITFIRE_NVM_EMULATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace spitfire {
+
+struct NVMEmulatorConfig {
+    // Added to every kAccessSize access, on top of what the DRAM that stands in for NVM costs.
+    uint64_t read_latency_ns = 200;
+    uint64_t write_latency_ns = 100;
+    // Added to every NVMUtilities::persist. The bytes persisted are charged when they are written.
+    uint64_t persist_latency_ns = 300;
+    // Reads and writes are capped separately, 0 for no cap.
+    uint64_t read_bandwidth_mb = 6600;
+    uint64_t write_bandwidth_mb = 2300;
+};
+
+// Stands in for NVM on machines without it. The NVM pages and logs stay in DRAM, and the emulator
+// holds up the threads that touch them as the device would: each kAccessSize access and each
+// persist costs its latency, and a token bucket per direction shares out the bandwidth between
+// the threads. Delays are spun, they are far below what the scheduler can sleep for.
+class NVMEmulator {
+public:
+    // The access granularity of Optane DC persistent memory.
+    static constexpr size_t kAccessSize = 256;
+
+    explicit NVMEmulator(const NVMEmulatorConfig &config);
+
+    NVMEmulator(const NVMEmulator &) = delete;
+
+    NVMEmulator &operator=(const NVMEmulator &) = delete;
+
+    // Hold the calling thread up for as long as reading `bytes` of NVM takes.
+    void Read(size_t bytes);
+
+    void Write(size_t bytes);
+
+    void Persist();
+
+    std::string ToString() const;
+
+    // The emulator NVMUtilities::persist charges, nullptr on real NVM. There is one per process,
+    // like the device.
+    static NVMEmulator *Active() { return active.load(std::memory_order_relaxed); }
+
+    static void SetActive(NVMEmulator *emulator) { active.store(emulator); }
+
+private:
+    // A token bucket in its generic cell rate form: a single timestamp of when the bytes taken
+    // so far are paid for, up to `burst_ns` of which may be taken ahead of time.
+    class TokenBucket {
+    public:
+        TokenBucket(uint64_t bytes_per_sec, uint64_t burst_ns);
+
+        // When the caller may go on after taking `bytes` at `now`, in ns.
+        uint64_t Take(size_t bytes, uint64_t now);
+
+    private:
+        const double ns_per_byte;
+        const uint64_t burst_ns;
+        std::atomic<uint64_t> paid_until{0};
+    };
+
+    // Spin until `until`, counting the time held up.
+    void Delay(uint64_t now, uint64_t until);
+
+    static size_t Accesses(size_t bytes) { return (bytes + kAccessSize - 1) / kAccessSize; }
+
+    const NVMEmulatorConfig config;
+    TokenBucket read_bucket;
+    TokenBucket write_bucket;
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> persists{0};
+    std::atomic<uint64_t> delayed_ns{0};
+
+    static std::atomic<NVMEmulator *> active;
+};
+
+}
+#endif //SPITFIRE_NVM_EMULATOR_H
@@ -0,0 +1,148 @@
+//
+// Created by zxjcarrot on 2020-06-16.
+//
+
+#ifndef SPITFIRE_OBJECT_POOL_H
+#define SPITFIRE_OBJECT_POOL_H
+
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "util/sync.h"
+
+namespace spitfire {
+
+// Type-specific pool for objects that are created and destroyed at a high rate, such as
+// page descriptors. Objects live in cache line aligned slots carved out of slabs that are
+// never returned to the system. Every thread caches free slots in a magazine and trades
+// kMagazineSize slots at a time with a global depot, so the fast path takes no lock and
+// the depot lock is taken once per kMagazineSize operations.
+//
+// Retire is the deferred version of Delete for objects other threads may still reference
+// through a RefManager. Instead of blocking in WaitUntilNoRefs, the object is parked in a
+// per-thread limbo list and returned to the pool once no thread can reference it.
+template<class T>
+class ObjectPool {
+public:
+    template<class... Args>
+    static T *New(Args &&... args) {
+        return new(Local().Take()) T(std::forward<Args>(args)...);
+    }
+
+    static void Delete(T *obj) {
+        obj->~T();
+        Local().Give(obj);
+    }
+
+    static void Retire(T *obj, RefManager &manager) {
+        Local().Retire(obj, manager);
+    }
+
+    static constexpr size_t kMagazineSize = 64;
+    static constexpr size_t kSlabSize = 256;
+    // Limbo size at which a thread checks which of its retired objects can be reused.
+    static constexpr size_t kLimboScanThreshold = 32;
+
+private:
+    static constexpr size_t kAlignment = alignof(T) > 64 ? alignof(T) : 64;
+    static constexpr size_t kSlotSize = (sizeof(T) + kAlignment - 1) / kAlignment * kAlignment;
+
+    struct Depot {
+        std::mutex mtx;
+        std::vector<void *> slots;
+
+        void Take(std::vector<void *> &magazine, size_t n) {
+            std::lock_guard<std::mutex> g(mtx);
+            if (slots.size() < n) {
+                char *slab = nullptr;
+                if (posix_memalign((void **) &slab, kAlignment, kSlotSize * kSlabSize) != 0)
+                    throw std::bad_alloc();
+                for (size_t i = kSlabSize; i > 0; --i)
+                    slots.push_back(slab + (i - 1) * kSlotSize);
+            }
+            magazine.insert(magazine.end(), slots.end() - n, slots.end());
+            slots.resize(slots.size() - n);
+        }
+
+        void Give(std::vector<void *> &magazine, size_t n) {
+            std::lock_guard<std::mutex> g(mtx);
+            slots.insert(slots.end(), magazine.end() - n, magazine.end());
+            magazine.resize(magazine.size() - n);
+        }
+    };
+
+    struct ThreadCache {
+        std::vector<void *> magazine;
+        std::vector<std::pair<T *, RefManager *>> limbo;
+        // Grows with the objects that stay referenced, so that scans stay amortized O(1) per Retire.
+        size_t next_limbo_scan = kLimboScanThreshold;
+
+        ThreadCache() {
+            magazine.reserve(2 * kMagazineSize);
+        }
+
+        ~ThreadCache() {
+            for (auto &retired : limbo) {
+                WaitUntilNoRefs(*retired.second, (uintptr_t) retired.first);
+                retired.first->~T();
+                magazine.push_back(retired.first);
+            }
+            if (!magazine.empty())
+                GetDepot().Give(magazine, magazine.size());
+        }
+
+        void *Take() {
+            if (magazine.empty()) {
+                if (limbo.empty() == false)
+                    ScanLimbo();
+                if (magazine.empty())
+                    GetDepot().Take(magazine, kMagazineSize);
+            }
+            void *slot = magazine.back();
+            magazine.pop_back();
+            return slot;
+        }
+
+        void Give(void *slot) {
+            if (magazine.size() == 2 * kMagazineSize)
+                GetDepot().Give(magazine, kMagazineSize);
+            magazine.push_back(slot);
+        }
+
+        void Retire(T *obj, RefManager &manager) {
+            limbo.emplace_back(obj, &manager);
+            if (limbo.size() >= next_limbo_scan)
+                ScanLimbo();
+        }
+
+        void ScanLimbo() {
+            size_t kept = 0;
+            for (size_t i = 0; i < limbo.size(); ++i) {
+                if (HasNoRefs(*limbo[i].second, (uintptr_t) limbo[i].first)) {
+                    limbo[i].first->~T();
+                    Give(limbo[i].first);
+                } else {
+                    limbo[kept++] = limbo[i];
+                }
+            }
+            limbo.resize(kept);
+            next_limbo_scan = 2 * kept > kLimboScanThreshold ? 2 * kept : kLimboScanThreshold;
+        }
+    };
+
+    static Depot &GetDepot() {
+        // Never destroyed, threads may return their slots after static destructors have run.
+        static Depot *depot = new Depot;
+        return *depot;
+    }
+
+    static ThreadCache &Local() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+};
+
+}
+#endif //SPITFIRE_OBJECT_POOL_H
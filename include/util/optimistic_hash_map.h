@@ -0,0 +1,225 @@
+//
+// Created by zxjcarrot on 2020-06-02.
+//
+
+#ifndef SPITFIRE_OPTIMISTIC_HASH_MAP_H
+#define SPITFIRE_OPTIMISTIC_HASH_MAP_H
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <cassert>
+#include "util/concurrent_bytell_hash_map.h"
+
+namespace spitfire {
+
+// A fixed-capacity open addressing hash map (linear probing) whose lookups take no lock.
+// Every slot has a meta word that packs a version and a state. Readers validate
+// the version before and after reading a slot, seqlock style, and retry the slot if
+// it changed. Writers claim a slot by CASing its meta word into the busy state.
+// Writers of the same key are serialized by striped mutexes, so one key never
+// occupies two slots. Erased slots become tombstones. A tombstone is turned back
+// into an empty slot when the slot that follows it is empty, which keeps probe
+// sequences for misses short under churn.
+// Keys and values must fit in lock-free std::atomic.
+// Values are not reclaimed by the map. Callers protect them with their own
+// reclamation scheme (e.g. RefManager).
+template<typename K, typename V, typename H, int N = 7>
+class OptimisticHashMap {
+public:
+    explicit OptimisticHashMap(size_t capacity) {
+        size_t cap = 16;
+        while (cap < capacity)
+            cap <<= 1;
+        mask = cap - 1;
+        slots = std::unique_ptr<Slot[]>(new Slot[cap]);
+        for (size_t i = 0; i < cap; ++i) {
+            slots[i].meta.store(kEmpty, std::memory_order_relaxed);
+        }
+    }
+
+    OptimisticHashMap(const OptimisticHashMap &) = delete;
+
+    OptimisticHashMap &operator=(const OptimisticHashMap &) = delete;
+
+    bool Find(const K &k, V &v) const {
+        size_t i = HomeSlot(k);
+        for (size_t probes = 0; probes <= mask;) {
+            const Slot &slot = slots[i];
+            uint64_t m1 = slot.meta.load(std::memory_order_acquire);
+            uint64_t st = State(m1);
+            if (st == kBusy) {
+                // A writer is working on this slot, wait for it.
+                asm volatile("pause":: : "memory");
+                continue;
+            }
+            if (st == kEmpty)
+                return false;
+            if (st == kFull) {
+                K kk = slot.key.load(std::memory_order_relaxed);
+                V vv = slot.value.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.meta.load(std::memory_order_relaxed) != m1)
+                    continue; // Changed while reading, retry this slot.
+                if (kk == k) {
+                    v = vv;
+                    return true;
+                }
+            }
+            i = (i + 1) & mask;
+            ++probes;
+        }
+        return false;
+    }
+
+    // Returns false if the key exists or the map is full.
+    bool Insert(const K &k, const V &v) {
+        std::lock_guard<std::mutex> g(StripeOf(k));
+        restart:
+        size_t i = HomeSlot(k);
+        size_t free_pos = kNoSlot;
+        uint64_t free_meta = 0;
+        for (size_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+            uint64_t m = slots[i].meta.load(std::memory_order_acquire);
+            uint64_t st = State(m);
+            if (st == kBusy) {
+                // The probe sequence might be changing under us, start over.
+                asm volatile("pause":: : "memory");
+                goto restart;
+            }
+            if (st == kFull) {
+                // Slots holding k are only modified under our stripe lock, so this read is stable.
+                if (slots[i].key.load(std::memory_order_relaxed) == k)
+                    return false;
+            } else if (free_pos == kNoSlot) {
+                free_pos = i;
+                free_meta = m;
+            }
+            if (st == kEmpty)
+                break;
+        }
+        if (free_pos == kNoSlot)
+            return false;
+        Slot &slot = slots[free_pos];
+        if (slot.meta.compare_exchange_strong(free_meta, Lock(free_meta)) == false)
+            goto restart;
+        slot.key.store(k, std::memory_order_relaxed);
+        slot.value.store(v, std::memory_order_relaxed);
+        slot.meta.store(Publish(free_meta, kFull), std::memory_order_release);
+        return true;
+    }
+
+    bool Erase(const K &k) {
+        std::lock_guard<std::mutex> g(StripeOf(k));
+        size_t i = HomeSlot(k);
+        for (size_t probes = 0; probes <= mask;) {
+            Slot &slot = slots[i];
+            uint64_t m = slot.meta.load(std::memory_order_acquire);
+            uint64_t st = State(m);
+            if (st == kBusy) {
+                asm volatile("pause":: : "memory");
+                continue;
+            }
+            if (st == kEmpty)
+                return false;
+            if (st == kFull && slot.key.load(std::memory_order_relaxed) == k) {
+                if (slot.meta.compare_exchange_strong(m, Lock(m)) == false)
+                    continue;
+                slot.meta.store(Publish(m, kDeleted), std::memory_order_release);
+                ReclaimTombstones(i);
+                return true;
+            }
+            i = (i + 1) & mask;
+            ++probes;
+        }
+        return false;
+    }
+
+    // Not linearizable with respect to concurrent writers.
+    void Iterate(std::function<void(const K &k, const V &v)> processor) const {
+        for (size_t i = 0; i <= mask; ++i) {
+            if (State(slots[i].meta.load(std::memory_order_acquire)) == kFull) {
+                processor(slots[i].key.load(std::memory_order_relaxed),
+                          slots[i].value.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    size_t Size() const {
+        size_t sz = 0;
+        for (size_t i = 0; i <= mask; ++i) {
+            if (State(slots[i].meta.load(std::memory_order_relaxed)) == kFull)
+                ++sz;
+        }
+        return sz;
+    }
+
+    size_t Capacity() const { return mask + 1; }
+
+private:
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kBusy = 1;
+    static constexpr uint64_t kFull = 2;
+    static constexpr uint64_t kDeleted = 3;
+    static constexpr uint64_t kStateMask = 3;
+    static constexpr uint64_t kVersionInc = 4;
+    static constexpr size_t kNoSlot = (size_t) -1;
+    constexpr static int kNumStripes = 1 << N;
+
+    struct Slot {
+        std::atomic<uint64_t> meta;
+        std::atomic<K> key;
+        std::atomic<V> value;
+    };
+
+    static uint64_t State(uint64_t meta) { return meta & kStateMask; }
+
+    static uint64_t Lock(uint64_t meta) { return (meta & ~kStateMask) + kVersionInc + kBusy; }
+
+    // Meta word that releases a slot locked from `meta` with the given state.
+    static uint64_t Publish(uint64_t meta, uint64_t state) { return (meta & ~kStateMask) + 2 * kVersionInc + state; }
+
+    size_t HomeSlot(const K &k) const {
+        // Mix the bits since page ids hash to consecutive values.
+        uint64_t h = hasher(k);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h & mask;
+    }
+
+    std::mutex &StripeOf(const K &k) {
+        return stripes[HomeSlot(k) & (kNumStripes - 1)].mtx;
+    }
+
+    // Turn tombstones ending at slot `i` back into empty slots when they are followed by an empty slot.
+    // Both the tombstone and its successor are locked during the conversion, so no writer can
+    // claim the successor for a key whose probe sequence passed through the tombstone.
+    void ReclaimTombstones(size_t i) {
+        for (size_t steps = 0; steps <= mask; ++steps, i = (i - 1) & mask) {
+            Slot &slot = slots[i];
+            Slot &next = slots[(i + 1) & mask];
+            uint64_t m = slot.meta.load(std::memory_order_acquire);
+            uint64_t nm = next.meta.load(std::memory_order_acquire);
+            if (State(m) != kDeleted || State(nm) != kEmpty)
+                return;
+            if (slot.meta.compare_exchange_strong(m, Lock(m)) == false)
+                return;
+            if (next.meta.compare_exchange_strong(nm, Lock(nm)) == false) {
+                slot.meta.store(Publish(m, kDeleted), std::memory_order_release);
+                return;
+            }
+            slot.meta.store(Publish(m, kEmpty), std::memory_order_release);
+            next.meta.store(Publish(nm, kEmpty), std::memory_order_release);
+        }
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    PaddedMutex stripes[kNumStripes];
+    H hasher;
+};
+
+}
+#endif //SPITFIRE_OPTIMISTIC_HASH_MAP_H
@@ -0,0 +1,91 @@
+//
+// Created by zxjcarrot on 2020-06-18.
+//
+
+#ifndef SPITFIRE_PARKING_LOT_H
+#define SPITFIRE_PARKING_LOT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <immintrin.h>
+
+namespace spitfire {
+
+// Futex-based waiting on 32-bit atomic words, such as pin counts and flush sequence numbers.
+// Threads park on the address of a word and are woken by UnparkAll on the same word after
+// it changed. Words hash to kNumBuckets buckets. A bucket counts its parked threads, so that
+// UnparkAll skips the system call when nobody waits, and keeps the spin budget of WaitUntil,
+// which adapts to how long waits on its words usually take: waits that end while spinning
+// raise the budget and waits that end up parked lower it.
+// A parked thread also wakes up after kParkTimeoutUs, so a missed wakeup only costs latency.
+class ParkingLot {
+public:
+    // Blocks while `word` holds `expected`, until UnparkAll on `word`, a timeout or a spurious wakeup.
+    static void Park(std::atomic<int> &word, int expected, uint32_t timeout_us = kParkTimeoutUs);
+
+    static void UnparkAll(std::atomic<int> &word);
+
+    // Waits until `ready` returns true on the value of `word`, spinning first and parking once
+    // the spin budget is used up. Returns false if `timeout_us` passed first, 0 waits forever.
+    template<class Ready>
+    static bool WaitUntil(std::atomic<int> &word, Ready ready, uint64_t timeout_us = 0) {
+        Bucket &b = BucketOf(&word);
+        int budget = b.spin_budget.load(std::memory_order_relaxed);
+        int v = word.load();
+        for (int i = 0; i < budget; ++i) {
+            if (ready(v)) {
+                // Aim for twice the spins this wait took.
+                int target = 2 * i + kMinSpins;
+                b.spin_budget.store(AdjustBudget(budget, target), std::memory_order_relaxed);
+                return true;
+            }
+            _mm_pause();
+            v = word.load();
+        }
+        b.spin_budget.store(AdjustBudget(budget, kMinSpins), std::memory_order_relaxed);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+        while (ready(v) == false) {
+            uint32_t park_us = kParkTimeoutUs;
+            if (timeout_us) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline)
+                    return false;
+                auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count() + 1;
+                if (left < park_us)
+                    park_us = left;
+            }
+            Park(word, v, park_us);
+            v = word.load();
+        }
+        return true;
+    }
+
+    static constexpr int kNumBuckets = 1024;
+    static constexpr uint32_t kParkTimeoutUs = 1000;
+    static constexpr int kMinSpins = 16;
+    static constexpr int kMaxSpins = 4096;
+
+private:
+    struct alignas(64) Bucket {
+        std::atomic<int> num_parked{0};
+        std::atomic<int> spin_budget{128};
+    };
+
+    static Bucket &BucketOf(const void *addr) {
+        uint64_t h = (uintptr_t) addr;
+        h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+        return buckets[(h >> 40) % kNumBuckets];
+    }
+
+    // Moves the budget an eighth of the way to `target`.
+    static int AdjustBudget(int budget, int target) {
+        int next = budget + (target - budget) / 8;
+        return next < kMinSpins ? kMinSpins : (next > kMaxSpins ? kMaxSpins : next);
+    }
+
+    static Bucket buckets[kNumBuckets];
+};
+
+}
+#endif //SPITFIRE_PARKING_LOT_H
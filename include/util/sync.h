@@ -5,6 +5,7 @@
 #ifndef SPITFIRE_SYNC_H
 #define SPITFIRE_SYNC_H
 
+#include <atomic>
 #include <vector>
 #include <queue>
 #include <memory>
@@ -132,6 +133,20 @@ static void WaitUntilNoRefs(RefManager &manager, uintptr_t V) {
     }
 }
 
+// Whether no thread can hold a reference to V at this point, see WaitUntilNoRefs.
+static bool HasNoRefs(RefManager &manager, uintptr_t V) {
+    bool might_have_refs = false;
+    manager.IterateThreadRefs(
+            [&might_have_refs,
+                    V](ThreadRefHolder *te) {
+                auto tev = te->GetValue();
+                if (te->Active() && (tev == 0 || tev == V)) {
+                    might_have_refs = true;
+                }
+            });
+    return might_have_refs == false;
+}
+
 static bool WaitUntilNoRefsNonBlocking(RefManager &manager, uintptr_t V, int wait_times) {
     while (wait_times--) {
         bool might_have_refs = false;
@@ -366,5 +381,94 @@ private:
 template<int buckets>
 thread_local uint64_t DistributedCounter<buckets>::cpuId = (uint64_t) std::hash<std::thread::id>{}(std::this_thread::get_id());
 
+// Bounded multi-producer multi-consumer queue (Vyukov style).
+// Every cell carries a sequence number that tells producers and consumers
+// whether the cell is ready for them, so neither side ever takes a lock.
+// The capacity is rounded up to a power of 2.
+template<class T>
+class BoundedMPMCQueue {
+public:
+    explicit BoundedMPMCQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        mask = cap - 1;
+        cells = std::unique_ptr<Cell[]>(new Cell[cap]);
+        for (size_t i = 0; i < cap; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos.data = 0;
+        dequeue_pos.data = 0;
+    }
+
+    BoundedMPMCQueue(const BoundedMPMCQueue &) = delete;
+
+    BoundedMPMCQueue &operator=(const BoundedMPMCQueue &) = delete;
+
+    bool TryPush(const T &v) {
+        size_t pos = __atomic_load_n(&enqueue_pos.data, __ATOMIC_RELAXED);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&enqueue_pos.data, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = __atomic_load_n(&enqueue_pos.data, __ATOMIC_RELAXED);
+            }
+        }
+        cell->data = v;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T &v) {
+        size_t pos = __atomic_load_n(&dequeue_pos.data, __ATOMIC_RELAXED);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&dequeue_pos.data, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            } else if (diff < 0) {
+                return false; // Empty
+            } else {
+                pos = __atomic_load_n(&dequeue_pos.data, __ATOMIC_RELAXED);
+            }
+        }
+        v = cell->data;
+        cell->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate number of elements in the queue.
+    size_t Size() const {
+        size_t head = __atomic_load_n(&dequeue_pos.data, __ATOMIC_RELAXED);
+        size_t tail = __atomic_load_n(&enqueue_pos.data, __ATOMIC_RELAXED);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t Capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    PadInt enqueue_pos;
+    PadInt dequeue_pos;
+};
+
 }
 #endif //SPITFIRE_SYNC_H
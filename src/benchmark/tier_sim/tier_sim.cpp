@@ -0,0 +1,617 @@
+//
+// Created by zxjcarrot on 2020-06-21.
+//
+
+#include <getopt.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "buf/buf_mgr.h"
+#include "engine/txn.h"
+#include "util/access_trace.h"
+#include "util/logger.h"
+
+// Replays a trace recorded with BufferPoolConfig::access_trace_path against models of the
+// DRAM|NVM|SSD hierarchy, one for every combination of the capacities, migration policies and
+// replacers given, and prints the hit ratios and the bytes moved between the tiers of each.
+// The models are single-threaded and page grained. They make the same decisions as
+// ConcurrentBufferManager::Get, FillDRAMPage and Flush, with one slot ring per tier in place of
+// the partitions of ConcurrentReplacer.
+
+namespace spitfire {
+namespace benchmark {
+namespace tier_sim {
+
+static bool IsWrite(uint8_t intent) {
+    return intent == ConcurrentBufferManager::INTENT_WRITE || intent == ConcurrentBufferManager::INTENT_WRITE_FULL;
+}
+
+// The pages a tier holds and which of them it evicts, after the replacer of the tier.
+class TierModel {
+public:
+    struct Frame {
+        size_t slot;
+        bool dirty = false;
+        bool referenced = false;
+        bool hot = false;
+        // Handed out by Get with DRAM bypassed, the accesses that follow go to NVM.
+        bool direct = false;
+        uint64_t last_access = 0;
+        uint64_t penultimate_access = 0;
+    };
+
+    TierModel(ReplacerType type, size_t capacity_in_pages)
+            : type(type), capacity(capacity_in_pages), n_ghosts(std::max(capacity_in_pages, (size_t) 1)),
+              ghosts(n_ghosts, kInvalidPID) {}
+
+    size_t Capacity() const { return capacity; }
+
+    Frame *Find(pid_t pid) {
+        auto it = frames.find(pid);
+        return it == frames.end() ? nullptr : &it->second;
+    }
+
+    void Touch(Frame *f) {
+        if (type == ReplacerType::LRU_2) {
+            if (f->last_access != virtual_time) {
+                f->penultimate_access = f->last_access;
+                f->last_access = virtual_time;
+            }
+        } else {
+            f->referenced = true;
+        }
+    }
+
+    // Admit `pid`. Returns true if a page had to make room, which is then in `victim`.
+    bool Add(pid_t pid, bool dirty, pid_t &victim, bool &victim_dirty) {
+        assert(capacity > 0 && frames.find(pid) == frames.end());
+        bool evicted = false;
+        size_t slot;
+        if (slots.size() < capacity) {
+            slot = slots.size();
+            slots.push_back(pid);
+        } else {
+            slot = SweepForVictim();
+            victim = slots[slot];
+            auto it = frames.find(victim);
+            victim_dirty = it->second.dirty;
+            if (type == ReplacerType::TWO_Q) {
+                if (it->second.hot)
+                    hot_pages--;
+                else
+                    ghosts[PidHasher()(victim) % n_ghosts] = victim;
+            }
+            frames.erase(it);
+            slots[slot] = pid;
+            evicted = true;
+        }
+        Frame &f = frames[pid];
+        f.slot = slot;
+        f.dirty = dirty;
+        if (type == ReplacerType::TWO_Q) {
+            pid_t &ghost = ghosts[PidHasher()(pid) % n_ghosts];
+            if (ghost == pid) {
+                ghost = kInvalidPID;
+                f.hot = true;
+                hot_pages++;
+            }
+        } else if (type == ReplacerType::LRU_2) {
+            f.last_access = ++virtual_time;
+        }
+        return evicted;
+    }
+
+    // The page the next Add would evict, if one turns up within AdmissionFilter::kVictimSearchSteps
+    // slots of the hand. Nothing changes.
+    pid_t PeekVictim() {
+        if (slots.size() < capacity)
+            return kInvalidPID;
+        pid_t victim = kInvalidPID;
+        uint64_t victim_penultimate = 0, victim_last = 0;
+        for (size_t step = 0; step < (size_t) AdmissionFilter::kVictimSearchSteps && step < slots.size(); ++step) {
+            pid_t pid = slots[(hand + step) % slots.size()];
+            const Frame &f = frames[pid];
+            if (type == ReplacerType::LRU_2) {
+                if (step >= (size_t) kSampleSize)
+                    break;
+                if (victim == kInvalidPID || Older(f, victim_penultimate, victim_last)) {
+                    victim = pid;
+                    victim_penultimate = f.penultimate_access;
+                    victim_last = f.last_access;
+                }
+            } else if (!f.referenced && !f.hot) {
+                return pid;
+            }
+        }
+        return victim;
+    }
+
+private:
+    static constexpr int kSampleSize = 8;
+    static constexpr double kHotRatio = 0.75;
+
+    static bool Older(const Frame &f, uint64_t penultimate, uint64_t last) {
+        return f.penultimate_access < penultimate || (f.penultimate_access == penultimate && f.last_access < last);
+    }
+
+    size_t SweepForVictim() {
+        if (type == ReplacerType::LRU_2) {
+            size_t victim_slot = hand;
+            for (int step = 0; step < kSampleSize; ++step) {
+                size_t slot = (hand + step) % slots.size();
+                const Frame &f = frames[slots[slot]];
+                const Frame &v = frames[slots[victim_slot]];
+                if (Older(f, v.penultimate_access, v.last_access))
+                    victim_slot = slot;
+            }
+            hand = (hand + kSampleSize) % slots.size();
+            return victim_slot;
+        }
+        // Every page gets a second chance at most twice, once to be promoted and once to be demoted.
+        for (size_t step = 0; step < 3 * slots.size(); ++step) {
+            size_t slot = hand;
+            hand = (hand + 1) % slots.size();
+            Frame &f = frames[slots[slot]];
+            bool referenced = f.referenced;
+            f.referenced = false;
+            if (type == ReplacerType::CLOCK) {
+                if (!referenced)
+                    return slot;
+            } else if (!f.hot) {
+                if (!referenced)
+                    return slot;
+                f.hot = true;
+                hot_pages++;
+            } else if (!referenced && hot_pages > kHotRatio * capacity) {
+                f.hot = false;
+                hot_pages--;
+            }
+        }
+        return hand;
+    }
+
+    const ReplacerType type;
+    const size_t capacity;
+    std::vector<pid_t> slots;
+    std::unordered_map<pid_t, Frame> frames;
+    size_t hand = 0;
+    uint64_t virtual_time = 0;
+    size_t hot_pages = 0;
+    const size_t n_ghosts;
+    std::vector<pid_t> ghosts;
+};
+
+struct SimConfig {
+    ReplacerType replacer = ReplacerType::CLOCK;
+    size_t dram_pages = BufferPoolConfig::default_num_buffer_pages;
+    // 0 for no NVM buffer pool.
+    size_t nvm_pages = 3 * BufferPoolConfig::default_num_buffer_pages;
+    PageMigrationPolicy policy;
+    bool hymem = false;
+    // In percentage of the NVM buffer pool pages.
+    double admission_set_size = 10;
+    uint32_t seed = 0;
+};
+
+struct SimStats {
+    uint64_t gets = 0;
+    uint64_t hits_on_dram = 0;
+    uint64_t hits_on_nvm = 0;
+    uint64_t ssd_reads = 0;
+    uint64_t ssd_writes = 0;
+    uint64_t dram_evictions = 0;
+    uint64_t nvm_evictions = 0;
+    uint64_t nvm_admissions = 0;
+    uint64_t nvm_admission_rejects = 0;
+    uint64_t bytes_nvm_to_dram = 0;
+    uint64_t bytes_dram_to_nvm = 0;
+    uint64_t bytes_nvm_to_ssd = 0;
+    uint64_t bytes_dram_to_ssd = 0;
+    uint64_t bytes_ssd_to_dram = 0;
+    uint64_t bytes_ssd_to_nvm = 0;
+    uint64_t bytes_direct_read_nvm = 0;
+    uint64_t bytes_direct_write_nvm = 0;
+    // Accesses to a page the model evicted from DRAM after its Get. The buffer manager keeps
+    // the page pinned until it is put, the model does not know when that is and takes it back in.
+    uint64_t pinned_readmissions = 0;
+};
+
+class TierSimulator {
+public:
+    explicit TierSimulator(const SimConfig &config)
+            : config(config), dram(config.replacer, config.dram_pages),
+              nvm(config.replacer, config.nvm_pages),
+              admission_filter(config.hymem ? std::max((size_t) (config.nvm_pages * config.admission_set_size / 100), (size_t) 1) : 0),
+              generator(config.seed) {}
+
+    void Replay(const std::vector<AccessTraceRecord> &records) {
+        for (auto &r : records) {
+            if (r.op == (uint8_t) AccessTraceOp::GET)
+                Get(r.pid, r.intent);
+            else
+                Access(r.pid, r.intent, r.size);
+        }
+    }
+
+    const SimStats &Stats() const { return stats; }
+
+private:
+    bool NVMEnabled() const { return config.nvm_pages > 0; }
+
+    // As the PageMigrationPolicy::Bypass* methods, with a generator of the simulation's own.
+    bool Bypass(double prob) {
+        double x = std::uniform_int_distribution<int>(0, 100000)(generator) / 100000.0;
+        return x > 0 ? x > prob : true;
+    }
+
+    void Get(pid_t pid, uint8_t intent) {
+        stats.gets++;
+        bool write = IsWrite(intent);
+        if (auto f = dram.Find(pid)) {
+            dram.Touch(f);
+            stats.hits_on_dram++;
+            return;
+        }
+        if (config.hymem)
+            admission_filter.Record(pid);
+        bool bypass_dram = false, fill_dram_from_ssd = false;
+        if (NVMEnabled()) {
+            auto nvm_frame = nvm.Find(pid);
+            bypass_dram = !config.hymem && Bypass(write ? config.policy.Dw : config.policy.Dr);
+            if (nvm_frame == nullptr)
+                fill_dram_from_ssd = Bypass(write ? config.policy.Nw : config.policy.Nr);
+            if (nvm_frame != nullptr && bypass_dram) {
+                nvm.Touch(nvm_frame);
+                nvm_frame->direct = true;
+                stats.hits_on_nvm++;
+                return;
+            }
+            if (nvm_frame == nullptr && bypass_dram && !fill_dram_from_ssd) {
+                stats.ssd_reads++;
+                stats.bytes_ssd_to_nvm += kPageSize;
+                AddToNVM(pid, false);
+                nvm.Find(pid)->direct = true;
+                return;
+            }
+        }
+        AddToDRAM(pid);
+        if (!NVMEnabled() || fill_dram_from_ssd) {
+            stats.ssd_reads++;
+            stats.bytes_ssd_to_dram += kPageSize;
+            return;
+        }
+        // FillDRAMPage, done by the first access in the buffer manager. The evictions of AddToDRAM
+        // may have brought the page into NVM or taken it out.
+        auto nvm_frame = nvm.Find(pid);
+        if ((!config.hymem || nvm_frame != nullptr) && (nvm_frame != nullptr || !Bypass(config.policy.Nr))) {
+            if (nvm_frame == nullptr) {
+                stats.ssd_reads++;
+                stats.bytes_ssd_to_nvm += kPageSize;
+                AddToNVM(pid, false);
+            } else {
+                nvm.Touch(nvm_frame);
+                nvm_frame->direct = false;
+                stats.hits_on_nvm++;
+            }
+            stats.bytes_nvm_to_dram += kPageSize;
+        } else {
+            stats.ssd_reads++;
+            stats.bytes_ssd_to_dram += kPageSize;
+        }
+    }
+
+    void Access(pid_t pid, uint8_t intent, size_t size) {
+        bool write = IsWrite(intent);
+        auto dram_frame = dram.Find(pid);
+        auto nvm_frame = NVMEnabled() && dram_frame == nullptr ? nvm.Find(pid) : nullptr;
+        // The buffer manager does not evict pinned pages, some of which stay pinned for long, e.g. the
+        // root of a BTree. The model keeps the pages in use as if they were touched instead.
+        if (dram_frame != nullptr) {
+            dram.Touch(dram_frame);
+            dram_frame->dirty |= write;
+        } else if (nvm_frame != nullptr && nvm_frame->direct) {
+            nvm.Touch(nvm_frame);
+            nvm_frame->dirty |= write;
+            if (write)
+                stats.bytes_direct_write_nvm += size;
+            else
+                stats.bytes_direct_read_nvm += size;
+        } else {
+            stats.pinned_readmissions++;
+            AddToDRAM(pid);
+            dram_frame = dram.Find(pid);
+            dram.Touch(dram_frame);
+            dram_frame->dirty |= write;
+        }
+    }
+
+    void AddToDRAM(pid_t pid) {
+        pid_t victim = kInvalidPID;
+        bool victim_dirty = false;
+        if (dram.Add(pid, false, victim, victim_dirty))
+            EvictFromDRAM(victim, victim_dirty);
+    }
+
+    void AddToNVM(pid_t pid, bool dirty) {
+        pid_t victim = kInvalidPID;
+        bool victim_dirty = false;
+        if (nvm.Add(pid, dirty, victim, victim_dirty)) {
+            stats.nvm_evictions++;
+            if (victim_dirty) {
+                stats.bytes_nvm_to_ssd += kPageSize;
+                stats.ssd_writes++;
+            }
+        }
+    }
+
+    // As Flush of an evicted DRAM page.
+    void EvictFromDRAM(pid_t pid, bool dirty) {
+        stats.dram_evictions++;
+        if (!dirty && !config.hymem)
+            return;
+        auto nvm_frame = NVMEnabled() ? nvm.Find(pid) : nullptr;
+        bool go_to_ssd = !NVMEnabled() || (nvm_frame == nullptr && Bypass(config.policy.Nw));
+        if (config.hymem && nvm_frame == nullptr) {
+            if (admission_filter.Admit(pid, nvm.PeekVictim())) {
+                stats.nvm_admissions++;
+                go_to_ssd = false;
+            } else {
+                stats.nvm_admission_rejects++;
+                go_to_ssd = true;
+            }
+        }
+        if (go_to_ssd) {
+            if (dirty) {
+                stats.bytes_dram_to_ssd += kPageSize;
+                stats.ssd_writes++;
+            }
+        } else if (nvm_frame == nullptr) {
+            stats.bytes_dram_to_nvm += kPageSize;
+            AddToNVM(pid, dirty);
+        } else if (dirty) {
+            stats.bytes_dram_to_nvm += kPageSize;
+            nvm_frame->dirty = true;
+        }
+    }
+
+    const SimConfig config;
+    TierModel dram;
+    TierModel nvm;
+    AdmissionFilter admission_filter;
+    std::mt19937 generator;
+    SimStats stats;
+};
+
+struct Options {
+    std::string trace_path;
+    std::vector<size_t> dram_pages = {BufferPoolConfig::default_num_buffer_pages};
+    std::vector<size_t> nvm_pages = {3 * BufferPoolConfig::default_num_buffer_pages};
+    std::vector<PageMigrationPolicy> policies = {PageMigrationPolicy()};
+    std::vector<ReplacerType> replacers = {ReplacerType::CLOCK};
+    bool hymem = false;
+    double admission_set_size = 10;
+    uint32_t seed = 0;
+};
+
+static void Usage(FILE *out) {
+    fprintf(out,
+            "Command line options : tier_sim <options> \n"
+            "   -h --help              :  print help message \n"
+            "   -f --trace             :  trace recorded with BufferPoolConfig::access_trace_path \n"
+            "   -T --dram_buf_num_pages:  # pages(16KB) in dram buffer pool, comma separated to try several \n"
+            "   -Y --nvm_buf_num_pages :  # pages(16KB) in nvm buffer pool, 0 for none, comma separated \n"
+            "   -P --policy            :  Dr:Dw:Nr:Nw migration probabilities, comma separated \n"
+            "   -r --replacer          :  clock, 2q or lru2, comma separated \n"
+            "   -t --enable_hymem      :  model the HyMem settings, Nr and Nw are taken as 1 \n"
+            "   -X --admission_set_sz  :  size of the admission set in HyMem settings in percentage of # buffer pages in NVM \n"
+            "   -s --seed              :  seed of the migration decisions \n"
+    );
+}
+
+static struct option opts[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"trace", required_argument, NULL, 'f'},
+        {"dram_buf_num_pages", required_argument, NULL, 'T'},
+        {"nvm_buf_num_pages", required_argument, NULL, 'Y'},
+        {"policy", required_argument, NULL, 'P'},
+        {"replacer", required_argument, NULL, 'r'},
+        {"enable_hymem", no_argument, NULL, 't'},
+        {"admission_set_sz", required_argument, NULL, 'X'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+};
+
+static std::vector<std::string> Split(const std::string &s, char delim) {
+    std::vector<std::string> parts;
+    std::istringstream is(s);
+    std::string part;
+    while (std::getline(is, part, delim))
+        parts.push_back(part);
+    return parts;
+}
+
+static void ParseArguments(int argc, char *argv[], Options &options) {
+    while (1) {
+        int idx = 0;
+        int c = getopt_long(argc, argv, "htf:T:Y:P:r:X:s:", opts, &idx);
+        if (c == -1) break;
+        switch (c) {
+            case 'f':
+                options.trace_path = optarg;
+                break;
+            case 'T':
+                options.dram_pages.clear();
+                for (auto &p : Split(optarg, ','))
+                    options.dram_pages.push_back(atol(p.c_str()));
+                break;
+            case 'Y':
+                options.nvm_pages.clear();
+                for (auto &p : Split(optarg, ','))
+                    options.nvm_pages.push_back(atol(p.c_str()));
+                break;
+            case 'P':
+                options.policies.clear();
+                for (auto &p : Split(optarg, ',')) {
+                    auto probs = Split(p, ':');
+                    if (probs.size() != 4) {
+                        LOG_ERROR("Invalid policy :: %s", p.c_str());
+                        exit(EXIT_FAILURE);
+                    }
+                    PageMigrationPolicy policy;
+                    policy.Dr = atof(probs[0].c_str());
+                    policy.Dw = atof(probs[1].c_str());
+                    policy.Nr = atof(probs[2].c_str());
+                    policy.Nw = atof(probs[3].c_str());
+                    for (double prob : {policy.Dr, policy.Dw, policy.Nr, policy.Nw}) {
+                        if (prob < 0 || prob > 1.0) {
+                            LOG_ERROR("Invalid policy :: %s", p.c_str());
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    options.policies.push_back(policy);
+                }
+                break;
+            case 'r':
+                options.replacers.clear();
+                for (auto &r : Split(optarg, ',')) {
+                    if (r == "clock") {
+                        options.replacers.push_back(ReplacerType::CLOCK);
+                    } else if (r == "2q") {
+                        options.replacers.push_back(ReplacerType::TWO_Q);
+                    } else if (r == "lru2") {
+                        options.replacers.push_back(ReplacerType::LRU_2);
+                    } else {
+                        LOG_ERROR("Unknown replacer :: %s", r.c_str());
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            case 't':
+                options.hymem = true;
+                break;
+            case 'X':
+                options.admission_set_size = atof(optarg);
+                break;
+            case 's':
+                options.seed = atoi(optarg);
+                break;
+            case 'h':
+                Usage(stderr);
+                exit(EXIT_FAILURE);
+                break;
+            default:
+                LOG_ERROR("Unknown option: -%c-", c);
+                Usage(stderr);
+                exit(EXIT_FAILURE);
+                break;
+        }
+    }
+    if (options.trace_path.empty()) {
+        Usage(stderr);
+        exit(EXIT_FAILURE);
+    }
+    for (auto dram_pages : options.dram_pages) {
+        if (dram_pages == 0) {
+            LOG_ERROR("Invalid dram_buf_num_pages :: 0");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static const char *ReplacerName(ReplacerType type) {
+    switch (type) {
+        case ReplacerType::CLOCK:
+            return "clock";
+        case ReplacerType::TWO_Q:
+            return "2q";
+        case ReplacerType::LRU_2:
+            return "lru2";
+    }
+    return "?";
+}
+
+// What the recording buffer manager saw, to set the models against.
+static void PrintRecordedTiers(const std::vector<AccessTraceRecord> &records) {
+    uint64_t counts[2][4] = {};
+    for (auto &r : records)
+        counts[r.op & 1][r.tier & 3]++;
+    for (int op = 0; op < 2; ++op) {
+        uint64_t total = counts[op][0] + counts[op][1] + counts[op][2] + counts[op][3];
+        double n = std::max(total, (uint64_t) 1);
+        printf("recorded %-6s %12lu  dram %.3f nvm %.3f ssd %.3f unfilled %.3f\n", op == 0 ? "gets" : "access",
+               total, counts[op][0] / n, counts[op][1] / n, counts[op][2] / n, counts[op][3] / n);
+    }
+}
+
+static void Run(const Options &options) {
+    std::vector<AccessTraceRecord> records;
+    size_t page_size = 0;
+    Status s = AccessTraceRecorder::Read(options.trace_path, records, &page_size);
+    if (!s.ok()) {
+        LOG_ERROR("Failed to read the trace :: %s", s.ToString().c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (page_size != kPageSize) {
+        LOG_ERROR("The trace has pages of %zu bytes, this build %zu", page_size, kPageSize);
+        exit(EXIT_FAILURE);
+    }
+    PrintRecordedTiers(records);
+    constexpr double _1MB = 1024 * 1024;
+    printf("%-6s %10s %10s %-28s %9s %9s %10s %10s %12s %12s %12s %12s %12s %12s %12s %12s %10s\n",
+           "repl", "dram_pages", "nvm_pages", "policy", "dram_hit", "nvm_hit", "ssd_reads", "ssd_writes",
+           "nvm_to_dram", "dram_to_nvm", "nvm_to_ssd", "dram_to_ssd", "ssd_to_dram", "ssd_to_nvm",
+           "nvm_read", "nvm_write", "readmits");
+    for (auto replacer : options.replacers) {
+        for (auto dram_pages : options.dram_pages) {
+            for (auto nvm_pages : options.nvm_pages) {
+                for (auto policy : options.policies) {
+                    SimConfig config;
+                    config.replacer = replacer;
+                    config.dram_pages = dram_pages;
+                    config.nvm_pages = nvm_pages;
+                    config.policy = policy;
+                    config.hymem = options.hymem && nvm_pages > 0;
+                    if (config.hymem)
+                        config.policy.Nr = config.policy.Nw = 1;
+                    config.admission_set_size = options.admission_set_size;
+                    config.seed = options.seed;
+                    TierSimulator sim(config);
+                    sim.Replay(records);
+                    auto &st = sim.Stats();
+                    // As Stats::ToString, accesses that miss DRAM are served either by NVM or by an SSD read.
+                    uint64_t nvm_accesses = st.hits_on_nvm + st.ssd_reads;
+                    char policy_str[64];
+                    snprintf(policy_str, sizeof(policy_str), "%.2f:%.2f:%.2f:%.2f",
+                             config.policy.Dr, config.policy.Dw, config.policy.Nr, config.policy.Nw);
+                    printf("%-6s %10zu %10zu %-28s %9.4f %9.4f %10lu %10lu %10.1fMB %10.1fMB %10.1fMB %10.1fMB "
+                           "%10.1fMB %10.1fMB %10.1fMB %10.1fMB %10lu\n",
+                           ReplacerName(replacer), dram_pages, nvm_pages, policy_str,
+                           st.gets ? st.hits_on_dram / (double) st.gets : 0.0,
+                           nvm_accesses ? st.hits_on_nvm / (double) nvm_accesses : 0.0,
+                           st.ssd_reads, st.ssd_writes,
+                           st.bytes_nvm_to_dram / _1MB, st.bytes_dram_to_nvm / _1MB, st.bytes_nvm_to_ssd / _1MB,
+                           st.bytes_dram_to_ssd / _1MB, st.bytes_ssd_to_dram / _1MB, st.bytes_ssd_to_nvm / _1MB,
+                           st.bytes_direct_read_nvm / _1MB, st.bytes_direct_write_nvm / _1MB, st.pinned_readmissions);
+                }
+            }
+        }
+    }
+}
+
+}
+}
+
+std::vector<BaseDataTable*> database_tables;
+}
+
+int main(int argc, char **argv) {
+    spitfire::benchmark::tier_sim::Options options;
+    spitfire::benchmark::tier_sim::ParseArguments(argc, argv, options);
+    spitfire::benchmark::tier_sim::Run(options);
+    return 0;
+}
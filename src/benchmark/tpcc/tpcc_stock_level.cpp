@@ -76,7 +76,7 @@ bool RunStockLevel(const size_t &thread_id, ConcurrentBufferManager *buf_mgr) {
             return false;
         }
         assert(executor.GetResults().size() == 1);
-        o_id == executor.GetResults()[0].D_NEXT_O_ID;
+        o_id = executor.GetResults()[0].D_NEXT_O_ID;
     }
     // Construct index scan executor
 //    std::vector<oid_t> district_column_ids = {COL_IDX_D_NEXT_O_ID};
@@ -124,7 +124,7 @@ bool RunStockLevel(const size_t &thread_id, ConcurrentBufferManager *buf_mgr) {
     int max_o_id = o_id;
     int min_o_id = max_o_id - 20;
 
-    std::unordered_set<int> distinct_items;
+    std::vector<Stock::StockKey> stock_keys;
     for (int curr_o_id = min_o_id; curr_o_id < max_o_id; ++curr_o_id) {
         OrderLine::OrderLineKey start_key{w_id, d_id, curr_o_id, -1};
 
@@ -150,31 +150,37 @@ bool RunStockLevel(const size_t &thread_id, ConcurrentBufferManager *buf_mgr) {
                       order_lines.size());
             continue;
         }
-
-        // Index Join
         for (int j = 0; j < order_lines.size(); ++j) {
-            int32_t item_id = order_lines[j].OL_I_ID;
-            Stock::StockKey key{w_id, item_id};
-            bool point_lookup = true;
-            bool acquire_owner = false;
-            auto predicate = [w_id, item_id](const Stock &s, bool &should_end_scan) -> bool {
-                should_end_scan = true;
-                return s.S_W_ID == w_id && s.S_I_ID == item_id;
-            };
-            IndexScanExecutor<Stock::StockKey, Stock> stock_scan_executor(*stock_table, key, point_lookup, predicate,
-                                                                          acquire_owner, txn, buf_mgr);
-            auto res = stock_scan_executor.Execute();
-            if (txn->GetResult() != ResultType::SUCCESS) {
-                LOG_TRACE("abort transaction");
-                txn_manager->AbortTransaction(txn);
-                return false;
-            }
+            stock_keys.push_back(Stock::StockKey{w_id, order_lines[j].OL_I_ID});
+        }
+    }
+
+    // Bring in the stock pages of all order lines at once so that their misses overlap.
+    stock_table->GetPrimaryIndex().PrefetchLeaves(stock_keys);
+
+    // Index Join
+    std::unordered_set<int> distinct_items;
+    for (auto &key : stock_keys) {
+        int32_t item_id = key.S_I_ID;
+        bool point_lookup = true;
+        bool acquire_owner = false;
+        auto predicate = [w_id, item_id](const Stock &s, bool &should_end_scan) -> bool {
+            should_end_scan = true;
+            return s.S_W_ID == w_id && s.S_I_ID == item_id;
+        };
+        IndexScanExecutor<Stock::StockKey, Stock> stock_scan_executor(*stock_table, key, point_lookup, predicate,
+                                                                      acquire_owner, txn, buf_mgr);
+        auto res = stock_scan_executor.Execute();
+        if (txn->GetResult() != ResultType::SUCCESS) {
+            LOG_TRACE("abort transaction");
+            txn_manager->AbortTransaction(txn);
+            return false;
+        }
 
-            assert(stock_scan_executor.GetResults().size() == 1);
-            auto &stock = stock_scan_executor.GetResults()[0];
-            if (stock.S_QUANTITY < threshold) {
-                distinct_items.insert(stock.S_I_ID);
-            }
+        assert(stock_scan_executor.GetResults().size() == 1);
+        auto &stock = stock_scan_executor.GetResults()[0];
+        if (stock.S_QUANTITY < threshold) {
+            distinct_items.insert(stock.S_I_ID);
         }
     }
 
@@ -116,6 +116,7 @@ void RunBenchmark() {
     LOG_INFO("%s : %d", "enable_direct_io", state.bp_config.enable_direct_io);
     LOG_INFO("%s : %d", "enable_annealing", state.enable_annealing);
     LOG_INFO("%s : %d", "enable_hymem", state.enable_hymem);
+    LOG_INFO("%s : %d", "enable_numa", state.bp_config.enable_numa);
     LOG_INFO("%s : %d", "nvm_block_size", spitfire::kNVMBlockSize);
     if (state.enable_hymem) {
         LOG_INFO("%s : %f", "admission_set_size", state.admission_set_size);
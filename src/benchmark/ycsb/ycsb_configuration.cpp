@@ -55,6 +55,8 @@ void Usage(FILE *out) {
           "   -s --shuffle_keys      :  whether to shuffle keys at startup (Default: fasle)\n"
           "   -t --enable_hymem      :  whether to enable HyMem settings"
           "   -X --admission_set_sz  :  size of the admission queue in HyMem settings in percentage of # buffer pages in NVM\n"
+          "   -N --numa              :  split the buffer pools by NUMA node and pin backends to cores spread over the nodes\n"
+          "   -K --access_trace      :  record the page accesses to this file for tier_sim\n"
   );
 }
 
@@ -87,6 +89,8 @@ static struct option opts[] = {
     { "shuffle_keys", optional_argument, NULL, 's' },
     { "enable_hymem", optional_argument, NULL, 't' },
     { "admission_set_sz", optional_argument, NULL, 'X' },
+    { "numa", no_argument, NULL, 'N' },
+    { "access_trace", optional_argument, NULL, 'K' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -185,7 +189,7 @@ void ParseArguments(int argc, char *argv[], configuration &state) {
   // Parse args
   while (1) {
     int idx = 0;
-    int c = getopt_long(argc, argv, "hemsALMItk:d:p:b:c:o:X:u:z:l:y:U:B:D:Q:Y:P:W:E:R:T:J:", opts, &idx);
+    int c = getopt_long(argc, argv, "hemsALMINtk:d:p:b:c:o:X:u:z:l:y:U:B:D:Q:Y:P:W:E:R:T:J:K:", opts, &idx);
 
     if (c == -1) break;
 
@@ -196,6 +200,10 @@ void ParseArguments(int argc, char *argv[], configuration &state) {
       case 'I':
         state.bp_config.enable_direct_io = true;
         break;
+      case 'N':
+        state.bp_config.enable_numa = true;
+        state.pin_threads = true;
+        break;
       case 'D':
         state.db_path = optarg;
         break;
@@ -214,6 +222,9 @@ void ParseArguments(int argc, char *argv[], configuration &state) {
       case 'J':
         state.wal_path = optarg;
         break;
+      case 'K':
+        state.bp_config.access_trace_path = optarg;
+        break;
       case 'Q':
         state.mg_policy.Dr = atof(optarg);
         break;
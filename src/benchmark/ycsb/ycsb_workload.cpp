@@ -62,6 +62,8 @@ void PinToCore(size_t core) {
 void RunWarmupBackend(ConcurrentBufferManager *buf_mgr, const size_t thread_id, const std::vector<uint64_t> &keys) {
 
     //PinToCore(thread_id);
+    if (state.pin_threads)
+        Numa::PinWorker(thread_id);
 
     ZipfDistribution zipf((state.scale_factor * 1000) - 1,
                           state.zipf_theta);
@@ -98,6 +100,8 @@ void RunWarmupBackend(ConcurrentBufferManager *buf_mgr, const size_t thread_id,
 void RunBackend(ConcurrentBufferManager *buf_mgr, const size_t thread_id, const std::vector<uint64_t> &keys) {
 
     //PinToCore(thread_id);
+    if (state.pin_threads)
+        Numa::PinWorker(thread_id);
 
     PadInt &execution_count_ref = abort_counts[thread_id];
     PadInt &transaction_count_ref = commit_counts[thread_id];
@@ -0,0 +1,254 @@
+//
+// Created by zxjcarrot on 2020-06-23.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "buf/buf_mgr.h"
+
+namespace spitfire {
+
+// Requests a write of the log is split into, and how many of them are in flight at once.
+static constexpr size_t kLogWriteSize = 1024 * 1024;
+static constexpr size_t kLogQueueDepth = 64;
+
+static size_t RoundUpToBlock(size_t size) {
+    return (size + BlockLogFileBackend::kBlockSize - 1) / BlockLogFileBackend::kBlockSize *
+           BlockLogFileBackend::kBlockSize;
+}
+
+BlockLogFileBackend::BlockLogFileBackend(const std::string &file_path, size_t initial_file_capacity,
+                                         IOEngineType io_engine_type, size_t num_buffers) :
+        file_path(file_path), file_capacity(RoundUpToBlock(initial_file_capacity)), io_engine_type(io_engine_type),
+        num_buffers(std::max(num_buffers, (size_t) 1)) {}
+
+BlockLogFileBackend::~BlockLogFileBackend() {
+    for (auto &buffer : buffers)
+        free(buffer.data);
+    if (image != nullptr)
+        munmap(image, image_size);
+    if (fd >= 0)
+        close(fd);
+    delete io_engine;
+}
+
+Status BlockLogFileBackend::Init() {
+    Status s = IOEngine::Create(io_engine_type, kLogQueueDepth, io_engine);
+    if (!s.ok()) {
+        fprintf(stderr, "BlockLogFileBackend::Init I/O engine unavailable (%s), falling back to pread/pwrite\n",
+                s.ToString().c_str());
+        s = IOEngine::Create(IOEngineType::POSIX, kLogQueueDepth, io_engine);
+        if (!s.ok())
+            return s;
+    }
+    // Keep all of a log file the last run extended, LogRecovery reads it whole.
+    uint64_t file_size = 0;
+    bool exists = PosixEnv::FileExists(file_path);
+    if (exists && PosixEnv::GetFileSize(file_path, &file_size).ok())
+        file_capacity = std::max(file_capacity, RoundUpToBlock(file_size));
+    auto open_file = [&](bool direct) {
+        return exists ? PosixEnv::OpenRWFile(file_path, fd, direct) : PosixEnv::CreateRWFile(file_path, fd, direct);
+    };
+    s = open_file(true);
+    if (!s.ok()) {
+        // tmpfs and a few others do not take O_DIRECT.
+        direct_io = false;
+        s = open_file(false);
+        if (!s.ok())
+            return s;
+    }
+    s = PosixEnv::Fallocate(fd, 0, file_capacity);
+    if (!s.ok())
+        return s;
+    void *addr = mmap(nullptr, file_capacity, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return PosixError(file_path, errno);
+    image = (char *) addr;
+    image_size = file_capacity;
+    pos = 0;
+    return Status::OK();
+}
+
+Status BlockLogFileBackend::Extend(uint64_t capacity) {
+    // Double the capacity of the log file when extending
+    uint64_t new_file_capacity = std::max(file_capacity * 2, RoundUpToBlock(capacity));
+    Status s = PosixEnv::Fallocate(fd, file_capacity, new_file_capacity - file_capacity);
+    if (!s.ok())
+        return s;
+    file_capacity = new_file_capacity;
+    return s;
+}
+
+Status BlockLogFileBackend::Seek(uint64_t off) {
+    if (off >= file_capacity) {
+        return Status::IOError("Out of range");
+    }
+    pos = off;
+    return Status::OK();
+}
+
+Status BlockLogFileBackend::Read(char *buf, uint64_t size) {
+    if (pos + size > file_capacity) {
+        return Status::IOError("Out of range");
+    }
+    size_t begin = pos / kBlockSize * kBlockSize;
+    size_t end = RoundUpToBlock(pos + size);
+    void *blocks = nullptr;
+    if (posix_memalign(&blocks, kBlockSize, end - begin) != 0)
+        return Status::IOError("BlockLogFileBackend::Read out of memory");
+    Status s = io_engine->Read(fd, blocks, end - begin, begin);
+    if (s.ok()) {
+        memcpy(buf, (char *) blocks + (pos - begin), size);
+        pos += size;
+    }
+    free(blocks);
+    return s;
+}
+
+Status BlockLogFileBackend::Append(const char *buf, uint64_t size) {
+    Status s;
+    if (size > FreeSpace()) {
+        s = Extend(pos + size);
+        if (!s.ok())
+            return s;
+    }
+    // Read, modify and write the blocks, the MainRecord shares its block with nothing else.
+    size_t begin = pos / kBlockSize * kBlockSize;
+    size_t end = RoundUpToBlock(pos + size);
+    void *blocks = nullptr;
+    if (posix_memalign(&blocks, kBlockSize, end - begin) != 0)
+        return Status::IOError("BlockLogFileBackend::Append out of memory");
+    s = io_engine->Read(fd, blocks, end - begin, begin);
+    if (s.ok()) {
+        memcpy((char *) blocks + (pos - begin), buf, size);
+        s = WriteBlocks(begin, (const char *) blocks, end - begin);
+    }
+    free(blocks);
+    if (s.ok())
+        pos += size;
+    return s;
+}
+
+char *BlockLogFileBackend::AllocatePersistentBufferAtTheEnd(uint64_t size) {
+    assert(pos % kBlockSize == 0 && size % kBlockSize == 0);
+    Status s;
+    if (size > FreeSpace()) {
+        s = Extend(pos + size);
+        if (!s.ok())
+            return nullptr;
+    }
+    void *data = nullptr;
+    if (posix_memalign(&data, kBlockSize, size) != 0)
+        return nullptr;
+    memset(data, 0, size);
+    // The blocks may still hold a log the file had before.
+    s = WriteBlocks(pos, (const char *) data, size);
+    if (!s.ok()) {
+        fprintf(stderr, "BlockLogFileBackend %s buffer not allocated: %s\n", file_path.c_str(), s.ToString().c_str());
+        free(data);
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> g(buffers_mtx);
+        buffers.push_back({(char *) data, size, pos});
+        while (buffers.size() > num_buffers) {
+            free(buffers.front().data);
+            buffers.pop_front();
+        }
+    }
+    pos += size;
+    return (char *) data;
+}
+
+bool BlockLogFileBackend::Owns(const char *p) const {
+    std::lock_guard<std::mutex> g(buffers_mtx);
+    for (auto &buffer : buffers) {
+        if (p >= buffer.data && p < buffer.data + buffer.size)
+            return true;
+    }
+    return false;
+}
+
+Status BlockLogFileBackend::Persist(char *p, size_t size) {
+    Buffer buffer = {};
+    {
+        std::lock_guard<std::mutex> g(buffers_mtx);
+        for (auto &b : buffers) {
+            if (p >= b.data && p < b.data + b.size)
+                buffer = b;
+        }
+    }
+    if (buffer.data == nullptr)
+        return Status::InvalidArgument("BlockLogFileBackend::Persist not a log buffer");
+    size_t begin = (p - buffer.data) / kBlockSize * kBlockSize;
+    size_t end = std::min(RoundUpToBlock(p + size - buffer.data), buffer.size);
+    return WriteBlocks(buffer.file_off + begin, buffer.data + begin, end - begin);
+}
+
+Status BlockLogFileBackend::WriteBlocks(uint64_t off, const char *p, size_t size) {
+    {
+        // A write takes the blocks as they are when it is issued. One at a time, a block written
+        // later has all that was in it when an earlier write of it was issued.
+        std::lock_guard<std::mutex> g(write_mtx);
+        size_t done = 0;
+        while (done < size) {
+            std::vector<IOHandle> handles;
+            for (; done < size && handles.size() < kLogQueueDepth; done += kLogWriteSize) {
+                size_t n = std::min(kLogWriteSize, size - done);
+                handles.push_back(io_engine->PrepareWrite(fd, p + done, n, off + done));
+            }
+            Status s = io_engine->Submit();
+            for (auto &h : handles) {
+                Status hs = h->Wait();
+                if (s.ok())
+                    s = hs;
+            }
+            if (!s.ok())
+                return s;
+        }
+        bytes_written += size;
+        ++writes;
+    }
+    return Sync();
+}
+
+Status BlockLogFileBackend::Sync() {
+    std::unique_lock<std::mutex> l(sync_mtx);
+    // Covered by a sync started from now on.
+    uint64_t ticket = ++syncs_requested;
+    while (syncs_done < ticket) {
+        if (syncing) {
+            sync_cv.wait(l);
+            continue;
+        }
+        syncing = true;
+        uint64_t upto = syncs_requested;
+        l.unlock();
+        Status s;
+        if (fdatasync(fd) != 0)
+            s = PosixError(file_path, errno);
+        ++syncs;
+        l.lock();
+        syncing = false;
+        syncs_done = upto;
+        sync_status = s;
+        sync_cv.notify_all();
+    }
+    return sync_status;
+}
+
+std::string BlockLogFileBackend::ToString() const {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s %s%s, written %.3fMB in %lu writes, %lu syncs", file_path.c_str(),
+             io_engine ? io_engine->Name().c_str() : "none", direct_io ? " O_DIRECT" : "",
+             bytes_written.load() / 1024.0 / 1024, writes.load(), syncs.load());
+    return buf;
+}
+
+}
@@ -7,6 +7,8 @@
 #include "util/logger.h"
 #include "buf/buf_mgr.h"
 #include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace spitfire {
 
@@ -40,37 +42,129 @@ static std::string DebugPidAccessSkewToString() {
 }
 thread_local ThreadRefHolder ConcurrentBufferManager::page_payload_ref;
 thread_local ThreadRefHolder ConcurrentBufferManager::shared_pd_ref;
-thread_local ThreadRefHolder *ConcurrentClockReplacer::pd_reader_ref = new ThreadRefHolder;
+thread_local ThreadRefHolder *ConcurrentReplacer::pd_reader_ref = new ThreadRefHolder;
 thread_local size_t num_rw_ops = 0;
 
+static size_t NumaNodes(const BufferPoolConfig &config) {
+    if (!config.enable_numa)
+        return 1;
+    return config.numa_nodes ? config.numa_nodes : Numa::NumNodes();
+}
+
+// The capacities the pools can be resized up to.
+static size_t DRAMMaxCap(const BufferPoolConfig &config) {
+    return std::max(config.dram_buf_pool_cap_in_bytes, config.dram_buf_pool_max_cap_in_bytes);
+}
+
+static size_t NVMMaxCap(const BufferPoolConfig &config) {
+    return std::max(config.nvm_buf_pool_cap_in_bytes, config.nvm_buf_pool_max_cap_in_bytes);
+}
+
+// A FreeFrameProducer watermark in pages.
+static size_t FreeFrameWatermark(size_t cap_in_bytes, double fraction) {
+    return std::max((size_t) (cap_in_bytes / kPageSize * fraction), (size_t) 1);
+}
+
 ConcurrentBufferManager::ConcurrentBufferManager(SSDPageManager *ssd_page_manager, PageMigrationPolicy policy,
                                                  BufferPoolConfig config)
         : ssd_page_manager(ssd_page_manager), migration_policy(policy), config(config),
-          dram_buf_pool_replacer(config.dram_buf_pool_cap_in_bytes,
-                                 config.enable_mini_page ? sizeof(MiniPage) : kPageSize, &page_ref_manager, this),
-          nvm_buf_pool_replacer(config.nvm_buf_pool_cap_in_bytes, kPageSize, &page_ref_manager, this), stat(new Stats(this)),
+          numa_nodes(NumaNodes(config)),
+          dram_buf_pool_replacer(ConcurrentReplacer::Create(config.dram_replacer, config.dram_buf_pool_cap_in_bytes,
+                                                            config.enable_mini_page ? sizeof(MiniPage) : kPageSize,
+                                                            &page_ref_manager, this, config.replacer_partitions,
+                                                            numa_nodes, config.dram_buf_pool_max_cap_in_bytes)),
+          nvm_buf_pool_replacer(ConcurrentReplacer::Create(config.nvm_replacer, config.nvm_buf_pool_cap_in_bytes,
+                                                           kPageSize, &page_ref_manager, this,
+                                                           config.replacer_partitions, numa_nodes,
+                                                           config.nvm_buf_pool_max_cap_in_bytes)),
+          stat(new Stats(this)),
           pid_in_flush(config.dram_buf_pool_cap_in_bytes / (config.enable_mini_page ? sizeof(MiniPage) : kPageSize)),
           dram_page_leaky_buffer(32), nvm_page_leaky_buffer(32),
-          admission_set(config.enable_hymem ? config.nvm_admission_set_size_limit * 1.3 : 0),
-          nvm_page_allocator(nullptr), log_manager(nullptr), mvcc_purger(nullptr) {}
+          admission_filter(config.enable_hymem ? config.nvm_admission_set_size_limit : 0),
+          log_manager(nullptr), mvcc_purger(nullptr),
+          eviction_write_back_pool(nullptr), migration_policy_tuner(nullptr),
+          dram_frame_producer(nullptr), nvm_frame_producer(nullptr), resident_set_snapshotter(nullptr),
+          optimistic_mapping_table(nullptr), nvm_emulator(nullptr), access_trace_recorder(nullptr) {
+    for (int i = 0; i < kNumSSDWriteSeqs; ++i) {
+        ssd_write_seqs[i].store(0);
+    }
+    if (config.enable_optimistic_mapping_table) {
+        // The table does not grow. Size it for every page that can be resident in either tier
+        // plus the evicted pages waiting for write-back, at a load factor of at most 1/4.
+        size_t max_entries = DRAMMaxCap(config) / (config.enable_mini_page ? sizeof(MiniPage) : kPageSize);
+        if (config.enable_nvm_buf_pool)
+            max_entries += NVMMaxCap(config) / kPageSize;
+        if (config.enable_async_eviction_writeback)
+            max_entries += config.eviction_queue_capacity;
+        optimistic_mapping_table = new OptimisticHashMap<pid_t, SharedPageDesc *, PidHasher>(
+                std::max(max_entries * 4, (size_t) 1024));
+    }
+}
 
 
 ConcurrentBufferManager::~ConcurrentBufferManager() {
+    if (access_trace_recorder != nullptr) {
+        access_trace_recorder->Stop();
+        delete access_trace_recorder;
+        access_trace_recorder = nullptr;
+    }
+    if (resident_set_snapshotter != nullptr) {
+        resident_set_snapshotter->Stop();
+        delete resident_set_snapshotter;
+        resident_set_snapshotter = nullptr;
+    }
+    if (!config.warm_restart_snapshot_path.empty()) {
+        Status s = SaveResidentSet();
+        if (!s.ok())
+            fprintf(stderr, "ConcurrentBufferManager resident set not saved: %s\n", s.ToString().c_str());
+    }
+
+    if (migration_policy_tuner != nullptr) {
+        migration_policy_tuner->Stop();
+        delete migration_policy_tuner;
+        migration_policy_tuner = nullptr;
+    }
+
+    // Producers write back through the eviction write-back pool and the log manager.
+    if (dram_frame_producer != nullptr) {
+        dram_frame_producer->Stop();
+        delete dram_frame_producer;
+        dram_frame_producer = nullptr;
+    }
+    if (nvm_frame_producer != nullptr) {
+        nvm_frame_producer->Stop();
+        delete nvm_frame_producer;
+        nvm_frame_producer = nullptr;
+    }
+
     if (log_manager) {
         log_manager->EndPageCleanerProcess();
-        delete log_manager;
-        log_manager = nullptr;
     }
 
     EndPurging();
 
+    if (eviction_write_back_pool != nullptr) {
+        // Drain the pending write-backs before the final flush below.
+        eviction_write_back_pool->Stop();
+        delete eviction_write_back_pool;
+        eviction_write_back_pool = nullptr;
+    }
+
     // Flush every dirty page
     std::vector<pid_t> pids;
-    dram_buf_pool_replacer.Clear();
-    nvm_buf_pool_replacer.Clear();
-    mapping_table.Iterate([&](const pid_t &pid, SharedPageDesc *const &) {
+    MappingTableIterate([&](const pid_t &pid, SharedPageDesc *const &) {
         pids.push_back(pid);
     });
+    if (config.enable_nvm_frame_recovery && !nvm_page_allocators.empty()) {
+        // Move the dirty DRAM pages down first. The NVM pages are then written back and left
+        // in the heap files, none older than its SSD copy.
+        for (auto pid: pids) {
+            Flush(pid, false, true);
+        }
+        retain_nvm_frames = true;
+    }
+    dram_buf_pool_replacer->Clear();
+    nvm_buf_pool_replacer->Clear();
     for (auto pid: pids) {
         Flush(pid, true);
     }
@@ -78,6 +172,12 @@ ConcurrentBufferManager::~ConcurrentBufferManager() {
     for (auto pid: pids) {
         Flush(pid, true);
     }
+    if (log_manager) {
+        // Every page is in the database, the next run starts a new log.
+        log_manager->CloseLog();
+        delete log_manager;
+        log_manager = nullptr;
+    }
 
     Page *p = nullptr;
     while ((p = nvm_page_leaky_buffer.Get()) != nullptr) {
@@ -87,9 +187,31 @@ ConcurrentBufferManager::~ConcurrentBufferManager() {
     while ((p = dram_page_leaky_buffer.Get()) != nullptr) {
         config.dram_free(p);
     }
-    if (nvm_page_allocator != nullptr) {
-        delete nvm_page_allocator;
-        nvm_page_allocator = nullptr;
+    for (auto allocator : nvm_page_allocators) {
+        ssd_page_manager->UnregisterIOBuffer(allocator->Base());
+        delete allocator;
+    }
+    nvm_page_allocators.clear();
+    // Frames of the pages still resident are released with the arenas.
+    for (auto arena : dram_frame_arenas) {
+        ssd_page_manager->UnregisterIOBuffer(arena->Base());
+        delete arena;
+    }
+    dram_frame_arenas.clear();
+    for (auto arena : nvm_frame_arenas) {
+        ssd_page_manager->UnregisterIOBuffer(arena->Base());
+        delete arena;
+    }
+    nvm_frame_arenas.clear();
+    if (optimistic_mapping_table != nullptr) {
+        delete optimistic_mapping_table;
+        optimistic_mapping_table = nullptr;
+    }
+    if (nvm_emulator != nullptr) {
+        if (NVMEmulator::Active() == nvm_emulator)
+            NVMEmulator::SetActive(nullptr);
+        delete nvm_emulator;
+        nvm_emulator = nullptr;
     }
 
 
@@ -105,79 +227,442 @@ void ConcurrentBufferManager::EndPurging() {
 
 std::string ConcurrentBufferManager::ReplacerStats() const {
     std::string stats = "----dram_buf_replacer----\n";
-    stats += dram_buf_pool_replacer.GetStats();
+    stats += dram_buf_pool_replacer->GetStats();
     stats += "----dram_buf_replacer----\n";
     if (config.enable_nvm_buf_pool) {
         stats += "\n----nvm_buf_replacer----\n";
-        stats += nvm_buf_pool_replacer.GetStats();
+        stats += nvm_buf_pool_replacer->GetStats();
         stats += "----nvm_buf_replacer----\n";
     }
     return stats;
 }
 
 Status ConcurrentBufferManager::InitLogging() {
+    fprintf(stderr, "ConcurrentBufferManager::Init wal_file_path %s\n", config.wal_file_path.c_str());
+    if (config.wal_file_path.empty())
+        return Status::OK();
+    auto new_backend = [this](const std::string &path) -> LogFileBackend * {
+        if (config.wal_file_backend == kBlockStorage)
+            return new BlockLogFileBackend(path, 128 * 1024 * 1024UL, config.wal_io_engine);
+        return new NVMLogFileBackend(path, 128 * 1024 * 1024UL);
+    };
+    auto backend1 = new_backend(config.wal_file_path + ".1");
+    Status s = backend1->Init();
+    if (!s.ok())
+        return s;
+    auto backend2 = new_backend(config.wal_file_path + ".2");
+    s = backend2->Init();
+    if (!s.ok())
+        return s;
+    size_t recovery_threads = config.wal_recovery_threads;
+    if (recovery_threads == 0)
+        recovery_threads = std::max(1u, std::thread::hardware_concurrency());
+    {
+        // Replayed with no log manager, the recovered updates are not logged again.
+        LogRecovery recovery(this, backend1, backend2, ssd_page_manager->Incarnation(), recovery_threads);
+        s = recovery.Run();
+        if (!s.ok())
+            return s;
+        fprintf(stderr, "ConcurrentBufferManager::Init log recovery %s\n", recovery.ToString().c_str());
+        // The new log starts empty, what was recovered has to be in the database before.
+        if (stat->wal_redone_updates.load() + stat->wal_undone_updates.load() > 0)
+            WriteBackVolatilePages(true);
+        log_manager = new LogManager(this, backend1, backend2, 32 * 1024 * 1024, config.enable_slotted_log_buffer);
+        s = log_manager->Init(ssd_page_manager->Incarnation(), recovery.EndLSN());
+        if (!s.ok())
+            return s;
+    }
+    dram_buf_pool_replacer->SetEvictDirty(false);
+    if (NVM_SSD_MODE) {
+        dram_buf_pool_replacer->SetEvictDirty(true);
+        assert(config.enable_nvm_buf_pool == false);
+    }
+    if (config.enable_nvm_buf_pool) {
+        nvm_buf_pool_replacer->SetEvictDirty(true);
+    }
+    fprintf(stderr, "logging module initialized\n");
     return Status::OK();
 }
 
+size_t ConcurrentBufferManager::WriteBackVolatilePages(bool include_dram) {
+    bool dram_volatile = include_dram || NVM_SSD_MODE;
+    bool nvm_volatile = config.enable_nvm_buf_pool &&
+                        !(config.enable_nvm_frame_recovery && !nvm_page_allocators.empty());
+    if (!dram_volatile && !nvm_volatile)
+        return 0;
+    std::vector<pid_t> pids;
+    MappingTableIterate([&](const pid_t &pid, SharedPageDesc *const &) {
+        pids.push_back(pid);
+    });
+    size_t written = 0;
+    for (auto pid : pids) {
+        if (dram_volatile) {
+            // Down to NVM, or to SSD without an NVM buffer pool.
+            Status s = Flush(pid, false, true);
+            if (!s.ok() && !s.IsNotFound())
+                fprintf(stderr, "ConcurrentBufferManager::WriteBackVolatilePages page %lu: %s\n", pid, s.ToString().c_str());
+        }
+        if (!nvm_volatile)
+            continue;
+        auto pid_hash_pos = pid_in_flush.GetHashPos(PidHasher()(pid));
+        pid_in_flush.Lock(pid_hash_pos);
+        DeferCode c([&, this, pid_hash_pos]() { pid_in_flush.Unlock(pid_hash_pos); });
+        SharedPageDesc *sph = nullptr;
+        if (!MappingTableFind(pid, sph))
+            continue;
+        LockGuard g_nvm_latch(&sph->nvm_latch);
+        auto nvm_ph = sph->nvm_ph;
+        // Left dirty, the page still has to be written back when it leaves NVM.
+        if (nvm_ph == nullptr || nvm_ph->page == nullptr || nvm_ph->dirty == false)
+            continue;
+        LockGuard g_ssd_latch(&sph->ssd_latch);
+        Status s = WriteSSDPage(pid, nvm_ph->page);
+        if (!s.ok()) {
+            fprintf(stderr, "ConcurrentBufferManager::WriteBackVolatilePages page %lu: %s\n", pid, s.ToString().c_str());
+            continue;
+        }
+        EmulateNVMRead(kPageSize);
+        stat->bytes_copied_nvm_to_ssd += kPageSize;
+        stat->ssd_writes += 1;
+        ++written;
+    }
+    return written;
+}
+
+lsn_t ConcurrentBufferManager::RecoveredPageLSN(const pid_t pid) {
+    if (!ssd_page_manager->Allocated(pid))
+        return kInvalidLSN;
+    if (!config.enable_nvm_frame_recovery)
+        return 0;
+    shared_pd_ref.Register(&shared_pd_ref_manager);
+    ThreadRefGuard guard(shared_pd_ref);
+    SharedPageDesc *sph = nullptr;
+    if (!MappingTableFind(pid, sph))
+        return 0;
+    LockGuard g_nvm_latch(&sph->nvm_latch);
+    auto nvm_ph = sph->nvm_ph;
+    if (nvm_ph == nullptr || nvm_ph->page == nullptr)
+        return 0;
+    NVMPageAllocator *allocator = NVMFrameAllocatorOf(nvm_ph->page);
+    NVMFrameHeader *header = allocator != nullptr ? allocator->HeaderOf(nvm_ph->page) : nullptr;
+    return header != nullptr ? header->lsn.load() : 0;
+}
+
 Status ConcurrentBufferManager::Init() {
     fprintf(stderr, "ConcurrentBufferManager::Init nvm_heap_file_path %s\n", config.nvm_heap_file_path.c_str());
+    if (config.enable_nvm_emulation) {
+        assert(nvm_emulator == nullptr);
+        nvm_emulator = new NVMEmulator(config.nvm_emulation);
+        // The log and the frame headers persist through NVMUtilities::persist, which charges the
+        // emulator of the process.
+        NVMEmulator::SetActive(nvm_emulator);
+    }
     if (!config.nvm_heap_file_path.empty()) {
-        assert(nvm_page_allocator == nullptr);
+        assert(nvm_page_allocators.empty());
         size_t required_num_pages = config.nvm_buf_pool_cap_in_bytes / kPageSize;
         
         size_t padded_num_pages = required_num_pages * 1.1; // Give 10% more overflow pages.
-        nvm_page_allocator = new NVMPageAllocator(config.nvm_heap_file_path, padded_num_pages);
-        Status s = nvm_page_allocator->Init();
-        if (!s.ok())
-            fprintf(stderr, "ConcurrentBufferManager::Init nvm_page_allocator->Init() failed: %s\n", s.ToString().c_str());
-        if (!s.ok())
-            return s;
+        // The heap files are sized for the largest capacity, only the pages of the current one are used.
+        size_t max_padded_num_pages = NVMMaxCap(config) / kPageSize * 1.1;
+        for (size_t node = 0; node < numa_nodes; ++node) {
+            auto allocator = numa_nodes == 1 ? new NVMPageAllocator(config.nvm_heap_file_path, padded_num_pages, -1,
+                                                                    max_padded_num_pages) :
+                             new NVMPageAllocator(config.nvm_heap_file_path + ".node" + std::to_string(node),
+                                                  padded_num_pages / numa_nodes + 1, node,
+                                                  max_padded_num_pages / numa_nodes + 1);
+            nvm_page_allocators.push_back(allocator);
+            Status s = allocator->Init(ssd_page_manager->Incarnation(), config.enable_nvm_frame_recovery);
+            if (!s.ok())
+                fprintf(stderr, "ConcurrentBufferManager::Init nvm_page_allocator->Init() failed: %s\n", s.ToString().c_str());
+            if (!s.ok())
+                return s;
+            s = ssd_page_manager->RegisterIOBuffer(allocator->Base(), allocator->Size());
+            if (!s.ok())
+                fprintf(stderr, "ConcurrentBufferManager::Init NVM buffer pool not registered for I/O: %s\n", s.ToString().c_str());
+        }
         config.nvm_malloc = [&](size_t sz) -> void * {
             assert(sz == kPageSize);
-            return nvm_page_allocator->AllocatePage();
+            if (numa_nodes == 1)
+                return nvm_page_allocators[0]->AllocatePage();
+            // Take the page from the node of this thread, then from the other nodes.
+            size_t home = Numa::CurrentNode() % numa_nodes;
+            while (true) {
+                for (size_t k = 0; k < numa_nodes; ++k) {
+                    void *p = nvm_page_allocators[(home + k) % numa_nodes]->TryAllocatePage();
+                    if (p != nullptr)
+                        return p;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
         };
         config.nvm_free = [&](void *p) {
-            nvm_page_allocator->DeallocatePage(p);
+            for (auto allocator : nvm_page_allocators) {
+                if (allocator->Owns(p)) {
+                    allocator->DeallocatePage(p);
+                    return;
+                }
+            }
+            assert(false);
         };
     }
 
-    fprintf(stderr, "ConcurrentBufferManager::Init wal_file_path %s\n", config.wal_file_path.c_str());
-    if (!config.wal_file_path.empty()) {
-        fprintf(stderr, "logging module not initialized yet\n");
-        auto backend1 = new NVMLogFileBackend(config.wal_file_path + ".1",
-                                              128 * 1024 * 1024UL);
-        Status s = backend1->Init();
+    if (config.enable_frame_arena) {
+        Status s = InitFrameArenas();
+        if (!s.ok())
+            return s;
+    }
+
+    if (config.enable_async_eviction_writeback) {
+        assert(eviction_write_back_pool == nullptr);
+        eviction_write_back_pool = new EvictionWriteBackPool(this, config.num_eviction_writers,
+                                                             config.eviction_queue_capacity,
+                                                             config.eviction_queue_high_watermark);
+        eviction_write_back_pool->Start();
+    }
+    if (config.enable_nvm_frame_recovery) {
+        Status s = RecoverNVMFrames();
         if (!s.ok())
             return s;
-        auto backend2 = new NVMLogFileBackend(config.wal_file_path + ".2",
-                                              128 * 1024 * 1024UL);
-        s = backend2->Init();
+    }
+    {
+        // After RecoverNVMFrames, whose pages redo skips the updates of.
+        Status s = InitLogging();
         if (!s.ok())
             return s;
-        log_manager = new LogManager(this, backend1, backend2);
-        s = log_manager->Init();
+    }
+    if (!config.warm_restart_snapshot_path.empty()) {
+        Status s = LoadResidentSet();
         if (!s.ok())
             return s;
-        dram_buf_pool_replacer.SetEvictDirty(false);
-        if (NVM_SSD_MODE) {
-            dram_buf_pool_replacer.SetEvictDirty(true);
-            assert(config.enable_nvm_buf_pool == false);
-        }
+    }
+    if (!config.access_trace_path.empty()) {
+        // Started after the warm-up, whose reads are not the workload's.
+        assert(access_trace_recorder == nullptr);
+        access_trace_recorder = new AccessTraceRecorder(
+                config.access_trace_path, kPageSize,
+                config.access_trace_buffer_mb * 1024 * 1024 / (AccessTraceRecorder::kBufferRecords * sizeof(AccessTraceRecord)));
+        Status s = access_trace_recorder->Start();
+        if (!s.ok())
+            return s;
+    }
+    if (config.enable_migration_policy_tuner) {
+        assert(migration_policy_tuner == nullptr);
+        migration_policy_tuner = new MigrationPolicyTuner(this, config);
+        migration_policy_tuner->Start();
+    }
+    if (config.enable_free_frame_producer) {
+        assert(dram_frame_producer == nullptr && nvm_frame_producer == nullptr);
+        dram_frame_producer = new FreeFrameProducer(this, dram_buf_pool_replacer.get(),
+                                                    FreeFrameWatermark(config.dram_buf_pool_cap_in_bytes, config.free_frame_low_watermark),
+                                                    FreeFrameWatermark(config.dram_buf_pool_cap_in_bytes, config.free_frame_high_watermark));
+        dram_frame_producer->Start();
         if (config.enable_nvm_buf_pool) {
-            nvm_buf_pool_replacer.SetEvictDirty(true);
+            nvm_frame_producer = new FreeFrameProducer(this, nvm_buf_pool_replacer.get(),
+                                                       FreeFrameWatermark(config.nvm_buf_pool_cap_in_bytes, config.free_frame_low_watermark),
+                                                       FreeFrameWatermark(config.nvm_buf_pool_cap_in_bytes, config.free_frame_high_watermark));
+            nvm_frame_producer->Start();
         }
-        fprintf(stderr, "logging module initialized\n");
+    }
+    if (!config.warm_restart_snapshot_path.empty() && config.warm_restart_snapshot_period_ms > 0) {
+        assert(resident_set_snapshotter == nullptr);
+        resident_set_snapshotter = new ResidentSetSnapshotter(this, config.warm_restart_snapshot_period_ms);
+        resident_set_snapshotter->Start();
     }
     //mvcc_purger = new MVCCPurger(this);
     //mvcc_purger->StartPurgerThread();
     return Status::OK();
 }
 
+Status ConcurrentBufferManager::InitFrameArenas() {
+    assert(dram_frame_arenas.empty() && nvm_frame_arenas.empty());
+    // Like the NVM heap file, leave 10% of overflow frames for the pages that are evicted but
+    // not yet freed, plus the frames parked in the leaky buffers. Allocations beyond that
+    // fall back to the heap.
+    const size_t kLeakyBufferFrames = 32;
+    // The arenas are sized for the largest capacities of the pools.
+    size_t dram_frames = DRAMMaxCap(config) / kPageSize * 1.1 + kLeakyBufferFrames;
+    size_t dram_mini_frames = config.enable_mini_page ? DRAMMaxCap(config) / sizeof(MiniPage) * 1.1 : 0;
+    Status s = InitNodeFrameArenas(dram_frame_arenas, {{kPageSize, dram_frames}, {sizeof(MiniPage), dram_mini_frames}});
+    if (!s.ok())
+        return s;
+    config.dram_malloc = [this](size_t sz) -> void * {
+        void *p = AllocateFrame(dram_frame_arenas, sz);
+        return p != nullptr ? p : block_aligned_alloc(sz);
+    };
+    config.dram_free = [this](void *p) {
+        FreeFrame(dram_frame_arenas, p);
+    };
+
+    if (config.enable_nvm_buf_pool && nvm_page_allocators.empty()) {
+        size_t nvm_frames = NVMMaxCap(config) / kPageSize * 1.1 + kLeakyBufferFrames;
+        s = InitNodeFrameArenas(nvm_frame_arenas, {{kPageSize, nvm_frames}});
+        if (!s.ok())
+            return s;
+        config.nvm_malloc = [this](size_t sz) -> void * {
+            void *p = AllocateFrame(nvm_frame_arenas, sz);
+            return p != nullptr ? p : block_aligned_alloc(sz);
+        };
+        config.nvm_free = [this](void *p) {
+            FreeFrame(nvm_frame_arenas, p);
+        };
+    }
+    return Status::OK();
+}
+
+Status ConcurrentBufferManager::InitNodeFrameArenas(std::vector<FrameArena *> &arenas,
+                                                    const std::vector<FrameArena::SizeClass> &classes) {
+    assert(arenas.empty());
+    for (size_t node = 0; node < numa_nodes; ++node) {
+        std::vector<FrameArena::SizeClass> node_classes = classes;
+        if (numa_nodes > 1) {
+            for (auto &c : node_classes)
+                c.num_frames = (c.num_frames + numa_nodes - 1) / numa_nodes;
+        }
+        auto arena = new FrameArena(node_classes, numa_nodes > 1 ? (int) node : -1);
+        arenas.push_back(arena);
+        Status s = arena->Init();
+        if (!s.ok())
+            return s;
+        fprintf(stderr, "ConcurrentBufferManager::Init frame arena: %s\n", arena->ToString().c_str());
+        s = ssd_page_manager->RegisterIOBuffer(arena->Base(), arena->Size());
+        if (!s.ok())
+            fprintf(stderr, "ConcurrentBufferManager::Init frame arena not registered for I/O: %s\n", s.ToString().c_str());
+    }
+    return Status::OK();
+}
+
+void *ConcurrentBufferManager::AllocateFrame(const std::vector<FrameArena *> &arenas, size_t size) {
+    // The arena of the node of this thread first, so that the page is homed where it is first faulted.
+    size_t home = arenas.size() > 1 ? Numa::CurrentNode() % arenas.size() : 0;
+    for (size_t k = 0; k < arenas.size(); ++k) {
+        void *p = arenas[(home + k) % arenas.size()]->Allocate(size);
+        if (p != nullptr)
+            return p;
+    }
+    return nullptr;
+}
+
+void ConcurrentBufferManager::FreeFrame(const std::vector<FrameArena *> &arenas, void *p) {
+    for (auto arena : arenas) {
+        if (arena->Owns(p)) {
+            arena->Deallocate(p);
+            return;
+        }
+    }
+    free(p);
+}
+
+int ConcurrentBufferManager::FrameNode(const void *frame) const {
+    for (auto arena : dram_frame_arenas) {
+        if (arena->Owns(frame))
+            return arena->Node();
+    }
+    for (auto arena : nvm_frame_arenas) {
+        if (arena->Owns(frame))
+            return arena->Node();
+    }
+    for (auto allocator : nvm_page_allocators) {
+        if (allocator->Owns(frame))
+            return allocator->Node();
+    }
+    return -1;
+}
+
+NVMPageAllocator *ConcurrentBufferManager::NVMFrameAllocatorOf(const void *p) const {
+    for (auto allocator : nvm_page_allocators) {
+        if (allocator->Owns(p))
+            return allocator->HeaderOf(p) != nullptr ? allocator : nullptr;
+    }
+    return nullptr;
+}
+
+void ConcurrentBufferManager::PublishNVMFrame(PageDesc *nvm_ph, bool dirty) {
+    if (!config.enable_nvm_frame_recovery)
+        return;
+    NVMPageAllocator *allocator = NVMFrameAllocatorOf(nvm_ph->page);
+    if (allocator == nullptr)
+        return;
+    FlushLogForWriteBack();
+    NVMUtilities::persist((char *) nvm_ph->page, kPageSize);
+    allocator->PublishFrame(nvm_ph->page, nvm_ph->pid, dirty);
+}
+
+void ConcurrentBufferManager::SetNVMFrameDirty(PageDesc *nvm_ph, bool dirty) {
+    if (!config.enable_nvm_frame_recovery)
+        return;
+    NVMPageAllocator *allocator = NVMFrameAllocatorOf(nvm_ph->page);
+    if (allocator != nullptr)
+        allocator->SetFrameDirty(nvm_ph->page, dirty);
+}
+
+void ConcurrentBufferManager::AdvanceNVMFrameLSN(PageDesc *nvm_ph, lsn_t lsn) {
+    if (!config.enable_nvm_frame_recovery)
+        return;
+    NVMPageAllocator *allocator = NVMFrameAllocatorOf(nvm_ph->page);
+    if (allocator != nullptr)
+        allocator->AdvanceFrameLSN(nvm_ph->page, lsn);
+}
+
+void ConcurrentBufferManager::ClearNVMFrame(Page *nvm_page) {
+    if (!config.enable_nvm_frame_recovery)
+        return;
+    NVMPageAllocator *allocator = NVMFrameAllocatorOf(nvm_page);
+    if (allocator != nullptr)
+        allocator->ClearFrame(nvm_page);
+}
+
+Status ConcurrentBufferManager::RecoverNVMFrames() {
+    size_t dirty_pages = 0;
+    std::vector<pid_t> evicted_pids;
+    for (auto allocator : nvm_page_allocators) {
+        allocator->RecoverFrames([&](void *p, const NVMFrameHeader &header) {
+            pid_t pid = header.pid.load();
+            SharedPageDesc *sph = nullptr;
+            // Freed since, or a second copy of a page already mapped
+            if (!ssd_page_manager->Allocated(pid) || MappingTableFind(pid, sph))
+                return false;
+            sph = ObjectPool<SharedPageDesc>::New();
+            bool inserted = MappingTableInsert(pid, sph);
+            assert(inserted);
+            auto nvm_ph = ObjectPool<PageDesc>::New(pid, PageType::NVM_FULL, sph);
+            nvm_ph->page = static_cast<Page *>(p);
+            nvm_ph->dirty = header.flags.load() & NVMFrameHeader::kDirty;
+            dirty_pages += nvm_ph->dirty;
+            sph->nvm_ph = nvm_ph;
+            // The pool may be smaller than in the last run.
+            auto evicted = nvm_buf_pool_replacer->Add(nvm_ph, kPageSize);
+            assert(evicted != nvm_ph);
+            if (evicted != nullptr)
+                evicted_pids.push_back(evicted->pid);
+            nvm_buf_pool_replacer->EnsureSpace(nvm_ph, evicted_pids);
+            Put(nvm_ph);
+            stat->bytes_allocated_nvm += kPageSize;
+            stat->nvm_recovered_pages++;
+            return true;
+        });
+    }
+    stat->nvm_evictions += evicted_pids.size();
+    FlushEvictedPages(evicted_pids);
+    fprintf(stderr, "ConcurrentBufferManager::Init recovered %ld NVM pages, %lu dirty\n",
+            stat->nvm_recovered_pages.load(), dirty_pages);
+    return Status::OK();
+}
+
 Status ConcurrentBufferManager::NewPage(pid_t &pid) {
     return ssd_page_manager->AllocateNewPage(pid);
 }
 
 Status ConcurrentBufferManager::FreePage(const pid_t &pid) {
+    {
+        shared_pd_ref.Register(&shared_pd_ref_manager);
+        ThreadRefGuard guard(shared_pd_ref);
+        SharedPageDesc *sph = nullptr;
+        if (MappingTableFind(pid, sph)) {
+            // Freeing a page that is still buffered would let a later allocation of the same pid
+            // observe the stale frame.
+            return Status::InvalidArgument("page " + std::to_string(pid) + " is still buffered");
+        }
+    }
     return ssd_page_manager->FreePage(pid);
 }
 
@@ -186,11 +671,30 @@ ConcurrentBufferManager::Stats::Stats(ConcurrentBufferManager *buf_mgr) {
     Clear();
 }
 
+static std::string ArenasToString(const std::vector<FrameArena *> &arenas) {
+    if (arenas.empty())
+        return "off";
+    std::string str;
+    for (size_t i = 0; i < arenas.size(); ++i) {
+        if (i > 0)
+            str += "; ";
+        if (arenas.size() > 1)
+            str += "node " + std::to_string(i) + ": ";
+        str += arenas[i]->ToString();
+    }
+    return str;
+}
+
 std::string ConcurrentBufferManager::Stats::ToString() const {
     char buf[100000];
     float _1MB = 1024 * 1024;
     constexpr float CYCLES_PER_SEC = 3 * 1024ULL * 1024 * 1024;
     auto num_pages_on_disk = buf_mgr->ssd_page_manager->CountPages();
+    // Swizzled hits skip Get, so they are neither in buf_gets nor in hits_on_dram.
+    // Accesses that miss DRAM are served either by NVM or by an SSD read.
+    int64_t dram_hits = hits_on_dram.load() + swizzled_hits.load();
+    int64_t dram_accesses = buf_gets.load() + swizzled_hits.load();
+    int64_t nvm_accesses = hits_on_nvm.load() + ssd_reads.load();
     snprintf(buf, sizeof(buf),
              "nvm_to_dram              %.3fMB\n"
              "dram_to_nvm              %.3fMB\n"
@@ -212,11 +716,39 @@ std::string ConcurrentBufferManager::Stats::ToString() const {
              "mini_page_promotions     %ld\n"
              "hits_on_dram             %ld\n"
              "hits_on_nvm              %ld\n"
+             "dram_replacer            %s\n"
+             "dram_hit_ratio           %.3f\n"
+             "nvm_replacer             %s\n"
+             "nvm_hit_ratio            %.3f\n"
              "buf_gets                 %ld\n"
              "ssd_reads                %ld\n"
              "ssd_writes               %ld\n"
+             "async_evictions          %ld\n"
+             "eviction_queue_depth     %lu\n"
+             "eviction_queue_stalls    %ld\n"
+             "eviction_stall_time      %.3fs\n"
+             "swizzled_hits            %ld\n"
+             "overlapped_ssd_reads     %ld\n"
+             "prefetched_pages         %ld\n"
+             "warm_restart_pages       %ld\n"
+             "nvm_recovered_pages      %ld\n"
+             "wal_redone_updates       %ld\n"
+             "wal_undone_updates       %ld\n"
+             "wal_commits              %ld\n"
+             "wal_log_flushes          %ld\n"
+             "wal_commits_per_flush    %.3f\n"
+             "wal_commit_timeouts      %ld\n"
+             "nvm_admissions           %ld\n"
+             "nvm_admission_rejects    %ld\n"
+             "dram_remote_accesses     %ld\n"
+             "nvm_remote_accesses      %ld\n"
              "num_pages_allocated      %ld\n"
              "database_size            %.3fMB\n"
+             "dram_frame_arena         %s\n"
+             "nvm_frame_arena          %s\n"
+             "migration_policy_tuner   %s\n"
+             "nvm_emulation            %s\n"
+             "access_trace             %s\n"
              "%s",
              bytes_copied_nvm_to_dram.load() / _1MB,
              bytes_copied_dram_to_nvm.load() / _1MB,
@@ -238,11 +770,39 @@ std::string ConcurrentBufferManager::Stats::ToString() const {
              mini_page_promotions.load(),
              hits_on_dram.load(),
              hits_on_nvm.load(),
+             buf_mgr->dram_buf_pool_replacer->Name().c_str(),
+             dram_accesses ? dram_hits / (double) dram_accesses : 0.0,
+             buf_mgr->nvm_buf_pool_replacer->Name().c_str(),
+             nvm_accesses ? hits_on_nvm.load() / (double) nvm_accesses : 0.0,
              buf_gets.load(),
              ssd_reads.load(),
              ssd_writes.load(),
+             async_evictions.load(),
+             buf_mgr->eviction_write_back_pool ? buf_mgr->eviction_write_back_pool->QueueDepth() : 0,
+             eviction_queue_stalls.load(),
+             cycles_stalled_on_eviction_queue.load() / CYCLES_PER_SEC,
+             swizzled_hits.load(),
+             overlapped_ssd_reads.load(),
+             prefetched_pages.load(),
+             warm_restart_pages.load(),
+             nvm_recovered_pages.load(),
+             wal_redone_updates.load(),
+             wal_undone_updates.load(),
+             wal_commits.load(),
+             wal_log_flushes.load(),
+             wal_log_flushes.load() ? wal_commits.load() / (double) wal_log_flushes.load() : 0.0,
+             wal_commit_timeouts.load(),
+             nvm_admissions.load(),
+             nvm_admission_rejects.load(),
+             dram_remote_accesses.load(),
+             nvm_remote_accesses.load(),
              num_pages_on_disk,
              num_pages_on_disk * kPageSize / _1MB,
+             ArenasToString(buf_mgr->dram_frame_arenas).c_str(),
+             ArenasToString(buf_mgr->nvm_frame_arenas).c_str(),
+             buf_mgr->migration_policy_tuner ? buf_mgr->migration_policy_tuner->ToString().c_str() : "off",
+             buf_mgr->nvm_emulator ? buf_mgr->nvm_emulator->ToString().c_str() : "off",
+             buf_mgr->access_trace_recorder ? buf_mgr->access_trace_recorder->ToString().c_str() : "off",
              debug_pid_access_skew ? DebugPidAccessSkewToString().c_str():"");
     return buf;
 }
@@ -271,6 +831,23 @@ void ConcurrentBufferManager::Stats::Clear() {
     buf_gets.store(0);
     ssd_reads.store(0);
     ssd_writes.store(0);
+    async_evictions.store(0);
+    eviction_queue_stalls.store(0);
+    cycles_stalled_on_eviction_queue.store(0);
+    swizzled_hits.store(0);
+    overlapped_ssd_reads.store(0);
+    prefetched_pages.store(0);
+    warm_restart_pages.store(0);
+    nvm_recovered_pages.store(0);
+    wal_redone_updates.store(0);
+    wal_undone_updates.store(0);
+    wal_commits.store(0);
+    wal_log_flushes.store(0);
+    wal_commit_timeouts.store(0);
+    nvm_admissions.store(0);
+    nvm_admission_rejects.store(0);
+    dram_remote_accesses.store(0);
+    nvm_remote_accesses.store(0);
 }
 
 std::vector<pid_t> ConcurrentBufferManager::GetManagedPids() {
@@ -289,10 +866,7 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
     static thread_local std::vector<pid_t> evicted_pids;
     evicted_pids.clear();
     DeferCode c([&, this]() {
-        for (auto pid : evicted_pids) {
-            this->Flush(pid);
-        }
-        evicted_pids.clear();
+        FlushEvictedPages(evicted_pids);
     });
     shared_pd_ref.Register(&shared_pd_ref_manager);
     restart:
@@ -301,20 +875,22 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
         shared_pd_ref.Leave();
         // loop goto restart until pid is not in-flush
         ThreadRefGuard guard(shared_pd_ref);
-        if (pid_in_flush.Check(pid_hash_pos)) {
+        // Read before the descriptors, a page found evicted below is detached by a flush that ends after it.
+        int flush_seq = pid_in_flush.Sequence(pid_hash_pos);
+        if (flush_seq & 1) {
             shared_pd_ref.Leave();
-            // pid might be in flush, retry later
-            std::this_thread::sleep_for(std::chrono::microseconds(1));
+            // pid might be in flush, retry once the flush is done
+            pid_in_flush.WaitUnlocked(pid_hash_pos);
             goto restart;
         }
         SharedPageDesc *sph = nullptr;
-        bool found = mapping_table.Find(pid, sph);
+        bool found = MappingTableFind(pid, sph);
         if (found == false) {
-            sph = new SharedPageDesc;
+            sph = ObjectPool<SharedPageDesc>::New();
             assert(sph != nullptr);
             shared_pd_ref.SetValue((uint64_t) sph);
-            if (mapping_table.Insert(pid, sph) == false) {
-                delete sph;
+            if (MappingTableInsert(pid, sph) == false) {
+                ObjectPool<SharedPageDesc>::Delete(sph);
                 sph = nullptr;
                 goto restart;
             }
@@ -338,9 +914,15 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                 // Case 1: page in DRAM buffer pool but not in NVM buffer pool
                 // Case 2: page in DRAM buffer pool and in NVM buffer pool
                 // In those two cases, we simply return the DRAM page.
+                // Announce the reference before reading sph->dram_ph. Otherwise a concurrent
+                // Flush could free the descriptor between the read and SetValue.
+                page_payload_ref.Register(&page_ref_manager);
+                page_payload_ref.Enter();
+                asm volatile("mfence":: : "memory");
                 auto dram_ph = sph->dram_ph;
-                if (dram_ph) {
-                    page_payload_ref.Enter();
+                if (dram_ph == nullptr) {
+                    page_payload_ref.Leave();
+                } else {
                     page_payload_ref.SetValue((uint64_t) dram_ph);
                     // If the page is already in DRAM buffer pool, return it.
                     ph = dram_ph;
@@ -348,16 +930,21 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                         //g_dram_latch.Unlock();
                         //g.Unlock();
                         page_payload_ref.Leave();
-                        std::this_thread::sleep_for(std::chrono::microseconds(1));
+                        shared_pd_ref.Leave();
+                        pid_in_flush.WaitForFlush(pid_hash_pos, flush_seq);
                         goto restart;
                     }
-                    ph->Reference();
+                    dram_buf_pool_replacer->Touch(ph);
                     assert(ph->PinCount() >= 1);
                     stat->hits_on_dram++;
+                    CountRemoteAccess(ph, stat->dram_remote_accesses);
                     page_payload_ref.Leave();
+                    TraceAccess(AccessTraceOp::GET, pid, intent, 0, kPageSize, AccessTraceTier::DRAM);
                     return Status::OK();
                 }
             }
+            if (config.enable_hymem)
+                admission_filter.Record(pid);
             bool bypass_dram = false;
             bool fill_dram_from_ssd_page = false;
             if (config.enable_nvm_buf_pool) {
@@ -384,17 +971,20 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                     if (!ph->Pin()) { // Evicted, retry
                         g_nvm_latch.Unlock();
                         //g.Unlock();
-                        std::this_thread::sleep_for(std::chrono::microseconds(1));
+                        shared_pd_ref.Leave();
+                        pid_in_flush.WaitForFlush(pid_hash_pos, flush_seq);
                         goto restart;
                     }
                     stat->hits_on_nvm++;
-                    ph->Reference();
+                    CountRemoteAccess(ph, stat->nvm_remote_accesses);
+                    nvm_buf_pool_replacer->Touch(ph);
                     assert(ph->PinCount() >= 1);
+                    TraceAccess(AccessTraceOp::GET, pid, intent, 0, kPageSize, AccessTraceTier::NVM);
                     return Status::OK();
                 } else if (bypass_dram && in_NVM_buf_pool == false) {
                     if (!fill_dram_from_ssd_page) {
                         // load the page into the NVM pool.
-                        nvm_ph = new PageDesc(pid, PageType::NVM_FULL, sph);
+                        nvm_ph = ObjectPool<PageDesc>::New(pid, PageType::NVM_FULL, sph);
                         Page *nvm_p = nullptr;
                         if ((nvm_p = nvm_page_leaky_buffer.Get()) == nullptr) {
                             // The leaky buffer is empty, do an allocation
@@ -407,27 +997,30 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                         {
                             ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_ssd_to_nvm +=d; });
                             LockGuard g_ssd_latch(&sph->ssd_latch);
-                            Status s = ssd_page_manager->ReadPage(pid, nvm_p);
+                            Status s = ReadSSDPage(pid, nvm_p);
                             if (!s.ok())
                                 return s;
                             stat->ssd_reads += 1;
                         }
+                        PublishNVMFrame(nvm_ph, false);
 
-                        auto evicted = nvm_buf_pool_replacer.Add(nvm_ph, kPageSize);
+                        auto evicted = nvm_buf_pool_replacer->Add(nvm_ph, kPageSize);
                         assert(nvm_ph != evicted);
                         if (evicted != nullptr) {
                             evicted_pids.push_back(evicted->pid);
                         }
-                        nvm_buf_pool_replacer.EnsureSpace(evicted_pids);
+                        nvm_buf_pool_replacer->EnsureSpace(nvm_ph, evicted_pids);
                         stat->nvm_evictions += evicted_pids.size();
 
                         assert(config.enable_nvm_buf_pool == true);
+                        EmulateNVMWrite(kPageSize);
                         stat->bytes_copied_ssd_to_nvm += kPageSize;
 
                         assert(sph->nvm_ph == nullptr);
                         sph->nvm_ph = nvm_ph;
                         ph = nvm_ph;
                         assert(ph->PinCount() >= 1);
+                        TraceAccess(AccessTraceOp::GET, pid, intent, 0, kPageSize, AccessTraceTier::SSD);
                         return Status::OK();
                     }
                 }
@@ -446,7 +1039,7 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                                                                                : PageType::DRAM_FULL;
             // Case 4: Page not in DRAM buffer pool and not in NVM buffer pool or dram not bypassed
             // In this case, we should bring the page into DRAM buffer pool.
-            ph = new PageDesc(pid, new_page_type, sph);
+            ph = ObjectPool<PageDesc>::New(pid, new_page_type, sph);
             Page *p = nullptr;
             if (new_page_type == PageType::DRAM_MINI) {
                 size_t sz = sizeof(MiniPage);
@@ -460,12 +1053,12 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
             stat->bytes_allocated_dram += ph->PageSize();
             ph->page = p;
 
-            auto evicted = dram_buf_pool_replacer.Add(ph, ph->PageSize());
+            auto evicted = dram_buf_pool_replacer->Add(ph, ph->PageSize());
             assert(ph != evicted);
             if (evicted != nullptr) {
                 evicted_pids.push_back(evicted->pid);
             }
-            dram_buf_pool_replacer.EnsureSpace(evicted_pids);
+            dram_buf_pool_replacer->EnsureSpace(ph, evicted_pids);
             stat->dram_evictions += evicted_pids.size();
             assert(sph->dram_ph == nullptr);
             assert(ph->PinCount() == 1);
@@ -474,7 +1067,7 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                 assert(ph->type == PageType::DRAM_FULL);
                 LockGuard g_ssd_latch(&shared_ph->ssd_latch);
                 // Load the entire page from SSD instead
-                Status s = ssd_page_manager->ReadPage(pid, ph->page);
+                Status s = ReadSSDPage(pid, ph->page);
                 if (!s.ok())
                     return s;
                 stat->bytes_copied_ssd_to_dram += kPageSize;
@@ -482,6 +1075,8 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
                 ph->residency_bitmap.SetAll();
             }
             sph->dram_ph = ph;
+            TraceAccess(AccessTraceOp::GET, pid, intent, 0, kPageSize,
+                        fill_dram_from_ssd_page ? AccessTraceTier::SSD : AccessTraceTier::UNFILLED);
         }
 
         return Status::OK();
@@ -490,9 +1085,9 @@ Status ConcurrentBufferManager::Get(const pid_t pid, SharedPageDesc *&shared_ph,
 
 
 void ConcurrentBufferManager::EvictPurgablePages(const std::unordered_set<pid_t> &evict_set) {
-    dram_buf_pool_replacer.EvictPurgablePages(evict_set);
+    dram_buf_pool_replacer->EvictPurgablePages(evict_set);
     if (config.enable_nvm_buf_pool)
-        nvm_buf_pool_replacer.EvictPurgablePages(evict_set);
+        nvm_buf_pool_replacer->EvictPurgablePages(evict_set);
 }
 
 Status ConcurrentBufferManager::Get(const pid_t pid, PageDesc *&ph, PageOPIntent intent) {
@@ -509,12 +1104,318 @@ Status ConcurrentBufferManager::Get(const pid_t pid, PageAccessor &page_accessor
     return s;
 }
 
+Status ConcurrentBufferManager::GetBatch(const pid_t *pids, size_t n, PageAccessor *out, PageOPIntent intent) {
+    StageSSDReads(pids, n);
+    for (size_t i = 0; i < n; ++i) {
+        Status s = Get(pids[i], out[i], intent);
+        if (!s.ok()) {
+            for (size_t j = 0; j < i; ++j) {
+                Put(out[j].GetPageDesc());
+            }
+            return s;
+        }
+    }
+    return Status::OK();
+}
+
+namespace {
+// SSD reads issued ahead of time by a thread, see ConcurrentBufferManager::StageSSDReads.
+struct StagedSSDReads {
+    struct Entry {
+        pid_t pid;
+        uint64_t seq;
+        Page *buf;
+        IOHandle handle;
+    };
+    static constexpr size_t kMaxEntries = 64;
+
+    ~StagedSSDReads() {
+        Clear();
+        for (auto buf : free_bufs)
+            free(buf);
+    }
+
+    // Drop the unconsumed reads, waiting for the in-flight ones before recycling their buffers.
+    void Clear() {
+        for (auto &e : entries) {
+            e.handle->Wait();
+            free_bufs.push_back(e.buf);
+        }
+        entries.clear();
+    }
+
+    void DropOldest() {
+        auto &e = entries.front();
+        e.handle->Wait();
+        free_bufs.push_back(e.buf);
+        entries.erase(entries.begin());
+    }
+
+    Page *AllocateBuffer() {
+        if (free_bufs.empty())
+            return (Page *) block_aligned_alloc(kPageSize);
+        Page *buf = free_bufs.back();
+        free_bufs.pop_back();
+        return buf;
+    }
+
+    const void *owner = nullptr;
+    std::vector<Entry> entries;
+    std::vector<Page *> free_bufs;
+};
+
+thread_local StagedSSDReads staged_ssd_reads;
+}
+
+size_t ConcurrentBufferManager::StageSSDReads(const pid_t *pids, size_t n) {
+    auto &staged = staged_ssd_reads;
+    if (staged.owner != this) {
+        staged.Clear();
+        staged.owner = this;
+    }
+    shared_pd_ref.Register(&shared_pd_ref_manager);
+    size_t issued = 0;
+    for (size_t i = 0; i < n && issued < StagedSSDReads::kMaxEntries; ++i) {
+        pid_t pid = pids[i];
+        if (pid == kInvalidPID || !ssd_page_manager->Allocated(pid))
+            continue;
+        bool resident = false;
+        {
+            ThreadRefGuard guard(shared_pd_ref);
+            SharedPageDesc *sph = nullptr;
+            if (MappingTableFind(pid, sph)) {
+                shared_pd_ref.SetValue((uint64_t) sph);
+                resident = sph->dram_ph != nullptr || sph->nvm_ph != nullptr;
+            }
+        }
+        if (resident)
+            continue;
+        bool duplicate = false;
+        for (auto &e : staged.entries)
+            duplicate |= e.pid == pid;
+        if (duplicate)
+            continue;
+        uint64_t seq = SSDWriteSeqOf(pid).load();
+        if (seq & 1) // Being written, read it later.
+            continue;
+        if (staged.entries.size() == StagedSSDReads::kMaxEntries)
+            staged.DropOldest();
+        Page *buf = staged.AllocateBuffer();
+        staged.entries.push_back({pid, seq, buf, ssd_page_manager->ReadPageAsync(pid, buf)});
+        ++issued;
+    }
+    ssd_page_manager->SubmitIO();
+    return issued;
+}
+
+void ConcurrentBufferManager::Prefetch(const pid_t *pids, size_t n) {
+    stat->prefetched_pages += StageSSDReads(pids, n);
+}
+
+void ReadAheadCursor::Hint(const pid_t *pids, size_t n) {
+    if (enabled == false)
+        return;
+    hints.assign(pids, pids + n);
+    next_hint = hints_issued = 0;
+}
+
+void ReadAheadCursor::Reset() {
+    stride = 0;
+    next_pid = kInvalidPID;
+    run_started = false;
+    window = kMinWindow;
+}
+
+void ReadAheadCursor::OnAccess(pid_t pid) {
+    if (enabled == false)
+        return;
+    if (next_hint < hints.size()) {
+        if (hints[next_hint] == pid) {
+            ++next_hint;
+            last_pid = pid;
+            if (hints_issued < next_hint)
+                hints_issued = next_hint;
+            if (hints_issued < hints.size() && hints_issued - next_hint <= window / 2) {
+                size_t n = std::min(hints.size(), next_hint + window) - hints_issued;
+                mgr->Prefetch(&hints[hints_issued], n);
+                hints_issued += n;
+                window = std::min(window * 2, kMaxWindow);
+            }
+            return;
+        }
+        // The scan left the hinted path.
+        hints.clear();
+        next_hint = hints_issued = 0;
+        Reset();
+    }
+
+    int64_t delta = last_pid == kInvalidPID ? 0 : (int64_t) pid - (int64_t) last_pid;
+    last_pid = pid;
+    if (delta != (int64_t) kPageSize && delta != -(int64_t) kPageSize) {
+        Reset();
+        return;
+    }
+    if (delta != stride) {
+        // First step in this direction.
+        Reset();
+        stride = delta;
+        return;
+    }
+    if (run_started == false) {
+        run_started = true;
+        next_pid = SSDPageManager::AdjacentPID(pid, stride);
+    }
+    if (next_pid == kInvalidPID)
+        return;
+    // Pages prefetched and not yet accessed
+    size_t ahead = ((int64_t) next_pid - (int64_t) pid) / stride - 1;
+    if (ahead > window / 2)
+        return;
+    pid_t pids[kMaxWindow];
+    size_t n = 0;
+    while (n < window - ahead && next_pid != kInvalidPID) {
+        pids[n++] = next_pid;
+        next_pid = SSDPageManager::AdjacentPID(next_pid, stride);
+    }
+    mgr->Prefetch(pids, n);
+    window = std::min(window * 2, kMaxWindow);
+}
+
+Status ConcurrentBufferManager::ReadSSDPage(pid_t pid, Page *p) {
+    auto &staged = staged_ssd_reads;
+    if (staged.owner == this) {
+        for (size_t i = 0; i < staged.entries.size(); ++i) {
+            auto &e = staged.entries[i];
+            if (e.pid != pid)
+                continue;
+            bool valid = e.handle->Wait().ok() && SSDWriteSeqOf(pid).load() == e.seq;
+            if (valid) {
+                memcpy(p, e.buf, kPageSize);
+                stat->overlapped_ssd_reads++;
+            }
+            staged.free_bufs.push_back(e.buf);
+            staged.entries.erase(staged.entries.begin() + i);
+            if (valid)
+                return Status::OK();
+            break;
+        }
+    }
+    return ssd_page_manager->ReadPage(pid, p);
+}
+
+void ConcurrentBufferManager::FlushLogForWriteBack() {
+    if (log_manager != nullptr)
+        log_manager->WaitForFlushedLSN(log_manager->WrittenLSN());
+}
+
+Status ConcurrentBufferManager::WriteSSDPage(pid_t pid, const Page *p) {
+    FlushLogForWriteBack();
+    auto &seq = SSDWriteSeqOf(pid);
+    seq.fetch_add(1);
+    Status s = ssd_page_manager->WritePage(pid, p);
+    seq.fetch_add(1);
+    return s;
+}
+
 ConcurrentBufferManager::PageAccessor ConcurrentBufferManager::GetPageAccessorFromDesc(PageDesc *ph) {
     assert(ph->PinCount() > 0);
     assert(ph->sph_back_pointer);
     return PageAccessor(this, ph->sph_back_pointer, ph, ph->type);
 }
 
+bool ConcurrentBufferManager::GetSwizzled(PageDesc *parent, size_t pos, pid_t pid, PageAccessor &page_accessor) {
+    assert(parent->PinCount() > 0);
+    SwizzleTable *table = parent->swizzle_table.load(std::memory_order_acquire);
+    if (table == nullptr || pos >= table->num_slots)
+        return false;
+    // Announce the reference before reading the slot. Unswizzle clears the slot
+    // before waiting for references to the page to go away, so the page read below stays valid.
+    page_payload_ref.Register(&page_ref_manager);
+    page_payload_ref.Enter();
+    asm volatile("mfence":: : "memory");
+    PageDesc *ph = table->slots[pos].load();
+    if (ph == nullptr) {
+        page_payload_ref.Leave();
+        return false;
+    }
+    page_payload_ref.SetValue((uint64_t) ph);
+    if (ph->pid != pid || !ph->Pin()) {
+        page_payload_ref.Leave();
+        return false;
+    }
+    dram_buf_pool_replacer->Touch(ph);
+    stat->swizzled_hits++;
+    page_payload_ref.Leave();
+    page_accessor = PageAccessor(this, ph->sph_back_pointer, ph, ph->type);
+    return true;
+}
+
+void ConcurrentBufferManager::Swizzle(PageDesc *parent, size_t pos, size_t num_slots, PageDesc *child) {
+    assert(parent->PinCount() > 0 && child->PinCount() > 0);
+    if (pos >= num_slots || child->type == PageType::NVM_FULL)
+        return;
+    SwizzleTable *table = parent->swizzle_table.load(std::memory_order_acquire);
+    if (table == nullptr) {
+        auto new_table = new SwizzleTable(num_slots);
+        if (parent->swizzle_table.compare_exchange_strong(table, new_table)) {
+            table = new_table;
+        } else {
+            delete new_table;
+        }
+    }
+    if (pos >= table->num_slots)
+        return;
+    auto &slot = table->slots[pos];
+    PageDesc *old = slot.load();
+    if (old == child)
+        return;
+    if (old != nullptr) {
+        // A stale pointer left by a structural change of the parent.
+        UnswizzleSlot(slot, old);
+    }
+    // A slot points to a page iff the page points back to the slot. Both sides
+    // only change under the swizzle latch of the page.
+    std::lock_guard<std::mutex> g(SwizzleLatchOf(child));
+    if (child->swizzled_in != nullptr) {
+        // The child moved to another slot.
+        child->swizzled_in->store(nullptr);
+        child->swizzled_in = nullptr;
+    }
+    PageDesc *expected = nullptr;
+    if (slot.compare_exchange_strong(expected, child)) {
+        child->swizzled_in = &slot;
+    }
+}
+
+void ConcurrentBufferManager::UnswizzleSlot(std::atomic<PageDesc *> &slot, PageDesc *child) {
+    std::lock_guard<std::mutex> g(SwizzleLatchOf(child));
+    // `child` is still alive if the slot points to it, since pages clear their slot before being freed.
+    if (slot.load() == child) {
+        assert(child->swizzled_in == &slot);
+        child->swizzled_in = nullptr;
+        slot.store(nullptr);
+    }
+}
+
+void ConcurrentBufferManager::Unswizzle(PageDesc *ph) {
+    {
+        std::lock_guard<std::mutex> g(SwizzleLatchOf(ph));
+        if (ph->swizzled_in != nullptr) {
+            ph->swizzled_in->store(nullptr);
+            ph->swizzled_in = nullptr;
+        }
+    }
+    SwizzleTable *table = ph->swizzle_table.exchange(nullptr);
+    if (table != nullptr) {
+        for (size_t i = 0; i < table->num_slots; ++i) {
+            PageDesc *child = table->slots[i].load();
+            if (child != nullptr)
+                UnswizzleSlot(table->slots[i], child);
+        }
+        delete table;
+    }
+}
+
 // Assume shared_ph->dram_latch is taken.
 Status ConcurrentBufferManager::PromoteMiniPage(PageDesc *dram_ph, std::vector<pid_t> &evicted_pids) {
     // Must have not been evicted
@@ -540,8 +1441,8 @@ Status ConcurrentBufferManager::PromoteMiniPage(PageDesc *dram_ph, std::vector<p
 
     stat->bytes_allocated_dram += dram_ph->PageSize();
     stat->mini_page_promotions += 1;
-    dram_buf_pool_replacer.AddCurrentBytesInBuf(kPageSize - sizeof(MiniPage));
-    dram_buf_pool_replacer.EnsureSpace(evicted_pids);
+    dram_buf_pool_replacer->AddCurrentBytesInBuf(dram_ph, kPageSize - sizeof(MiniPage));
+    dram_buf_pool_replacer->EnsureSpace(dram_ph, evicted_pids);
     stat->dram_evictions += evicted_pids.size();
 
     WaitUntilNoRefs(page_ref_manager, (uint64_t) mp);
@@ -576,7 +1477,7 @@ Status ConcurrentBufferManager::FillDRAMPage(SharedPageDesc *shared_ph, PageDesc
                 if (nvm_ph == nullptr) {
                     // Not in NVM buffer pool and not allowed to bypass NVM during read.
                     // Bring the page into NVM buffer pool.
-                    nvm_ph = new PageDesc(pid, PageType::NVM_FULL, shared_ph);
+                    nvm_ph = ObjectPool<PageDesc>::New(pid, PageType::NVM_FULL, shared_ph);
                     Page *nvm_p = nullptr;
                     if ((nvm_p = nvm_page_leaky_buffer.Get()) == nullptr) {
                         // The leaky buffer is empty, do an allocation
@@ -589,34 +1490,32 @@ Status ConcurrentBufferManager::FillDRAMPage(SharedPageDesc *shared_ph, PageDesc
                     {
                         ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_ssd_to_nvm +=d; });
                         LockGuard g_ssd_latch(&shared_ph->ssd_latch);
-                        Status s = ssd_page_manager->ReadPage(pid, nvm_p);
+                        Status s = ReadSSDPage(pid, nvm_p);
                         if (!s.ok())
                             return s;
                         stat->ssd_reads += 1;
                     }
+                    PublishNVMFrame(nvm_ph, false);
 
-                    auto evicted = nvm_buf_pool_replacer.Add(nvm_ph, kPageSize);
+                    auto evicted = nvm_buf_pool_replacer->Add(nvm_ph, kPageSize);
                     assert(nvm_ph != evicted);
                     if (evicted != nullptr) {
                         evicted_pids.push_back(evicted->pid);
                     }
-                    nvm_buf_pool_replacer.EnsureSpace(evicted_pids);
+                    nvm_buf_pool_replacer->EnsureSpace(nvm_ph, evicted_pids);
                     stat->nvm_evictions += evicted_pids.size();
 
                     assert(config.enable_nvm_buf_pool == true);
+                    EmulateNVMWrite(kPageSize);
                     stat->bytes_copied_ssd_to_nvm += kPageSize;
                     assert(nvm_ph->PinCount() == 1);
                 } else {
                     // Wait for all direct references to NVM page to drop before doing the copying.
                     // This ensures the data in DRAM page is up to date.
-                    int cnt = 0;
-                    while (nvm_ph->PinCount() > 0) {
-                        std::this_thread::yield();
-                        ++cnt;
-                        if (cnt > 10000) {
-                            // Waited too long, try later.
-                            return Status::PageEvicted(std::to_string(pid));
-                        }
+                    // Unpin wakes us up once the last reference is gone.
+                    if (!ParkingLot::WaitUntil(nvm_ph->pin, [](int pin) { return pin <= 0; }, kMaxNVMUnpinWaitUs)) {
+                        // Waited too long, try later.
+                        return Status::PageEvicted(std::to_string(pid));
                     }
 
                     // Try to pin the NVM page down
@@ -625,10 +1524,11 @@ Status ConcurrentBufferManager::FillDRAMPage(SharedPageDesc *shared_ph, PageDesc
                     }
                     assert(nvm_ph->PinCount() == 1);
                     stat->hits_on_nvm++;
+                    CountRemoteAccess(nvm_ph, stat->nvm_remote_accesses);
                 }
                 assert(nvm_ph != nullptr);
                 assert(nvm_ph->page != nullptr);
-        nvm_ph->Reference();
+                nvm_buf_pool_replacer->Touch(nvm_ph);
 
                 ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_nvm_to_dram+=d;});
                 size_t bytes_copied = 0;
@@ -661,6 +1561,7 @@ Status ConcurrentBufferManager::FillDRAMPage(SharedPageDesc *shared_ph, PageDesc
                 assert(nvm_ph->PinCount() > 0);
                 Put(nvm_ph, false);
 
+                EmulateNVMRead(bytes_copied);
                 stat->bytes_copied_nvm_to_dram += bytes_copied;
                 go_to_ssd = false;
             }
@@ -677,7 +1578,7 @@ Status ConcurrentBufferManager::FillDRAMPage(SharedPageDesc *shared_ph, PageDesc
         //assert(dram_ph->CountSetBitsInBitmapByRange(0, kPageSize, dram_ph->dirty_bitmap) == 0);
         LockGuard g_ssd_latch(&shared_ph->ssd_latch);
         // Load the entire page from SSD instead
-        Status s = ssd_page_manager->ReadPage(pid, dram_ph->page);
+        Status s = ReadSSDPage(pid, dram_ph->page);
         if (!s.ok())
             return s;
         stat->bytes_copied_ssd_to_dram += kPageSize;
@@ -692,12 +1593,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
     std::vector<pid_t> local_evicted_pids;
     restart:
     {
-        retry_lock_pid_in_flush:
         // Make sure there is only one flusher for every pid at any time
-        if (pid_in_flush.TryLock(pid_hash_pos) == false) {
-            std::this_thread::sleep_for(std::chrono::microseconds(1));
-            goto retry_lock_pid_in_flush;
-        }
+        pid_in_flush.Lock(pid_hash_pos);
         bool pid_in_flush_unlocked = false;
         DeferCode c([&, this, pid_hash_pos]() {
             if (pid_in_flush_unlocked == false) {
@@ -706,7 +1603,7 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
             }
         });
         SharedPageDesc *sph = nullptr;
-        bool found = mapping_table.Find(pid, sph);
+        bool found = MappingTableFind(pid, sph);
         if (found == false) {
             return Status::NotFound("pid: " + std::to_string(pid));
         }
@@ -720,24 +1617,28 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
             // NVM flush
             auto nvm_ph1 = sph->nvm_ph;
             if (nvm_ph1 != nullptr && (nvm_ph1->Evicted() || forced)) {
-                nvm_buf_pool_replacer.AssertNotInBuffer(nvm_ph1);
-                dram_buf_pool_replacer.AssertNotInBuffer(nvm_ph1);
+                nvm_buf_pool_replacer->AssertNotInBuffer(nvm_ph1);
+                dram_buf_pool_replacer->AssertNotInBuffer(nvm_ph1);
                 assert(nvm_ph1->page != nullptr);
                 if (forced)
                     assert(nvm_ph1->PinCount() <= 0);
                 if (nvm_ph1->dirty) {
                     ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_nvm_to_ssd+=d; });
                     LockGuard g_ssd_latch(&sph->ssd_latch);
-                    s = ssd_page_manager->WritePage(nvm_ph1->pid, nvm_ph1->page);
+                    s = WriteSSDPage(nvm_ph1->pid, nvm_ph1->page);
                     assert(s.ok());
                     if (!s.ok()) {
                         return s;
                     }
+                    EmulateNVMRead(kPageSize);
                     stat->bytes_copied_nvm_to_ssd += kPageSize;
                     stat->ssd_writes += 1;
+                    SetNVMFrameDirty(nvm_ph1, false);
                 }
                 nvm_ph1->dirty = false;
                 if (keep_in_buffer == false || nvm_ph1->Evicted()) {
+                    if (!retain_nvm_frames)
+                        ClearNVMFrame(nvm_ph1->page);
                     if (nvm_page_leaky_buffer.Put(nvm_ph1->page) == false) {
                         // The leaky buffer is full, do a deallocation
                         config.nvm_free(nvm_ph1->page);
@@ -745,8 +1646,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                     nvm_ph1->page = nullptr;
                     sph->nvm_ph = nullptr;
                     assert(config.enable_nvm_buf_pool == true);
-                    WaitUntilNoRefs(page_ref_manager, (uint64_t) nvm_ph1);
-                    delete nvm_ph1;
+                    Unswizzle(nvm_ph1);
+                    ObjectPool<PageDesc>::Retire(nvm_ph1, page_ref_manager);
                 }
             }
         }
@@ -765,8 +1666,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                 }
 
                 // If this is ttb setting, we need to consider admitting the page into NVM
-                // even if it's clean.
-                if (dram_ph->dirty == false && config.enable_hymem == false) {
+                // even if it's clean. Not at shutdown, when the NVM pages freed keep their headers.
+                if (dram_ph->dirty == false && (config.enable_hymem == false || retain_nvm_frames)) {
                     goto cleanup;
                 }
 
@@ -794,14 +1695,16 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                             go_to_ssd = false;
                             resident_bits = dram_ph->CountSetBitsInBitmapByRange(0, kPageSize,
                                                                                  dram_ph->residency_bitmap);
-                            bool in_admission_set = admission_set.Exist(pid);
-                            if (in_admission_set || resident_bits != kNumBlocksPerPage) {
-                                // In the admission set, admit the page into NVM
-                                //size_t admission_set_size =  admission_set.Size();
+                            // Partially resident pages always go to NVM, SSD only takes whole pages.
+                            // Other pages have to be more popular than the page NVM would evict for them.
+                            pid_t victim = kInvalidPID;
+                            if (resident_bits == kNumBlocksPerPage && !nvm_buf_pool_replacer->HasFreeSpace(pid, kPageSize))
+                                victim = nvm_buf_pool_replacer->PeekVictim(pid, AdmissionFilter::kVictimSearchSteps);
+                            if (resident_bits != kNumBlocksPerPage || admission_filter.Admit(pid, victim)) {
+                                stat->nvm_admissions++;
                                 go_to_ssd = false;
-                                admission_set.Remove(dram_ph->pid);
                             } else {
-                                admission_set.Put(pid);
+                                stat->nvm_admission_rejects++;
                                 go_to_ssd = true;
                             }
                         } else {
@@ -820,7 +1723,7 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                             ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_dram_to_ssd+=d; });
                             LockGuard g_ssd_latch(&sph->ssd_latch);
                             // Directly write to ssd page
-                            s = ssd_page_manager->WritePage(dram_ph->pid, dram_ph->page);
+                            s = WriteSSDPage(dram_ph->pid, dram_ph->page);
                             if (!s.ok())
                                 return s;
                             stat->bytes_copied_dram_to_ssd += kPageSize;
@@ -834,7 +1737,7 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                         if (nvm_ph == nullptr) {
                             // Not in NVM buffer pool and not allowed to bypass NVM during read.
                             assert(nvm_ph == nullptr);
-                            nvm_ph = new PageDesc(pid, PageType::NVM_FULL, sph);
+                            nvm_ph = ObjectPool<PageDesc>::New(pid, PageType::NVM_FULL, sph);
                             Page *nvm_p = nullptr;
                             if ((nvm_p = nvm_page_leaky_buffer.Get()) == nullptr) {
                                 // The leaky buffer is empty, do an allocation
@@ -849,20 +1752,21 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                             if (resident_bits != kNumBlocksPerPage) {
                                 ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_ssd_to_nvm +=d; });
                                 LockGuard g_ssd_latch(&sph->ssd_latch);
-                                s = ssd_page_manager->ReadPage(pid, nvm_ph->page);
+                                s = ReadSSDPage(pid, nvm_ph->page);
                                 if (!s.ok())
                                     return s;
+                                EmulateNVMWrite(kPageSize);
                                 stat->bytes_copied_ssd_to_nvm += kPageSize;
                                 stat->ssd_reads += 1;
                             }
 
-                            auto evicted = nvm_buf_pool_replacer.Add(nvm_ph, kPageSize);
+                            auto evicted = nvm_buf_pool_replacer->Add(nvm_ph, kPageSize);
                             assert(evicted != nvm_ph);
                             if (evicted != nullptr) {
                                 assert(evicted->PinCount() == -1);
                                 local_evicted_pids.push_back(evicted->pid);
                             }
-                            nvm_buf_pool_replacer.EnsureSpace(local_evicted_pids);
+                            nvm_buf_pool_replacer->EnsureSpace(nvm_ph, local_evicted_pids);
                             stat->nvm_evictions += local_evicted_pids.size();
 
                             assert(config.enable_nvm_buf_pool == true);
@@ -900,6 +1804,7 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                                                                               });
                                 }
                             }
+                            PublishNVMFrame(nvm_ph, dram_ph->dirty);
                             nvm_ph->Reference();
                             sph->nvm_ph = nvm_ph;
                             assert(sph->nvm_ph != nullptr);
@@ -915,7 +1820,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                                 pid_in_flush.Unlock(pid_hash_pos);
                                 pid_in_flush_unlocked = true;
                                 //g.Unlock();
-                                std::this_thread::sleep_for(std::chrono::microseconds(1));
+                                // Let the flush of the evicted page go first.
+                                pid_in_flush.WaitForFlush(pid_hash_pos, pid_in_flush.Sequence(pid_hash_pos));
                                 goto restart;
                             }
                             assert(nvm_ph->PinCount() >= 1);
@@ -928,6 +1834,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                             assert(nvm_ph->page);
 
                             if (dram_ph->dirty == true) {
+                                if (!nvm_ph->dirty)
+                                    SetNVMFrameDirty(nvm_ph, true);
                                 ScopedTimer timer([&, this](unsigned long long d){this->stat->cycles_spent_dram_to_nvm +=d; });
                                 // If the page comes from NVM, we only copy over the dirty blocks if any.
                                 // Copy the dirty blocks in DRAM page over to the NVM page
@@ -953,6 +1861,7 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                         assert(nvm_ph->PinCount() > 0);
                         // Unpin the NVM page after copying
                         Put(nvm_ph, dram_ph->dirty);
+                        EmulateNVMWrite(bytes_copied);
                         stat->bytes_copied_dram_to_nvm += bytes_copied;
                     }
                 }
@@ -973,8 +1882,8 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
                     dram_ph->page = nullptr;
                     sph->dram_ph = nullptr;
 
-                    WaitUntilNoRefs(page_ref_manager, (uint64_t) dram_ph);
-                    delete dram_ph;
+                    Unswizzle(dram_ph);
+                    ObjectPool<PageDesc>::Retire(dram_ph, page_ref_manager);
                 }
             }
         }
@@ -986,16 +1895,17 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
             // We make sure there is no reference to sph and check again.
             WaitUntilNoRefs(shared_pd_ref_manager, (uint64_t) sph);
             if (sph->dram_ph == nullptr && sph->nvm_ph == nullptr) {
-                bool erased = mapping_table.Erase(pid);
+                bool erased = MappingTableErase(pid);
                 assert(erased);
-                delete sph;
+                ObjectPool<SharedPageDesc>::Delete(sph);
             }
         }
     }
     for (auto local_pid : local_evicted_pids) {
         Status s = Flush(local_pid, forced);
-        assert(s.ok());
-        if (!s.ok()) {
+        // Not found if another thread has flushed the page already, the rest still have to be flushed.
+        assert(s.ok() || s.IsNotFound());
+        if (!s.ok() && !s.IsNotFound()) {
             local_evicted_pids.clear();
             return s;
         }
@@ -1003,6 +1913,391 @@ Status ConcurrentBufferManager::Flush(const pid_t pid, bool forced, bool keep_in
     return Status::OK();
 }
 
+void ConcurrentBufferManager::FlushEvictedPages(std::vector<pid_t> &evicted_pids) {
+    if (evicted_pids.empty())
+        return;
+    if (eviction_write_back_pool != nullptr) {
+        eviction_write_back_pool->Enqueue(evicted_pids);
+    } else {
+        for (auto pid : evicted_pids) {
+            Flush(pid);
+        }
+    }
+    evicted_pids.clear();
+}
+
+EvictionWriteBackPool::EvictionWriteBackPool(ConcurrentBufferManager *buf_mgr, size_t num_writers,
+                                             size_t queue_capacity, size_t high_watermark)
+        : buf_mgr(buf_mgr), num_writers(std::max(num_writers, (size_t) 1)),
+          high_watermark(std::max(std::min(high_watermark, queue_capacity), (size_t) 1)),
+          queue(queue_capacity) {}
+
+void EvictionWriteBackPool::Start() {
+    assert(stopped.load() == true);
+    stopped.store(false);
+    for (size_t i = 0; i < num_writers; ++i) {
+        writers.emplace_back(WriterProcess, this);
+    }
+}
+
+void EvictionWriteBackPool::Stop() {
+    if (stopped.load() == false) {
+        stopped.store(true);
+        writer_cv.notify_all();
+        for (auto &t : writers) {
+            t.join();
+        }
+        writers.clear();
+    }
+}
+
+void EvictionWriteBackPool::Enqueue(const std::vector<pid_t> &pids) {
+    for (auto pid : pids) {
+        if (queue.Size() >= high_watermark || queue.TryPush(pid) == false) {
+            // Too many pages pending write-back, wait for the writers to catch up.
+            ScopedTimer timer([this](unsigned long long d) { buf_mgr->stat->cycles_stalled_on_eviction_queue += d; });
+            buf_mgr->stat->eviction_queue_stalls++;
+            num_stalled_producers++;
+            writer_cv.notify_all();
+            do {
+                std::unique_lock<std::mutex> g(producer_mtx);
+                if (queue.Size() >= high_watermark) {
+                    producer_cv.wait_for(g, std::chrono::microseconds(100));
+                }
+            } while (queue.Size() >= high_watermark || queue.TryPush(pid) == false);
+            num_stalled_producers--;
+        }
+        buf_mgr->stat->async_evictions++;
+    }
+    if (num_idle_writers.load() > 0) {
+        writer_cv.notify_one();
+    }
+}
+
+void EvictionWriteBackPool::WriterProcess(EvictionWriteBackPool *pool) {
+    while (true) {
+        pid_t pid;
+        if (pool->queue.TryPop(pid)) {
+            // The page might have been flushed already, in which case Flush returns NotFound.
+            pool->buf_mgr->Flush(pid);
+            if (pool->num_stalled_producers.load() > 0 && pool->queue.Size() < pool->high_watermark) {
+                pool->producer_cv.notify_all();
+            }
+            continue;
+        }
+        // Only exit when the queue is drained.
+        if (pool->stopped.load()) {
+            break;
+        }
+        pool->num_idle_writers++;
+        {
+            std::unique_lock<std::mutex> g(pool->writer_mtx);
+            if (pool->queue.Size() == 0 && pool->stopped.load() == false) {
+                pool->writer_cv.wait_for(g, std::chrono::milliseconds(1));
+            }
+        }
+        pool->num_idle_writers--;
+    }
+}
+
+FreeFrameProducer::FreeFrameProducer(ConcurrentBufferManager *buf_mgr, ConcurrentReplacer *replacer,
+                                     size_t low_watermark, size_t high_watermark)
+        : buf_mgr(buf_mgr), replacer(replacer) {
+    replacer->SetFreeFrameWatermarks(low_watermark, std::max(low_watermark, high_watermark));
+}
+
+void FreeFrameProducer::Start() {
+    assert(stopped.load() == true);
+    stopped.store(false);
+    producer = std::thread(ProducerProcess, this);
+}
+
+void FreeFrameProducer::Stop() {
+    if (stopped.load() == false) {
+        stopped.store(true);
+        replacer->free_frames_wanted++;
+        ParkingLot::UnparkAll(replacer->free_frames_wanted);
+        producer.join();
+        replacer->SetFreeFrameWatermarks(0, 0);
+    }
+}
+
+void FreeFrameProducer::ProducerProcess(FreeFrameProducer *producer) {
+    ConcurrentReplacer *replacer = producer->replacer;
+    std::vector<pid_t> evicted_pids;
+    while (producer->stopped.load() == false) {
+        int wanted = replacer->free_frames_wanted.load();
+        if (replacer->FreeFrames() < replacer->free_frames_low) {
+            while (producer->stopped.load() == false && replacer->FreeFrames() < replacer->free_frames_high) {
+                PageDesc *evicted = replacer->ProduceFreeFrame();
+                if (evicted == nullptr) {
+                    // Everything is pinned, or dirty while dirty pages are not evicted.
+                    break;
+                }
+                evicted_pids.push_back(evicted->pid);
+                if (evicted_pids.size() >= kFlushBatch) {
+                    producer->buf_mgr->FlushEvictedPages(evicted_pids);
+                }
+            }
+            producer->buf_mgr->FlushEvictedPages(evicted_pids);
+        }
+        ParkingLot::WaitUntil(replacer->free_frames_wanted, [&](int v) {
+            return v != wanted || producer->stopped.load();
+        }, kIdleCheckUs);
+    }
+}
+
+void ResidentSetSnapshotter::Start() {
+    assert(stopped.load() == true);
+    stopped.store(false);
+    snapshotter = std::thread(SnapshotProcess, this);
+}
+
+void ResidentSetSnapshotter::Stop() {
+    if (stopped.load() == false) {
+        {
+            std::lock_guard<std::mutex> g(stop_mtx);
+            stopped.store(true);
+        }
+        stop_cv.notify_all();
+        snapshotter.join();
+    }
+}
+
+void ResidentSetSnapshotter::SnapshotProcess(ResidentSetSnapshotter *snapshotter) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> g(snapshotter->stop_mtx);
+            snapshotter->stop_cv.wait_for(g, snapshotter->period, [snapshotter]() { return snapshotter->stopped.load(); });
+        }
+        if (snapshotter->stopped.load())
+            break;
+        Status s = snapshotter->buf_mgr->SaveResidentSet();
+        if (!s.ok())
+            fprintf(stderr, "ResidentSetSnapshotter resident set not saved: %s\n", s.ToString().c_str());
+    }
+}
+
+MigrationPolicyTuner::MigrationPolicyTuner(ConcurrentBufferManager *buf_mgr, const BufferPoolConfig &config)
+        : buf_mgr(buf_mgr), period(std::max(config.migration_tuner_period_ms, (size_t) 1)),
+          min_prob(std::max(std::min(config.migration_tuner_min_prob, 1.0), 0.0)),
+          max_prob(std::max(std::min(config.migration_tuner_max_prob, 1.0), min_prob)),
+          max_step(config.migration_tuner_max_step), nvm_write_cost(config.migration_tuner_nvm_write_cost),
+          generator(std::random_device()()), frozen(config.migration_tuner_frozen) {}
+
+void MigrationPolicyTuner::Start() {
+    assert(stopped.load() == true);
+    accepted = buf_mgr->GetPageMigrationPolicy();
+    // The first sample is the baseline of the initial policy.
+    SampleCost();
+    stopped.store(false);
+    tuner = std::thread(TunerProcess, this);
+}
+
+void MigrationPolicyTuner::Stop() {
+    if (stopped.load() == false) {
+        {
+            std::lock_guard<std::mutex> g(stop_mtx);
+            stopped.store(true);
+        }
+        stop_cv.notify_all();
+        tuner.join();
+    }
+}
+
+void MigrationPolicyTuner::SetFrozen(bool frozen) {
+    std::lock_guard<std::mutex> g(mtx);
+    this->frozen = frozen;
+    if (frozen && exploring) {
+        exploring = false;
+        buf_mgr->SetPageMigrationPolicy(accepted);
+    }
+}
+
+std::string MigrationPolicyTuner::ToString() const {
+    std::lock_guard<std::mutex> g(mtx);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s, rounds %ld, accepted moves %ld, policy %s, cost %.1f cycles/access",
+             frozen ? "frozen" : "exploring", rounds, accepted_moves, accepted.ToString().c_str(), accepted_cost);
+    return buf;
+}
+
+void MigrationPolicyTuner::TunerProcess(MigrationPolicyTuner *tuner) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> g(tuner->stop_mtx);
+            tuner->stop_cv.wait_for(g, tuner->period, [tuner]() { return tuner->stopped.load(); });
+        }
+        if (tuner->stopped.load())
+            break;
+        tuner->Round();
+    }
+}
+
+double MigrationPolicyTuner::SampleCost() {
+    auto stat = buf_mgr->GetStats();
+    int64_t accesses = stat.buf_gets.load() + stat.swizzled_hits.load();
+    double cycles = stat.cycles_spent_nvm_to_dram.load() + stat.cycles_spent_dram_to_nvm.load() +
+                    stat.cycles_spent_nvm_to_ssd.load() + stat.cycles_spent_dram_to_ssd.load() +
+                    stat.cycles_spent_ssd_to_dram.load() + stat.cycles_spent_ssd_to_nvm.load() +
+                    stat.cycles_stalled_on_eviction_queue.load();
+    double nvm_bytes = stat.bytes_direct_write_nvm.load() + stat.bytes_copied_dram_to_nvm.load() +
+                       stat.bytes_copied_ssd_to_nvm.load();
+    int64_t d_accesses = accesses - last_accesses;
+    double d_cycles = cycles - last_cycles;
+    double d_nvm_bytes = nvm_bytes - last_nvm_bytes;
+    if (d_accesses < 0 || d_cycles < 0 || d_nvm_bytes < 0) {
+        // The stats were cleared, start over from here.
+        last_accesses = accesses;
+        last_cycles = cycles;
+        last_nvm_bytes = nvm_bytes;
+        return -1;
+    }
+    if (d_accesses < kMinAccessesPerRound)
+        return -1;
+    last_accesses = accesses;
+    last_cycles = cycles;
+    last_nvm_bytes = nvm_bytes;
+    return (d_cycles + nvm_write_cost * d_nvm_bytes / 1024) / d_accesses;
+}
+
+PageMigrationPolicy MigrationPolicyTuner::Neighbor(const PageMigrationPolicy &p) {
+    std::uniform_real_distribution<> step(-max_step, max_step);
+    auto clamp = [this](double x) { return std::max(min_prob, std::min(max_prob, x)); };
+    PageMigrationPolicy n = p;
+    switch (generator() % 4) {
+        case 0: n.Dr = clamp(p.Dr + step(generator)); break;
+        case 1: n.Dw = clamp(p.Dw + step(generator)); break;
+        case 2: n.Nr = clamp(p.Nr + step(generator)); break;
+        default: n.Nw = clamp(p.Nw + step(generator)); break;
+    }
+    return n;
+}
+
+void MigrationPolicyTuner::Round() {
+    constexpr double kCooling = 0.95;
+    constexpr double kMinTemperature = 0.001;
+    std::lock_guard<std::mutex> g(mtx);
+    double cost = SampleCost();
+    if (cost < 0)
+        return;
+    ++rounds;
+    if (exploring) {
+        exploring = false;
+        // Relative to the accepted cost, so that the temperature does not depend on the hardware.
+        double delta = accepted_cost > 0 ? (cost - accepted_cost) / accepted_cost : (cost > 0 ? 1 : 0);
+        std::uniform_real_distribution<> uniform(0.0, 1.0);
+        if (delta < 0 || uniform(generator) < std::exp(-delta / temperature)) {
+            accepted = candidate;
+            accepted_cost = cost;
+            ++accepted_moves;
+            LOG_INFO("MigrationPolicyTuner accepted %s, cost %.1f", accepted.ToString().c_str(), cost);
+        } else {
+            buf_mgr->SetPageMigrationPolicy(accepted);
+        }
+        temperature = std::max(temperature * kCooling, kMinTemperature);
+    } else {
+        // A measurement of the accepted policy, which follows workload changes.
+        accepted_cost = cost;
+    }
+    if (frozen)
+        return;
+    candidate = Neighbor(accepted);
+    buf_mgr->SetPageMigrationPolicy(candidate);
+    exploring = true;
+}
+
+AdmissionFilter::AdmissionFilter(size_t num_entries) : additions(0), agings(0) {
+    size_t n = 64;
+    while (n < num_entries)
+        n <<= 1;
+    width = n;
+    // 8 bits per page with two probes keep the false positive rate of the doorkeeper around 5%.
+    doorkeeper_bits = 8 * n;
+    sample_size = 10 * std::max(num_entries, (size_t) 1);
+    sketch = std::vector<std::atomic<uint64_t>>(kDepth * width / 16);
+    doorkeeper = std::vector<std::atomic<uint64_t>>(doorkeeper_bits / 64);
+    for (auto &w : sketch)
+        w.store(0, std::memory_order_relaxed);
+    for (auto &w : doorkeeper)
+        w.store(0, std::memory_order_relaxed);
+}
+
+uint64_t AdmissionFilter::Hash(pid_t pid) {
+    uint64_t h = pid;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+size_t AdmissionFilter::CounterIndex(uint64_t h, int row) const {
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    return row * width + ((h1 + row * h2) & (width - 1));
+}
+
+bool AdmissionFilter::DoorkeeperContains(uint64_t h) const {
+    size_t b1 = (h >> 32) & (doorkeeper_bits - 1);
+    size_t b2 = (h * 0x9e3779b97f4a7c15ULL >> 32) & (doorkeeper_bits - 1);
+    return (doorkeeper[b1 / 64].load(std::memory_order_relaxed) & (1ULL << (b1 % 64))) &&
+           (doorkeeper[b2 / 64].load(std::memory_order_relaxed) & (1ULL << (b2 % 64)));
+}
+
+bool AdmissionFilter::DoorkeeperInsert(uint64_t h) {
+    size_t b1 = (h >> 32) & (doorkeeper_bits - 1);
+    size_t b2 = (h * 0x9e3779b97f4a7c15ULL >> 32) & (doorkeeper_bits - 1);
+    uint64_t old1 = doorkeeper[b1 / 64].fetch_or(1ULL << (b1 % 64), std::memory_order_relaxed);
+    uint64_t old2 = doorkeeper[b2 / 64].fetch_or(1ULL << (b2 % 64), std::memory_order_relaxed);
+    return (old1 & (1ULL << (b1 % 64))) && (old2 & (1ULL << (b2 % 64)));
+}
+
+void AdmissionFilter::Record(pid_t pid) {
+    uint64_t h = Hash(pid);
+    if (DoorkeeperInsert(h)) {
+        for (int row = 0; row < kDepth; ++row) {
+            size_t idx = CounterIndex(h, row);
+            auto &w = sketch[idx / 16];
+            int shift = (idx % 16) * 4;
+            uint64_t old = w.load(std::memory_order_relaxed);
+            while (((old >> shift) & 0xf) < kMaxCount &&
+                   !w.compare_exchange_weak(old, old + (1ULL << shift), std::memory_order_relaxed)) {
+            }
+        }
+    }
+    if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size)
+        Age();
+}
+
+void AdmissionFilter::Age() {
+    for (auto &w : sketch) {
+        uint64_t old = w.load(std::memory_order_relaxed);
+        while (!w.compare_exchange_weak(old, (old >> 1) & 0x7777777777777777ULL, std::memory_order_relaxed)) {
+        }
+    }
+    for (auto &w : doorkeeper)
+        w.store(0, std::memory_order_relaxed);
+    additions.fetch_sub(sample_size / 2, std::memory_order_relaxed);
+    agings.fetch_add(1, std::memory_order_relaxed);
+}
+
+int AdmissionFilter::Estimate(pid_t pid) const {
+    uint64_t h = Hash(pid);
+    int freq = kMaxCount;
+    for (int row = 0; row < kDepth; ++row) {
+        size_t idx = CounterIndex(h, row);
+        int c = (sketch[idx / 16].load(std::memory_order_relaxed) >> ((idx % 16) * 4)) & 0xf;
+        freq = std::min(freq, c);
+    }
+    return freq + (DoorkeeperContains(h) ? 1 : 0);
+}
+
+bool AdmissionFilter::Admit(pid_t candidate, pid_t victim) const {
+    int candidate_freq = Estimate(candidate);
+    if (victim == kInvalidPID)
+        return candidate_freq > 1;
+    return candidate_freq > Estimate(victim);
+}
+
 Status ConcurrentBufferManager::Put(PageDesc *ph, bool dirtied) {
     ph->dirty |= dirtied;
     if (ph->type == DRAM_FULL && dirtied) {
@@ -1030,10 +2325,231 @@ void ConcurrentBufferManager::SetPageMigrationPolicy(PageMigrationPolicy policy)
     this->migration_policy = policy;
 }
 
+void ConcurrentBufferManager::FreezeMigrationPolicyTuner(bool frozen) {
+    if (migration_policy_tuner != nullptr)
+        migration_policy_tuner->SetFrozen(frozen);
+}
+
+Status ConcurrentBufferManager::ResizeTier(BufferPoolTier tier, size_t new_cap_in_bytes) {
+    bool dram = tier == BufferPoolTier::DRAM;
+    if (!dram && !config.enable_nvm_buf_pool)
+        return Status::InvalidArgument("ConcurrentBufferManager::ResizeTier", "NVM buffer pool not enabled");
+    ConcurrentReplacer *replacer = dram ? dram_buf_pool_replacer.get() : nvm_buf_pool_replacer.get();
+    if ((int64_t) new_cap_in_bytes > replacer->MaxCapacity())
+        return Status::InvalidArgument("ConcurrentBufferManager::ResizeTier",
+                                       "above the maximum capacity " + std::to_string(replacer->MaxCapacity()));
+    if (new_cap_in_bytes < kPageSize * replacer->NumPartitions())
+        return Status::InvalidArgument("ConcurrentBufferManager::ResizeTier",
+                                       "below a page per replacer partition");
+
+    std::lock_guard<std::mutex> g(resize_mtx);
+    auto set_heap_limit = [&](size_t cap_in_bytes) {
+        if (dram || nvm_page_allocators.empty())
+            return;
+        // The same overflow pages as in Init.
+        size_t padded_num_pages = cap_in_bytes / kPageSize * 1.1;
+        for (auto allocator : nvm_page_allocators)
+            allocator->SetLimit(numa_nodes == 1 ? padded_num_pages : padded_num_pages / numa_nodes + 1);
+    };
+    int64_t cap = replacer->Capacity();
+    int64_t target = new_cap_in_bytes;
+    if (target > cap) {
+        set_heap_limit(target);
+        replacer->Grow(target - cap);
+    } else {
+        std::vector<pid_t> evicted_pids;
+        while (cap > target) {
+            int64_t step = std::min(cap - target, (int64_t) kPageSize);
+            replacer->Shrink(step, evicted_pids);
+            (dram ? stat->dram_evictions : stat->nvm_evictions) += evicted_pids.size();
+            FlushEvictedPages(evicted_pids);
+            cap -= step;
+        }
+        // Heap file pages still holding evicted pages are released as they are freed.
+        set_heap_limit(target);
+    }
+
+    (dram ? config.dram_buf_pool_cap_in_bytes : config.nvm_buf_pool_cap_in_bytes) = new_cap_in_bytes;
+    if ((dram ? dram_frame_producer : nvm_frame_producer) != nullptr) {
+        replacer->SetFreeFrameWatermarks(FreeFrameWatermark(new_cap_in_bytes, config.free_frame_low_watermark),
+                                         FreeFrameWatermark(new_cap_in_bytes, config.free_frame_high_watermark));
+    }
+    return Status::OK();
+}
+
+namespace {
+
+// The resident set file written by SaveResidentSet, a header followed by an entry per resident page.
+struct ResidentSetHeader {
+    uint64_t magic;
+    uint64_t num_entries;
+    // Masked crc32c of the entries.
+    uint32_t crc;
+    uint32_t padding;
+};
+
+struct ResidentSetEntry {
+    pid_t pid;
+    // A BufferPoolTier
+    uint8_t tier;
+    uint8_t referenced;
+    uint8_t padding[6];
+};
+
+static_assert(sizeof(ResidentSetEntry) == 16, "ResidentSetEntry is padded");
+
+constexpr uint64_t kResidentSetMagic = 0x3154455354534552ULL; // "RESTSET1"
+
+}
+
+Status ConcurrentBufferManager::SaveResidentSet() {
+    const std::string &path = config.warm_restart_snapshot_path;
+    if (path.empty())
+        return Status::InvalidArgument("ConcurrentBufferManager::SaveResidentSet", "no warm_restart_snapshot_path");
+    std::lock_guard<std::mutex> g(snapshot_mtx);
+    std::vector<ResidentSetEntry> entries;
+    std::vector<std::pair<pid_t, bool>> pages;
+    auto add_tier = [&](ConcurrentReplacer *replacer, BufferPoolTier tier) {
+        pages.clear();
+        replacer->GetResidentPages(pages);
+        for (auto &page : pages) {
+            ResidentSetEntry e = {};
+            e.pid = page.first;
+            e.tier = (uint8_t) tier;
+            e.referenced = page.second;
+            entries.push_back(e);
+        }
+    };
+    add_tier(dram_buf_pool_replacer.get(), BufferPoolTier::DRAM);
+    if (config.enable_nvm_buf_pool)
+        add_tier(nvm_buf_pool_replacer.get(), BufferPoolTier::NVM);
+
+    ResidentSetHeader header = {};
+    header.magic = kResidentSetMagic;
+    header.num_entries = entries.size();
+    header.crc = crc32c::Mask(crc32c::Value((const char *) entries.data(), entries.size() * sizeof(ResidentSetEntry)));
+    // Written aside and renamed over the old file, a crash leaves one of the two whole.
+    std::string tmp_path = path + ".tmp";
+    int fd = -1;
+    Status s = PosixEnv::CreateRWFile(tmp_path, fd);
+    if (!s.ok())
+        return s;
+    s = PosixEnv::PWrite(fd, 0, &header, sizeof(header));
+    if (s.ok() && !entries.empty())
+        s = PosixEnv::PWrite(fd, sizeof(header), entries.data(), entries.size() * sizeof(ResidentSetEntry));
+    if (s.ok() && fsync(fd) != 0)
+        s = PosixError(tmp_path, errno);
+    close(fd);
+    if (!s.ok())
+        return s;
+    return PosixEnv::RenameFile(tmp_path, path);
+}
+
+Status ConcurrentBufferManager::LoadResidentSet() {
+    const std::string &path = config.warm_restart_snapshot_path;
+    if (!PosixEnv::FileExists(path))
+        return Status::OK();
+    uint64_t size = 0;
+    Status s = PosixEnv::GetFileSize(path, &size);
+    if (!s.ok())
+        return s;
+    int fd = -1;
+    s = PosixEnv::OpenRWFile(path, fd);
+    if (!s.ok())
+        return s;
+    ResidentSetHeader header = {};
+    std::vector<ResidentSetEntry> entries;
+    bool valid = false;
+    if (size >= sizeof(header))
+        s = PosixEnv::PRead(fd, 0, &header, sizeof(header));
+    if (s.ok() && size >= sizeof(header) && header.magic == kResidentSetMagic &&
+        size == sizeof(header) + header.num_entries * sizeof(ResidentSetEntry)) {
+        entries.resize(header.num_entries);
+        if (!entries.empty())
+            s = PosixEnv::PRead(fd, sizeof(header), entries.data(), entries.size() * sizeof(ResidentSetEntry));
+        valid = s.ok() && crc32c::Unmask(header.crc) ==
+                          crc32c::Value((const char *) entries.data(), entries.size() * sizeof(ResidentSetEntry));
+    }
+    close(fd);
+    if (!s.ok())
+        return s;
+    if (!valid) {
+        fprintf(stderr, "ConcurrentBufferManager::Init resident set %s damaged, starting cold\n", path.c_str());
+        return Status::OK();
+    }
+
+    // Referenced pages first, they are the first to go if the tiers have shrunk since.
+    std::stable_partition(entries.begin(), entries.end(), [](const ResidentSetEntry &e) { return e.referenced != 0; });
+    std::vector<pid_t> dram_pids, nvm_pids;
+    size_t dram_limit = config.dram_buf_pool_cap_in_bytes / kPageSize;
+    size_t nvm_limit = config.enable_nvm_buf_pool ? config.nvm_buf_pool_cap_in_bytes / kPageSize : 0;
+    for (auto &e : entries) {
+        // Freed since the snapshot
+        if (!ssd_page_manager->Allocated(e.pid))
+            continue;
+        if (e.tier == (uint8_t) BufferPoolTier::DRAM && dram_pids.size() < dram_limit)
+            dram_pids.push_back(e.pid);
+        else if (e.tier == (uint8_t) BufferPoolTier::NVM && nvm_pids.size() < nvm_limit)
+            nvm_pids.push_back(e.pid);
+    }
+
+    PageMigrationPolicy policy = migration_policy;
+    // HyMem only admits pages into NVM when they leave DRAM, its NVM pages are left to come back that way.
+    if (!config.enable_hymem) {
+        // Bypass DRAM and stop in NVM.
+        PageMigrationPolicy nvm_policy;
+        nvm_policy.Dr = nvm_policy.Dw = 0;
+        nvm_policy.Nr = nvm_policy.Nw = 1;
+        WarmUp(nvm_pids, nvm_policy, INTENT_READ);
+    }
+    // Read whole pages straight from SSD into DRAM, pages in both tiers are filled from NVM on their first access.
+    PageMigrationPolicy dram_policy = policy;
+    dram_policy.Dr = dram_policy.Dw = 1;
+    if (!config.enable_hymem)
+        dram_policy.Nr = dram_policy.Nw = 0;
+    WarmUp(dram_pids, dram_policy, INTENT_READ_FULL);
+    migration_policy = policy;
+    fprintf(stderr, "ConcurrentBufferManager::Init warmed up %lu DRAM and %lu NVM pages from %s\n",
+            dram_pids.size(), config.enable_hymem ? 0 : nvm_pids.size(), path.c_str());
+    return Status::OK();
+}
+
+void ConcurrentBufferManager::WarmUp(const std::vector<pid_t> &pids, const PageMigrationPolicy &policy,
+                                     PageOPIntent intent) {
+    migration_policy = policy;
+    std::atomic<size_t> next_batch{0};
+    auto warm_up_batches = [&]() {
+        while (true) {
+            size_t begin = next_batch++ * kWarmUpBatch;
+            if (begin >= pids.size())
+                break;
+            size_t n = std::min(kWarmUpBatch, pids.size() - begin);
+            // The SSD reads of a batch overlap
+            Prefetch(&pids[begin], n);
+            for (size_t i = begin; i < begin + n; ++i) {
+                PageAccessor accessor;
+                if (!Get(pids[i], accessor, intent).ok())
+                    continue;
+                // Frames are filled on their first access
+                accessor.PrepareForRead(0, kPageSize);
+                accessor.FinishAccess();
+                Put(accessor.GetPageDesc());
+                stat->warm_restart_pages++;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < config.warm_restart_threads; ++i)
+        threads.emplace_back(warm_up_batches);
+    warm_up_batches();
+    for (auto &t : threads)
+        t.join();
+}
+
 std::string ConcurrentBufferManager::GetStatsString() const {
     if (config.enable_nvm_buf_pool) {
-        auto dram_pids = std::move(dram_buf_pool_replacer.GetManagedPids());
-        auto nvm_pids = std::move(nvm_buf_pool_replacer.GetManagedPids());
+        auto dram_pids = std::move(dram_buf_pool_replacer->GetManagedPids());
+        auto nvm_pids = std::move(nvm_buf_pool_replacer->GetManagedPids());
         auto merged_pids = nvm_pids;
         for (auto &pid : dram_pids) {
             merged_pids.insert(pid);
@@ -1071,32 +2587,118 @@ void ConcurrentBufferManager::ClearStats() {
 }
 
 
-ConcurrentClockReplacer::ConcurrentClockReplacer(const int64_t capacity_in_bytes, const size_t page_size,
-                                                 RefManager *epoch_manager, ConcurrentBufferManager *buf_mgr)
+static size_t NumReplacerNodes(size_t n_pages, size_t num_nodes) {
+    // Too small to give every node a partition.
+    return n_pages / ConcurrentReplacer::kMinPartitionSlots >= num_nodes ? num_nodes : 1;
+}
+
+static size_t NumReplacerPartitions(size_t n_pages, size_t requested, size_t n_nodes) {
+    size_t n = requested ? requested : std::max(std::thread::hardware_concurrency(), 1u);
+    n = std::min(n, std::max(n_pages / ConcurrentReplacer::kMinPartitionSlots, (size_t) 1));
+    // An equal number of partitions per node.
+    return std::max(n / n_nodes, (size_t) 1) * n_nodes;
+}
+
+ConcurrentReplacer::ConcurrentReplacer(const int64_t capacity_in_bytes, const size_t page_size,
+                                       RefManager *epoch_manager, ConcurrentBufferManager *buf_mgr,
+                                       size_t num_partitions, size_t num_nodes, int64_t max_capacity_in_bytes)
         : cap_in_bytes(capacity_in_bytes),
-          n_pages(cap_in_bytes / page_size),
+          max_cap_in_bytes(std::max(capacity_in_bytes, max_capacity_in_bytes)),
+          n_pages(max_cap_in_bytes / page_size),
           pool(n_pages),
           free(n_pages),
-          clock_hand(0),
+          n_nodes(NumReplacerNodes(n_pages, num_nodes)),
+          n_partitions(NumReplacerPartitions(n_pages, num_partitions, n_nodes)),
+          partitions(new Partition[n_partitions]),
+          free_frames(n_pages),
           epoch_manager(epoch_manager),
           buf_mgr(buf_mgr) {
-    Clear();
+    ConcurrentReplacer::Clear();
 }
 
-void ConcurrentClockReplacer::Clear() {
+ConcurrentReplacer *ConcurrentReplacer::Create(ReplacerType type, const int64_t capacity_in_bytes,
+                                               const size_t page_size, RefManager *epoch_manager,
+                                               ConcurrentBufferManager *buf_mgr, size_t num_partitions,
+                                               size_t num_nodes, int64_t max_capacity_in_bytes) {
+    switch (type) {
+        case ReplacerType::TWO_Q:
+            return new ConcurrentTwoQReplacer(capacity_in_bytes, page_size, epoch_manager, buf_mgr,
+                                              num_partitions, num_nodes, max_capacity_in_bytes);
+        case ReplacerType::LRU_2:
+            return new ConcurrentLRU2Replacer(capacity_in_bytes, page_size, epoch_manager, buf_mgr,
+                                              num_partitions, num_nodes, max_capacity_in_bytes);
+        case ReplacerType::CLOCK:
+        default:
+            return new ConcurrentClockReplacer(capacity_in_bytes, page_size, epoch_manager, buf_mgr,
+                                               num_partitions, num_nodes, max_capacity_in_bytes);
+    }
+}
+
+void ConcurrentReplacer::Clear() {
     for (int i = 0; i < n_pages; ++i)
         pool[i].store(nullptr);
     free.store(n_pages);
-    clock_hand.store(0);
-    current_bytes_in_buffer.store(0);
+    for (size_t k = 0; k < n_partitions; ++k) {
+        Partition &p = partitions[k];
+        p.begin = k * n_pages / n_partitions;
+        p.end = (k + 1) * n_pages / n_partitions;
+        p.clock_hand.store(0);
+        p.bytes.store(0);
+        p.budget.store(ShareOf(p, cap_in_bytes.load()));
+        p.cleaning.store(0);
+    }
+    size_t slot;
+    while (free_frames.TryPop(slot));
+    steals.store(0);
+    free_frame_hits.store(0);
+    frames_produced.store(0);
 }
 
-void ConcurrentClockReplacer::AssertNotInBuffer(PageDesc *entry) {
+int64_t ConcurrentReplacer::ShareOf(const Partition &p, int64_t bytes) const {
+    // Split evenly by slots, the shares of all partitions add up to exactly `bytes`.
+    auto bytes_up_to = [&](size_t slot) { return (int64_t) ((__int128) bytes * slot / std::max(n_pages, (size_t) 1)); };
+    return bytes_up_to(p.end) - bytes_up_to(p.begin);
+}
+
+void ConcurrentReplacer::Grow(int64_t bytes) {
+    for (size_t k = 0; k < n_partitions; ++k)
+        partitions[k].budget += ShareOf(partitions[k], bytes);
+    cap_in_bytes += bytes;
+}
+
+void ConcurrentReplacer::Shrink(int64_t bytes, std::vector<pid_t> &evicted_pids) {
+    size_t idx = 0;
+    for (size_t k = 1; k < n_partitions; ++k) {
+        if (partitions[k].budget.load() > partitions[idx].budget.load())
+            idx = k;
+    }
+    cap_in_bytes -= bytes;
+    partitions[idx].budget -= bytes;
+    EnsurePartitionSpace(idx, evicted_pids);
+}
+
+size_t ConcurrentReplacer::PartitionOfSlot(size_t slot) const {
+    size_t k = slot * n_partitions / n_pages;
+    while (k + 1 < n_partitions && partitions[k + 1].begin <= slot)
+        ++k;
+    while (partitions[k].begin > slot)
+        --k;
+    return k;
+}
+
+int64_t ConcurrentReplacer::BytesInBuffer() const {
+    int64_t bytes = 0;
+    for (size_t k = 0; k < n_partitions; ++k)
+        bytes += partitions[k].bytes.load();
+    return bytes;
+}
+
+void ConcurrentReplacer::AssertNotInBuffer(PageDesc *entry) {
     //for (size_t i = 0; i < size; ++i)
     //    assert(pool[i].load() != entry);
 }
 
-std::string ConcurrentClockReplacer::GetStats() const {
+std::string ConcurrentReplacer::GetStats() const {
     int64_t total_size = 0;
     size_t mini_pages = 0;
     size_t full_pages = 0;
@@ -1110,20 +2712,26 @@ std::string ConcurrentClockReplacer::GetStats() const {
             total_size += pool[i].load()->PageSize();
         }
     }
-    assert(total_size == current_bytes_in_buffer.load());
+    assert(total_size == BytesInBuffer());
     char buf[1000];
-    snprintf(buf, sizeof(buf), "mini pages: %lu\n"
+    snprintf(buf, sizeof(buf), "policy:     %s\n"
+                               "mini pages: %lu\n"
                                "full pages: %lu\n"
                                "page slots: %lu\n"
                                "bytes:      %lu\n"
-                               "cap_bytes:  %lu\n",
-             mini_pages, full_pages,
-             n_pages, current_bytes_in_buffer.load(),
-             cap_in_bytes);
-    return buf;
+                               "cap_bytes:  %lu\n"
+                               "partitions: %lu\n"
+                               "steals:     %ld\n"
+                               "free frames taken:    %ld\n"
+                               "free frames produced: %ld\n",
+             Name().c_str(), mini_pages, full_pages,
+             n_pages, BytesInBuffer(),
+             cap_in_bytes.load(), n_partitions, steals.load(),
+             free_frame_hits.load(), frames_produced.load());
+    return buf + PolicyStats();
 }
 
-std::unordered_set<pid_t> ConcurrentClockReplacer::GetManagedPids() const {
+std::unordered_set<pid_t> ConcurrentReplacer::GetManagedPids() const {
     std::unordered_set<pid_t> pids;
     for (size_t i = 0; i < n_pages; ++i) {
         if (pool[i].load()) {
@@ -1133,175 +2741,412 @@ std::unordered_set<pid_t> ConcurrentClockReplacer::GetManagedPids() const {
     return pids;
 }
 
-
-void ConcurrentClockReplacer::EvictPurgablePages(const std::unordered_set<pid_t> &evict_set) {
+void ConcurrentReplacer::GetResidentPages(std::vector<std::pair<pid_t, bool>> &pages) const {
     pd_reader_ref->Register(epoch_manager);
-    {
+    for (size_t i = 0; i < n_pages; ++i) {
+        if (pool[i].load() == nullptr)
+            continue;
+        ThreadRefGuard g(*pd_reader_ref);
+        PageDesc *e = pool[i].load();
+        if (e == nullptr)
+            continue;
+        pd_reader_ref->SetValue((uint64_t) e);
+        pages.emplace_back(e->pid, e->Referenced());
+    }
+}
 
-        int start = clock_hand.load() % n_pages;
-        int i = start;
-        do {
-            PageDesc *e = pool[i].load();
-            if (e == nullptr) {
-                i = (i + 1) % n_pages;
-                continue;
-            }
-            ThreadRefGuard g(*pd_reader_ref);
-            e = pool[i].load();
-            if (e == nullptr) {
-                i = (i + 1) % n_pages;
-                continue;
-            }
-            pd_reader_ref->SetValue((uint64_t) e);
-            if (evict_set.find(e->pid) == evict_set.end()) {
-                i = (i + 1) % n_pages;
-                continue;
-            }
-            int pin_count = e->PinCount();
-            assert(pin_count <= 0);
-            // pin_count == 0
-            if (e->TryEvict()) {
-                pool[i].store(nullptr);
-                MoveClockHand(i, start);
-                current_bytes_in_buffer.increment(0 - e->PageSize());
-                e->dirty = false;
-                e->dirty_bitmap.ClearAll();
-            }
-            // else {} others have evicted this entry
-            i = (i + 1) % n_pages;
-        } while (i != start);
+
+void ConcurrentReplacer::EvictPurgablePages(const std::unordered_set<pid_t> &evict_set) {
+    pd_reader_ref->Register(epoch_manager);
+    for (size_t i = 0; i < n_pages; ++i) {
+        PageDesc *e = pool[i].load();
+        if (e == nullptr)
+            continue;
+        ThreadRefGuard g(*pd_reader_ref);
+        e = pool[i].load();
+        if (e == nullptr)
+            continue;
+        pd_reader_ref->SetValue((uint64_t) e);
+        if (evict_set.find(e->pid) == evict_set.end())
+            continue;
+        int pin_count = e->PinCount();
+        assert(pin_count <= 0);
+        // pin_count == 0
+        if (e->TryEvict()) {
+            pool[i].store(nullptr);
+            Replaced(partitions[PartitionOfSlot(i)], i, e, nullptr, 0);
+            e->dirty = false;
+            e->dirty_bitmap.ClearAll();
+        }
+        // else {} others have evicted this entry
     }
 }
-PageDesc *ConcurrentClockReplacer::Add(PageDesc *entry, int64_t size) {
+
+PageDesc *ConcurrentReplacer::Add(PageDesc *entry, int64_t size) {
     AssertNotInBuffer(entry);
-    assert(entry->PinCount() > 0);
     assert(entry != nullptr);
-    return Swap(entry, size);
-//    do {
-//        int free_cnt = free.load();
-//        if (free_cnt == 0)
-//            return Swap(entry, size);
-//        if (free.compare_exchange_strong(free_cnt, free_cnt - 1))
-//            break;
-//    } while (true);
-//
-//    // Get an empty slot
-//    auto hand = clock_hand.load();
-//    int idx = hand % n_pages;
-//    while (true) {
-//        auto null = pool[idx].load();
-//        ++hand;
-//        if (null == nullptr) {
-//            if (pool[idx].compare_exchange_strong(null, entry)) {
-//                break;
-//            }
-//        }
-//        idx = (idx + 1) % n_pages;
-//    }
-//
-//    clock_hand.store(hand);
-//    current_bytes_in_buffer.increment(size);
-    return nullptr;
+    assert(entry->PinCount() > 0);
+    pd_reader_ref->Register(epoch_manager);
+    size_t slot;
+    for (int pops = 0; pops < kMaxFreeFramePops && free_frames.TryPop(slot); ++pops) {
+        Partition &p = partitions[PartitionOfSlot(slot)];
+        entry->partition = &p - partitions.get();
+        PageDesc *e = nullptr;
+        if (pool[slot].compare_exchange_strong(e, entry)) {
+            Replaced(p, slot, nullptr, entry, size);
+            free_frame_hits++;
+            WantFreeFrames();
+            return nullptr;
+        }
+        // Taken by a sweep since it was freed
+    }
+    WantFreeFrames();
+    size_t home = HomePartition(entry->pid);
+    while (true) {
+        // Partitions with room come first, nothing is evicted while capacity of another partition is unused.
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t k = 0; k < n_partitions; ++k) {
+                Partition &p = partitions[NthPartition(home, k)];
+                if (pass == 0 && p.bytes.load() + size > p.budget.load())
+                    continue;
+                PageDesc *evicted = nullptr;
+                // Two rounds of the hand are enough to clear the reference bits of every unpinned page on the way.
+                if (Sweep(p, entry, size, 2 * p.Slots(), evicted)) {
+                    if (k > 0)
+                        steals++;
+                    return evicted;
+                }
+            }
+        }
+        // Every page is pinned, or dirty while dirty pages are not evicted.
+        std::this_thread::yield();
+    }
 }
 
-static std::atomic<bool> replacer_cleaning(false);
-
-void ConcurrentClockReplacer::EnsureSpace(std::vector<pid_t> &evicted_pids) {
+void ConcurrentReplacer::EnsurePartitionSpace(size_t idx, std::vector<pid_t> &evicted_pids) {
+    Partition &p = partitions[idx];
     restart:
-    if (current_bytes_in_buffer.load() <= cap_in_bytes)
-        return;
-    bool s = false;
-    if (replacer_cleaning.load() == true || replacer_cleaning.compare_exchange_strong(s, true) == false) {
-        while (current_bytes_in_buffer.load() > cap_in_bytes) {
-            if (replacer_cleaning == false) {
-                goto restart;
-            }
-            std::this_thread::yield();
-        }
+    if (p.bytes.load() <= p.budget.load())
         return;
+    int s = 0;
+    if (p.cleaning.load() == 1 || p.cleaning.compare_exchange_strong(s, 1) == false) {
+        ParkingLot::WaitUntil(p.cleaning, [&p](int cleaning) {
+            return cleaning == 0 || p.bytes.load() <= p.budget.load();
+        });
+        goto restart;
     }
-    // Only one thread is allowed to do the space cleaning
-    do {
-        PageDesc *evicted = Swap(nullptr, 0);
+    // Only one thread is allowed to do the space cleaning of a partition
+    pd_reader_ref->Register(epoch_manager);
+    while (p.bytes.load() > p.budget.load()) {
+        PageDesc *evicted = nullptr;
+        if (Sweep(p, nullptr, 0, 2 * p.Slots(), evicted) == false)
+            evicted = StealBudget(idx);
         if (evicted != nullptr) {
             assert(evicted->Evicted());
             evicted_pids.push_back(evicted->pid);
+        } else {
+            std::this_thread::yield();
         }
-    } while (current_bytes_in_buffer.load() > cap_in_bytes);
+    }
+
+    p.cleaning.store(0);
+    ParkingLot::UnparkAll(p.cleaning);
+}
 
-    replacer_cleaning.store(false);
+PageDesc *ConcurrentReplacer::StealBudget(size_t idx) {
+    Partition &p = partitions[idx];
+    for (size_t k = 1; k < n_partitions; ++k) {
+        Partition &q = partitions[NthPartition(idx, k)];
+        // Leave every partition at least half of its even share of the capacity.
+        int64_t min_budget = ShareOf(q, cap_in_bytes.load()) / 2;
+        if (q.budget.load() - (int64_t) kPageSize < min_budget)
+            continue;
+        PageDesc *evicted = nullptr;
+        if (Sweep(q, nullptr, 0, 2 * q.Slots(), evicted)) {
+            int64_t size = evicted->PageSize();
+            q.budget -= size;
+            p.budget += size;
+            steals++;
+            return evicted;
+        }
+    }
+    return nullptr;
 }
 
-PageDesc *ConcurrentClockReplacer::Swap(PageDesc *entry, int64_t size) {
+void ConcurrentReplacer::WaitForCleanPages(const Partition &p, size_t steps) {
+    if (steps % std::max(p.Slots() / 5, (size_t) 1) == 0) {
+        // There is still no clean page after a sweep over a long distance, notify the page cleaner.
+        if (buf_mgr->GetLogManager()) {
+            buf_mgr->GetLogManager()->WakeUpPageCleaner();
+            // Wait a while for the page cleaner to produce some clean pages
+            buf_mgr->WaitForPageCleanerSignal(30);
+        }
+    }
+}
+
+void ConcurrentReplacer::Replaced(Partition &p, size_t slot, PageDesc *e, PageDesc *entry, int64_t size) {
+    if (entry != nullptr)
+        OnAdmit(entry);
+    p.bytes += size - (e != nullptr ? (int64_t) e->PageSize() : 0);
+    if (e != nullptr) {
+        OnEvict(e);
+        // A full list only means Add sweeps for the slot.
+        if (entry == nullptr)
+            free_frames.TryPush(slot);
+    }
+}
+
+void ConcurrentReplacer::WantFreeFrames() {
+    if (free_frames_low == 0 || FreeFrames() >= free_frames_low)
+        return;
+    free_frames_wanted++;
+    ParkingLot::UnparkAll(free_frames_wanted);
+}
+
+PageDesc *ConcurrentReplacer::ProduceFreeFrame() {
     pd_reader_ref->Register(epoch_manager);
-    {
-        int num_pinning = 0;
-        int start = clock_hand.load();
-        int steps = 0;
-        for (int i = start % n_pages;; i = (i + 1) % n_pages) {
-            PageDesc *e = pool[i].load();
-            ++steps;
-            if (steps % (n_pages / 5) == 0) {
-                // There is still no clean page after a sweep over a long distance, notify the page cleaner.
-                if (buf_mgr->GetLogManager()) {
-                    buf_mgr->GetLogManager()->WakeUpPageCleaner();
-                    // Wait a while for the page cleaner to produce some clean pages
-                    buf_mgr->WaitForPageCleanerSignal(30);
+    for (size_t k = 0; k < n_partitions; ++k) {
+        Partition &p = partitions[producer_cursor++ % n_partitions];
+        PageDesc *evicted = nullptr;
+        if (Sweep(p, nullptr, 0, 2 * p.Slots(), evicted)) {
+            frames_produced++;
+            return evicted;
+        }
+    }
+    return nullptr;
+}
+
+bool ConcurrentReplacer::Sweep(Partition &p, PageDesc *entry, int64_t size, size_t max_steps, PageDesc *&evicted) {
+    if (entry != nullptr)
+        entry->partition = &p - partitions.get();
+    size_t start = p.clock_hand.load();
+    for (size_t step = 0; step < max_steps; ++step) {
+        size_t i = p.begin + (start + step) % p.Slots();
+        PageDesc *e = pool[i].load();
+        WaitForCleanPages(p, step + 1);
+        if (e == nullptr) {
+            if (entry != nullptr) {
+                if (pool[i].compare_exchange_strong(e, entry)) {
+                    p.clock_hand.fetch_add(step + 1);
+                    Replaced(p, i, nullptr, entry, size);
+                    evicted = nullptr;
+                    return true;
                 }
             }
-            if (e == nullptr) {
-                if (entry != nullptr) {
-                    if (pool[i].compare_exchange_strong(e, entry)) {
-                        entry->Reference();
-                        MoveClockHand(i, start);
-                        current_bytes_in_buffer.increment(size);
-                        return e;
-                    }
+            continue;
+        }
+        ThreadRefGuard g(*pd_reader_ref);
+        e = pool[i].load();
+        if (e == nullptr)
+            continue;
+        pd_reader_ref->SetValue((uint64_t) e);
+        int pin_count = e->PinCount();
+        if (pin_count != 0) {
+            // Pinned, or evicted by another thread
+            continue;
+        }
+        if (ShouldEvict(e) && (evict_dirty == true || e->dirty == false)) {
+            if (e->TryEvict()) {
+                pool[i].store(entry);
+                p.clock_hand.fetch_add(step + 1);
+                Replaced(p, i, e, entry, size);
+                evicted = e;
+                return true;
+            }
+            // others have evicted this entry
+        }
+    }
+    return false;
+}
+
+pid_t ConcurrentReplacer::PeekVictim(pid_t pid, int max_steps) {
+    pd_reader_ref->Register(epoch_manager);
+    Partition &p = partitions[HomePartition(pid)];
+    size_t start = p.clock_hand.load();
+    for (size_t step = 0; step < (size_t) max_steps && step < p.Slots(); ++step) {
+        size_t i = p.begin + (start + step) % p.Slots();
+        if (pool[i].load() == nullptr)
+            continue;
+        ThreadRefGuard g(*pd_reader_ref);
+        PageDesc *e = pool[i].load();
+        if (e == nullptr)
+            continue;
+        pd_reader_ref->SetValue((uint64_t) e);
+        if (e->PinCount() == 0)
+            return e->pid;
+    }
+    return kInvalidPID;
+}
+
+bool ConcurrentClockReplacer::ShouldEvict(PageDesc *e) {
+    if (e->Referenced() == false)
+        return true;
+    e->ClearReferenced();
+    return false;
+}
+
+ConcurrentTwoQReplacer::ConcurrentTwoQReplacer(const int64_t capacity_in_bytes, const size_t page_size,
+                                               RefManager *epoch_manager, ConcurrentBufferManager *buf_mgr,
+                                               size_t num_partitions, size_t num_nodes,
+                                               int64_t max_capacity_in_bytes)
+        : ConcurrentReplacer(capacity_in_bytes, page_size, epoch_manager, buf_mgr, num_partitions, num_nodes,
+                             max_capacity_in_bytes),
+          n_ghosts(std::max(n_pages, (size_t) 1)),
+          ghosts(new std::atomic<pid_t>[n_ghosts]) {
+    Clear();
+}
+
+void ConcurrentTwoQReplacer::Clear() {
+    ConcurrentReplacer::Clear();
+    hot_pages.store(0);
+    for (size_t i = 0; i < n_ghosts; ++i)
+        ghosts[i].store(kInvalidPID);
+    ghost_hits.store(0);
+    promotions.store(0);
+}
+
+void ConcurrentTwoQReplacer::OnAdmit(PageDesc *entry) {
+    entry->ClearReferenced();
+    auto &ghost = GhostSlotOf(entry->pid);
+    pid_t pid = entry->pid;
+    if (ghost.load() == pid && ghost.compare_exchange_strong(pid, kInvalidPID)) {
+        // Missed again shortly after its eviction, the page has a reuse distance close to the pool size.
+        entry->hot.store(true);
+        hot_pages++;
+        ghost_hits++;
+    } else {
+        entry->hot.store(false);
+    }
+}
+
+bool ConcurrentTwoQReplacer::ShouldEvict(PageDesc *e) {
+    bool referenced = e->Referenced();
+    if (referenced)
+        e->ClearReferenced();
+    if (e->hot.load() == false) {
+        if (referenced == false)
+            return true;
+        bool cold = false;
+        if (e->hot.compare_exchange_strong(cold, true)) {
+            hot_pages++;
+            promotions++;
+        }
+        return false;
+    }
+    if (referenced == false && hot_pages.load() > HotTarget()) {
+        bool hot = true;
+        if (e->hot.compare_exchange_strong(hot, false))
+            hot_pages--;
+    }
+    return false;
+}
+
+void ConcurrentTwoQReplacer::OnEvict(PageDesc *e) {
+    if (e->hot.load()) {
+        // Only purging evicts hot pages
+        e->hot.store(false);
+        hot_pages--;
+        return;
+    }
+    GhostSlotOf(e->pid).store(e->pid);
+}
+
+std::string ConcurrentTwoQReplacer::PolicyStats() const {
+    char buf[1000];
+    snprintf(buf, sizeof(buf), "hot pages:  %ld\n"
+                               "hot target: %ld\n"
+                               "promotions: %ld\n"
+                               "ghost hits: %ld\n",
+             hot_pages.load(), HotTarget(), promotions.load(), ghost_hits.load());
+    return buf;
+}
+
+void ConcurrentLRU2Replacer::OnAdmit(PageDesc *entry) {
+    entry->penultimate_access.store(0, std::memory_order_relaxed);
+    entry->last_access.store(++virtual_time, std::memory_order_relaxed);
+}
+
+void ConcurrentLRU2Replacer::Touch(PageDesc *entry) {
+    // Hits between two admissions count as one access, which keeps a burst of
+    // correlated hits from making a page look like it was reused.
+    uint64_t now = virtual_time.load(std::memory_order_relaxed);
+    uint64_t last = entry->last_access.load(std::memory_order_relaxed);
+    if (last != now) {
+        entry->penultimate_access.store(last, std::memory_order_relaxed);
+        entry->last_access.store(now, std::memory_order_relaxed);
+    }
+}
+
+bool ConcurrentLRU2Replacer::Sweep(Partition &p, PageDesc *entry, int64_t size, size_t max_steps,
+                                   PageDesc *&evicted) {
+    if (entry != nullptr)
+        entry->partition = &p - partitions.get();
+    size_t start = p.clock_hand.load();
+    int sampled = 0;
+    size_t victim_slot = 0;
+    PageDesc *victim = nullptr;
+    uint64_t victim_penultimate = 0;
+    uint64_t victim_last = 0;
+    for (size_t step = 0; step < max_steps; ++step) {
+        size_t i = p.begin + (start + step) % p.Slots();
+        PageDesc *e = pool[i].load();
+        WaitForCleanPages(p, step + 1);
+        if (e == nullptr) {
+            if (entry != nullptr) {
+                if (pool[i].compare_exchange_strong(e, entry)) {
+                    p.clock_hand.fetch_add(step + 1);
+                    Replaced(p, i, nullptr, entry, size);
+                    evicted = nullptr;
+                    return true;
                 }
-                continue;
             }
+            continue;
+        }
+        {
             ThreadRefGuard g(*pd_reader_ref);
             e = pool[i].load();
             if (e == nullptr)
                 continue;
             pd_reader_ref->SetValue((uint64_t) e);
-            int pin_count = e->PinCount();
-            if (pin_count == -1) { // evicted ?
-                // Do not compete with other evictors
+            if (e->PinCount() != 0) // Pinned, or evicted by another thread
                 continue;
-            }
-            if (pin_count > 0) {
-                if (++num_pinning >= n_pages) // All pinned ?
-                    std::this_thread::yield();
+            if (evict_dirty == false && e->dirty == true)
                 continue;
+            uint64_t penultimate = e->penultimate_access.load(std::memory_order_relaxed);
+            uint64_t last = e->last_access.load(std::memory_order_relaxed);
+            if (victim == nullptr || penultimate < victim_penultimate ||
+                (penultimate == victim_penultimate && last < victim_last)) {
+                victim = e;
+                victim_slot = i;
+                victim_penultimate = penultimate;
+                victim_last = last;
             }
-            // pin_count == 0
-            if (e->Referenced() == false && (evict_dirty == true || e->dirty == false)) {
-                if (e->TryEvict()) {
-                    pool[i].store(entry);
-                    MoveClockHand(i, start);
-                    if (entry != nullptr)
-                        entry->Reference();
-                    current_bytes_in_buffer.increment(size - e->PageSize());
-                    //                if (entry == nullptr)
-                    //                    free += 1;
-                    return e;
-                }
-                // others have evicted this entry
-            }
-            e->ClearReferenced();
+        }
+        if (++sampled < kSampleSize && step + 1 < max_steps)
+            continue;
+        sampled = 0;
+        if (victim == nullptr)
+            continue;
+        ThreadRefGuard g(*pd_reader_ref);
+        // The victim might have left its slot since it was sampled. Another page taking
+        // over the same descriptor address and slot is fine, it is unpinned as well.
+        PageDesc *candidate = victim;
+        victim = nullptr;
+        e = pool[victim_slot].load();
+        if (e == nullptr || e != candidate)
+            continue;
+        pd_reader_ref->SetValue((uint64_t) e);
+        if (evict_dirty == false && e->dirty == true)
+            continue;
+        if (e->TryEvict()) {
+            pool[victim_slot].store(entry);
+            p.clock_hand.fetch_add(step + 1);
+            Replaced(p, victim_slot, e, entry, size);
+            evicted = e;
+            return true;
         }
     }
-}
-
-void ConcurrentClockReplacer::MoveClockHand(int curr, int start) {
-    int delta;
-    if (curr < start) {
-        delta = curr + (int) n_pages - start + 1;
-    } else {
-        delta = curr - start + 1;
-    }
-    clock_hand.fetch_add(delta);
+    return false;
 }
 
 
@@ -1326,13 +3171,13 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
     LogWrite();
     thread_local static std::vector<pid_t> evicted_pids;
     auto flush_evicted_pages = [&]() {
-        for (auto pid : evicted_pids) {
-            mgr->Flush(pid);
-        }
-        evicted_pids.clear();
+        mgr->FlushEvictedPages(evicted_pids);
     };
     ++num_rw_ops;
     int restart_times = 0;
+    // Where the bytes came from, for the access trace. The mini page path may restart after the fill.
+    AccessTraceTier tier = AccessTraceTier::DRAM;
+    bool traced = false;
     restart:
     {
         if (restart_times++)
@@ -1351,7 +3196,11 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
                 // Mark the corresponding page as dirty
                 MarkDirty(0, kPageSize);
                 mgr->stat->bytes_direct_write_nvm += size;
+                mgr->EmulateNVMWrite(size);
+            } else {
+                mgr->EmulateNVMRead(size);
             }
+            mgr->TraceAccess(AccessTraceOp::ACCESS, ph->pid, intent, off, size, AccessTraceTier::NVM);
             //nvm_ph->Reference();
             //mgr->stat.hits_on_nvm++;
             return Slice(reinterpret_cast<char *>(nvm_ph->page) + off, size);
@@ -1375,6 +3224,8 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
             LockGuard g_dram_latch(&shared_ph->dram_latch);
             unset_bits = dram_ph->NumUnsetBitsInBitmapByRange(off, size, dram_ph->residency_bitmap);
             if (unset_bits) {
+                // FillDRAMPage copies from the NVM page if there is one, it brings one in from SSD otherwise.
+                tier = shared_ph->nvm_ph != nullptr ? AccessTraceTier::NVM : AccessTraceTier::SSD;
                 bool dram_mini = dram_ph->type == PageType::DRAM_MINI;
                 if (dram_mini) {
                     dram_ph->version++;
@@ -1394,6 +3245,8 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
                     if (s.IsPageEvicted()) {
                         g_dram_latch.Unlock();
                         //g.Unlock();
+                        // The page may be one evicted by this very call, its flush must not wait for the retry.
+                        flush_evicted_pages();
                         std::this_thread::sleep_for(std::chrono::microseconds(1));
                         goto restart;
                     } else {
@@ -1410,6 +3263,10 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
         if (intent == PageOPIntent::INTENT_WRITE || intent == PageOPIntent::INTENT_WRITE_FULL) {
             MarkDirty(off, size);
         }
+        if (!traced) {
+            mgr->TraceAccess(AccessTraceOp::ACCESS, dram_ph->pid, intent, off, size, tier);
+            traced = true;
+        }
 
         mgr->page_payload_ref.Register(&page_ref_manager);
         mgr->page_payload_ref.Enter();
@@ -1439,6 +3296,8 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForAccess(uint32_t off, size
 void ConcurrentBufferManager::PageAccessor::MarkDirty(uint32_t off, size_t size) {
     if (cur_type == PageType::NVM_FULL) {
         auto nvm_ph = ph;
+        if (!nvm_ph->dirty)
+            mgr->SetNVMFrameDirty(nvm_ph, true);
         nvm_ph->dirty = true;
     } else {
         // Mark the corresponding blocks as dirty
@@ -1451,18 +3310,20 @@ void ConcurrentBufferManager::PageAccessor::MarkDirty(uint32_t off, size_t size)
 void ConcurrentBufferManager::PageAccessor::LogWrite() {
     if (mgr->GetLogManager() != nullptr) {
         if (dirtied == true) {
-            redo_buf = new char[redo_undo_size];
-            memcpy(redo_buf, undo_origin, redo_undo_size);
+            // The redo image is serialized from the page itself.
             lsn_t lsn = mgr->GetLogManager()->LogUpdate(current_txn_id, GetPageDesc()->pid, redo_undo_page_off,
                                                         redo_undo_size,
-                                                        redo_buf, undo_buf,
+                                                        undo_origin, undo_buf,
                                                         GetLastLogRecordLSN());
             SetLastLogRecordLSN(lsn);
             ClearLoggingStates();
+            if (mgr->IsNVMSSDMode() == true || cur_type == NVM_FULL)
+                mgr->FlushLogForWriteBack();
             if (mgr->IsNVMSSDMode() == true) {
                 NVMUtilities::persist(((char*)shared_ph->dram_ph->page) + redo_undo_page_off, redo_undo_size);
             } else if (cur_type == NVM_FULL) {
                 NVMUtilities::persist(((char*)shared_ph->nvm_ph->page) + redo_undo_page_off, redo_undo_size);
+                mgr->AdvanceNVMFrameLSN(shared_ph->nvm_ph, lsn);
             }
         }
     }
@@ -1471,12 +3332,9 @@ void ConcurrentBufferManager::PageAccessor::LogWrite() {
 void ConcurrentBufferManager::PageAccessor::ClearLoggingStates() {
     if (mgr->GetLogManager() != nullptr) {
         if (dirtied == true) {
-            if (redo_buf)
-                delete[] redo_buf;
             if (undo_buf)
-                delete[] undo_buf;
+                ReleaseLogImage();
 
-            redo_buf = nullptr;
             undo_origin = nullptr;
             undo_buf = nullptr;
             redo_undo_size = 0;
@@ -1500,7 +3358,7 @@ Slice ConcurrentBufferManager::PageAccessor::PrepareForWrite(uint32_t off, size_
     assert(dirtied == false);
     if (mgr->GetLogManager() != nullptr) {
         dirtied = true;
-        undo_buf = new char[size];
+        undo_buf = AllocateLogImage(size);
         memcpy(undo_buf, s.data(), size);
         redo_undo_size = size;
         redo_undo_page_off = off;
@@ -1519,9 +3377,143 @@ std::string PageMigrationPolicy::ToString() const {
     return os.str();
 }
 
-Status NVMPageAllocator::Init() {
-    size_t filesize = num_pages * kPageSize;
-    return PosixEnv::MMapNVMFile(heapfile_path, mmap_start_addr, filesize);
+namespace {
+
+constexpr uint64_t kNVMHeapFileMagic = 0x31504145484d564eULL; // "NVMHEAP1"
+
+}
+
+Status NVMPageAllocator::Init(uint64_t db_id, bool recover) {
+    // The pages, then a cache line for the HeapFileHeader and the frame headers.
+    size_t headers_size = ((kCacheLineSize + num_pages * sizeof(NVMFrameHeader) + kPageSize - 1) / kPageSize) * kPageSize;
+    size_t filesize = num_pages * kPageSize + headers_size;
+    Status s = PosixEnv::MMapNVMFile(heapfile_path, mmap_start_addr, filesize);
+    if (!s.ok())
+        return s;
+    file_header = reinterpret_cast<HeapFileHeader *>(static_cast<char *>(mmap_start_addr) + Size());
+    auto frame_headers = reinterpret_cast<NVMFrameHeader *>(reinterpret_cast<char *>(file_header) + kCacheLineSize);
+    bool valid = file_header->magic == kNVMHeapFileMagic && file_header->db_id == db_id &&
+                 file_header->num_pages == num_pages;
+    // The frame headers are trusted only while every run on the heap file keeps them up to date.
+    file_header->magic = 0;
+    NVMUtilities::persist((char *) file_header, sizeof(HeapFileHeader));
+    if (recover) {
+        headers = frame_headers;
+        if (!valid) {
+            memset((void *) headers, 0, num_pages * sizeof(NVMFrameHeader));
+            NVMUtilities::persist((char *) headers, num_pages * sizeof(NVMFrameHeader));
+        }
+        // Keep the valid pages for RecoverFrames.
+        for (size_t pos = 0; pos < num_pages; ++pos) {
+            if (headers[pos].flags.load() & NVMFrameHeader::kValid)
+                bitmap.TrySet(pos);
+        }
+        file_header->db_id = db_id;
+        file_header->num_pages = num_pages;
+        NVMUtilities::persist((char *) file_header, sizeof(HeapFileHeader));
+        file_header->magic = kNVMHeapFileMagic;
+        NVMUtilities::persist((char *) file_header, sizeof(HeapFileHeader));
+    }
+    // Release the free pages beyond the limit, runs of them at a time.
+    int run = -1;
+    for (int pos = limit.load(); pos <= (int) num_pages; ++pos) {
+        if (pos < (int) num_pages && !bitmap.Test(pos)) {
+            if (run < 0)
+                run = pos;
+            continue;
+        }
+        if (run >= 0) {
+            ReleasePages(run, pos - run);
+            run = -1;
+        }
+    }
+    if (node >= 0) {
+        // Best effort, the file system places the pages of the file. The NVM of a node is picked by the path.
+        Status bs = Numa::BindToNode(mmap_start_addr, filesize, node);
+        if (!bs.ok())
+            fprintf(stderr, "NVMPageAllocator::Init %s not bound to node %d: %s\n", heapfile_path.c_str(), node,
+                    bs.ToString().c_str());
+    }
+    return s;
+}
+
+void NVMPageAllocator::RecoverFrames(const std::function<bool(void *, const NVMFrameHeader &)> &adopt) {
+    if (headers == nullptr)
+        return;
+    for (size_t pos = 0; pos < num_pages; ++pos) {
+        if ((headers[pos].flags.load() & NVMFrameHeader::kValid) == 0)
+            continue;
+        void *p = static_cast<char *>(mmap_start_addr) + pos * kPageSize;
+        if (!adopt(p, headers[pos])) {
+            ClearFrame(p);
+            DeallocatePage(p);
+        }
+    }
+}
+
+void NVMPageAllocator::PublishFrame(void *p, pid_t pid, bool dirty) {
+    NVMFrameHeader *header = HeaderOf(p);
+    if (header == nullptr)
+        return;
+    // The fields share a cache line, so they persist in the order they are stored in.
+    header->flags.store(0);
+    header->pid.store(pid);
+    header->lsn.store(0);
+    header->flags.store(NVMFrameHeader::kValid | (dirty ? NVMFrameHeader::kDirty : 0));
+    PersistHeader(header);
+}
+
+void NVMPageAllocator::SetFrameDirty(void *p, bool dirty) {
+    NVMFrameHeader *header = HeaderOf(p);
+    if (header == nullptr)
+        return;
+    if (dirty)
+        header->flags.fetch_or(NVMFrameHeader::kDirty);
+    else
+        header->flags.fetch_and(~NVMFrameHeader::kDirty);
+    PersistHeader(header);
+}
+
+void NVMPageAllocator::AdvanceFrameLSN(void *p, uint64_t lsn) {
+    NVMFrameHeader *header = HeaderOf(p);
+    if (header == nullptr)
+        return;
+    uint64_t cur = header->lsn.load();
+    while (cur < lsn && !header->lsn.compare_exchange_weak(cur, lsn));
+    PersistHeader(header);
+}
+
+void NVMPageAllocator::ClearFrame(void *p) {
+    NVMFrameHeader *header = HeaderOf(p);
+    if (header == nullptr)
+        return;
+    header->flags.store(0);
+    PersistHeader(header);
+}
+
+void NVMPageAllocator::SetLimit(size_t n_pages) {
+    int new_limit = std::min(((n_pages + 63) / 64) * 64, num_pages);
+    int old_limit = limit.exchange(new_limit);
+    // Take the free pages beyond the new limit while their storage is released, runs of them at a time.
+    int run = -1;
+    for (int pos = new_limit; pos <= old_limit; ++pos) {
+        if (pos < old_limit && bitmap.TrySet(pos)) {
+            if (run < 0)
+                run = pos;
+            continue;
+        }
+        if (run >= 0) {
+            ReleasePages(run, pos - run);
+            for (int i = run; i < pos; ++i)
+                bitmap.Clear(i);
+            run = -1;
+        }
+    }
+}
+
+void NVMPageAllocator::ReleasePages(size_t first, size_t count) {
+    // Best effort, the file system may not support punching holes.
+    madvise(static_cast<char *>(mmap_start_addr) + first * kPageSize, count * kPageSize, MADV_REMOVE);
 }
 
 
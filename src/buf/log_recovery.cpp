@@ -0,0 +1,228 @@
+//
+// Created by zxjcarrot on 2020-06-22.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include "engine/txn.h"
+#include "buf/buf_mgr.h"
+
+namespace spitfire {
+
+LogRecovery::LogRecovery(ConcurrentBufferManager *buf_mgr, LogFileBackend *backend1, LogFileBackend *backend2,
+                         uint64_t db_id, size_t num_threads)
+        : buf_mgr(buf_mgr), db_id(db_id), num_threads(std::max(num_threads, (size_t) 1)) {
+    backends[0] = backend1;
+    backends[1] = backend2;
+}
+
+LogRecovery::~LogRecovery() {
+    for (auto &entries : records) {
+        for (auto &e : entries)
+            delete e.rec;
+    }
+}
+
+bool LogRecovery::ReadMainRecord(MainRecord &main_rec) {
+    bool found = false;
+    for (auto backend : backends) {
+        if (backend->CurrentCapacity() < sizeof(MainRecord))
+            continue;
+        MainRecord rec;
+        memcpy(&rec, backend->Data(), sizeof(rec));
+        if (rec.crc != rec.ComputeCRC())
+            continue;
+        // The next log starts past that of any database which used the files before.
+        end_lsn = std::max(end_lsn, std::max(rec.start_lsn, rec.latest_checkpoint));
+        if (rec.db_id != db_id)
+            continue;
+        if (!found || std::tie(rec.start_lsn, rec.latest_checkpoint, rec.log_begin_lsn) >
+                      std::tie(main_rec.start_lsn, main_rec.latest_checkpoint, main_rec.log_begin_lsn)) {
+            main_rec = rec;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void LogRecovery::FindBuffers(LogFileBackend *backend, std::vector<Buffer> &buffers) {
+    const char *data = backend->Data();
+    size_t capacity = backend->CurrentCapacity();
+    size_t pos = backend->FirstBufferOffset();
+    lsn_t expected_lsn = kInvalidLSN;
+    while (pos + sizeof(LogBufferHeader) <= capacity) {
+        const LogBufferHeader *header = (const LogBufferHeader *) (data + pos);
+        if (header->magic != LogBufferHeader::kMagic || header->capacity == 0 ||
+            header->capacity > capacity - pos - sizeof(LogBufferHeader))
+            break;
+        if (header->format != kSequentialLogBuffer && header->format != kSlottedLogBuffer)
+            break;
+        // A buffer of an older log, after the last one the file was rewritten with.
+        if (expected_lsn != kInvalidLSN && header->start_lsn != expected_lsn)
+            break;
+        // The records past durable_lsn were not flushed, parts of them may have reached the file.
+        uint64_t durable_size = header->durable_lsn > header->start_lsn ?
+                                std::min(header->durable_lsn - header->start_lsn, header->capacity) : 0;
+        buffers.push_back({header->start_lsn, header->capacity, (LogBufferFormat) header->format,
+                           data + pos + sizeof(LogBufferHeader), durable_size});
+        expected_lsn = header->start_lsn + header->capacity;
+        end_lsn = std::max(end_lsn, expected_lsn);
+        pos += sizeof(LogBufferHeader) + header->capacity;
+    }
+}
+
+void LogRecovery::ParseBuffer(const Buffer &buffer, std::vector<Entry> &entries) {
+    if (buffer.format == kSequentialLogBuffer) {
+        LogRecordParser parser(buffer.data, buffer.durable_size);
+        size_t offset = 0;
+        while (LogRecord *rec = parser.ParseNext(offset))
+            entries.push_back({buffer.start_lsn + offset, rec});
+        return;
+    }
+    PersistentLogBuffer<>::ForEachRecord(buffer.data, buffer.capacity,
+                                         [&](uint32_t offset, const char *payload, size_t size) {
+        LogRecordParser parser(payload, size);
+        size_t record_offset = 0;
+        LogRecord *rec = parser.ParseNext(record_offset);
+        if (rec != nullptr)
+            entries.push_back({buffer.start_lsn + offset, rec});
+    });
+    // The slots of a record are wherever its hash put them, its lsn is that of its head slot.
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.lsn < b.lsn; });
+}
+
+void LogRecovery::RunInParallel(const std::function<void(size_t)> &f) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i)
+        threads.emplace_back(f, i);
+    f(0);
+    for (auto &t : threads)
+        t.join();
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Status LogRecovery::Run() {
+    auto start = std::chrono::steady_clock::now();
+    MainRecord main_rec;
+    bool found = ReadMainRecord(main_rec);
+    std::vector<Buffer> buffers;
+    FindBuffers(backends[0], buffers);
+    FindBuffers(backends[1], buffers);
+    // A new database, or files with no log of this one. Only end_lsn matters then.
+    if (!found)
+        return Status::OK();
+
+    /**
+     * Analysis: parse the buffers of the last two log files and find the losers.
+     */
+    buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [&](const Buffer &b) {
+        return b.start_lsn < main_rec.log_begin_lsn;
+    }), buffers.end());
+    std::sort(buffers.begin(), buffers.end(), [](const Buffer &a, const Buffer &b) {
+        return a.start_lsn < b.start_lsn;
+    });
+    records.resize(buffers.size());
+    std::atomic<size_t> next_buffer{0};
+    RunInParallel([&](size_t) {
+        for (size_t i = next_buffer++; i < buffers.size(); i = next_buffer++)
+            ParseBuffer(buffers[i], records[i]);
+    });
+    buffers_parsed = buffers.size();
+
+    // Whether a transaction with updates ended.
+    std::unordered_map<txn_id_t, bool> ended;
+    for (auto &entries : records) {
+        for (auto &e : entries) {
+            ++records_parsed;
+            txn_id_t tid = e.rec->GetTID();
+            switch (e.rec->GetType()) {
+                case LogRecordType::UPDATE:
+                    if (tid != INVALID_TXN_ID)
+                        ended.emplace(tid, false);
+                    break;
+                case LogRecordType::COMMIT_TXN:
+                case LogRecordType::ABORT_TXN:
+                case LogRecordType::EOL:
+                    // The updates of an aborted transaction are rolled back in the log before its abort record.
+                    ended[tid] = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    redo_partitions.resize(num_threads);
+    undo_partitions.resize(num_threads);
+    for (auto &entries : records) {
+        for (auto &e : entries) {
+            if (e.rec->GetType() != LogRecordType::UPDATE)
+                continue;
+            auto update = static_cast<LogRecordUpdate *>(e.rec);
+            size_t partition = PidHasher()(update->GetPageId()) % num_threads;
+            if (e.lsn >= main_rec.latest_checkpoint)
+                redo_partitions[partition].push_back(e);
+            txn_id_t tid = update->GetTID();
+            if (tid != INVALID_TXN_ID && ended[tid] == false)
+                undo_partitions[partition].push_back(e);
+        }
+    }
+    losers = std::count_if(ended.begin(), ended.end(), [](const std::pair<const txn_id_t, bool> &kv) {
+        return kv.second == false;
+    });
+    analysis_secs = SecondsSince(start);
+
+    /**
+     * Redo: repeat history from the checkpoint on, page by page in lsn order.
+     */
+    start = std::chrono::steady_clock::now();
+    RunInParallel([&](size_t partition) {
+        for (auto &e : redo_partitions[partition]) {
+            auto update = static_cast<LogRecordUpdate *>(e.rec);
+            // Also skips the pages freed since, whose page lsn is kInvalidLSN.
+            if (e.lsn < buf_mgr->RecoveredPageLSN(update->GetPageId())) {
+                ++updates_skipped;
+                continue;
+            }
+            update->Redo(buf_mgr);
+            ++updates_redone;
+            buf_mgr->stat->wal_redone_updates++;
+        }
+    });
+    redo_secs = SecondsSince(start);
+
+    /**
+     * Undo: roll the losers back, page by page in reverse lsn order.
+     */
+    start = std::chrono::steady_clock::now();
+    RunInParallel([&](size_t partition) {
+        auto &entries = undo_partitions[partition];
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            auto update = static_cast<LogRecordUpdate *>(it->rec);
+            if (buf_mgr->RecoveredPageLSN(update->GetPageId()) == kInvalidLSN)
+                continue;
+            update->Undo(buf_mgr);
+            ++updates_undone;
+            buf_mgr->stat->wal_undone_updates++;
+        }
+    });
+    undo_secs = SecondsSince(start);
+    return Status::OK();
+}
+
+std::string LogRecovery::ToString() const {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "end_lsn %lu, %lu buffers, %lu records, %lu losers, %lu updates redone, "
+                               "%lu skipped, %lu undone, analysis %.3fs, redo %.3fs, undo %.3fs, %lu threads",
+             end_lsn, buffers_parsed, records_parsed, losers, updates_redone.load(), updates_skipped.load(),
+             updates_undone.load(), analysis_secs, redo_secs, undo_secs, num_threads);
+    return buf;
+}
+
+}
@@ -2,6 +2,7 @@
 // Created by zxjcarrot on 2020-06-25.
 //
 
+#include "util/bump_arena.h"
 #include "util/logger.h"
 #include "engine/txn.h"
 #include "buf/buf_mgr.h"
@@ -13,6 +14,11 @@ NVMLogFileBackend::NVMLogFileBackend(const std::string &file_path, size_t initia
         mmap_addr(nullptr) {}
 
 Status NVMLogFileBackend::Init() {
+    // Map all of a log file the last run extended, LogRecovery reads it whole.
+    uint64_t file_size = 0;
+    if (PosixEnv::FileExists(file_path) && PosixEnv::GetFileSize(file_path, &file_size).ok() &&
+        file_size > file_capacity)
+        file_capacity = file_size;
     // MMap the file
     void *mmap_addr_tmp;
     Status s = PosixEnv::MMapNVMFile(file_path, mmap_addr_tmp, file_capacity);
@@ -32,7 +38,7 @@ Status NVMLogFileBackend::Seek(uint64_t off) {
 }
 
 Status NVMLogFileBackend::Read(char *buf, uint64_t size) {
-    if (buf + size > mmap_addr + file_capacity) {
+    if (ptr + size > mmap_addr + file_capacity) {
         return Status::IOError("Out of range");
     }
     memcpy(buf, ptr, size);
@@ -81,6 +87,8 @@ Status NVMLogFileBackend::Append(const char *buf, uint64_t size) {
             return s;
     }
     memcpy(ptr, buf, size);
+    if (NVMEmulator *emulator = NVMEmulator::Active())
+        emulator->Write(size);
     NVMUtilities::persist(ptr, size);
     ptr += size;
     return s;
@@ -94,7 +102,9 @@ char *NVMLogFileBackend::AllocatePersistentBufferAtTheEnd(uint64_t size) {
             return nullptr;
     }
     char *ret = ptr;
-    memset(ret, size, 0);
+    memset(ret, 0, size);
+    if (NVMEmulator *emulator = NVMEmulator::Active())
+        emulator->Write(size);
     NVMUtilities::persist(ret, size);
     ptr += size;
     return ret;
@@ -125,16 +135,13 @@ LogRecordAbortTxn::LogRecordAbortTxn(lsn_t prev_lsn, txn_id_t tid) :
 LogRecordEOL::LogRecordEOL(lsn_t prev_lsn, txn_id_t tid) :
         prev_lsn(prev_lsn), tid(tid) {}
 
-LogManager::LogManager(ConcurrentBufferManager *buf_mgr, NVMLogFileBackend *backend1, NVMLogFileBackend *backend2,
-                       size_t log_buffer_size) :
-        buf_mgr(buf_mgr), current_backend_idx(0), next_lsn(0), log_buffer_size(log_buffer_size) {
+LogManager::LogManager(ConcurrentBufferManager *buf_mgr, LogFileBackend *backend1, LogFileBackend *backend2,
+                       size_t log_buffer_size, bool slotted_log_buffer) :
+        buf_mgr(buf_mgr), log_buffer_mgr(nullptr), current_backend_idx(0), log_buffer_size(log_buffer_size),
+        log_buffer_format(slotted_log_buffer ? kSlottedLogBuffer : kSequentialLogBuffer), current_main_rec(),
+        next_lsn(0) {
     logfile_backends[0] = backend1;
     logfile_backends[1] = backend2;
-    backend1->Seek(sizeof(MainRecord));
-    backend2->Seek(sizeof(MainRecord));
-    log_buffer_mgr = new ConcurrentLogBufferManager(this, log_buffer_size);
-    //log_buffer_mgr = new PersistentLogBufferManager(this, log_buffer_size);
-    //log_buffer_mgr = new ThreadLocalBasicLogBufferManager(this, log_buffer_size);
 }
 
 
@@ -148,10 +155,10 @@ void LogRecordAbortTxn::Flush(WritableSlice &slice) {
 
 Status LogRecordAbortTxn::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->prev_lsn, sizeof(this->prev_lsn));
+    s = slice.Read((char *) &this->prev_lsn, sizeof(this->prev_lsn));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->tid, sizeof(this->tid));
+    s = slice.Read((char *) &this->tid, sizeof(this->tid));
     if (!s.ok())
         return s;
     return s;
@@ -177,10 +184,10 @@ void LogRecordCommitTxn::Flush(WritableSlice &slice) {
 
 Status LogRecordCommitTxn::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->prev_lsn, sizeof(this->prev_lsn));
+    s = slice.Read((char *) &this->prev_lsn, sizeof(this->prev_lsn));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->tid, sizeof(this->tid));
+    s = slice.Read((char *) &this->tid, sizeof(this->tid));
     if (!s.ok())
         return s;
     return s;
@@ -202,10 +209,10 @@ void LogRecordBeginTxn::Flush(WritableSlice &slice) {
 
 Status LogRecordBeginTxn::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->prev_lsn, sizeof(this->prev_lsn));
+    s = slice.Read((char *) &this->prev_lsn, sizeof(this->prev_lsn));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->tid, sizeof(this->tid));
+    s = slice.Read((char *) &this->tid, sizeof(this->tid));
     if (!s.ok())
         return s;
     return s;
@@ -227,10 +234,10 @@ void LogRecordEOL::Flush(WritableSlice &slice) {
 
 Status LogRecordEOL::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->prev_lsn, sizeof(this->prev_lsn));
+    s = slice.Read((char *) &this->prev_lsn, sizeof(this->prev_lsn));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->tid, sizeof(this->tid));
+    s = slice.Read((char *) &this->tid, sizeof(this->tid));
     if (!s.ok())
         return s;
     return s;
@@ -251,8 +258,8 @@ void LogRecordUpdate::Flush(WritableSlice &slice) {
     slice.Append((const char *) &this->page_id, sizeof(this->page_id));
     slice.Append((const char *) &this->offset_in_page, sizeof(this->offset_in_page));
     slice.Append((const char *) &this->len, sizeof(this->len));
-    slice.Append(this->redo_info.get(), this->len);
-    slice.Append(this->undo_info.get(), this->len);
+    slice.Append(this->redo_image, this->len);
+    slice.Append(this->undo_image, this->len);
 }
 
 size_t LogRecordUpdate::Size() {
@@ -270,21 +277,23 @@ size_t LogRecordUpdate::Size() {
 
 Status LogRecordUpdate::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->prev_lsn, sizeof(this->prev_lsn));
+    s = slice.Read((char *) &this->prev_lsn, sizeof(this->prev_lsn));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->tid, sizeof(this->tid));
+    s = slice.Read((char *) &this->tid, sizeof(this->tid));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->page_id, sizeof(this->page_id));
+    s = slice.Read((char *) &this->page_id, sizeof(this->page_id));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->offset_in_page, sizeof(this->offset_in_page));
+    s = slice.Read((char *) &this->offset_in_page, sizeof(this->offset_in_page));
     if (!s.ok())
         return s;
-    s = slice.Read((char *) this->len, sizeof(this->len));
+    s = slice.Read((char *) &this->len, sizeof(this->len));
     if (!s.ok())
         return s;
+    if (this->offset_in_page + this->len > kPageSize || 2 * this->len > slice.BytesLeft())
+        return Status::Corruption("update record out of range");
     this->redo_info = std::shared_ptr<char>(new char[len], std::default_delete<char[]>());
     this->undo_info = std::shared_ptr<char>(new char[len], std::default_delete<char[]>());
     s = slice.Read((char *) this->redo_info.get(), this->len);
@@ -293,10 +302,34 @@ Status LogRecordUpdate::Parse(spitfire::ReadableSlice &slice) {
     s = slice.Read((char *) this->undo_info.get(), this->len);
     if (!s.ok())
         return s;
+    this->redo_image = this->redo_info.get();
+    this->undo_image = this->undo_info.get();
     return s;
 }
 
 
+void LogRecordUpdate::Redo(ConcurrentBufferManager *buf_mgr) {
+    WriteImage(buf_mgr, redo_image);
+}
+
+void LogRecordUpdate::Undo(ConcurrentBufferManager *buf_mgr) {
+    WriteImage(buf_mgr, undo_image);
+}
+
+void LogRecordUpdate::WriteImage(ConcurrentBufferManager *buf_mgr, const char *image) {
+    ConcurrentBufferManager::PageAccessor accessor;
+    Status s = buf_mgr->Get(page_id, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_WRITE);
+    if (!s.ok()) {
+        fprintf(stderr, "LogRecordUpdate page %lu not recovered: %s\n", page_id, s.ToString().c_str());
+        assert(false);
+        return;
+    }
+    Slice slice = accessor.PrepareForWrite(offset_in_page, len);
+    memcpy(slice.data(), image, len);
+    accessor.FinishAccess();
+    buf_mgr->Put(accessor.GetPageDesc());
+}
+
 LogRecordUpdate::LogRecordUpdate(lsn_t prev_lsn, txn_id_t tid, pid_t page_id, uint64_t offset, uint64_t len,
                                  const char *redo, const char *undo) {
     this->prev_lsn = prev_lsn;
@@ -304,14 +337,8 @@ LogRecordUpdate::LogRecordUpdate(lsn_t prev_lsn, txn_id_t tid, pid_t page_id, ui
     this->page_id = page_id;
     this->offset_in_page = offset;
     this->len = len;
-    this->redo_info = std::shared_ptr<char>(new char[len], std::default_delete<char[]>());
-    this->undo_info = std::shared_ptr<char>(new char[len], std::default_delete<char[]>());
-    memcpy(redo_info.get(), redo, len);
-    memcpy(undo_info.get(), undo, len);
-}
-
-static lsn_t MakeLSN(lsn_t main_rec_start_lsn, size_t pos) {
-    return main_rec_start_lsn + sizeof(MainRecord) + pos;
+    this->redo_image = redo;
+    this->undo_image = undo;
 }
 
 lsn_t LogManager::LogBeginTxn(txn_id_t tid, lsn_t prev_lsn) {
@@ -323,16 +350,18 @@ lsn_t LogManager::LogUpdate(txn_id_t tid, pid_t page_id, size_t page_offset, siz
                             const char *undo_info, lsn_t prev_lsn) {
     LogRecordUpdate rec(prev_lsn, tid, page_id, page_offset, len, redo_info, undo_info);
     this->dirty_page_table.LockOnKey(page_id);
-    lsn_t lsn = this->log_buffer_mgr->WriteRecord(&rec);
     // If it's in NVM_SSD mode, we don't need to record the page as dirty for flushing
     // because the page-update is already persistent.
+    // The page goes into the dirty page table before the record takes its lsn, at the lsn of the current
+    // log buffer, which no record written afterwards is below. A checkpoint at that lsn then finds it.
     if (buf_mgr->IsNVMSSDMode() == false)
-        this->DirtyPage(page_id, lsn);
+        this->DirtyPage(page_id, current_buffer_lsn.load());
+    lsn_t lsn = this->log_buffer_mgr->WriteRecord(&rec);
     this->dirty_page_table.UnlockOnKey(page_id);
     return lsn;
 }
 
-NVMLogFileBackend *LogManager::GetCurrentLogFileBackend() {
+LogFileBackend *LogManager::GetCurrentLogFileBackend() {
     return logfile_backends[current_backend_idx];
 }
 
@@ -361,6 +390,30 @@ void SetLastLogRecordLSN(lsn_t lsn) {
     last_log_record_lsn = lsn;
 }
 
+struct LogImageArena {
+    BumpArena arena;
+    // Images allocated and not yet released.
+    size_t pending = 0;
+};
+
+static thread_local LogImageArena log_image_arena;
+
+char *AllocateLogImage(size_t size) {
+    ++log_image_arena.pending;
+    return log_image_arena.arena.Allocate(size);
+}
+
+void ReleaseLogImage() {
+    assert(log_image_arena.pending > 0);
+    if (--log_image_arena.pending == 0)
+        log_image_arena.arena.Rewind();
+}
+
+void TrimLogImages() {
+    if (log_image_arena.pending == 0)
+        log_image_arena.arena.Trim();
+}
+
 
 LogRecordCheckpoint::LogRecordCheckpoint(lsn_t checkpoint_lsn) : checkpoint_lsn(checkpoint_lsn) {}
 
@@ -374,15 +427,16 @@ void LogRecordCheckpoint::Flush(WritableSlice &slice) {
 
 Status LogRecordCheckpoint::Parse(spitfire::ReadableSlice &slice) {
     Status s;
-    s = slice.Read((char *) this->checkpoint_lsn, sizeof(this->checkpoint_lsn));
+    s = slice.Read((char *) &this->checkpoint_lsn, sizeof(this->checkpoint_lsn));
     if (!s.ok())
         return s;
     return s;
 }
 
 
-void LogManager::PersistMainRecord(NVMLogFileBackend *backend) {
+void LogManager::PersistMainRecord(LogFileBackend *backend) {
     std::lock_guard<std::recursive_mutex> g(this->lock);
+    current_main_rec.crc = current_main_rec.ComputeCRC();
     auto save = backend->NextWritingPosition();
     backend->Seek(0);
     backend->Append((const char *) &this->current_main_rec, sizeof(MainRecord));
@@ -404,6 +458,8 @@ void LogManager::PageCleaningProcess(LogManager *mgr) {
         if (mgr->stopped.load()) {
             break;
         }
+        // The records of the transactions that committed without waiting, see WALCommitMode::ASYNC.
+        mgr->FlushLog();
 
         {
             lsn_t persisted_lsn = mgr->persisted_lsn.load();
@@ -420,10 +476,14 @@ void LogManager::PageCleaningProcess(LogManager *mgr) {
                 lsn_t flush_lsn;
                 do {
                     flush_lsn = std::min((size_t)(persisted_lsn + mgr->log_buffer_size / factor), prev_checkpoint_lsn + flush_lsn_amount);
-                    flushed += mgr->FlushDirtyPages(flush_lsn);;
+                    size_t flushed_this_round = mgr->FlushDirtyPages(flush_lsn);
+                    flushed += flushed_this_round;
+                    // Nothing left below the widest flush_lsn, the rest of the dirty pages wait for the log.
+                    if (factor == 1 && flushed_this_round == 0)
+                        break;
                     factor /= 2;
                     factor = std::max((size_t)1, factor);
-                } while(flushed < 10);
+                } while(flushed < 10 && mgr->stopped.load() == false);
                 prev_checkpoint_lsn = flush_lsn;
             }
             // Checkpoint if log file is too big
@@ -437,13 +497,58 @@ void LogManager::PageCleaningProcess(LogManager *mgr) {
 LogManager::~LogManager() {
     EndPageCleanerProcess();
     delete log_buffer_mgr;
+    delete logfile_backends[0];
+    delete logfile_backends[1];
 }
 
-Status LogManager::Init() {
+Status LogManager::Init(uint64_t db_id, lsn_t start_lsn) {
+    {
+        std::lock_guard<std::recursive_mutex> g(this->lock);
+        current_main_rec = MainRecord();
+        current_main_rec.db_id = db_id;
+        current_main_rec.latest_checkpoint = start_lsn;
+        current_main_rec.log_begin_lsn = start_lsn;
+        current_main_rec.start_lsn = start_lsn;
+        current_backend_idx = 0;
+        next_lsn = start_lsn;
+        current_buffer_lsn = start_lsn;
+        persisted_lsn = start_lsn;
+        written_lsn = start_lsn;
+        flushed_lsn = start_lsn;
+        // ConcurrentLogBufferManager leaves its records to FlushLog, the others persist each one.
+        group_flush = log_buffer_format == kSequentialLogBuffer;
+        logfile_backends[0]->Seek(logfile_backends[0]->FirstBufferOffset());
+        logfile_backends[1]->Seek(logfile_backends[1]->FirstBufferOffset());
+        // The buffers left in the files are below start_lsn, LogRecovery skips them from now on.
+        PersistMainRecord(logfile_backends[0]);
+        PersistMainRecord(logfile_backends[1]);
+    }
+    if (log_buffer_format == kSlottedLogBuffer)
+        log_buffer_mgr = new PersistentLogBufferManager(this, log_buffer_size);
+    else
+        log_buffer_mgr = new ConcurrentLogBufferManager(this, log_buffer_size);
+    //log_buffer_mgr = new ThreadLocalBasicLogBufferManager(this, log_buffer_size);
     StartPageCleanerProcess();
     return Status::OK();
 }
 
+void LogManager::Checkpoint(lsn_t checkpoint_lsn) {
+    std::lock_guard<std::recursive_mutex> g(this->lock);
+    if (checkpoint_lsn <= current_main_rec.latest_checkpoint)
+        return;
+    current_main_rec.latest_checkpoint = checkpoint_lsn;
+    PersistMainRecord(this->logfile_backends[0]);
+    PersistMainRecord(this->logfile_backends[1]);
+}
+
+void LogManager::CloseLog() {
+    std::lock_guard<std::recursive_mutex> g(this->lock);
+    current_main_rec.latest_checkpoint = next_lsn.load();
+    current_main_rec.log_begin_lsn = next_lsn.load();
+    PersistMainRecord(this->logfile_backends[0]);
+    PersistMainRecord(this->logfile_backends[1]);
+}
+
 void LogManager::StartPageCleanerProcess() {
     checkpoint_process.reset(new std::thread(PageCleaningProcess, this));
 }
@@ -451,7 +556,8 @@ void LogManager::StartPageCleanerProcess() {
 void LogManager::EndPageCleanerProcess() {
     if (stopped.load() == false) {
         this->stopped.store(true);
-        checkpoint_process->join();
+        if (checkpoint_process)
+            checkpoint_process->join();
     }
 }
 
@@ -500,9 +606,9 @@ size_t LogManager::FlushDirtyPages(lsn_t upto_lsn) {
                 int cnt = 0;
                 for (size_t j = begin; j < end; ++j) {
                     pid_t pid = dirty_pages[j].second;
-                    Status s = buf_mgr->Flush(pid, false, true);
-                    //s = buf_mgr->Flush(pid, false, true);
+                    // Out of the table before the flush, an update racing with it dirties the page again.
                     dirty_page_table.Erase(pid);
+                    Status s = buf_mgr->Flush(pid, false, true);
                     ++cnt;
                     if (cnt % 25 == 0) {
                         buf_mgr->CleanPageReady();
@@ -522,7 +628,6 @@ size_t LogManager::FlushDirtyPages(lsn_t upto_lsn) {
 }
 
 void LogManager::SwitchLogFileIfTooBig() {
-    lsn_t checkpoint_lsn = 0;
     {
         std::lock_guard<std::recursive_mutex> g(this->lock);
         size_t log_file_size = GetCurrentLogFileBackend()->NextWritingPosition();
@@ -531,19 +636,27 @@ void LogManager::SwitchLogFileIfTooBig() {
             return;
         }
         LOG_INFO("log_file_size %fMB exceeds threshold(%fMB), cleaning & switching", log_file_size / 1024.0 / 1024, (float)log_switch_threshold / 1024 / 1024);
-        // Update the main record to incorporate the size of the previous log
-        current_main_rec.start_lsn += this->GetCurrentLogFileBackend()->NextWritingPosition() - sizeof(MainRecord);
+    }
+    // Checkpoint before the switch, the log in the other file is overwritten from then on.
+    // Every page updated below checkpoint_lsn is in the dirty page table, see LogUpdate, or in a
+    // buffer pool the database does not survive a crash with.
+    lsn_t checkpoint_lsn = current_buffer_lsn.load();
+    FlushDirtyPages(checkpoint_lsn);
+    buf_mgr->WriteBackVolatilePages(false);
+    Checkpoint(checkpoint_lsn);
+    {
+        std::lock_guard<std::recursive_mutex> g(this->lock);
+        // The log in the current file stays for undoing the transactions still running.
+        current_main_rec.log_begin_lsn = current_main_rec.start_lsn;
+        // The next log buffer is the first in the other file.
+        current_main_rec.start_lsn = next_lsn.load();
         // Switch to the other log file
         this->current_backend_idx = 1 - this->current_backend_idx;
+        // Start writing to the position after the Main Record.
+        this->GetCurrentLogFileBackend()->Seek(this->GetCurrentLogFileBackend()->FirstBufferOffset());
         PersistMainRecord(this->logfile_backends[0]);
         PersistMainRecord(this->logfile_backends[1]);
-
-        // Start writing to the position after the Main Record.
-        this->GetCurrentLogFileBackend()->Seek(sizeof(MainRecord));
-
-        checkpoint_lsn = current_main_rec.start_lsn;
     }
-    FlushDirtyPages(checkpoint_lsn);
 
     /**
      * Phase 1: write the checkpoint begin record.
@@ -652,11 +765,36 @@ void LogManager::SwitchLogFileIfTooBig() {
 std::pair<lsn_t, char *>
 LogManager::PersistLogBufferAsync(char *log_buffer, size_t log_buffer_size, size_t new_log_buffer_cap) {
     std::lock_guard<std::recursive_mutex> g(this->lock);
-    char *buf = GetCurrentLogFileBackend()->AllocatePersistentBufferAtTheEnd(new_log_buffer_cap);
-    size_t offset = GetCurrentLogFileBackend()->NextWritingPosition() - sizeof(MainRecord);
-    persisted_lsn += log_buffer_size;
-    //assert(current_main_rec.start_lsn + offset == persisted_lsn.load());
-    return std::make_pair(current_main_rec.start_lsn + offset, buf);
+    // The buffer is full, every record in it is whole.
+    if (group_flush && log_buffer != nullptr) {
+        assert(log_buffer == current_buffer);
+        PersistLog(current_buffer_lsn.load() + log_buffer_size);
+    }
+    // The buffer comes zeroed, LogRecovery takes the first zeroes in it for the end of its records.
+    // It ends where the backend can start the next one, the space past new_log_buffer_cap stays empty.
+    size_t alignment = GetCurrentLogFileBackend()->Alignment();
+    size_t size = (sizeof(LogBufferHeader) + new_log_buffer_cap + alignment - 1) / alignment * alignment;
+    char *buf = GetCurrentLogFileBackend()->AllocatePersistentBufferAtTheEnd(size);
+    if (buf == nullptr)
+        return std::make_pair(kInvalidLSN, nullptr);
+    lsn_t lsn = next_lsn.load();
+    LogBufferHeader *header = (LogBufferHeader *) buf;
+    header->start_lsn = lsn;
+    header->capacity = size - sizeof(LogBufferHeader);
+    header->format = log_buffer_format;
+    header->durable_lsn = lsn;
+    Persist(buf, sizeof(LogBufferHeader));
+    // The magic goes in last, a header with it is whole.
+    header->magic = LogBufferHeader::kMagic;
+    Persist((char *) &header->magic, sizeof(header->magic));
+    next_lsn += header->capacity;
+    current_buffer_lsn = lsn;
+    // The buffers before this one are full.
+    persisted_lsn = lsn;
+    current_buffer = buf + sizeof(LogBufferHeader);
+    if (group_flush)
+        AdvanceFlushedLSN(lsn);
+    return std::make_pair(lsn, current_buffer);
     // Notify the page cleaner that a log buffer is persisted.
 
 //    std::async([&, this]() {
@@ -682,9 +820,10 @@ lsn_t LogManager::NextLSN() {
 
 
 LogRecord *LogRecordParser::ParseNext(size_t &offset) {
-    uint16_t type;
+    uint16_t type = 0;
     offset = slice.Offset();
-    slice.Read((char *) &type, sizeof(type));
+    if (!slice.Read((char *) &type, sizeof(type)).ok())
+        return nullptr;
     LogRecord *rec;
     switch (type) {
         case LogRecordType::BEGIN_TXN:
@@ -706,10 +845,14 @@ LogRecord *LogRecordParser::ParseNext(size_t &offset) {
             rec = new LogRecordEOL;
             break;
         default:
-            assert(false);
+            // The zeroes past the last record.
+            return nullptr;
     }
     Status s = rec->Parse(slice);
-    assert(s.ok());
+    if (!s.ok()) {
+        delete rec;
+        return nullptr;
+    }
     return rec;
 }
 
@@ -721,9 +864,32 @@ void LogManager::DirtyPage(pid_t page_id, lsn_t lsn) {
     });
 }
 
+// Record in the header of the log buffer whose data is at `buf` that its records below `lsn` are whole.
+// LogRecovery parses no further, the records past it may be torn.
+static void PersistDurableLSN(LogManager *log_mgr, char *buf, lsn_t lsn) {
+    LogBufferHeader *header = (LogBufferHeader *) (buf - sizeof(LogBufferHeader));
+    header->durable_lsn = lsn;
+    log_mgr->Persist((char *) &header->durable_lsn, sizeof(header->durable_lsn));
+}
+
+void LogManager::Persist(char *p, size_t size) {
+    for (auto backend : logfile_backends) {
+        if (backend->Owns(p) == false)
+            continue;
+        Status s = backend->Persist(p, size);
+        if (!s.ok()) {
+            fprintf(stderr, "LogManager log not persisted: %s\n", s.ToString().c_str());
+            assert(false);
+        }
+        return;
+    }
+    assert(false);
+}
+
 BasicLogBufferManager::BasicLogBufferManager(LogManager *log_mgr, size_t buf_size) : log_mgr(log_mgr), buf_capacity(buf_size) {
-    buf = new char[buf_capacity];
-    log_buffer_start_lsn = 0;
+    std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(nullptr, 0, buf_capacity);
+    buf = p.second;
+    log_buffer_start_lsn = p.first;
     free_pos = 0;
 }
 
@@ -736,7 +902,8 @@ lsn_t BasicLogBufferManager::WriteRecord(LogRecord *rec) {
     assert(buf_start);
     WritableSlice slice(buf_start, size);
     rec->Flush(slice);
-    NVMUtilities::persist(buf_start, size);
+    log_mgr->Persist(buf_start, size);
+    PersistDurableLSN(log_mgr, buf, lsn + size);
     return lsn;
 }
 
@@ -759,23 +926,36 @@ char *BasicLogBufferManager::ClaimSpace(size_t sz, lsn_t &claimed_lsn) {
 }
 
 ConcurrentLogBufferManager::ConcurrentLogBufferManager(LogManager *log_mgr, size_t buf_size) : log_mgr(log_mgr), buf_capacity(buf_size) {
-    buf = new char[buf_capacity];
-    log_buffer_start_lsn.store(0);
+    std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(nullptr, 0, buf_capacity);
+    buf = p.second;
+    log_buffer_start_lsn.store(p.first);
     filled_bytes.store(0);
     free_pos.store(0);
 }
 
 ConcurrentLogBufferManager::~ConcurrentLogBufferManager() {}
 
+// The writers of ConcurrentLogBufferManager. An active one has not written its record yet, which
+// is at or above the lsn it holds. LogManager::FlushLog persists the log up to the lowest of them.
+static RefManager log_writer_ref_manager(1024);
+static thread_local ThreadRefHolder *log_writer_ref = new ThreadRefHolder;
+
 lsn_t ConcurrentLogBufferManager::WriteRecord(LogRecord *rec) {
     size_t size = rec->Size();
     lsn_t lsn;
+    log_writer_ref->Register(&log_writer_ref_manager);
+    // Listed before the space is claimed, the record is in the current buffer or a later one.
+    log_writer_ref->SetValue(log_mgr->CurrentBufferLSN() << 1);
+    log_writer_ref->Enter();
     char *buf_start = this->ClaimSpace(size, lsn);
     assert(buf_start);
+    log_writer_ref->SetValue(lsn << 1);
     WritableSlice slice(buf_start, size);
     rec->Flush(slice);
-    NVMUtilities::persist(buf_start, size);
     filled_bytes.increment(size);
+    // Orders the record before the writer leaves.
+    log_mgr->RecordWritten(lsn + size);
+    log_writer_ref->Leave();
     return lsn;
 }
 
@@ -801,7 +981,7 @@ char *ConcurrentLogBufferManager::ClaimSpace(size_t sz, lsn_t &claimed_lsn) {
             assert(filled_bytes.load() == pos);
 
             // TODO : hand over the log buffer task to the log manager.
-            std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(buf, buf_capacity, buf_capacity);
+            std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(buf, pos, buf_capacity);
 
             log_buffer_start_lsn = p.first;
             buf = p.second;
@@ -824,6 +1004,89 @@ char *ConcurrentLogBufferManager::ClaimSpace(size_t sz, lsn_t &claimed_lsn) {
     }
 }
 
+void LogManager::RecordWritten(lsn_t end_lsn) {
+    lsn_t lsn = written_lsn.load();
+    while (lsn < end_lsn && written_lsn.compare_exchange_weak(lsn, end_lsn) == false);
+}
+
+void LogManager::AdvanceFlushedLSN(lsn_t lsn) {
+    flushed_lsn.store(lsn);
+    {
+        std::lock_guard<std::mutex> g(flush_mtx);
+    }
+    flush_cv.notify_all();
+}
+
+void LogManager::PersistLog(lsn_t upto) {
+    std::lock_guard<std::recursive_mutex> g(this->lock);
+    lsn_t from = std::max(flushed_lsn.load(), current_buffer_lsn.load());
+    if (upto <= from)
+        return;
+    assert(upto - current_buffer_lsn.load() <= log_buffer_size);
+    // The writers of the records are done with them, clwb writes their lines back from any cache.
+    Persist(current_buffer + (from - current_buffer_lsn.load()), upto - from);
+    PersistDurableLSN(this, current_buffer, upto);
+    buf_mgr->stat->wal_log_flushes++;
+    AdvanceFlushedLSN(upto);
+}
+
+lsn_t LogManager::FlushLog() {
+    if (group_flush == false)
+        return flushed_lsn.load();
+    // No buffer switch in between, the records below written_lsn are in the current buffer or flushed.
+    std::lock_guard<std::recursive_mutex> g(this->lock);
+    // Read before the writers. The writer of a record below it was listed before it claimed the record.
+    lsn_t upto = written_lsn.load();
+    log_writer_ref_manager.IterateThreadRefs([&upto](ThreadRefHolder *ref) {
+        if (ref->Active())
+            upto = std::min(upto, (lsn_t) (ref->GetValue() >> 1));
+    });
+    PersistLog(upto);
+    return flushed_lsn.load();
+}
+
+bool LogManager::WaitForFlushedLSN(lsn_t upto, WALCommitMode mode) {
+    if (group_flush == false || flushed_lsn.load() >= upto)
+        return true;
+    if (mode == WALCommitMode::ASYNC)
+        return false;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(buf_mgr->GetConfig().wal_commit_timeout_us);
+    std::unique_lock<std::mutex> l(flush_mtx);
+    while (flushed_lsn.load() < upto) {
+        if (mode == WALCommitMode::TIMED && std::chrono::steady_clock::now() >= deadline)
+            return false;
+        if (flush_leader) {
+            if (mode == WALCommitMode::TIMED)
+                flush_cv.wait_until(l, deadline);
+            else
+                flush_cv.wait(l);
+            continue;
+        }
+        // Lead the group. The waiters that come in the meantime wait for the next leader.
+        flush_leader = true;
+        l.unlock();
+        lsn_t flushed = FlushLog();
+        // A record below `upto` is still being written.
+        if (flushed < upto)
+            std::this_thread::yield();
+        l.lock();
+        flush_leader = false;
+        flush_cv.notify_all();
+    }
+    return true;
+}
+
+bool LogManager::WaitForCommit(lsn_t commit_lsn) {
+    auto &config = buf_mgr->GetConfig();
+    buf_mgr->stat->wal_commits++;
+    // The log is flushed up to the end of a record, past commit_lsn is past the commit record.
+    bool durable = WaitForFlushedLSN(commit_lsn + 1, config.wal_commit_mode);
+    if (durable == false && config.wal_commit_mode == WALCommitMode::TIMED)
+        buf_mgr->stat->wal_commit_timeouts++;
+    return durable;
+}
+
 lsn_t ThreadLocalBasicLogBufferManager::WriteRecord(LogRecord *rec) {
     thread_local static BasicLogBufferManager * basic_log_buf_mgr = nullptr;
     if (basic_log_buf_mgr == nullptr) {
@@ -870,7 +1133,9 @@ lsn_t PersistentLogBufferManager::WriteRecord(LogRecord *rec) {
         std::lock_guard<std::mutex> g(log_buffer_init_mtx);
         if (persistent_log_buffer == nullptr) {
             std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(nullptr, buf_size, buf_size);
-            persistent_log_buffer = new PersistentLogBuffer<>(p.second, buf_size, p.first);
+            persistent_log_buffer = new PersistentLogBuffer<>(p.second, buf_size, p.first, [this](char *data, size_t size) {
+                log_mgr->Persist(data, size);
+            });
             Status s = persistent_log_buffer->Init();
             assert(s.ok());
         }
@@ -887,7 +1152,9 @@ lsn_t PersistentLogBufferManager::WriteRecord(LogRecord *rec) {
             log_buffer_ref->Leave();
             std::pair<lsn_t, char *> p = log_mgr->PersistLogBufferAsync(persistent_log_buffer_ref->Data(), buf_size,
                                                                         buf_size);
-            persistent_log_buffer = new PersistentLogBuffer<>(p.second, buf_size, p.first);
+            persistent_log_buffer = new PersistentLogBuffer<>(p.second, buf_size, p.first, [this](char *data, size_t size) {
+                log_mgr->Persist(data, size);
+            });
             WaitUntilNoRefs(log_buffer_ref_manager, (uint64_t) persistent_log_buffer_ref);
             buffer_switch_status.store(BUFFER_SWITCH_STATUS_NORMAL);
             delete persistent_log_buffer_ref;
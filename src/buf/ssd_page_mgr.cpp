@@ -1,6 +1,7 @@
 //
 // Created by zxjcarrot on 2019-12-22.
 //
+#include <unistd.h>
 #include "buf/buf_mgr.h"
 
 namespace spitfire {
@@ -8,9 +9,24 @@ namespace spitfire {
 constexpr static int kDirectIOSize = 512;
 // Currently supports 4TB database at max.
 constexpr static int kSSDHeapFilesCap = 65536;
+SSDPageManager::~SSDPageManager() {
+    delete io_engine;
+    io_engine = nullptr;
+}
+
 Status SSDPageManager::Init() {
     std::lock_guard<std::mutex> g(mtx);
     Status s = Status::OK();
+    if (io_engine == nullptr) {
+        s = IOEngine::Create(io_engine_type, io_queue_depth, io_engine);
+        if (!s.ok()) {
+            fprintf(stderr, "SSDPageManager::Init I/O engine unavailable (%s), falling back to pread/pwrite\n",
+                    s.ToString().c_str());
+            s = IOEngine::Create(IOEngineType::POSIX, io_queue_depth, io_engine);
+            if (!s.ok())
+                return s;
+        }
+    }
     if (!PosixEnv::FileExists(db_path)) {
         s = PosixEnv::CreateDir(db_path);
         if (!s.ok())
@@ -37,7 +53,31 @@ Status SSDPageManager::Init() {
     });
     num_files = files.size();
     files.resize(kSSDHeapFilesCap);
-    return Status::OK();
+    return InitIncarnation();
+}
+
+Status SSDPageManager::InitIncarnation() {
+    std::string path = db_path + "/" + kIncarnationFileName;
+    int fd = -1;
+    Status s;
+    if (PosixEnv::FileExists(path)) {
+        s = PosixEnv::OpenRWFile(path, fd);
+        if (!s.ok())
+            return s;
+        s = PosixEnv::PRead(fd, 0, &incarnation, sizeof(incarnation));
+        close(fd);
+        return s;
+    }
+    std::random_device rd;
+    incarnation = ((uint64_t) rd() << 32 | rd()) ^ (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+    s = PosixEnv::CreateRWFile(path, fd);
+    if (!s.ok())
+        return s;
+    s = PosixEnv::PWrite(fd, 0, &incarnation, sizeof(incarnation));
+    if (s.ok() && fsync(fd) != 0)
+        s = PosixError(path, errno);
+    close(fd);
+    return s;
 }
 
 Status SSDPageManager::DestroyDB(const std::string &db_path) {
@@ -49,7 +89,7 @@ Status SSDPageManager::DestroyDB(const std::string &db_path) {
     PosixEnv::GetChildren(db_path, &children);
 
     for (int i = 0; i < children.size(); ++i) {
-        if (Slice(children[i]).starts_with(kHeapFilePrefix)) {
+        if (Slice(children[i]).starts_with(kHeapFilePrefix) || children[i] == kIncarnationFileName) {
             auto db_filepath = db_path + "/" + children[i];
             s = PosixEnv::DeleteFile(db_filepath);
             if (!s.ok())
@@ -67,8 +107,7 @@ Status SSDPageManager::ReadPage(pid_t pid, Page *p) {
     assert(files[file_no]->Allocated(off_in_file));
     assert(direct_io == false || (uint64_t)(char*)p % kDirectIOSize == 0);
     assert(direct_io == false || off_in_file % kDirectIOSize == 0);
-    return files[file_no]->ReadPage(off_in_file, (void *) p, kPageSize);
-    return Status::OK();
+    return io_engine->Read(files[file_no]->fd, (void *) p, kPageSize, off_in_file);
 }
 
 Status SSDPageManager::WritePage(pid_t pid, const Page *p) {
@@ -78,8 +117,37 @@ Status SSDPageManager::WritePage(pid_t pid, const Page *p) {
     assert(file_no < num_files);
     assert(files[file_no]->Allocated(off_in_file));
     assert(direct_io == false || (uint64_t)(char*)p % kDirectIOSize == 0);
-    return files[file_no]->WritePage(off_in_file, (const void *) p, kPageSize);
-    return Status::OK();
+    return io_engine->Write(files[file_no]->fd, (const void *) p, kPageSize, off_in_file);
+}
+
+IOHandle SSDPageManager::ReadPageAsync(pid_t pid, Page *p) {
+    uint32_t file_no = GetFileNo(pid);
+    uint32_t off_in_file = GetFileOff(pid);
+    assert(file_no < num_files);
+    assert(files[file_no]->Allocated(off_in_file));
+    assert(direct_io == false || (uint64_t)(char*)p % kDirectIOSize == 0);
+    return io_engine->PrepareRead(files[file_no]->fd, (void *) p, kPageSize, off_in_file);
+}
+
+IOHandle SSDPageManager::WritePageAsync(pid_t pid, const Page *p) {
+    uint32_t file_no = GetFileNo(pid);
+    uint32_t off_in_file = GetFileOff(pid);
+    assert(file_no < num_files);
+    assert(files[file_no]->Allocated(off_in_file));
+    assert(direct_io == false || (uint64_t)(char*)p % kDirectIOSize == 0);
+    return io_engine->PrepareWrite(files[file_no]->fd, (const void *) p, kPageSize, off_in_file);
+}
+
+Status SSDPageManager::SubmitIO() {
+    return io_engine->Submit();
+}
+
+Status SSDPageManager::RegisterIOBuffer(void *base, size_t size) {
+    return io_engine->RegisterBuffer(base, size);
+}
+
+void SSDPageManager::UnregisterIOBuffer(void *base) {
+    io_engine->UnregisterBuffer(base);
 }
 
 size_t SSDPageManager::CountPages() {
@@ -174,12 +242,18 @@ bool SSDPageManager::Allocated(const pid_t pid) {
     std::lock_guard<std::mutex> g(mtx);
     uint32_t file_no = GetFileNo(pid);
     uint32_t off_in_file = GetFileOff(pid);
-    assert(file_no < num_files);
     if (file_no >= num_files)
         return false;
     return files[file_no]->Allocated(off_in_file);
 }
 
+pid_t SSDPageManager::AdjacentPID(pid_t pid, int64_t delta) {
+    int64_t off_in_file = (int64_t) GetFileOff(pid) + delta;
+    if (off_in_file < 0 || off_in_file >= (int64_t) kFileEffectiveSize)
+        return kInvalidPID;
+    return MakePID(GetFileNo(pid), (uint32_t) off_in_file);
+}
+
 Status SSDPageManager::HeapFile::Init() {
     assert(bitmap == nullptr);
     char * ptr;
@@ -74,6 +74,7 @@ void MVTOTransactionManager::EndTransaction(TransactionContext *current_txn) {
         //auto last_lsn = GetLastLogRecordLSN();
         //lsn_t lsn = buf_mgr_->GetLogManager()->LogEOL(tid, last_lsn);
         //SetLastLogRecordLSN(lsn);
+        TrimLogImages();
     }
     delete current_txn;
     current_txn = nullptr;
@@ -1137,6 +1138,7 @@ ResultType MVTOTransactionManager::CommitTransaction(
         auto last_lsn = GetLastLogRecordLSN();
         lsn_t lsn = buf_mgr_->GetLogManager()->LogCommitTxn(tid, last_lsn);
         SetLastLogRecordLSN(lsn);
+        buf_mgr_->GetLogManager()->WaitForCommit(lsn);
     }
     EndTransaction(current_txn);
 
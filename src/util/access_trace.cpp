@@ -0,0 +1,196 @@
+//
+// Created by zxjcarrot on 2020-06-21.
+//
+
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include "util/access_trace.h"
+#include "util/env.h"
+
+namespace spitfire {
+
+std::atomic<uint64_t> AccessTraceRecorder::next_id{1};
+
+AccessTraceRecorder::AccessTraceRecorder(const std::string &path, size_t page_size, size_t max_pending_buffers)
+        : path(path), page_size(page_size), max_pending_buffers(std::max(max_pending_buffers, (size_t) 1)),
+          id(next_id++) {
+    assert(page_size <= UINT16_MAX);
+}
+
+AccessTraceRecorder::~AccessTraceRecorder() {
+    Stop();
+    for (auto &channel : channels)
+        delete channel->buffer;
+    for (auto buffer : free_buffers)
+        delete buffer;
+}
+
+uint64_t AccessTraceRecorder::NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Status AccessTraceRecorder::Start() {
+    assert(stopped.load() == true);
+    Status s = PosixEnv::CreateRWFile(path, fd);
+    if (!s.ok())
+        return s;
+    FileHeader header = {};
+    header.magic = kMagic;
+    header.version = 1;
+    header.record_size = sizeof(AccessTraceRecord);
+    header.page_size = page_size;
+    header.start_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    s = PosixEnv::PWrite(fd, 0, &header, sizeof(header));
+    if (!s.ok()) {
+        close(fd);
+        fd = -1;
+        return s;
+    }
+    file_offset = sizeof(header);
+    start_ns = NowNs();
+    stopped.store(false);
+    writer = std::thread(WriterProcess, this);
+    return Status::OK();
+}
+
+void AccessTraceRecorder::Stop() {
+    if (stopped.load() == true)
+        return;
+    {
+        std::lock_guard<std::mutex> g(mtx);
+        stopped.store(true);
+    }
+    cv.notify_all();
+    writer.join();
+    // The writer drained the full buffers, what is left is in the channels.
+    std::lock_guard<std::mutex> g(mtx);
+    for (auto &channel : channels) {
+        WriteBuffer(channel->buffer);
+        channel->buffer->n = 0;
+    }
+    if (fsync(fd) != 0)
+        fprintf(stderr, "AccessTraceRecorder %s not synced: %s\n", path.c_str(), PosixError(path, errno).ToString().c_str());
+    close(fd);
+    fd = -1;
+}
+
+AccessTraceRecorder::Channel *AccessTraceRecorder::ThreadChannel() {
+    struct ThreadSlot {
+        uint64_t recorder_id = 0;
+        Channel *channel = nullptr;
+    };
+    static thread_local ThreadSlot slot;
+    if (slot.recorder_id != id) {
+        // First record of the thread with this recorder.
+        std::unique_ptr<Channel> channel(new Channel);
+        std::lock_guard<std::mutex> g(mtx);
+        channel->buffer = NewBuffer();
+        slot.channel = channel.get();
+        slot.recorder_id = id;
+        channels.push_back(std::move(channel));
+    }
+    return slot.channel;
+}
+
+AccessTraceRecorder::Buffer *AccessTraceRecorder::NewBuffer() {
+    if (free_buffers.empty())
+        return new Buffer;
+    Buffer *buffer = free_buffers.back();
+    free_buffers.pop_back();
+    return buffer;
+}
+
+void AccessTraceRecorder::Submit(Channel *channel) {
+    {
+        std::lock_guard<std::mutex> g(mtx);
+        if (pending.size() >= max_pending_buffers || stopped.load()) {
+            records_dropped += channel->buffer->n;
+            channel->buffer->n = 0;
+            return;
+        }
+        pending.push_back(channel->buffer);
+        channel->buffer = NewBuffer();
+    }
+    cv.notify_one();
+}
+
+void AccessTraceRecorder::WriteBuffer(Buffer *buffer) {
+    if (buffer->n == 0)
+        return;
+    size_t bytes = buffer->n * sizeof(AccessTraceRecord);
+    Status s = PosixEnv::PWrite(fd, file_offset, buffer->records, bytes);
+    if (!s.ok()) {
+        records_dropped += buffer->n;
+        fprintf(stderr, "AccessTraceRecorder records dropped: %s\n", s.ToString().c_str());
+        return;
+    }
+    file_offset += bytes;
+    records_written += buffer->n;
+}
+
+void AccessTraceRecorder::WriterProcess(AccessTraceRecorder *recorder) {
+    std::unique_lock<std::mutex> g(recorder->mtx);
+    while (true) {
+        recorder->cv.wait(g, [recorder]() { return !recorder->pending.empty() || recorder->stopped.load(); });
+        if (recorder->pending.empty())
+            break;
+        Buffer *buffer = recorder->pending.front();
+        recorder->pending.pop_front();
+        // Only the writer touches file_offset until Stop joins it.
+        g.unlock();
+        recorder->WriteBuffer(buffer);
+        buffer->n = 0;
+        g.lock();
+        recorder->free_buffers.push_back(buffer);
+    }
+}
+
+std::string AccessTraceRecorder::ToString() const {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s written %lu records %.3fMB dropped %lu", path.c_str(), records_written.load(),
+             records_written.load() * sizeof(AccessTraceRecord) / 1024.0 / 1024, records_dropped.load());
+    return buf;
+}
+
+Status AccessTraceRecorder::Read(const std::string &path, std::vector<AccessTraceRecord> &records, size_t *page_size) {
+    records.clear();
+    uint64_t size = 0;
+    Status s = PosixEnv::GetFileSize(path, &size);
+    if (!s.ok())
+        return s;
+    FileHeader header = {};
+    if (size < sizeof(header))
+        return Status::Corruption(path, "no trace header");
+    int fd = -1;
+    s = PosixEnv::OpenRWFile(path, fd);
+    if (!s.ok())
+        return s;
+    s = PosixEnv::PRead(fd, 0, &header, sizeof(header));
+    if (s.ok() && (header.magic != kMagic || header.record_size != sizeof(AccessTraceRecord)))
+        s = Status::Corruption(path, "not an access trace");
+    if (s.ok()) {
+        // A trace cut short by a crash ends in a partial record, which is left out.
+        records.resize((size - sizeof(header)) / sizeof(AccessTraceRecord));
+        if (!records.empty())
+            s = PosixEnv::PRead(fd, sizeof(header), records.data(), records.size() * sizeof(AccessTraceRecord));
+    }
+    close(fd);
+    if (!s.ok()) {
+        records.clear();
+        return s;
+    }
+    std::stable_sort(records.begin(), records.end(), [](const AccessTraceRecord &a, const AccessTraceRecord &b) {
+        return a.time_ns < b.time_ns;
+    });
+    if (page_size != nullptr)
+        *page_size = header.page_size;
+    return Status::OK();
+}
+
+}
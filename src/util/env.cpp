@@ -30,6 +30,7 @@
 #include <immintrin.h>
 
 #include "util/env.h"
+#include "util/nvm_emulator.h"
 namespace spitfire {
 
 Status PosixError(const std::string& context, int error_number){
@@ -272,6 +273,8 @@ void NVMUtilities::persist(char * addr, size_t size) {
         : "+m"(*ptr));
     }
     asm volatile ("sfence" ::: "memory");
+    if (NVMEmulator *emulator = NVMEmulator::Active())
+        emulator->Persist();
 }
 
 unsigned long long cycles_now() {
@@ -0,0 +1,195 @@
+//
+// Created by zxjcarrot on 2020-06-14.
+//
+
+#include <thread>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <sys/mman.h>
+#include "util/frame_arena.h"
+#include "util/env.h"
+#include "util/numa.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace spitfire {
+
+static constexpr size_t k2MB = 2UL << 20;
+static constexpr size_t k1GB = 1UL << 30;
+
+static size_t RoundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+FrameArena::FrameArena(const std::vector<SizeClass> &size_classes, int node) : node(node) {
+    for (auto &sc : size_classes) {
+        if (sc.num_frames == 0)
+            continue;
+        std::unique_ptr<Class> c(new Class);
+        // Keep frames cache line aligned.
+        c->frame_size = RoundUp(sc.frame_size, 64);
+        c->num_frames = sc.num_frames;
+        c->offset = 0;
+        // Caches hold at most a quarter of the frames, so that few are stranded in the caches of idle threads.
+        c->cache_capacity = std::min(kCacheCapacity, c->num_frames / kNumCaches / 4);
+        classes.push_back(std::move(c));
+    }
+    // Best fit is the first class that fits.
+    std::sort(classes.begin(), classes.end(), [](const std::unique_ptr<Class> &a, const std::unique_ptr<Class> &b) {
+        return a->frame_size < b->frame_size;
+    });
+}
+
+FrameArena::~FrameArena() {
+    if (base != nullptr)
+        munmap(base, mapped_size);
+}
+
+Status FrameArena::Init() {
+    assert(base == nullptr);
+    size_t size = 0;
+    for (auto &c : classes) {
+        // Start every class on a hugepage so that its frames do not share TLB entries with another class.
+        c->offset = size;
+        size += RoundUp(c->frame_size * c->num_frames, k2MB);
+    }
+    if (size == 0)
+        return Status::InvalidArgument("FrameArena::Init", "no frames");
+
+    struct Backing {
+        int flags;
+        size_t page_size;
+        const char *name;
+    };
+    const Backing backings[] = {
+            {MAP_HUGETLB | MAP_HUGE_1GB, k1GB, "1GB hugepages"},
+            {MAP_HUGETLB | MAP_HUGE_2MB, k2MB, "2MB hugepages"},
+            // Physical memory is committed as frames are first touched.
+            {MAP_NORESERVE, k2MB, "regular pages with transparent hugepages advised"}};
+    void *p = MAP_FAILED;
+    int err = 0;
+    for (auto &b : backings) {
+        // Do not round a small arena up to a whole 1GB page.
+        if (b.page_size == k1GB && size < k1GB)
+            continue;
+        size_t len = RoundUp(size, b.page_size);
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | b.flags, -1, 0);
+        if (p != MAP_FAILED) {
+            mapped_size = len;
+            backing = b.name;
+            if ((b.flags & MAP_HUGETLB) == 0)
+                madvise(p, len, MADV_HUGEPAGE);
+            break;
+        }
+        err = errno;
+    }
+    if (p == MAP_FAILED)
+        return PosixError("FrameArena::Init mmap", err);
+    base = (char *) p;
+    if (node >= 0) {
+        // Nothing is touched yet, so every frame is faulted in on the node.
+        Status s = Numa::BindToNode(base, mapped_size, node);
+        if (!s.ok())
+            fprintf(stderr, "FrameArena::Init frames not bound to node %d: %s\n", node, s.ToString().c_str());
+    }
+
+    for (auto &c : classes) {
+        c->free_frames.reserve(c->num_frames);
+        // Popped from the back, hand out low addresses first.
+        for (size_t i = c->num_frames; i > 0; --i) {
+            c->free_frames.push_back(base + c->offset + (i - 1) * c->frame_size);
+        }
+    }
+    return Status::OK();
+}
+
+FrameArena::Class &FrameArena::ClassOf(const void *p) {
+    size_t off = (const char *) p - base;
+    for (size_t i = classes.size(); i > 0; --i) {
+        if (off >= classes[i - 1]->offset)
+            return *classes[i - 1];
+    }
+    assert(false);
+    return *classes[0];
+}
+
+FrameArena::FrameCache &FrameArena::CacheOf(Class &c) {
+    static thread_local size_t cache_idx = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    return c.caches[cache_idx % kNumCaches];
+}
+
+void *FrameArena::Allocate(size_t size) {
+    Class *c = nullptr;
+    for (auto &cls : classes) {
+        if (cls->frame_size >= size) {
+            c = cls.get();
+            break;
+        }
+    }
+    if (c == nullptr)
+        return nullptr;
+    if (c->cache_capacity < 2) {
+        std::lock_guard<std::mutex> gc(c->mtx);
+        if (c->free_frames.empty())
+            return nullptr;
+        void *p = c->free_frames.back();
+        c->free_frames.pop_back();
+        bytes_in_use.fetch_add(c->frame_size, std::memory_order_relaxed);
+        return p;
+    }
+    FrameCache &cache = CacheOf(*c);
+    std::lock_guard<std::mutex> g(cache.mtx);
+    if (cache.count == 0) {
+        // Refill half of the cache from the global free list.
+        std::lock_guard<std::mutex> gc(c->mtx);
+        while (cache.count < c->cache_capacity / 2 && !c->free_frames.empty()) {
+            cache.frames[cache.count++] = c->free_frames.back();
+            c->free_frames.pop_back();
+        }
+        if (cache.count == 0)
+            return nullptr;
+    }
+    bytes_in_use.fetch_add(c->frame_size, std::memory_order_relaxed);
+    return cache.frames[--cache.count];
+}
+
+void FrameArena::Deallocate(void *p) {
+    assert(Owns(p));
+    Class &c = ClassOf(p);
+    assert(((char *) p - base - c.offset) % c.frame_size == 0);
+    bytes_in_use.fetch_sub(c.frame_size, std::memory_order_relaxed);
+    if (c.cache_capacity < 2) {
+        std::lock_guard<std::mutex> gc(c.mtx);
+        c.free_frames.push_back(p);
+        return;
+    }
+    FrameCache &cache = CacheOf(c);
+    std::lock_guard<std::mutex> g(cache.mtx);
+    if (cache.count == c.cache_capacity) {
+        // Return half of the cache to the global free list.
+        std::lock_guard<std::mutex> gc(c.mtx);
+        while (cache.count > c.cache_capacity / 2) {
+            c.free_frames.push_back(cache.frames[--cache.count]);
+        }
+    }
+    cache.frames[cache.count++] = p;
+}
+
+std::string FrameArena::ToString() const {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s, %.3fMB mapped, %.3fMB in use", backing.c_str(),
+             mapped_size / (1024.0 * 1024), BytesInUse() / (1024.0 * 1024));
+    return buf;
+}
+
+}
@@ -0,0 +1,426 @@
+//
+// Created by zxjcarrot on 2020-06-10.
+//
+
+#include <thread>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "util/io_engine.h"
+#include "util/env.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define SPITFIRE_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+namespace spitfire {
+
+Status IOCompletion::Wait() {
+    if (!Done()) {
+        Status s = engine->Submit();
+        if (!s.ok())
+            return s;
+    }
+    // Device latency is in the order of tens of microseconds, spin for a while before sleeping.
+    for (int i = 0; i < 1024 && !Done(); ++i) {
+        asm volatile("pause":: : "memory");
+    }
+    if (!Done()) {
+        std::unique_lock<std::mutex> g(mtx);
+        cv.wait(g, [this]() { return Done(); });
+    }
+    return status;
+}
+
+void IOCompletion::Complete(const Status &s) {
+    status = s;
+    std::lock_guard<std::mutex> g(mtx);
+    done.store(true, std::memory_order_release);
+    cv.notify_all();
+}
+
+Status IOEngine::Read(int fd, void *buf, size_t size, off_t off) {
+    return PrepareRead(fd, buf, size, off)->Wait();
+}
+
+Status IOEngine::Write(int fd, const void *buf, size_t size, off_t off) {
+    return PrepareWrite(fd, buf, size, off)->Wait();
+}
+
+IOHandle PosixIOEngine::PrepareRead(int fd, void *buf, size_t size, off_t off) {
+    IOHandle h = std::make_shared<IOCompletion>(this, fd, buf, size, off, false);
+    h->transferred = size;
+    h->Complete(PosixEnv::PRead(fd, off, buf, size));
+    return h;
+}
+
+IOHandle PosixIOEngine::PrepareWrite(int fd, const void *buf, size_t size, off_t off) {
+    IOHandle h = std::make_shared<IOCompletion>(this, fd, const_cast<void *>(buf), size, off, true);
+    h->transferred = size;
+    h->Complete(PosixEnv::PWrite(fd, off, buf, size));
+    return h;
+}
+
+Status PosixIOEngine::Read(int fd, void *buf, size_t size, off_t off) {
+    return PosixEnv::PRead(fd, off, buf, size);
+}
+
+Status PosixIOEngine::Write(int fd, const void *buf, size_t size, off_t off) {
+    return PosixEnv::PWrite(fd, off, buf, size);
+}
+
+#ifdef SPITFIRE_HAS_IO_URING
+
+// A minimal io_uring driver on top of the raw system calls.
+// Submitters fill the submission queue under a mutex, so a batch of prepared requests
+// costs one io_uring_enter. A dedicated thread reaps completions and wakes up the waiters.
+class IOUringEngine : public IOEngine {
+public:
+    explicit IOUringEngine(size_t queue_depth) : queue_depth(queue_depth) {}
+
+    ~IOUringEngine() override;
+
+    Status Init() override;
+
+    IOHandle PrepareRead(int fd, void *buf, size_t size, off_t off) override;
+
+    IOHandle PrepareWrite(int fd, const void *buf, size_t size, off_t off) override;
+
+    Status Submit() override;
+
+    Status RegisterBuffer(void *base, size_t size) override;
+
+    void UnregisterBuffer(void *base) override;
+
+    std::string Name() const override { return "io_uring"; }
+
+private:
+    IOHandle Prepare(int fd, void *buf, size_t size, off_t off, bool write);
+
+    // Wait for a free slot so that the completion queue never overflows.
+    void AcquireSlot();
+
+    // Queue the untransferred part of the request tracked by `h`. Assume sq_mtx is taken.
+    void QueueLocked(IOHandle *h);
+
+    // Queue a request that signals the reaper to exit. Assume sq_mtx is taken.
+    void QueueExitLocked();
+
+    Status SubmitLocked();
+
+    void ReaperProcess();
+
+    const size_t queue_depth;
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    std::mutex sq_mtx;
+    // Number of sqes queued but not yet passed to the kernel.
+    unsigned pending = 0;
+    std::atomic<size_t> inflight{0};
+    std::vector<iovec> registered_buffers;
+    std::thread reaper;
+};
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IOUringEngine::~IOUringEngine() {
+    if (ring_fd < 0)
+        return;
+    if (reaper.joinable()) {
+        Submit();
+        while (inflight.load() > 0) {
+            std::this_thread::yield();
+        }
+        {
+            std::lock_guard<std::mutex> g(sq_mtx);
+            QueueExitLocked();
+            SubmitLocked();
+        }
+        reaper.join();
+    }
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring)
+        munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+Status IOUringEngine::Init() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(queue_depth, &p);
+    if (ring_fd < 0)
+        return PosixError("io_uring_setup", errno);
+    sq_entries = p.sq_entries;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                   IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return PosixError("io_uring sq ring mmap", errno);
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return PosixError("io_uring cq ring mmap", errno);
+        }
+    }
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                 IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        return PosixError("io_uring sqes mmap", errno);
+    }
+
+    char *sq = (char *) sq_ring;
+    sq_head = (unsigned *) (sq + p.sq_off.head);
+    sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *) (sq + p.sq_off.array);
+    char *cq = (char *) cq_ring;
+    cq_head = (unsigned *) (cq + p.cq_off.head);
+    cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    reaper = std::thread(&IOUringEngine::ReaperProcess, this);
+    return Status::OK();
+}
+
+Status IOUringEngine::RegisterBuffer(void *base, size_t size) {
+    std::lock_guard<std::mutex> g(sq_mtx);
+    std::vector<iovec> buffers = registered_buffers;
+    buffers.push_back(iovec{base, size});
+    if (!registered_buffers.empty())
+        io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0) {
+        int err = errno;
+        // Restore the previous registration.
+        if (!registered_buffers.empty())
+            io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, registered_buffers.data(), registered_buffers.size());
+        return PosixError("io_uring_register", err);
+    }
+    registered_buffers.swap(buffers);
+    return Status::OK();
+}
+
+void IOUringEngine::UnregisterBuffer(void *base) {
+    std::lock_guard<std::mutex> g(sq_mtx);
+    std::vector<iovec> buffers;
+    for (auto &b : registered_buffers) {
+        if (b.iov_base != base)
+            buffers.push_back(b);
+    }
+    if (buffers.size() == registered_buffers.size())
+        return;
+    io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    if (!buffers.empty() &&
+        io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0) {
+        // The remaining arenas fall back to unregistered requests.
+        buffers.clear();
+    }
+    registered_buffers.swap(buffers);
+}
+
+IOHandle IOUringEngine::PrepareRead(int fd, void *buf, size_t size, off_t off) {
+    return Prepare(fd, buf, size, off, false);
+}
+
+IOHandle IOUringEngine::PrepareWrite(int fd, const void *buf, size_t size, off_t off) {
+    return Prepare(fd, const_cast<void *>(buf), size, off, true);
+}
+
+IOHandle IOUringEngine::Prepare(int fd, void *buf, size_t size, off_t off, bool write) {
+    IOHandle h = std::make_shared<IOCompletion>(this, fd, buf, size, off, write);
+    AcquireSlot();
+    std::lock_guard<std::mutex> g(sq_mtx);
+    // The reaper drops this reference once the request completes.
+    QueueLocked(new IOHandle(h));
+    return h;
+}
+
+void IOUringEngine::AcquireSlot() {
+    while (inflight.fetch_add(1) >= sq_entries) {
+        inflight.fetch_sub(1);
+        // The slots might be taken by our own queued requests.
+        Submit();
+        std::this_thread::yield();
+    }
+}
+
+void IOUringEngine::QueueLocked(IOHandle *h) {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        Status s = SubmitLocked();
+        assert(s.ok());
+    }
+    IOCompletion *c = h->get();
+    unsigned idx = tail & sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    char *addr = (char *) c->buf + c->transferred;
+    size_t len = c->size - c->transferred;
+    sqe->opcode = c->write ? IORING_OP_WRITE : IORING_OP_READ;
+    for (size_t i = 0; i < registered_buffers.size(); ++i) {
+        char *base = (char *) registered_buffers[i].iov_base;
+        if (addr >= base && addr + len <= base + registered_buffers[i].iov_len) {
+            sqe->opcode = c->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = i;
+            break;
+        }
+    }
+    sqe->fd = c->fd;
+    sqe->off = c->off + c->transferred;
+    sqe->addr = (uint64_t) addr;
+    sqe->len = len;
+    sqe->user_data = (uint64_t) h;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++pending;
+}
+
+void IOUringEngine::QueueExitLocked() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+        SubmitLocked();
+    unsigned idx = tail & sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++pending;
+}
+
+Status IOUringEngine::Submit() {
+    std::lock_guard<std::mutex> g(sq_mtx);
+    return SubmitLocked();
+}
+
+Status IOUringEngine::SubmitLocked() {
+    while (pending > 0) {
+        int ret = io_uring_enter(ring_fd, pending, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                std::this_thread::yield();
+                continue;
+            }
+            return PosixError("io_uring_enter", errno);
+        }
+        pending -= ret;
+    }
+    return Status::OK();
+}
+
+void IOUringEngine::ReaperProcess() {
+    bool exit = false;
+    while (!exit) {
+        if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            std::this_thread::yield();
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            io_uring_cqe *cqe = &cqes[head & cq_mask];
+            if (cqe->user_data == 0) {
+                exit = true;
+                continue;
+            }
+            IOHandle *h = (IOHandle *) cqe->user_data;
+            IOCompletion *c = h->get();
+            int res = cqe->res;
+            if (res == -EINTR || res == -EAGAIN || res > 0 && c->transferred + res < c->size) {
+                // Retry or transfer the rest.
+                if (res > 0)
+                    c->transferred += res;
+                std::lock_guard<std::mutex> g(sq_mtx);
+                QueueLocked(h);
+                SubmitLocked();
+                continue;
+            }
+            if (res < 0) {
+                c->Complete(PosixError("fd: " + std::to_string(c->fd), -res));
+            } else if (res == 0) {
+                c->Complete(Status::IOError("fd: " + std::to_string(c->fd), "unexpected end of file"));
+            } else {
+                c->transferred += res;
+                c->Complete(Status::OK());
+            }
+            delete h;
+            inflight.fetch_sub(1);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif
+
+Status IOEngine::Create(IOEngineType type, size_t queue_depth, IOEngine *&engine) {
+    IOEngine *e = nullptr;
+    switch (type) {
+        case IOEngineType::POSIX:
+            e = new PosixIOEngine;
+            break;
+        case IOEngineType::IO_URING:
+#ifdef SPITFIRE_HAS_IO_URING
+            e = new IOUringEngine(queue_depth);
+            break;
+#else
+            return Status::NotSupported("io_uring");
+#endif
+    }
+    Status s = e->Init();
+    if (!s.ok()) {
+        delete e;
+        return s;
+    }
+    engine = e;
+    return Status::OK();
+}
+
+}
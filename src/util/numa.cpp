@@ -0,0 +1,131 @@
+//
+// Created by zxjcarrot on 2020-06-19.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util/numa.h"
+#include "util/env.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+namespace spitfire {
+
+namespace {
+
+// Parses a list like "0-3,8,10-11".
+std::vector<int> ParseList(const std::string &list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n")
+            continue;
+        auto dash = range.find('-');
+        int lo = atoi(range.c_str());
+        int hi = dash == std::string::npos ? lo : atoi(range.c_str() + dash + 1);
+        for (int i = lo; i <= hi; ++i)
+            ids.push_back(i);
+    }
+    return ids;
+}
+
+std::string ReadLine(const std::string &path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+struct Topology {
+    // Cores of node i, nodes are numbered densely from 0.
+    std::vector<std::vector<int>> cores;
+    std::vector<int> node_of_core;
+    // System ids of the nodes, for mbind.
+    std::vector<int> node_ids;
+
+    Topology() {
+        node_ids = ParseList(ReadLine("/sys/devices/system/node/online"));
+        for (int id : node_ids) {
+            cores.push_back(ParseList(ReadLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist")));
+        }
+        if (node_ids.empty() || cores[0].empty()) {
+            node_ids = {0};
+            cores.assign(1, std::vector<int>());
+            for (int c = 0; c < (int) std::max(std::thread::hardware_concurrency(), 1u); ++c)
+                cores[0].push_back(c);
+        }
+        for (size_t n = 0; n < cores.size(); ++n) {
+            for (int c : cores[n]) {
+                if (c >= (int) node_of_core.size())
+                    node_of_core.resize(c + 1, 0);
+                node_of_core[c] = n;
+            }
+        }
+    }
+};
+
+const Topology &GetTopology() {
+    static Topology topology;
+    return topology;
+}
+
+}
+
+int Numa::NumNodes() {
+    return GetTopology().cores.size();
+}
+
+int Numa::CurrentNode() {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : NodeOfCore(cpu);
+}
+
+int Numa::NodeOfCore(int core) {
+    auto &t = GetTopology();
+    return core < (int) t.node_of_core.size() ? t.node_of_core[core] : 0;
+}
+
+const std::vector<int> &Numa::CoresOfNode(int node) {
+    auto &t = GetTopology();
+    return t.cores[node % t.cores.size()];
+}
+
+Status Numa::BindToNode(void *addr, size_t len, int node) {
+    auto &t = GetTopology();
+    int id = t.node_ids[node % t.node_ids.size()];
+    unsigned long mask[16] = {0};
+    if (id >= (int) (sizeof(mask) * 8))
+        return Status::InvalidArgument("Numa::BindToNode", "node " + std::to_string(id));
+    mask[id / 64] |= 1UL << (id % 64);
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0) != 0)
+        return PosixError("Numa::BindToNode mbind", errno);
+    return Status::OK();
+}
+
+Status Numa::PinToCore(int core) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    if (err != 0)
+        return PosixError("Numa::PinToCore", err);
+    return Status::OK();
+}
+
+Status Numa::PinWorker(size_t worker) {
+    int nodes = NumNodes();
+    auto &cores = CoresOfNode(worker % nodes);
+    return PinToCore(cores[worker / nodes % cores.size()]);
+}
+
+}
@@ -0,0 +1,84 @@
+//
+// Created by zxjcarrot on 2020-06-20.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <immintrin.h>
+#include "util/nvm_emulator.h"
+
+namespace spitfire {
+
+std::atomic<NVMEmulator *> NVMEmulator::active{nullptr};
+
+static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Let a burst of this many ns worth of bytes through undelayed, about a page at full bandwidth.
+static constexpr uint64_t kBurstNs = 5000;
+
+NVMEmulator::TokenBucket::TokenBucket(uint64_t bytes_per_sec, uint64_t burst_ns)
+        : ns_per_byte(bytes_per_sec == 0 ? 0 : 1e9 / bytes_per_sec), burst_ns(burst_ns) {}
+
+uint64_t NVMEmulator::TokenBucket::Take(size_t bytes, uint64_t now) {
+    if (ns_per_byte == 0)
+        return now;
+    uint64_t cost = bytes * ns_per_byte;
+    uint64_t cur = paid_until.load();
+    uint64_t next;
+    do {
+        // Bandwidth left unused in the past is lost.
+        next = std::max(cur, now) + cost;
+    } while (!paid_until.compare_exchange_weak(cur, next));
+    return next > now + burst_ns ? next - burst_ns : now;
+}
+
+NVMEmulator::NVMEmulator(const NVMEmulatorConfig &config)
+        : config(config), read_bucket(config.read_bandwidth_mb * 1024 * 1024, kBurstNs),
+          write_bucket(config.write_bandwidth_mb * 1024 * 1024, kBurstNs) {}
+
+void NVMEmulator::Delay(uint64_t now, uint64_t until) {
+    if (until <= now)
+        return;
+    delayed_ns += until - now;
+    while (NowNs() < until)
+        _mm_pause();
+}
+
+void NVMEmulator::Read(size_t bytes) {
+    if (bytes == 0)
+        return;
+    bytes_read += bytes;
+    uint64_t now = NowNs();
+    Delay(now, std::max(now + Accesses(bytes) * config.read_latency_ns, read_bucket.Take(bytes, now)));
+}
+
+void NVMEmulator::Write(size_t bytes) {
+    if (bytes == 0)
+        return;
+    bytes_written += bytes;
+    uint64_t now = NowNs();
+    Delay(now, std::max(now + Accesses(bytes) * config.write_latency_ns, write_bucket.Take(bytes, now)));
+}
+
+void NVMEmulator::Persist() {
+    persists++;
+    uint64_t now = NowNs();
+    Delay(now, now + config.persist_latency_ns);
+}
+
+std::string NVMEmulator::ToString() const {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "read %luns write %luns persist %luns per %luB, %lu/%luMB/s, read %.3fMB written %.3fMB "
+             "persists %lu delayed %.3fs",
+             config.read_latency_ns, config.write_latency_ns, config.persist_latency_ns, kAccessSize,
+             config.read_bandwidth_mb, config.write_bandwidth_mb, bytes_read.load() / 1024.0 / 1024,
+             bytes_written.load() / 1024.0 / 1024, persists.load(), delayed_ns.load() / 1e9);
+    return buf;
+}
+
+}
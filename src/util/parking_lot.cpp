@@ -0,0 +1,37 @@
+//
+// Created by zxjcarrot on 2020-06-18.
+//
+
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util/parking_lot.h"
+
+namespace spitfire {
+
+ParkingLot::Bucket ParkingLot::buckets[ParkingLot::kNumBuckets];
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex words must be plain ints");
+
+void ParkingLot::Park(std::atomic<int> &word, int expected, uint32_t timeout_us) {
+    Bucket &b = BucketOf(&word);
+    // The increment is ordered before the kernel compares the word with `expected`.
+    // A waker that changes the word after that comparison sees the increment and wakes us.
+    b.num_parked.fetch_add(1);
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+    b.num_parked.fetch_sub(1);
+}
+
+void ParkingLot::UnparkAll(std::atomic<int> &word) {
+    // Callers changed the word with a sequentially consistent operation before this load.
+    if (BucketOf(&word).num_parked.load() == 0)
+        return;
+    syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+}
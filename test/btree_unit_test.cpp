@@ -8,6 +8,8 @@
 #include <fstream>
 #include <map>
 #include <limits>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "util/random.h"
 #include "util/crc32c.h"
 #include "util/tools.h"
@@ -384,10 +386,12 @@ std::vector<uint64_t> GetWorkload(int n_ops, int n_kvs, const std::string &workl
     return workload;
 }
 
+// While the workers run, `background` is called over and over with the round number.
 void TestBTreeCorrectness(spitfire::BufferPoolConfig config, const std::string &db_path,
                           spitfire::PageMigrationPolicy policy,
                           size_t n_threads, spitfire::ThreadPool *tp,
-                          size_t total_ops) {
+                          size_t total_ops, bool enable_swizzling = false,
+                          const std::function<void(spitfire::ConcurrentBufferManager &, size_t)> &background = nullptr) {
     using namespace spitfire;
     using spitfire::pid_t;
     Status s = SSDPageManager::DestroyDB(db_path);
@@ -402,7 +406,7 @@ void TestBTreeCorrectness(spitfire::BufferPoolConfig config, const std::string &
         assert(s.ok());
 
         pid_t root_pid = kInvalidPID;
-        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        BTree<uint64_t, uint64_t> btree(&buf_mgr, enable_swizzling);
 
         s = btree.Init(root_pid);
         assert(s.ok());
@@ -451,10 +455,539 @@ void TestBTreeCorrectness(spitfire::BufferPoolConfig config, const std::string &
         for (size_t i = 0; i < n_threads; ++i) {
             tp->enqueue(thread_work, i);
         }
+        if (background) {
+            for (size_t round = 0; latch.GetCount() > 0; ++round)
+                background(buf_mgr, round);
+        }
         latch.Await();
 
     }
 }
+// Compare the lookup latency of pid-based and swizzled traversals over the same tree.
+void BenchmarkSwizzledLookup(spitfire::BufferPoolConfig config, const std::string &db_path,
+                             spitfire::PageMigrationPolicy policy, size_t n_kvs, size_t n_lookups) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+
+    pid_t root_pid = kInvalidPID;
+    {
+        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        for (size_t i = 0; i < n_kvs; ++i) {
+            btree.Insert(i, i);
+        }
+        root_pid = btree.GetRootPid();
+    }
+
+    std::vector<uint64_t> keys(n_lookups);
+    for (size_t i = 0; i < n_lookups; ++i) {
+        keys[i] = IntRand() % n_kvs;
+    }
+    for (bool enable_swizzling : {false, true}) {
+        BTree<uint64_t, uint64_t> btree(&buf_mgr, enable_swizzling);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        // Warm up the buffer pool and the swizzled pointers.
+        for (size_t i = 0; i < n_lookups; ++i) {
+            uint64_t val = 0;
+            btree.Lookup(keys[i], val);
+        }
+        buf_mgr.ClearStats();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_lookups; ++i) {
+            uint64_t val = 0;
+            bool res = btree.Lookup(keys[i], val);
+            assert(res);
+            assert(val == keys[i]);
+        }
+        auto end = std::chrono::steady_clock::now();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        auto stats = buf_mgr.GetStats();
+        std::cout << (enable_swizzling ? "swizzled" : "pid-based") << " lookup latency "
+                  << ns / (double) n_lookups << "ns, buf_gets " << stats.buf_gets.load()
+                  << ", swizzled_hits " << stats.swizzled_hits.load() << std::endl;
+    }
+}
+
+// Alternates full index scans with lookups on a hot key range that fits in DRAM
+// and reports the DRAM hit ratio of the hot lookups under each replacement policy.
+void BenchmarkScanResistance(spitfire::BufferPoolConfig config, const std::string &db_path,
+                             spitfire::PageMigrationPolicy policy, size_t n_kvs, size_t n_rounds) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    // Route every access through full DRAM pages so that the DRAM replacer sees the whole stream.
+    policy.Dr = policy.Dw = 1;
+    config.enable_mini_page = false;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    pid_t root_pid = kInvalidPID;
+    {
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        for (size_t i = 0; i < n_kvs; ++i) {
+            btree.Insert(i, i);
+        }
+        root_pid = btree.GetRootPid();
+    }
+
+    // A quarter of the DRAM pool worth of key-value pairs.
+    const size_t n_hot_keys = config.dram_buf_pool_cap_in_bytes / 4 / (sizeof(uint64_t) * 2);
+    std::vector<std::pair<ReplacerType, std::string>> replacers = {
+            {ReplacerType::CLOCK, "clock"}, {ReplacerType::TWO_Q, "2q"}, {ReplacerType::LRU_2, "lru2"}};
+    for (auto &replacer : replacers) {
+        config.dram_replacer = config.nvm_replacer = replacer.first;
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        // A few lookups per leaf, so that a leaf evicted by the scan shows up in the hit ratio.
+        auto lookup_hot_keys = [&]() {
+            for (size_t i = 0; i < n_hot_keys; i += 256) {
+                uint64_t val = 0;
+                bool res = btree.Lookup(i, val);
+                assert(res);
+                assert(val == i);
+            }
+        };
+        lookup_hot_keys();
+        lookup_hot_keys();
+        int64_t hot_hits = 0;
+        int64_t hot_gets = 0;
+        for (size_t r = 0; r < n_rounds; ++r) {
+            size_t scanned = 0;
+            btree.Scan(0, [&](const uint64_t &) {
+                ++scanned;
+                return BTreeOPResult::CONTINUE_SCAN;
+            });
+            assert(scanned == n_kvs);
+            buf_mgr.ClearStats();
+            lookup_hot_keys();
+            auto stats = buf_mgr.GetStats();
+            hot_hits += stats.hits_on_dram.load();
+            hot_gets += stats.buf_gets.load();
+        }
+        std::cout << replacer.second << " replacer, hot lookup dram hit ratio "
+                  << hot_hits / (double) std::max(hot_gets, (int64_t) 1) << ", misses " << hot_gets - hot_hits
+                  << std::endl;
+        std::cout << "Replacer Stats: \n" << buf_mgr.ReplacerStats() << std::endl;
+    }
+}
+
+void BenchmarkReadAheadScan(spitfire::BufferPoolConfig config, const std::string &db_path,
+                            spitfire::PageMigrationPolicy policy, size_t n_kvs) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    pid_t root_pid = kInvalidPID;
+    {
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        for (size_t i = 0; i < n_kvs; ++i) {
+            btree.Insert(i, i);
+        }
+        root_pid = btree.GetRootPid();
+    }
+
+    for (bool read_ahead : {false, true}) {
+        config.enable_read_ahead = read_ahead;
+        // Start from cold pools so that the leaves come from SSD. Prefetches only overlap
+        // with the scan on an asynchronous engine.
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io, IOEngineType::IO_URING);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        BTree<uint64_t, uint64_t> btree(&buf_mgr);
+        s = btree.Init(root_pid);
+        assert(s.ok());
+        size_t scanned = 0;
+        uint64_t expected = 0;
+        auto start = std::chrono::steady_clock::now();
+        btree.Scan(0, [&](const uint64_t &val) {
+            assert(val == expected);
+            ++expected;
+            ++scanned;
+            return BTreeOPResult::CONTINUE_SCAN;
+        });
+        auto end = std::chrono::steady_clock::now();
+        assert(scanned == n_kvs);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+        auto stats = buf_mgr.GetStats();
+        std::cout << "read-ahead " << (read_ahead ? "on" : "off") << ", full scan of " << n_kvs << " keys took "
+                  << ms << "ms, prefetched pages " << stats.prefetched_pages.load() << ", overlapped ssd reads "
+                  << stats.overlapped_ssd_reads.load() << std::endl;
+    }
+}
+
+// Run a skewed read-mostly workload with the migration policy tuner on and check that it
+// explores within its bounds. The initial policy must be within the bounds as well.
+void TestMigrationPolicyTuner(spitfire::BufferPoolConfig config, const std::string &db_path,
+                              spitfire::PageMigrationPolicy policy, size_t n_kvs, int seconds) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    config.enable_migration_policy_tuner = true;
+    config.migration_tuner_period_ms = 200;
+    config.migration_tuner_min_prob = 0.1;
+    config.migration_tuner_max_prob = 0.9;
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+    pid_t root_pid = kInvalidPID;
+    BTree<uint64_t, uint64_t> btree(&buf_mgr);
+    s = btree.Init(root_pid);
+    assert(s.ok());
+    for (size_t i = 0; i < n_kvs; ++i) {
+        btree.Insert(i, i);
+    }
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::mt19937 gen(0);
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 1000; ++i) {
+            // Half of the lookups go to 1/16 of the keys.
+            uint64_t key = gen() % 2 ? gen() % (n_kvs / 16) : gen() % n_kvs;
+            uint64_t val = 0;
+            bool res = btree.Lookup(key, val);
+            assert(res);
+            assert(val == key);
+            if (i % 10 == 0)
+                btree.Insert(key, key);
+        }
+    }
+    buf_mgr.FreezeMigrationPolicyTuner(true);
+    auto tuned = buf_mgr.GetPageMigrationPolicy();
+    for (double p : {tuned.Dr, tuned.Dw, tuned.Nr, tuned.Nw}) {
+        assert(p >= config.migration_tuner_min_prob && p <= config.migration_tuner_max_prob);
+    }
+    std::cout << "Tuned migration policy " << tuned.ToString() << std::endl;
+    std::cout << buf_mgr.GetStats().ToString() << std::endl;
+}
+
+void TestWarmRestart(spitfire::BufferPoolConfig config, const std::string &db_path,
+                     spitfire::PageMigrationPolicy policy, const std::string &snapshot_path) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    PosixEnv::DeleteFile(snapshot_path);
+    config.warm_restart_snapshot_path = snapshot_path;
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    // Half of DRAM, all of it fits after the restart.
+    const size_t n_pages = config.dram_buf_pool_cap_in_bytes / kPageSize / 2;
+    std::vector<pid_t> pids(n_pages);
+    {
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        for (auto &pid : pids) {
+            s = buf_mgr.NewPage(pid);
+            assert(s.ok());
+            ConcurrentBufferManager::PageAccessor accessor;
+            s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_WRITE_FULL);
+            assert(s.ok());
+            Slice slice = accessor.PrepareForWrite(0, kPageSize);
+            memset(slice.data(), 0, kPageSize);
+            *reinterpret_cast<pid_t *>(slice.data()) = pid;
+            accessor.FinishAccess();
+            buf_mgr.Put(accessor.GetPageDesc());
+        }
+    }
+    assert(PosixEnv::FileExists(snapshot_path));
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+    auto stats = buf_mgr.GetStats();
+    assert(stats.warm_restart_pages.load() == n_pages);
+    size_t ssd_reads = stats.ssd_reads.load();
+    for (auto pid : pids) {
+        ConcurrentBufferManager::PageAccessor accessor;
+        s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+        assert(s.ok());
+        Slice slice = accessor.PrepareForRead(0, sizeof(pid_t));
+        assert(*reinterpret_cast<const pid_t *>(slice.data()) == pid);
+        accessor.FinishAccess();
+        buf_mgr.Put(accessor.GetPageDesc());
+    }
+    // Every page was served from the warmed up pools.
+    assert(buf_mgr.GetStats().ssd_reads.load() == ssd_reads);
+    std::cout << "Warm restart " << stats.warm_restart_pages.load() << " pages" << std::endl;
+}
+
+void TestNVMFrameRecovery(spitfire::BufferPoolConfig config, const std::string &db_path) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    config.enable_nvm_frame_recovery = true;
+    // Pages go straight to NVM.
+    PageMigrationPolicy policy;
+    policy.Dr = policy.Dw = 0;
+    policy.Nr = policy.Nw = 1;
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    const size_t n_pages = config.nvm_buf_pool_cap_in_bytes / kPageSize / 2;
+    std::vector<pid_t> pids(n_pages);
+    {
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        for (auto &pid : pids) {
+            s = buf_mgr.NewPage(pid);
+            assert(s.ok());
+            ConcurrentBufferManager::PageAccessor accessor;
+            s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_WRITE);
+            assert(s.ok());
+            Slice slice = accessor.PrepareForWrite(0, sizeof(pid_t));
+            *reinterpret_cast<pid_t *>(slice.data()) = pid;
+            accessor.FinishAccess();
+            buf_mgr.Put(accessor.GetPageDesc());
+        }
+    }
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+    auto stats = buf_mgr.GetStats();
+    assert(stats.nvm_recovered_pages.load() == n_pages);
+    size_t ssd_reads = stats.ssd_reads.load();
+    for (auto pid : pids) {
+        ConcurrentBufferManager::PageAccessor accessor;
+        s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+        assert(s.ok());
+        Slice slice = accessor.PrepareForRead(0, sizeof(pid_t));
+        assert(*reinterpret_cast<const pid_t *>(slice.data()) == pid);
+        accessor.FinishAccess();
+        buf_mgr.Put(accessor.GetPageDesc());
+    }
+    // Every page was served from the recovered NVM pages.
+    assert(buf_mgr.GetStats().ssd_reads.load() == ssd_reads);
+    std::cout << "NVM frame recovery " << stats.nvm_recovered_pages.load() << " pages" << std::endl;
+}
+
+// Record the accesses of a single thread and read them back in order.
+void TestAccessTrace(spitfire::BufferPoolConfig config, const std::string &db_path,
+                     spitfire::PageMigrationPolicy policy, const std::string &trace_path) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    config.access_trace_path = trace_path;
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    // Half of DRAM, every read hits.
+    const size_t n_pages = config.dram_buf_pool_cap_in_bytes / kPageSize / 2;
+    std::vector<pid_t> pids(n_pages);
+    {
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        for (auto &pid : pids) {
+            s = buf_mgr.NewPage(pid);
+            assert(s.ok());
+            ConcurrentBufferManager::PageAccessor accessor;
+            s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_WRITE_FULL);
+            assert(s.ok());
+            Slice slice = accessor.PrepareForWrite(0, kPageSize);
+            memset(slice.data(), 0, kPageSize);
+            accessor.FinishAccess();
+            buf_mgr.Put(accessor.GetPageDesc());
+        }
+        for (auto pid : pids) {
+            ConcurrentBufferManager::PageAccessor accessor;
+            s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+            assert(s.ok());
+            accessor.PrepareForRead(0, sizeof(pid_t));
+            accessor.FinishAccess();
+            buf_mgr.Put(accessor.GetPageDesc());
+        }
+    }
+    std::vector<AccessTraceRecord> records;
+    s = AccessTraceRecorder::Read(trace_path, records);
+    assert(s.ok());
+    assert(records.size() >= 4 * n_pages);
+    // The reads close the trace, a GET and an ACCESS per page, all from DRAM.
+    auto read = records.end() - 2 * n_pages;
+    for (auto pid : pids) {
+        assert(read[0].op == (uint8_t) AccessTraceOp::GET && read[0].pid == pid &&
+               read[0].tier == (uint8_t) AccessTraceTier::DRAM);
+        assert(read[1].op == (uint8_t) AccessTraceOp::ACCESS && read[1].pid == pid &&
+               read[1].size == sizeof(pid_t) && read[1].tier == (uint8_t) AccessTraceTier::DRAM);
+        read += 2;
+    }
+    std::cout << "Access trace " << records.size() << " records" << std::endl;
+}
+
+// A child process writes pages in a committed transaction, overwrites half of them in another one
+// and dies with everything in the buffer pools. Recovery redoes the first and undoes the second.
+void TestWALRecovery(spitfire::BufferPoolConfig config, const std::string &db_path,
+                     spitfire::PageMigrationPolicy policy, bool slotted_log_buffer) {
+    using namespace spitfire;
+    using spitfire::pid_t;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    config.enable_slotted_log_buffer = slotted_log_buffer;
+    // A quarter of DRAM, the page cleaner leaves the pages alone.
+    const size_t n_pages = config.dram_buf_pool_cap_in_bytes / kPageSize / 4;
+    std::vector<pid_t> pids(n_pages);
+    {
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        for (auto &pid : pids) {
+            s = buf_mgr.NewPage(pid);
+            assert(s.ok());
+        }
+    }
+    ::pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+        s = ssd_page_manager.Init();
+        assert(s.ok());
+        // Never destroyed, the process dies with the pages in the buffer pools.
+        auto buf_mgr = new ConcurrentBufferManager(&ssd_page_manager, policy, config);
+        s = buf_mgr->Init();
+        assert(s.ok());
+        auto write_page = [&](pid_t pid, pid_t value) {
+            ConcurrentBufferManager::PageAccessor accessor;
+            Status s = buf_mgr->Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_WRITE);
+            assert(s.ok());
+            Slice slice = accessor.PrepareForWrite(0, sizeof(pid_t));
+            *reinterpret_cast<pid_t *>(slice.data()) = value;
+            accessor.FinishAccess();
+            buf_mgr->Put(accessor.GetPageDesc());
+        };
+        current_txn_id = 1;
+        for (auto pid : pids)
+            write_page(pid, pid);
+        lsn_t commit_lsn = buf_mgr->GetLogManager()->LogCommitTxn(1);
+        bool durable = buf_mgr->GetLogManager()->WaitForCommit(commit_lsn);
+        assert(durable);
+        current_txn_id = 2;
+        for (size_t i = 0; i < n_pages / 2; ++i)
+            write_page(pids[i], ~pids[i]);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    auto check = [&](ConcurrentBufferManager &buf_mgr) {
+        for (auto pid : pids) {
+            ConcurrentBufferManager::PageAccessor accessor;
+            Status s = buf_mgr.Get(pid, accessor, ConcurrentBufferManager::PageOPIntent::INTENT_READ);
+            assert(s.ok());
+            Slice slice = accessor.PrepareForRead(0, sizeof(pid_t));
+            assert(*reinterpret_cast<const pid_t *>(slice.data()) == pid);
+            accessor.FinishAccess();
+            buf_mgr.Put(accessor.GetPageDesc());
+        }
+    };
+    size_t redone = 0;
+    {
+        ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+        s = buf_mgr.Init();
+        assert(s.ok());
+        auto stats = buf_mgr.GetStats();
+        redone = stats.wal_redone_updates.load();
+        assert(redone >= n_pages + n_pages / 2);
+        assert(stats.wal_undone_updates.load() == n_pages / 2);
+        check(buf_mgr);
+    }
+    // Shut down cleanly, nothing is left to recover.
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+    assert(buf_mgr.GetStats().wal_redone_updates.load() == 0);
+    assert(buf_mgr.GetStats().wal_undone_updates.load() == 0);
+    check(buf_mgr);
+    std::cout << "WAL recovery " << (slotted_log_buffer ? "slotted" : "sequential") << " log, " << redone
+              << " updates redone" << std::endl;
+}
+
+void TestGroupCommit(spitfire::BufferPoolConfig config, const std::string &db_path,
+                     spitfire::PageMigrationPolicy policy, size_t n_threads) {
+    using namespace spitfire;
+    Status s = SSDPageManager::DestroyDB(db_path);
+    assert(s.ok());
+    SSDPageManager ssd_page_manager(db_path, config.enable_direct_io);
+    s = ssd_page_manager.Init();
+    assert(s.ok());
+    ConcurrentBufferManager buf_mgr(&ssd_page_manager, policy, config);
+    s = buf_mgr.Init();
+    assert(s.ok());
+    LogManager *log_mgr = buf_mgr.GetLogManager();
+    assert(log_mgr != nullptr);
+    const size_t n_commits = 1000;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = 0; i < n_commits; ++i) {
+                lsn_t lsn = log_mgr->LogCommitTxn(t * n_commits + i + 1);
+                bool durable = log_mgr->WaitForCommit(lsn);
+                assert(durable && log_mgr->FlushedLSN() > lsn);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    auto stats = buf_mgr.GetStats();
+    assert(stats.wal_commits.load() == n_threads * n_commits);
+    assert(stats.wal_log_flushes.load() <= stats.wal_commits.load());
+
+    // Left to the page cleaner.
+    buf_mgr.GetConfig().wal_commit_mode = WALCommitMode::ASYNC;
+    lsn_t lsn = log_mgr->LogCommitTxn(n_threads * n_commits + 1);
+    log_mgr->WaitForCommit(lsn);
+    while (log_mgr->FlushedLSN() <= lsn)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    std::cout << "Group commit, " << n_threads << " threads, "
+              << stats.wal_commits.load() / (double) stats.wal_log_flushes.load() << " commits per flush" << std::endl;
+}
+
 namespace spitfire {
 std::vector<BaseDataTable*> database_tables;
 }
@@ -505,6 +1038,88 @@ int main(int argc, char **argv) {
         config.wal_file_path = wal_file_path;
 
         TestBTreeCorrectness(config, db_path, policy, n_threads, &tp, n_ops);
+        TestBTreeCorrectness(config, db_path, policy, n_threads, &tp, n_ops, true);
+        {
+            spitfire::BufferPoolConfig arena_config = config;
+            arena_config.enable_frame_arena = true;
+            TestBTreeCorrectness(arena_config, db_path, policy, n_threads, &tp, n_ops);
+        }
+        {
+            // One replacer partition per worker, pages pinned in a full partition make others steal.
+            spitfire::BufferPoolConfig partitioned_config = config;
+            partitioned_config.replacer_partitions = n_threads;
+            TestBTreeCorrectness(partitioned_config, db_path, policy, n_threads, &tp, n_ops);
+        }
+        {
+            // Evictions mostly happen in the FreeFrameProducer threads.
+            spitfire::BufferPoolConfig producer_config = config;
+            producer_config.enable_free_frame_producer = true;
+            TestBTreeCorrectness(producer_config, db_path, policy, n_threads, &tp, n_ops);
+        }
+        {
+            // Two NUMA nodes, also on single-node machines, with per-node arenas and heap files.
+            spitfire::BufferPoolConfig numa_config = config;
+            numa_config.enable_numa = true;
+            numa_config.numa_nodes = 2;
+            numa_config.enable_frame_arena = true;
+            TestBTreeCorrectness(numa_config, db_path, policy, n_threads, &tp, n_ops);
+        }
+        {
+            // Both tiers cycle through a quarter, half, all and twice their initial capacities.
+            spitfire::BufferPoolConfig resize_config = config;
+            resize_config.dram_buf_pool_max_cap_in_bytes = 2 * config.dram_buf_pool_cap_in_bytes;
+            resize_config.nvm_buf_pool_max_cap_in_bytes = 2 * config.nvm_buf_pool_cap_in_bytes;
+            auto resize = [&](spitfire::ConcurrentBufferManager &buf_mgr, size_t round) {
+                size_t shift = round % 4;
+                spitfire::Status s = buf_mgr.ResizeTier(spitfire::BufferPoolTier::DRAM,
+                                                        (config.dram_buf_pool_cap_in_bytes << shift) / 4);
+                assert(s.ok());
+                s = buf_mgr.ResizeTier(spitfire::BufferPoolTier::NVM, (config.nvm_buf_pool_cap_in_bytes << shift) / 4);
+                assert(s.ok());
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            };
+            TestBTreeCorrectness(resize_config, db_path, policy, n_threads, &tp, n_ops, false, resize);
+        }
+        {
+            // HyMem admits evicted DRAM pages into NVM through the AdmissionFilter.
+            spitfire::BufferPoolConfig hymem_config = config;
+            hymem_config.enable_hymem = true;
+            hymem_config.nvm_admission_set_size_limit = n_pages / 5 / 10;
+            spitfire::PageMigrationPolicy hymem_policy = policy;
+            hymem_policy.Nr = hymem_policy.Nw = 1;
+            TestBTreeCorrectness(hymem_config, db_path, hymem_policy, n_threads, &tp, n_ops);
+        }
+        {
+            // The NVM tier on emulated NVM, slowed down but still correct.
+            spitfire::BufferPoolConfig emulated_config = config;
+            emulated_config.enable_nvm_emulation = true;
+            TestBTreeCorrectness(emulated_config, db_path, policy, n_threads, &tp, n_ops);
+        }
+        BenchmarkSwizzledLookup(config, db_path, policy, n_kvs, n_ops);
+        {
+            const size_t n_scan_kvs = 1024 * 1024;
+            const size_t n_scan_pages = n_scan_kvs * sizeof(uint64_t) * 2 / spitfire::kPageSize;
+            spitfire::BufferPoolConfig scan_config = config;
+            scan_config.dram_buf_pool_cap_in_bytes = n_scan_pages / 10 * spitfire::kPageSize;
+            scan_config.nvm_buf_pool_cap_in_bytes = n_scan_pages / 5 * spitfire::kPageSize;
+            BenchmarkScanResistance(scan_config, db_path, policy, n_scan_kvs, 5);
+            BenchmarkReadAheadScan(scan_config, db_path, policy, n_scan_kvs);
+            TestMigrationPolicyTuner(scan_config, db_path, policy, n_scan_kvs, 5);
+        }
+        TestWarmRestart(config, db_path, policy, nvm_path + "/resident_set");
+        TestNVMFrameRecovery(config, db_path);
+        TestAccessTrace(config, db_path, policy, nvm_path + "/access_trace");
+        TestWALRecovery(config, db_path, policy, false);
+        TestWALRecovery(config, db_path, policy, true);
+        TestGroupCommit(config, db_path, policy, n_threads);
+        {
+            // The log in a file on a block device, written with O_DIRECT.
+            spitfire::BufferPoolConfig block_log_config = config;
+            block_log_config.wal_file_backend = spitfire::kBlockStorage;
+            TestWALRecovery(block_log_config, db_path, policy, false);
+            TestWALRecovery(block_log_config, db_path, policy, true);
+            TestGroupCommit(block_log_config, db_path, policy, n_threads);
+        }
         auto workload = GetWorkload(n_ops, n_kvs, workload_filepath);
         for (int i = n_threads; i <= n_threads; ++i)
             TestConcurrentBTree(config, db_path, policy, i, &tp, workload);